@@ -14,7 +14,36 @@ OptionParser.new { |opt|
 }
 
 have_library( "png16")
+have_library( "z")
 have_header( "png.h")
 have_header( "zlib.h")
+have_func("adler32_z", "zlib.h")
+
+if have_header("ruby/io/buffer.h")
+  have_func("rb_io_buffer_get_bytes_for_writing", "ruby/io/buffer.h")
+  have_func("rb_io_buffer_get_mutable", "ruby/io/buffer.h")
+  have_func("rb_io_buffer_get_bytes_for_reading", "ruby/io/buffer.h")
+end
+
+have_header("ruby/memory_view.h")
+have_func("rb_interned_str_cstr", "ruby.h")
+
+if have_header("ruby/fiber/scheduler.h")
+  have_func("rb_fiber_scheduler_current", "ruby/fiber/scheduler.h")
+  have_func("rb_io_wait", "ruby.h")
+end
+
+if have_header("sys/mman.h")
+  have_func("mmap", "sys/mman.h")
+  have_func("madvise", "sys/mman.h")
+end
+
+have_header("immintrin.h")
+have_header("sys/uio.h")
+have_func("pread", "unistd.h")
+
+if have_header("pthread.h")
+  have_library("pthread")
+end
 
 create_makefile( "png/png")
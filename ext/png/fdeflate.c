@@ -0,0 +1,379 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fdeflate.h"
+#include "huffman.h"
+
+/*
+ * フィルタ処理済みの画像データ専用の一パス deflate
+ *
+ * 一致の検索は直前の画素(距離 = 画素のバイト数)と直前のバイト(距離 1)
+ * の連続(RLE)だけとし、ハッシュ表は持たない。ハフマン符号はフィルタ後の
+ * 値が 0 付近に集中する事を前提としたモデルから初期化時に一度だけ作り、
+ * 動的ハフマンブロックのヘッダもビット列として用意しておく。符号化は
+ * 表を引いてビットを詰めるだけになる。
+ *
+ * 出力が無圧縮ブロックより大きくなる場合は無圧縮ブロックで出力し直す。
+ */
+
+#define NUM_LITLEN                  286
+#define NUM_DIST                    4       // distance 1~4
+#define NUM_CLEN                    19
+#define MAX_BITS                    15
+#define MAX_CLEN_BITS               7
+#define MIN_MATCH                   3
+#define MAX_MATCH                   258
+#define STORED_MAX                  65535
+#define END_OF_BLOCK                256
+
+typedef struct {
+  uint8_t* p;
+  uint64_t buf;
+  int cnt;
+} bitw_t;
+
+static const uint16_t len_base[] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const uint8_t len_extra[] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static const uint8_t clen_order[NUM_CLEN] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+static uint16_t lit_code[NUM_LITLEN];
+static uint8_t lit_bits[NUM_LITLEN];
+
+static uint32_t match_code[MAX_MATCH + 1][NUM_DIST];
+static uint8_t match_bits[MAX_MATCH + 1];
+
+static uint8_t header[512];                 // dynamic block header
+static int header_bits;                     // (without BFINAL and BTYPE)
+
+static inline void
+put_bits(bitw_t* w, uint32_t code, int n)
+{
+  w->buf |= (uint64_t)code << w->cnt;
+  w->cnt += n;
+
+  if (w->cnt >= 32) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    uint32_t v;
+
+    v = (uint32_t)w->buf;
+    memcpy(w->p, &v, 4);
+#else /* defined(__BYTE_ORDER__) && ... */
+    w->p[0] = (uint8_t)(w->buf);
+    w->p[1] = (uint8_t)(w->buf >> 8);
+    w->p[2] = (uint8_t)(w->buf >> 16);
+    w->p[3] = (uint8_t)(w->buf >> 24);
+#endif /* defined(__BYTE_ORDER__) && ... */
+
+    w->p   += 4;
+    w->buf >>= 32;
+    w->cnt -= 32;
+  }
+}
+
+static void
+flush_bits(bitw_t* w)
+{
+  while (w->cnt > 0) {
+    *w->p++ = (uint8_t)w->buf;
+
+    w->buf >>= 8;
+    w->cnt -= 8;
+  }
+
+  w->buf = 0;
+  w->cnt = 0;
+}
+
+/*
+ * 符号化モデル: フィルタ後の値(符号付き)の絶対値に対して指数的に減少
+ * する頻度とし、一致の長さは短いものと最長(258)を優先する
+ */
+static void
+model_freq(uint32_t* freq)
+{
+  int s;
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    s       = (i < 128)? i: 256 - i;
+    freq[i] = 1 + (uint32_t)(65536.0 * pow(0.8, s));
+  }
+
+  freq[END_OF_BLOCK] = 1;
+
+  for (i = 0; i < 29; i++) {
+    freq[257 + i] = 1 + (8192 >> (i / 3));
+  }
+
+  freq[285] = 16384;
+}
+
+static void
+build_header(void)
+{
+  uint8_t lens[NUM_LITLEN + NUM_DIST];
+  uint32_t freq[NUM_CLEN];
+  uint8_t clen[NUM_CLEN];
+  uint16_t ccode[NUM_CLEN];
+  bitw_t w;
+  int hclen;
+  int i;
+
+  memcpy(lens, lit_bits, NUM_LITLEN);
+  memset(lens + NUM_LITLEN, 2, NUM_DIST);
+
+  memset(freq, 0, sizeof(freq));
+  for (i = 0; i < NUM_LITLEN + NUM_DIST; i++) freq[lens[i]]++;
+
+  huffman_lengths(freq, NUM_CLEN, MAX_CLEN_BITS, clen);
+  huffman_codes(clen, NUM_CLEN, ccode);
+
+  for (hclen = NUM_CLEN; hclen > 4; hclen--) {
+    if (clen[clen_order[hclen - 1]] > 0) break;
+  }
+
+  memset(header, 0, sizeof(header));
+
+  w.p   = header;
+  w.buf = 0;
+  w.cnt = 0;
+
+  put_bits(&w, NUM_LITLEN - 257, 5);
+  put_bits(&w, NUM_DIST - 1, 5);
+  put_bits(&w, hclen - 4, 4);
+
+  for (i = 0; i < hclen; i++) put_bits(&w, clen[clen_order[i]], 3);
+
+  for (i = 0; i < NUM_LITLEN + NUM_DIST; i++) {
+    put_bits(&w, ccode[lens[i]], clen[lens[i]]);
+  }
+
+  header_bits = (int)(w.p - header) * 8 + w.cnt;
+  flush_bits(&w);
+}
+
+void
+fdeflate_init(void)
+{
+  uint32_t freq[NUM_LITLEN];
+  uint32_t code;
+  int bits;
+  int sym;
+  int len;
+  int d;
+
+  model_freq(freq);
+  huffman_lengths(freq, NUM_LITLEN, MAX_BITS, lit_bits);
+  huffman_codes(lit_bits, NUM_LITLEN, lit_code);
+
+  /*
+   * 一致(長さと距離)の符号は長さの符号、拡張ビット、距離の符号(2ビット
+   * 固定)をまとめて一度に出力できるようにしておく
+   */
+  sym = 0;
+
+  for (len = MIN_MATCH; len <= MAX_MATCH; len++) {
+    while (sym < 28 && len >= len_base[sym + 1]) sym++;
+
+    code = lit_code[257 + sym];
+    bits = lit_bits[257 + sym];
+
+    code |= (uint32_t)(len - len_base[sym]) << bits;
+    bits += len_extra[sym];
+
+    for (d = 0; d < NUM_DIST; d++) {
+      match_code[len][d] = code | (huffman_reverse(d, 2) << bits);
+    }
+
+    match_bits[len] = (uint8_t)(bits + 2);
+  }
+
+  build_header();
+}
+
+static size_t
+stored_size(size_t len)
+{
+  return len + 5 * ((len + STORED_MAX - 1) / STORED_MAX);
+}
+
+/*
+ * ハフマン符号化で途中で打ち切る場合に行一つ分はみ出す事があるので、
+ * その分を見込んでおく
+ */
+size_t
+fdeflate_bound(size_t len, size_t stride)
+{
+  return stored_size(len) + (stride * 2) + sizeof(header) + 16;
+}
+
+static inline size_t
+match_length(const uint8_t* s, size_t i, int d, size_t max)
+{
+  size_t n;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  uint64_t a;
+  uint64_t b;
+#endif /* defined(__GNUC__) && ... */
+
+  n = 0;
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  while (n + 8 <= max) {
+    memcpy(&a, s + i + n, 8);
+    memcpy(&b, s + i + n - d, 8);
+
+    if (a != b) return n + (__builtin_ctzll(a ^ b) >> 3);
+
+    n += 8;
+  }
+#endif /* defined(__GNUC__) && ... */
+
+  while (n < max && s[i + n] == s[i + n - d]) n++;
+
+  return n;
+}
+
+static size_t
+write_stored(uint8_t* dst, const uint8_t* src, size_t len, int last)
+{
+  uint8_t* p;
+  size_t n;
+
+  p = dst;
+
+  do {
+    n = (len > STORED_MAX)? STORED_MAX: len;
+
+    p[0] = (last && n == len)? 1: 0;
+    p[1] = (uint8_t)(n);
+    p[2] = (uint8_t)(n >> 8);
+    p[3] = (uint8_t)(~n);
+    p[4] = (uint8_t)(~n >> 8);
+
+    memcpy(p + 5, src, n);
+
+    p   += 5 + n;
+    src += n;
+    len -= n;
+  } while (len > 0);
+
+  return p - dst;
+}
+
+/*
+ * ストリップ一つ分の圧縮(バイト境界から始まりバイト境界で終わる)。最後の
+ * ストリップ以外は空の無圧縮ブロックで終える(Z_SYNC_FLUSH と同じ)。
+ * 一致はストリップ内のみを参照するので、ストリップ毎に独立して処理できる。
+ */
+size_t
+fdeflate_strip(uint8_t* dst, size_t capa,
+               const uint8_t* src, size_t len,
+               size_t stride, int bpp, int last)
+{
+  bitw_t w;
+  size_t limit;
+  size_t row_end;
+  size_t tail;
+  size_t max;
+  size_t i;
+  size_t m;
+  int d;
+
+  if (capa < fdeflate_bound(len, stride)) return 0;
+
+  limit = stored_size(len);
+
+  w.p   = dst;
+  w.buf = 0;
+  w.cnt = 0;
+
+  put_bits(&w, last? 1: 0, 1);
+  put_bits(&w, 2, 2);                       // dynamic huffman
+
+  for (i = 0; i < (size_t)header_bits / 8; i++) put_bits(&w, header[i], 8);
+  put_bits(&w, header[i], header_bits % 8);
+
+  /*
+   * 一致は最短長(3バイト)をまとめて比較してから伸ばす(写真の様に殆どが
+   * リテラルになるデータで分岐の予測を外さない様にする)
+   */
+  i       = 0;
+  tail    = (len > MIN_MATCH)? len - MIN_MATCH: 0;
+  row_end = (stride < len)? stride: len;
+
+  while (i < len) {
+    while (i < row_end) {
+      if (i >= (size_t)bpp && i <= tail) {
+        if (memcmp(src + i, src + i - bpp, MIN_MATCH) == 0) {
+          d = bpp;
+        } else if (bpp > 1 && memcmp(src + i, src + i - 1, MIN_MATCH) == 0) {
+          d = 1;
+        } else {
+          d = 0;
+        }
+
+        if (d > 0) {
+          max = (len - i < MAX_MATCH)? len - i: MAX_MATCH;
+          m   = MIN_MATCH + match_length(src, i + MIN_MATCH, d,
+                                         max - MIN_MATCH);
+
+          put_bits(&w, match_code[m][d - 1], match_bits[m]);
+          i += m;
+          continue;
+        }
+      }
+
+      put_bits(&w, lit_code[src[i]], lit_bits[src[i]]);
+      i++;
+    }
+
+    // 無圧縮より大きくなる事が確定したら打ち切る
+    if ((size_t)(w.p - dst) > limit) {
+      return write_stored(dst, src, len, last);
+    }
+
+    row_end = (row_end + stride < len)? row_end + stride: len;
+  }
+
+  put_bits(&w, lit_code[END_OF_BLOCK], lit_bits[END_OF_BLOCK]);
+
+  if (!last) {
+    put_bits(&w, 0, 3);                     // empty stored block
+    flush_bits(&w);
+
+    w.p[0] = 0x00;
+    w.p[1] = 0x00;
+    w.p[2] = 0xff;
+    w.p[3] = 0xff;
+    w.p   += 4;
+
+  } else {
+    flush_bits(&w);
+  }
+
+  if ((size_t)(w.p - dst) > limit) {
+    return write_stored(dst, src, len, last);
+  }
+
+  return w.p - dst;
+}
@@ -0,0 +1,23 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+/*
+ * single pass deflate for filtered image data (:fast mode)
+ */
+
+#ifndef __FDEFLATE_H__
+#define __FDEFLATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern void fdeflate_init(void);
+extern size_t fdeflate_bound(size_t len, size_t stride);
+extern size_t fdeflate_strip(uint8_t* dst, size_t capa,
+                             const uint8_t* src, size_t len,
+                             size_t stride, int bpp, int last);
+
+#endif /* !defined(__FDEFLATE_H__) */
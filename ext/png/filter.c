@@ -0,0 +1,564 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+#if defined(__GNUC__) && defined(HAVE_IMMINTRIN_H) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+#ifdef __SSE2__
+#define SUPPORT_SSE2
+#endif /* defined(__SSE2__) */
+
+#define SUPPORT_AVX2
+#define TARGET_AVX2                 __attribute__((target("avx2")))
+#endif /* defined(__GNUC__) && ... */
+
+/*
+ * エンコード側のフィルタは元の画素値(左・上・左上)だけを参照するので、
+ * 行内のバイトは互いに独立に計算できる。先頭の bpp バイト(左の画素が
+ * 無い部分)と末尾の端数はスカラーで、残りをベクトル単位で処理する。
+ *
+ * フィルタの選択は libpng と同じく、フィルタ後の値を符号付きとみなした
+ * 絶対値の総和が最小のものとする。コストは整数で厳密に求めるので、
+ * どの実装でも同じフィルタが選ばれる(出力は実装に依存しない)。
+ */
+
+typedef struct {
+  const char* name;
+  int (*available)(void);
+  void (*apply)(int type, uint8_t* dst,
+                const uint8_t* cur, const uint8_t* prv, size_t n, int bpp);
+  void (*costs)(const uint8_t* cur, const uint8_t* prv,
+                size_t n, int bpp, size_t* cost);
+} engine_t;
+
+#define ABS8(v)                     (((v) < 128)? (v): 256 - (v))
+
+static inline uint8_t
+paeth_predictor(int a, int b, int c)
+{
+  int p;
+  int pa;
+  int pb;
+  int pc;
+
+  p  = a + b - c;
+  pa = abs(p - a);
+  pb = abs(p - b);
+  pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc) return (uint8_t)a;
+  if (pb <= pc) return (uint8_t)b;
+
+  return (uint8_t)c;
+}
+
+/*
+ * scalar
+ */
+static void
+apply_range(int type, uint8_t* dst,
+            const uint8_t* cur, const uint8_t* prv,
+            size_t i, size_t n, int bpp)
+{
+  int a;
+  int c;
+
+  for (; i < n; i++) {
+    a = (i >= (size_t)bpp)? cur[i - bpp]: 0;
+    c = (i >= (size_t)bpp)? prv[i - bpp]: 0;
+
+    switch (type) {
+    case FILTER_NONE:
+      dst[i] = cur[i];
+      break;
+
+    case FILTER_SUB:
+      dst[i] = cur[i] - a;
+      break;
+
+    case FILTER_UP:
+      dst[i] = cur[i] - prv[i];
+      break;
+
+    case FILTER_AVG:
+      dst[i] = cur[i] - ((a + prv[i]) >> 1);
+      break;
+
+    case FILTER_PAETH:
+      dst[i] = cur[i] - paeth_predictor(a, prv[i], c);
+      break;
+    }
+  }
+}
+
+static void
+costs_range(const uint8_t* cur, const uint8_t* prv,
+            size_t i, size_t n, int bpp, size_t* cost)
+{
+  uint8_t v[5];
+  int a;
+  int c;
+  int t;
+
+  for (; i < n; i++) {
+    a = (i >= (size_t)bpp)? cur[i - bpp]: 0;
+    c = (i >= (size_t)bpp)? prv[i - bpp]: 0;
+
+    v[FILTER_NONE]  = cur[i];
+    v[FILTER_SUB]   = cur[i] - a;
+    v[FILTER_UP]    = cur[i] - prv[i];
+    v[FILTER_AVG]   = cur[i] - ((a + prv[i]) >> 1);
+    v[FILTER_PAETH] = cur[i] - paeth_predictor(a, prv[i], c);
+
+    for (t = 0; t < 5; t++) cost[t] += ABS8(v[t]);
+  }
+}
+
+static int
+scalar_available(void)
+{
+  return !0;
+}
+
+static void
+scalar_apply(int type, uint8_t* dst,
+             const uint8_t* cur, const uint8_t* prv, size_t n, int bpp)
+{
+  if (type == FILTER_NONE) {
+    memcpy(dst, cur, n);
+  } else {
+    apply_range(type, dst, cur, prv, 0, n, bpp);
+  }
+}
+
+static void
+scalar_costs(const uint8_t* cur, const uint8_t* prv,
+             size_t n, int bpp, size_t* cost)
+{
+  costs_range(cur, prv, 0, n, bpp, cost);
+}
+
+/*
+ * SSE2 (16 bytes/iteration)
+ */
+#ifdef SUPPORT_SSE2
+static inline __m128i
+paeth16_sse2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i z;
+  __m128i pa;
+  __m128i pb;
+  __m128i pc;
+  __m128i m1;
+  __m128i m2;
+  __m128i bc;
+
+  z  = _mm_setzero_si128();
+
+  pa = _mm_sub_epi16(b, c);           // p - a
+  pb = _mm_sub_epi16(a, c);           // p - b
+  pc = _mm_add_epi16(pa, pb);         // p - c
+
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(z, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(z, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(z, pc));
+
+  m1 = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+  m2 = _mm_cmpgt_epi16(pb, pc);
+  bc = _mm_or_si128(_mm_and_si128(m2, c), _mm_andnot_si128(m2, b));
+
+  return _mm_or_si128(_mm_and_si128(m1, bc), _mm_andnot_si128(m1, a));
+}
+
+static inline __m128i
+paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i z;
+  __m128i lo;
+  __m128i hi;
+
+  z  = _mm_setzero_si128();
+
+  lo = paeth16_sse2(_mm_unpacklo_epi8(a, z),
+                    _mm_unpacklo_epi8(b, z),
+                    _mm_unpacklo_epi8(c, z));
+  hi = paeth16_sse2(_mm_unpackhi_epi8(a, z),
+                    _mm_unpackhi_epi8(b, z),
+                    _mm_unpackhi_epi8(c, z));
+
+  return _mm_packus_epi16(lo, hi);
+}
+
+static inline __m128i
+avg_sse2(__m128i a, __m128i b)
+{
+  // _mm_avg_epu8() は切り上げなので、切り捨てに直す
+  return _mm_sub_epi8(_mm_avg_epu8(a, b),
+                      _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+static inline __m128i
+abs_sum_sse2(__m128i acc, __m128i v)
+{
+  __m128i z;
+
+  z = _mm_setzero_si128();
+  v = _mm_min_epu8(v, _mm_sub_epi8(z, v));
+
+  return _mm_add_epi64(acc, _mm_sad_epu8(v, z));
+}
+
+static int
+sse2_available(void)
+{
+  return !0;
+}
+
+static void
+sse2_apply(int type, uint8_t* dst,
+           const uint8_t* cur, const uint8_t* prv, size_t n, int bpp)
+{
+  __m128i x;
+  __m128i a;
+  __m128i b;
+  __m128i c;
+  __m128i r;
+  size_t i;
+
+  if (type == FILTER_NONE) {
+    memcpy(dst, cur, n);
+    return;
+  }
+
+  i = ((size_t)bpp < n)? (size_t)bpp: n;
+  apply_range(type, dst, cur, prv, 0, i, bpp);
+
+  for (; i + 16 <= n; i += 16) {
+    x = _mm_loadu_si128((const __m128i*)(cur + i));
+    a = _mm_loadu_si128((const __m128i*)(cur + i - bpp));
+    b = _mm_loadu_si128((const __m128i*)(prv + i));
+    c = _mm_loadu_si128((const __m128i*)(prv + i - bpp));
+
+    switch (type) {
+    case FILTER_SUB:
+      r = _mm_sub_epi8(x, a);
+      break;
+
+    case FILTER_UP:
+      r = _mm_sub_epi8(x, b);
+      break;
+
+    case FILTER_AVG:
+      r = _mm_sub_epi8(x, avg_sse2(a, b));
+      break;
+
+    default:
+      r = _mm_sub_epi8(x, paeth_sse2(a, b, c));
+      break;
+    }
+
+    _mm_storeu_si128((__m128i*)(dst + i), r);
+  }
+
+  apply_range(type, dst, cur, prv, i, n, bpp);
+}
+
+static void
+sse2_costs(const uint8_t* cur, const uint8_t* prv,
+           size_t n, int bpp, size_t* cost)
+{
+  __m128i x;
+  __m128i a;
+  __m128i b;
+  __m128i c;
+  __m128i acc[5];
+  uint64_t sum[2];
+  size_t i;
+  int t;
+
+  i = ((size_t)bpp < n)? (size_t)bpp: n;
+  costs_range(cur, prv, 0, i, bpp, cost);
+
+  for (t = 0; t < 5; t++) acc[t] = _mm_setzero_si128();
+
+  for (; i + 16 <= n; i += 16) {
+    x = _mm_loadu_si128((const __m128i*)(cur + i));
+    a = _mm_loadu_si128((const __m128i*)(cur + i - bpp));
+    b = _mm_loadu_si128((const __m128i*)(prv + i));
+    c = _mm_loadu_si128((const __m128i*)(prv + i - bpp));
+
+    acc[FILTER_NONE]  = abs_sum_sse2(acc[FILTER_NONE], x);
+    acc[FILTER_SUB]   = abs_sum_sse2(acc[FILTER_SUB], _mm_sub_epi8(x, a));
+    acc[FILTER_UP]    = abs_sum_sse2(acc[FILTER_UP], _mm_sub_epi8(x, b));
+    acc[FILTER_AVG]   = abs_sum_sse2(acc[FILTER_AVG],
+                                     _mm_sub_epi8(x, avg_sse2(a, b)));
+    acc[FILTER_PAETH] = abs_sum_sse2(acc[FILTER_PAETH],
+                                     _mm_sub_epi8(x, paeth_sse2(a, b, c)));
+  }
+
+  for (t = 0; t < 5; t++) {
+    _mm_storeu_si128((__m128i*)sum, acc[t]);
+    cost[t] += (size_t)(sum[0] + sum[1]);
+  }
+
+  costs_range(cur, prv, i, n, bpp, cost);
+}
+#endif /* defined(SUPPORT_SSE2) */
+
+/*
+ * AVX2 (32 bytes/iteration, selected at run time)
+ *
+ * unpack/pack は 128bit レーン内で行われるが、対で使うので並びは保たれる
+ */
+#ifdef SUPPORT_AVX2
+static inline TARGET_AVX2 __m256i
+paeth16_avx2(__m256i a, __m256i b, __m256i c)
+{
+  __m256i pa;
+  __m256i pb;
+  __m256i pc;
+  __m256i m1;
+  __m256i m2;
+
+  pa = _mm256_sub_epi16(b, c);
+  pb = _mm256_sub_epi16(a, c);
+  pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+  pa = _mm256_abs_epi16(pa);
+  pb = _mm256_abs_epi16(pb);
+
+  m1 = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb),
+                       _mm256_cmpgt_epi16(pa, pc));
+  m2 = _mm256_cmpgt_epi16(pb, pc);
+
+  return _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c, m2), m1);
+}
+
+static inline TARGET_AVX2 __m256i
+paeth_avx2(__m256i a, __m256i b, __m256i c)
+{
+  __m256i z;
+  __m256i lo;
+  __m256i hi;
+
+  z  = _mm256_setzero_si256();
+
+  lo = paeth16_avx2(_mm256_unpacklo_epi8(a, z),
+                    _mm256_unpacklo_epi8(b, z),
+                    _mm256_unpacklo_epi8(c, z));
+  hi = paeth16_avx2(_mm256_unpackhi_epi8(a, z),
+                    _mm256_unpackhi_epi8(b, z),
+                    _mm256_unpackhi_epi8(c, z));
+
+  return _mm256_packus_epi16(lo, hi);
+}
+
+static inline TARGET_AVX2 __m256i
+avg_avx2(__m256i a, __m256i b)
+{
+  return _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+                         _mm256_and_si256(_mm256_xor_si256(a, b),
+                                          _mm256_set1_epi8(1)));
+}
+
+static inline TARGET_AVX2 __m256i
+abs_sum_avx2(__m256i acc, __m256i v)
+{
+  __m256i z;
+
+  z = _mm256_setzero_si256();
+  v = _mm256_min_epu8(v, _mm256_sub_epi8(z, v));
+
+  return _mm256_add_epi64(acc, _mm256_sad_epu8(v, z));
+}
+
+static int
+avx2_available(void)
+{
+  __builtin_cpu_init();
+
+  return __builtin_cpu_supports("avx2");
+}
+
+static TARGET_AVX2 void
+avx2_apply(int type, uint8_t* dst,
+           const uint8_t* cur, const uint8_t* prv, size_t n, int bpp)
+{
+  __m256i x;
+  __m256i a;
+  __m256i b;
+  __m256i c;
+  __m256i r;
+  size_t i;
+
+  if (type == FILTER_NONE) {
+    memcpy(dst, cur, n);
+    return;
+  }
+
+  i = ((size_t)bpp < n)? (size_t)bpp: n;
+  apply_range(type, dst, cur, prv, 0, i, bpp);
+
+  for (; i + 32 <= n; i += 32) {
+    x = _mm256_loadu_si256((const __m256i*)(cur + i));
+    a = _mm256_loadu_si256((const __m256i*)(cur + i - bpp));
+    b = _mm256_loadu_si256((const __m256i*)(prv + i));
+    c = _mm256_loadu_si256((const __m256i*)(prv + i - bpp));
+
+    switch (type) {
+    case FILTER_SUB:
+      r = _mm256_sub_epi8(x, a);
+      break;
+
+    case FILTER_UP:
+      r = _mm256_sub_epi8(x, b);
+      break;
+
+    case FILTER_AVG:
+      r = _mm256_sub_epi8(x, avg_avx2(a, b));
+      break;
+
+    default:
+      r = _mm256_sub_epi8(x, paeth_avx2(a, b, c));
+      break;
+    }
+
+    _mm256_storeu_si256((__m256i*)(dst + i), r);
+  }
+
+  apply_range(type, dst, cur, prv, i, n, bpp);
+}
+
+static TARGET_AVX2 void
+avx2_costs(const uint8_t* cur, const uint8_t* prv,
+           size_t n, int bpp, size_t* cost)
+{
+  __m256i x;
+  __m256i a;
+  __m256i b;
+  __m256i c;
+  __m256i acc[5];
+  uint64_t sum[4];
+  size_t i;
+  int t;
+
+  i = ((size_t)bpp < n)? (size_t)bpp: n;
+  costs_range(cur, prv, 0, i, bpp, cost);
+
+  for (t = 0; t < 5; t++) acc[t] = _mm256_setzero_si256();
+
+  for (; i + 32 <= n; i += 32) {
+    x = _mm256_loadu_si256((const __m256i*)(cur + i));
+    a = _mm256_loadu_si256((const __m256i*)(cur + i - bpp));
+    b = _mm256_loadu_si256((const __m256i*)(prv + i));
+    c = _mm256_loadu_si256((const __m256i*)(prv + i - bpp));
+
+    acc[FILTER_NONE]  = abs_sum_avx2(acc[FILTER_NONE], x);
+    acc[FILTER_SUB]   = abs_sum_avx2(acc[FILTER_SUB], _mm256_sub_epi8(x, a));
+    acc[FILTER_UP]    = abs_sum_avx2(acc[FILTER_UP], _mm256_sub_epi8(x, b));
+    acc[FILTER_AVG]   = abs_sum_avx2(acc[FILTER_AVG],
+                                     _mm256_sub_epi8(x, avg_avx2(a, b)));
+    acc[FILTER_PAETH] = abs_sum_avx2(acc[FILTER_PAETH],
+                                     _mm256_sub_epi8(x, paeth_avx2(a, b, c)));
+  }
+
+  for (t = 0; t < 5; t++) {
+    _mm256_storeu_si256((__m256i*)sum, acc[t]);
+    cost[t] += (size_t)(sum[0] + sum[1] + sum[2] + sum[3]);
+  }
+
+  costs_range(cur, prv, i, n, bpp, cost);
+}
+#endif /* defined(SUPPORT_AVX2) */
+
+/*
+ * 先頭から順に優先度が低い(最後に使用可能なものを採用する)
+ */
+static const engine_t engines[] = {
+  {"scalar", scalar_available, scalar_apply, scalar_costs},
+#ifdef SUPPORT_SSE2
+  {"sse2", sse2_available, sse2_apply, sse2_costs},
+#endif /* defined(SUPPORT_SSE2) */
+#ifdef SUPPORT_AVX2
+  {"avx2", avx2_available, avx2_apply, avx2_costs},
+#endif /* defined(SUPPORT_AVX2) */
+};
+
+static const engine_t* engine = engines;
+
+/*
+ * 環境変数 PNG_FILTER_ENGINE で実装を指定できる(比較・検証用)。使用
+ * できない実装が指定された場合は無視する。
+ */
+void
+filter_init(void)
+{
+  const engine_t* best;
+  const char* name;
+  int i;
+
+  name = getenv("PNG_FILTER_ENGINE");
+  best = engines;
+
+  for (i = 0; i < (int)(sizeof(engines) / sizeof(*engines)); i++) {
+    if (!engines[i].available()) continue;
+
+    if (name != NULL && strcmp(name, engines[i].name) == 0) {
+      engine = engines + i;
+      return;
+    }
+
+    best = engines + i;
+  }
+
+  engine = best;
+}
+
+const char*
+filter_engine(void)
+{
+  return engine->name;
+}
+
+void
+filter_apply(int type, uint8_t* dst,
+             const uint8_t* cur, const uint8_t* prv, size_t n, int bpp)
+{
+  engine->apply(type, dst, cur, prv, n, bpp);
+}
+
+/*
+ * last までのフィルタから選択し、dst[0] に種類、dst + 1 以降にフィルタ後の
+ * 行を置く
+ */
+int
+filter_select(uint8_t* dst,
+              const uint8_t* cur, const uint8_t* prv,
+              size_t n, int bpp, int last)
+{
+  size_t cost[5];
+  int best;
+  int t;
+
+  memset(cost, 0, sizeof(cost));
+  engine->costs(cur, prv, n, bpp, cost);
+
+  best = FILTER_NONE;
+
+  for (t = FILTER_SUB; t <= last; t++) {
+    if (cost[t] < cost[best]) best = t;
+  }
+
+  dst[0] = (uint8_t)best;
+  engine->apply(best, dst + 1, cur, prv, n, bpp);
+
+  return best;
+}
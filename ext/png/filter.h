@@ -0,0 +1,32 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+/*
+ * row filters for the encoder (scalar, SSE2 and AVX2 implementations)
+ */
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILTER_NONE                 0
+#define FILTER_SUB                  1
+#define FILTER_UP                   2
+#define FILTER_AVG                  3
+#define FILTER_PAETH                4
+
+extern void filter_init(void);
+extern const char* filter_engine(void);
+extern void filter_apply(int type, uint8_t* dst,
+                         const uint8_t* cur, const uint8_t* prv,
+                         size_t n, int bpp);
+extern int filter_select(uint8_t* dst,
+                         const uint8_t* cur, const uint8_t* prv,
+                         size_t n, int bpp, int last);
+
+#endif /* !defined(__FILTER_H__) */
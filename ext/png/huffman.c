@@ -0,0 +1,158 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "huffman.h"
+
+typedef struct {
+  uint32_t freq;
+  int sym;
+} leaf_t;
+
+uint32_t
+huffman_reverse(uint32_t code, int n)
+{
+  uint32_t ret;
+  int i;
+
+  ret = 0;
+
+  for (i = 0; i < n; i++) {
+    ret   = (ret << 1) | (code & 1);
+    code >>= 1;
+  }
+
+  return ret;
+}
+
+static int
+compare_leaf(const void* _a, const void* _b)
+{
+  const leaf_t* a;
+  const leaf_t* b;
+
+  a = (const leaf_t*)_a;
+  b = (const leaf_t*)_b;
+
+  if (a->freq != b->freq) return (a->freq < b->freq)? -1: 1;
+
+  return a->sym - b->sym;
+}
+
+/*
+ * ハフマン符号長の算出(頻度 0 の記号は符号長 0)。葉を頻度順に並べ、葉と
+ * 内部節点の二つのキューから小さい方を取り出して木を作る。最大長を越えた
+ * 場合は頻度を平坦化してやり直す。
+ */
+void
+huffman_lengths(const uint32_t* _freq, int n, int limit, uint8_t* len)
+{
+  uint32_t freq[HUFFMAN_MAX_SYMS];
+  leaf_t leaf[HUFFMAN_MAX_SYMS];
+  uint64_t weight[HUFFMAN_MAX_SYMS * 2];
+  int parent[HUFFMAN_MAX_SYMS * 2];
+  int depth[HUFFMAN_MAX_SYMS * 2];
+  int nleaf;
+  int pick[2];
+  int max;
+  int i;
+  int j;
+  int k;
+  int x;
+
+  memcpy(freq, _freq, sizeof(*freq) * n);
+  memset(len, 0, n);
+
+  do {
+    nleaf = 0;
+
+    for (i = 0; i < n; i++) {
+      if (freq[i] > 0) {
+        leaf[nleaf].freq = freq[i];
+        leaf[nleaf].sym  = i;
+        nleaf++;
+      }
+    }
+
+    if (nleaf == 0) return;
+
+    if (nleaf == 1) {
+      len[leaf[0].sym] = 1;
+      return;
+    }
+
+    qsort(leaf, nleaf, sizeof(*leaf), compare_leaf);
+
+    for (i = 0; i < nleaf; i++) weight[i] = leaf[i].freq;
+
+    i = 0;             // next leaf
+    j = nleaf;         // next internal node to be merged
+    k = nleaf;         // next internal node to be created
+
+    while (k < nleaf * 2 - 1) {
+      for (x = 0; x < 2; x++) {
+        if (i < nleaf && (j >= k || weight[i] <= weight[j])) {
+          pick[x] = i++;
+        } else {
+          pick[x] = j++;
+        }
+      }
+
+      weight[k]       = weight[pick[0]] + weight[pick[1]];
+      parent[pick[0]] = k;
+      parent[pick[1]] = k;
+      k++;
+    }
+
+    depth[k - 1] = 0;
+    max          = 0;
+
+    for (x = k - 2; x >= 0; x--) {
+      depth[x] = depth[parent[x]] + 1;
+      if (x < nleaf && depth[x] > max) max = depth[x];
+    }
+
+    for (i = 0; i < nleaf; i++) {
+      len[leaf[i].sym] = (uint8_t)depth[i];
+    }
+
+    for (i = 0; i < n; i++) {
+      if (freq[i] > 0) freq[i] = (freq[i] >> 1) | 1;
+    }
+  } while (max > limit);
+}
+
+/*
+ * 符号長から canonical なハフマン符号を作る(deflate は LSB から詰めるので
+ * ビットを反転しておく)
+ */
+void
+huffman_codes(const uint8_t* len, int n, uint16_t* code)
+{
+  uint16_t count[HUFFMAN_MAX_BITS + 1];
+  uint16_t next[HUFFMAN_MAX_BITS + 1];
+  uint16_t c;
+  int i;
+
+  memset(count, 0, sizeof(count));
+
+  for (i = 0; i < n; i++) count[len[i]]++;
+
+  count[0] = 0;
+  c        = 0;
+
+  for (i = 1; i <= HUFFMAN_MAX_BITS; i++) {
+    c       = (c + count[i - 1]) << 1;
+    next[i] = c;
+  }
+
+  for (i = 0; i < n; i++) {
+    code[i] = (len[i] > 0)?
+                (uint16_t)huffman_reverse(next[len[i]]++, len[i]): 0;
+  }
+}
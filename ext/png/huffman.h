@@ -0,0 +1,24 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+/*
+ * Huffman code construction shared by the deflate implementations
+ */
+
+#ifndef __HUFFMAN_H__
+#define __HUFFMAN_H__
+
+#include <stdint.h>
+
+#define HUFFMAN_MAX_SYMS            288
+#define HUFFMAN_MAX_BITS            15
+
+extern uint32_t huffman_reverse(uint32_t code, int n);
+extern void huffman_lengths(const uint32_t* freq, int n, int limit,
+                            uint8_t* len);
+extern void huffman_codes(const uint8_t* len, int n, uint16_t* code);
+
+#endif /* !defined(__HUFFMAN_H__) */
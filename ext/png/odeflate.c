@@ -0,0 +1,1253 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "huffman.h"
+#include "odeflate.h"
+#include "parallel.h"
+
+/*
+ * 反復による最適化を行う deflate (zopfli と同じ考え方)
+ *
+ * 入力を PART_SIZE 毎のパートに分け、パート毎に以下を行う(パートは直前の
+ * 32KiB を参照できるので、パート間は独立して並列に処理できる)。
+ *
+ *   1. ハッシュチェーンで各位置の一致を探し、一致長が伸びる度にその長さと
+ *      距離(その長さに届く最短の距離)を記録する
+ *   2. 記号毎の符号長(ビット数)を費用として、最短経路問題として最適な
+ *      リテラルと一致の並びを求める。求めた並びの記号の頻度から費用を
+ *      更新して繰り返し、最も小さくなった並びを採る
+ *   3. 記号の並びを、分割した方が小さくなる位置で再帰的にブロックに分け、
+ *      ブロック毎に動的ハフマン・固定ハフマン・無圧縮の最も小さいもので
+ *      出力する
+ *
+ * 無圧縮ブロックのパディングはパート内のビット位置で決まるので、最後以外の
+ * パートは空の無圧縮ブロック(Z_SYNC_FLUSH と同じ)でバイト境界に揃えて
+ * 終え、各パートの出力はバイト単位で連結する。
+ */
+
+#define NUM_LITLEN                  286
+#define NUM_DIST                    30
+#define NUM_CLEN                    19
+#define NUM_FIXED_LITLEN            288
+#define MAX_BITS                    15
+#define MAX_CLEN_BITS               7
+#define MIN_MATCH                   3
+#define MAX_MATCH                   258
+#define WINDOW_SIZE                 32768
+#define WINDOW_MASK                 (WINDOW_SIZE - 1)
+#define HASH_BITS                   16
+#define HASH_SIZE                   (1 << HASH_BITS)
+#define STORED_MAX                  65535
+#define END_OF_BLOCK                256
+#define PART_SIZE                   (1024 * 1024)
+#define SPLIT_MIN                   1024    // symbols per block (at least)
+#define SPLIT_POINTS                16
+
+typedef struct {
+  uint8_t* buf;
+  size_t size;
+  size_t capa;
+  uint64_t bits;
+  int cnt;
+  int failed;
+} bitw_t;
+
+typedef struct {
+  float lit[NUM_LITLEN];
+  float dist[NUM_DIST];       // including the extra bits
+  float len[MAX_MATCH + 1];   // including the extra bits
+} cost_t;
+
+typedef struct {
+  uint8_t ll_len[NUM_LITLEN];
+  uint8_t d_len[NUM_DIST];
+  uint8_t cl_len[NUM_CLEN];
+  uint8_t rle_sym[NUM_LITLEN + NUM_DIST];
+  uint8_t rle_ext[NUM_LITLEN + NUM_DIST];
+  int nrle;
+  int hlit;
+  int hdist;
+  int hclen;
+  size_t bits;                // size of the whole block
+} tree_t;
+
+typedef struct {
+  const uint8_t* src;         // whole input
+  size_t len;
+  size_t start;
+  size_t end;
+  int iterations;
+  int chain;
+  int last;
+
+  uint32_t* offsets;          // index of the first pair of each position
+  uint32_t* pairs;            // (length << 16) | distance
+  size_t npairs;
+  size_t pairs_capa;
+
+  uint16_t* lit;              // literal, or length of the match
+  uint16_t* dist;             // distance of the match (0: literal)
+  size_t nsyms;
+
+  size_t* bounds;             // end of each block (index of the symbols)
+  int nblocks;
+
+  bitw_t out;
+  int failed;
+} part_t;
+
+typedef struct {
+  const uint8_t* src;
+  size_t len;
+  int iterations;
+  int chain;
+  part_t* parts;
+  int nparts;
+} odeflate_t;
+
+typedef struct {
+  uint16_t* same;             // number of the same bytes that follow
+  float* cost;
+  uint16_t* from_len;
+  uint16_t* from_dist;
+  uint16_t* lit;              // symbols of the current iteration
+  uint16_t* dist;
+  uint32_t seed;
+} work_t;
+
+static const uint16_t len_base[] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const uint8_t len_extra[] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static const uint16_t dist_base[] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577,
+};
+
+static const uint8_t dist_extra[] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+static const uint8_t clen_order[NUM_CLEN] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+static uint8_t len_sym[MAX_MATCH + 1];
+static uint8_t dist_sym_tab[512];
+
+static uint8_t fixed_ll_len[NUM_FIXED_LITLEN];
+static uint16_t fixed_ll_code[NUM_FIXED_LITLEN];
+static uint8_t fixed_d_len[NUM_DIST];
+static uint16_t fixed_d_code[NUM_DIST];
+
+void
+odeflate_init(void)
+{
+  int sym;
+  int i;
+
+  sym = 0;
+
+  for (i = MIN_MATCH; i <= MAX_MATCH; i++) {
+    while (sym < 28 && i >= len_base[sym + 1]) sym++;
+    len_sym[i] = (uint8_t)sym;
+  }
+
+  /*
+   * 距離の記号は 256 までは距離 - 1 で、それ以上は (距離 - 1) >> 7 で
+   * 表を引く(zlib と同じ)
+   */
+  sym = 0;
+
+  for (i = 0; i < 256; i++) {
+    while (sym < 29 && i + 1 >= dist_base[sym + 1]) sym++;
+    dist_sym_tab[i] = (uint8_t)sym;
+  }
+
+  for (i = 256; i < 512; i++) {
+    while (sym < 29 && ((i - 256) << 7) + 1 >= dist_base[sym + 1]) sym++;
+    dist_sym_tab[i] = (uint8_t)sym;
+  }
+
+  for (i = 0; i < NUM_FIXED_LITLEN; i++) {
+    fixed_ll_len[i] = (i < 144)? 8: (i < 256)? 9: (i < 280)? 7: 8;
+  }
+
+  memset(fixed_d_len, 5, sizeof(fixed_d_len));
+
+  huffman_codes(fixed_ll_len, NUM_FIXED_LITLEN, fixed_ll_code);
+  huffman_codes(fixed_d_len, NUM_DIST, fixed_d_code);
+}
+
+static inline int
+dist_sym(int d)
+{
+  return (d <= 256)? dist_sym_tab[d - 1]: dist_sym_tab[256 + ((d - 1) >> 7)];
+}
+
+static inline void
+put_bits(bitw_t* w, uint32_t val, int n)
+{
+  w->bits |= (uint64_t)val << w->cnt;
+  w->cnt  += n;
+
+  while (w->cnt >= 8) {
+    if (w->size < w->capa) {
+      w->buf[w->size++] = (uint8_t)w->bits;
+    } else {
+      w->failed = !0;
+    }
+
+    w->bits >>= 8;
+    w->cnt   -= 8;
+  }
+}
+
+static void
+align_bits(bitw_t* w)
+{
+  if (w->cnt > 0) put_bits(w, 0, 8 - w->cnt);
+}
+
+static inline size_t
+match_length(const uint8_t* a, const uint8_t* b, size_t max)
+{
+  size_t n;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  uint64_t x;
+  uint64_t y;
+#endif /* defined(__GNUC__) && ... */
+
+  n = 0;
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  while (n + 8 <= max) {
+    memcpy(&x, a + n, 8);
+    memcpy(&y, b + n, 8);
+
+    if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3);
+
+    n += 8;
+  }
+#endif /* defined(__GNUC__) && ... */
+
+  while (n < max && a[n] == b[n]) n++;
+
+  return n;
+}
+
+static inline uint32_t
+hash3(const uint8_t* p)
+{
+  uint32_t v;
+
+  v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+
+  return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static int
+push_pair(part_t* pt, size_t len, size_t dist)
+{
+  uint32_t* tmp;
+
+  if (pt->npairs == pt->pairs_capa) {
+    pt->pairs_capa = (pt->pairs_capa > 0)? pt->pairs_capa * 2: 65536;
+    tmp            = (uint32_t*)realloc(pt->pairs,
+                                        pt->pairs_capa * sizeof(uint32_t));
+    if (tmp == NULL) return -1;
+
+    pt->pairs = tmp;
+  }
+
+  pt->pairs[pt->npairs++] = (uint32_t)((len << 16) | dist);
+
+  return 0;
+}
+
+/*
+ * 一致の検索。位置はハッシュ表の基点(パートの 32KiB 前)からの相対値で
+ * 持つ。一致はパートの終端を越えない。
+ *
+ * 同じバイトが続く部分ではチェーンが近くの位置で埋まって遠くの一致に
+ * 届かないので、先頭 3 バイトに同じバイトが続く数を加えたハッシュの
+ * チェーンも持ち、連続を覆う一致が見つかった後はそちらを辿る(zopfli と
+ * 同じ)。
+ */
+static int
+find_matches(part_t* pt)
+{
+  const uint8_t* src;
+  int32_t* head;
+  int32_t* prev;
+  int32_t* head2;
+  int32_t* prev2;
+  uint32_t* val2;
+  uint16_t* same;
+  size_t base;
+  size_t p;
+  size_t max;
+  size_t best;
+  size_t l;
+  int32_t c;
+  int32_t next;
+  int32_t i;
+  uint32_t h;
+  uint32_t h2;
+  int chain;
+  int use2;
+  int ret;
+
+  src  = pt->src;
+  base = (pt->start > WINDOW_SIZE)? pt->start - WINDOW_SIZE: 0;
+
+  head  = (int32_t*)malloc(HASH_SIZE * sizeof(int32_t));
+  prev  = (int32_t*)malloc(WINDOW_SIZE * sizeof(int32_t));
+  head2 = (int32_t*)malloc(HASH_SIZE * sizeof(int32_t));
+  prev2 = (int32_t*)malloc(WINDOW_SIZE * sizeof(int32_t));
+  val2  = (uint32_t*)malloc(WINDOW_SIZE * sizeof(uint32_t));
+  same  = (uint16_t*)malloc((pt->end - base + 1) * sizeof(uint16_t));
+
+  pt->offsets = (uint32_t*)malloc((pt->end - pt->start + 1) * sizeof(uint32_t));
+
+  ret = -1;
+
+  if (head && prev && head2 && prev2 && val2 && same && pt->offsets) {
+    memset(head, 0xff, HASH_SIZE * sizeof(int32_t));
+    memset(head2, 0xff, HASH_SIZE * sizeof(int32_t));
+
+    same[pt->end - base] = 0;
+
+    for (p = pt->end; p > base; p--) {
+      if (p < pt->end && src[p - 1] == src[p]) {
+        same[p - 1 - base] = (same[p - base] < 0xffff)? same[p - base] + 1: 0xffff;
+      } else {
+        same[p - 1 - base] = 0;
+      }
+    }
+
+    ret = 0;
+
+    for (p = base; p < pt->end; p++) {
+      if (p >= pt->start) pt->offsets[p - pt->start] = (uint32_t)pt->npairs;
+
+      if (p + MIN_MATCH > pt->len) continue;
+
+      i   = (int32_t)(p - base);
+      h   = hash3(src + p);
+      h2  = (h ^ (same[i] & 0xff)) & (HASH_SIZE - 1);
+      max = pt->end - p;
+      if (max > MAX_MATCH) max = MAX_MATCH;
+
+      if (p >= pt->start && max >= MIN_MATCH) {
+        best  = MIN_MATCH - 1;
+        chain = pt->chain;
+        use2  = 0;
+
+        for (c = head[h]; c >= 0 && i - c <= WINDOW_SIZE && chain > 0; c = next) {
+          chain--;
+
+          if (src[base + c + best] == src[p + best]) {
+            l = match_length(src + p, src + base + c, max);
+
+            if (l > best) {
+              if (push_pair(pt, l, i - c) != 0) {
+                ret = -1;
+                break;
+              }
+
+              best = l;
+              if (l == max) break;
+            }
+          }
+
+          if (!use2 && best >= same[i] && val2[c & WINDOW_MASK] == h2) {
+            use2 = !0;
+          }
+
+          next = (use2)? prev2[c & WINDOW_MASK]: prev[c & WINDOW_MASK];
+          if (next >= c) break;
+        }
+
+        if (ret != 0) break;
+      }
+
+      prev[i & WINDOW_MASK]  = head[h];
+      head[h]                = i;
+      prev2[i & WINDOW_MASK] = head2[h2];
+      val2[i & WINDOW_MASK]  = h2;
+      head2[h2]              = i;
+    }
+
+    pt->offsets[pt->end - pt->start] = (uint32_t)pt->npairs;
+  }
+
+  if (head != NULL) free(head);
+  if (prev != NULL) free(prev);
+  if (head2 != NULL) free(head2);
+  if (prev2 != NULL) free(prev2);
+  if (val2 != NULL) free(val2);
+  if (same != NULL) free(same);
+
+  return ret;
+}
+
+static void
+fill_len_cost(cost_t* cm)
+{
+  int l;
+
+  for (l = MIN_MATCH; l <= MAX_MATCH; l++) {
+    cm->len[l] = cm->lit[257 + len_sym[l]] + len_extra[len_sym[l]];
+  }
+}
+
+/*
+ * 最初の反復は固定ハフマン符号の符号長を費用とする
+ */
+static void
+fixed_cost(cost_t* cm)
+{
+  int i;
+
+  for (i = 0; i < NUM_LITLEN; i++) cm->lit[i] = fixed_ll_len[i];
+  for (i = 0; i < NUM_DIST; i++) cm->dist[i] = 5.0f + dist_extra[i];
+
+  fill_len_cost(cm);
+}
+
+/*
+ * 記号の頻度から費用(情報量)を求める。出現しなかった記号は頻度 1 未満と
+ * みなす。
+ */
+static void
+stat_cost(cost_t* cm, const uint32_t* ll, const uint32_t* dc)
+{
+  double sum;
+  double lsum;
+  int i;
+
+  sum = 0;
+  for (i = 0; i < NUM_LITLEN; i++) sum += ll[i];
+
+  lsum = log2((sum > 0)? sum: NUM_LITLEN);
+
+  for (i = 0; i < NUM_LITLEN; i++) {
+    cm->lit[i] = (float)((ll[i] > 0)? lsum - log2(ll[i]): lsum);
+  }
+
+  sum = 0;
+  for (i = 0; i < NUM_DIST; i++) sum += dc[i];
+
+  lsum = log2((sum > 0)? sum: NUM_DIST);
+
+  for (i = 0; i < NUM_DIST; i++) {
+    cm->dist[i] = (float)(((dc[i] > 0)? lsum - log2(dc[i]): lsum) +
+                          dist_extra[i]);
+  }
+
+  fill_len_cost(cm);
+}
+
+/*
+ * 最短経路による最適な記号の並びの探索(パート内の [ks, ke) の範囲)。同じ
+ * バイトの長い連続の中では距離 1 の最長一致で進める(zopfli と同じ省略)。
+ * 記号の並びは wk->lit, wk->dist に置き、その数を返す。
+ */
+static size_t
+optimal_parse(part_t* pt, const cost_t* cm, work_t* wk, size_t ks, size_t ke)
+{
+  const uint8_t* src;
+  float* cost;
+  uint16_t* from_len;
+  uint16_t* from_dist;
+  size_t n;
+  size_t k;
+  size_t t;
+  size_t l;
+  size_t max;
+  size_t m;
+  uint32_t q;
+  uint32_t plen;
+  uint32_t pdist;
+  float base;
+  float dc;
+  float c;
+
+  src       = pt->src + pt->start + ks;
+  n         = ke - ks;
+  cost      = wk->cost;
+  from_len  = wk->from_len;
+  from_dist = wk->from_dist;
+
+  cost[0] = 0.0f;
+  for (k = 1; k <= n; k++) cost[k] = FLT_MAX;
+
+  for (k = 0; k < n; k++) {
+    if (wk->same[ks + k] > MAX_MATCH * 2 && k > MAX_MATCH + 1 &&
+        k + MAX_MATCH * 2 + 1 < n && wk->same[ks + k - MAX_MATCH] > MAX_MATCH) {
+      c = cm->len[MAX_MATCH] + cm->dist[0];
+
+      for (t = 0; t < MAX_MATCH; t++, k++) {
+        cost[k + MAX_MATCH]      = cost[k] + c;
+        from_len[k + MAX_MATCH]  = MAX_MATCH;
+        from_dist[k + MAX_MATCH] = 1;
+      }
+    }
+
+    base = cost[k];
+
+    c = base + cm->lit[src[k]];
+    if (c < cost[k + 1]) {
+      cost[k + 1]      = c;
+      from_len[k + 1]  = 1;
+      from_dist[k + 1] = 0;
+    }
+
+    l   = MIN_MATCH;
+    max = n - k;
+
+    for (q = pt->offsets[ks + k]; q < pt->offsets[ks + k + 1]; q++) {
+      plen  = pt->pairs[q] >> 16;
+      pdist = pt->pairs[q] & 0xffff;
+      dc    = base + cm->dist[dist_sym(pdist)];
+
+      if (plen > max) plen = (uint32_t)max;
+
+      for (; l <= plen; l++) {
+        c = dc + cm->len[l];
+
+        if (c < cost[k + l]) {
+          cost[k + l]      = c;
+          from_len[k + l]  = (uint16_t)l;
+          from_dist[k + l] = (uint16_t)pdist;
+        }
+      }
+    }
+  }
+
+  /*
+   * 終端から辿って記号の並びを作る
+   */
+  m = 0;
+  for (k = n; k > 0; k -= from_len[k]) m++;
+
+  n = m;
+
+  for (k = ke - ks; k > 0; k -= from_len[k]) {
+    m--;
+
+    if (from_dist[k] == 0) {
+      wk->lit[m]  = src[k - 1];
+      wk->dist[m] = 0;
+    } else {
+      wk->lit[m]  = from_len[k];
+      wk->dist[m] = from_dist[k];
+    }
+  }
+
+  return n;
+}
+
+static void
+count_symbols(const uint16_t* lit, const uint16_t* dist, size_t lo, size_t hi,
+              uint32_t* ll, uint32_t* dc)
+{
+  size_t i;
+
+  memset(ll, 0, sizeof(uint32_t) * NUM_LITLEN);
+  memset(dc, 0, sizeof(uint32_t) * NUM_DIST);
+
+  for (i = lo; i < hi; i++) {
+    if (dist[i] == 0) {
+      ll[lit[i]]++;
+    } else {
+      ll[257 + len_sym[lit[i]]]++;
+      dc[dist_sym(dist[i])]++;
+    }
+  }
+
+  ll[END_OF_BLOCK] = 1;
+}
+
+static size_t
+extra_bits(const uint32_t* ll, const uint32_t* dc)
+{
+  size_t ret;
+  int i;
+
+  ret = 0;
+
+  for (i = 0; i < 29; i++) ret += (size_t)ll[257 + i] * len_extra[i];
+  for (i = 0; i < NUM_DIST; i++) ret += (size_t)dc[i] * dist_extra[i];
+
+  return ret;
+}
+
+/*
+ * 符号長の並びの連長圧縮(16: 直前の値の繰り返し、17/18: 0 の繰り返し)
+ */
+static void
+rle_lengths(tree_t* t, const uint8_t* lens, int n)
+{
+  int i;
+  int run;
+  int r;
+
+  t->nrle = 0;
+
+  for (i = 0; i < n; i += run) {
+    for (run = 1; i + run < n && lens[i + run] == lens[i]; run++);
+
+    r = run;
+
+    if (lens[i] == 0) {
+      while (r >= 11) {
+        t->rle_sym[t->nrle]   = 18;
+        t->rle_ext[t->nrle++] = (uint8_t)(((r < 138)? r: 138) - 11);
+        r -= (r < 138)? r: 138;
+      }
+
+      if (r >= 3) {
+        t->rle_sym[t->nrle]   = 17;
+        t->rle_ext[t->nrle++] = (uint8_t)(r - 3);
+        r = 0;
+      }
+
+    } else {
+      t->rle_sym[t->nrle]   = lens[i];
+      t->rle_ext[t->nrle++] = 0;
+      r--;
+
+      while (r >= 3) {
+        t->rle_sym[t->nrle]   = 16;
+        t->rle_ext[t->nrle++] = (uint8_t)(((r < 6)? r: 6) - 3);
+        r -= (r < 6)? r: 6;
+      }
+    }
+
+    while (r > 0) {
+      t->rle_sym[t->nrle]   = lens[i];
+      t->rle_ext[t->nrle++] = 0;
+      r--;
+    }
+  }
+}
+
+static const uint8_t rle_ext_bits[NUM_CLEN] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7,
+};
+
+/*
+ * 動的ハフマンブロックの符号長とヘッダを作り、ブロック全体のビット数を
+ * 求める
+ */
+static void
+build_tree(tree_t* t, const uint32_t* ll, const uint32_t* dc)
+{
+  uint8_t lens[NUM_LITLEN + NUM_DIST];
+  uint32_t freq[NUM_CLEN];
+  int used;
+  int i;
+
+  huffman_lengths(ll, NUM_LITLEN, MAX_BITS, t->ll_len);
+  huffman_lengths(dc, NUM_DIST, MAX_BITS, t->d_len);
+
+  /*
+   * 距離の符号が一つ以下の場合は二つにしておく(不完全な符号を受け付けない
+   * デコーダがある)
+   */
+  used = 0;
+  for (i = 0; i < NUM_DIST; i++) if (t->d_len[i] > 0) used++;
+
+  if (used == 0) {
+    t->d_len[0] = 1;
+    t->d_len[1] = 1;
+
+  } else if (used == 1) {
+    t->d_len[(t->d_len[0] > 0)? 1: 0] = 1;
+  }
+
+  for (t->hlit = NUM_LITLEN; t->hlit > 257; t->hlit--) {
+    if (t->ll_len[t->hlit - 1] > 0) break;
+  }
+
+  for (t->hdist = NUM_DIST; t->hdist > 1; t->hdist--) {
+    if (t->d_len[t->hdist - 1] > 0) break;
+  }
+
+  memcpy(lens, t->ll_len, t->hlit);
+  memcpy(lens + t->hlit, t->d_len, t->hdist);
+
+  rle_lengths(t, lens, t->hlit + t->hdist);
+
+  memset(freq, 0, sizeof(freq));
+  for (i = 0; i < t->nrle; i++) freq[t->rle_sym[i]]++;
+
+  huffman_lengths(freq, NUM_CLEN, MAX_CLEN_BITS, t->cl_len);
+
+  // 符号長の符号は不完全なものを受け付けないので、一つだけなら一つ足す
+  used = 0;
+  for (i = 0; i < NUM_CLEN; i++) if (t->cl_len[i] > 0) used++;
+
+  if (used == 1) t->cl_len[(t->cl_len[0] > 0)? 1: 0] = 1;
+
+  for (t->hclen = NUM_CLEN; t->hclen > 4; t->hclen--) {
+    if (t->cl_len[clen_order[t->hclen - 1]] > 0) break;
+  }
+
+  t->bits = 3 + 5 + 5 + 4 + (size_t)t->hclen * 3;
+
+  for (i = 0; i < t->nrle; i++) {
+    t->bits += t->cl_len[t->rle_sym[i]] + rle_ext_bits[t->rle_sym[i]];
+  }
+
+  for (i = 0; i < NUM_LITLEN; i++) t->bits += (size_t)ll[i] * t->ll_len[i];
+  for (i = 0; i < NUM_DIST; i++) t->bits += (size_t)dc[i] * t->d_len[i];
+
+  t->bits += extra_bits(ll, dc);
+}
+
+static size_t
+fixed_bits(const uint32_t* ll, const uint32_t* dc)
+{
+  size_t ret;
+  int i;
+
+  ret = 3;
+
+  for (i = 0; i < NUM_LITLEN; i++) ret += (size_t)ll[i] * fixed_ll_len[i];
+  for (i = 0; i < NUM_DIST; i++) ret += (size_t)dc[i] * fixed_d_len[i];
+
+  return ret + extra_bits(ll, dc);
+}
+
+static size_t
+range_bits(const part_t* pt, size_t lo, size_t hi)
+{
+  uint32_t ll[NUM_LITLEN];
+  uint32_t dc[NUM_DIST];
+  tree_t t;
+  size_t fixed;
+
+  count_symbols(pt->lit, pt->dist, lo, hi, ll, dc);
+  build_tree(&t, ll, dc);
+
+  fixed = fixed_bits(ll, dc);
+
+  return (t.bits < fixed)? t.bits: fixed;
+}
+
+/*
+ * ブロック分割(等間隔の候補から最も小さくなる位置を選び、その前後で
+ * もう一度細かく探す)
+ */
+static void
+split_blocks(part_t* pt, size_t lo, size_t hi, size_t whole)
+{
+  size_t best;
+  size_t best_a;
+  size_t best_b;
+  size_t pos;
+  size_t step;
+  size_t from;
+  size_t a;
+  size_t b;
+  size_t p;
+  int pass;
+  int j;
+
+  pos    = 0;
+  best   = whole;
+  best_a = 0;
+  best_b = 0;
+
+  if (hi - lo >= SPLIT_MIN * 2) {
+    from = lo + SPLIT_MIN;
+    step = (hi - lo - SPLIT_MIN * 2) / SPLIT_POINTS;
+
+    for (pass = 0; pass < 2 && step > 0; pass++) {
+      for (j = 0; j <= SPLIT_POINTS; j++) {
+        p = from + step * j;
+        if (p < lo + SPLIT_MIN || p > hi - SPLIT_MIN) continue;
+
+        a = range_bits(pt, lo, p);
+        b = range_bits(pt, p, hi);
+
+        if (a + b < best) {
+          best   = a + b;
+          best_a = a;
+          best_b = b;
+          pos    = p;
+        }
+      }
+
+      if (pos == 0) break;
+
+      from = (pos > lo + step)? pos - step: lo;
+      step = step * 2 / SPLIT_POINTS;
+    }
+  }
+
+  if (pos == 0) {
+    pt->bounds[pt->nblocks++] = hi;
+
+  } else {
+    split_blocks(pt, lo, pos, best_a);
+    split_blocks(pt, pos, hi, best_b);
+  }
+}
+
+static void
+put_symbols(bitw_t* w, const part_t* pt, size_t lo, size_t hi,
+            const uint8_t* ll_len, const uint16_t* ll_code,
+            const uint8_t* d_len, const uint16_t* d_code)
+{
+  size_t i;
+  int s;
+  int d;
+
+  for (i = lo; i < hi; i++) {
+    if (pt->dist[i] == 0) {
+      put_bits(w, ll_code[pt->lit[i]], ll_len[pt->lit[i]]);
+
+    } else {
+      s = len_sym[pt->lit[i]];
+      put_bits(w, ll_code[257 + s], ll_len[257 + s]);
+      put_bits(w, pt->lit[i] - len_base[s], len_extra[s]);
+
+      d = dist_sym(pt->dist[i]);
+      put_bits(w, d_code[d], d_len[d]);
+      put_bits(w, pt->dist[i] - dist_base[d], dist_extra[d]);
+    }
+  }
+
+  put_bits(w, ll_code[END_OF_BLOCK], ll_len[END_OF_BLOCK]);
+}
+
+static void
+write_block(part_t* pt, size_t lo, size_t hi,
+            const uint8_t* src, size_t len, int final)
+{
+  uint32_t ll[NUM_LITLEN];
+  uint32_t dc[NUM_DIST];
+  uint16_t ll_code[NUM_LITLEN];
+  uint16_t d_code[NUM_DIST];
+  uint16_t cl_code[NUM_CLEN];
+  tree_t t;
+  bitw_t* w;
+  size_t fixed;
+  size_t stored;
+  size_t n;
+  int i;
+
+  w = &pt->out;
+
+  count_symbols(pt->lit, pt->dist, lo, hi, ll, dc);
+  build_tree(&t, ll, dc);
+
+  fixed  = fixed_bits(ll, dc);
+  stored = (len + 5 * ((len + STORED_MAX - 1) / STORED_MAX + 1)) * 8;
+
+  if (stored < t.bits && stored < fixed) {
+    do {
+      n = (len > STORED_MAX)? STORED_MAX: len;
+
+      put_bits(w, (final && n == len)? 1: 0, 1);
+      put_bits(w, 0, 2);
+      align_bits(w);
+      put_bits(w, (uint32_t)n, 16);
+      put_bits(w, (uint32_t)(~n & 0xffff), 16);
+
+      if (w->size + n <= w->capa) {
+        memcpy(w->buf + w->size, src, n);
+        w->size += n;
+      } else {
+        w->failed = !0;
+      }
+
+      src += n;
+      len -= n;
+    } while (len > 0);
+
+  } else if (fixed <= t.bits) {
+    put_bits(w, final? 1: 0, 1);
+    put_bits(w, 1, 2);
+    put_symbols(w, pt, lo, hi,
+                fixed_ll_len, fixed_ll_code, fixed_d_len, fixed_d_code);
+
+  } else {
+    huffman_codes(t.ll_len, NUM_LITLEN, ll_code);
+    huffman_codes(t.d_len, NUM_DIST, d_code);
+    huffman_codes(t.cl_len, NUM_CLEN, cl_code);
+
+    put_bits(w, final? 1: 0, 1);
+    put_bits(w, 2, 2);
+    put_bits(w, t.hlit - 257, 5);
+    put_bits(w, t.hdist - 1, 5);
+    put_bits(w, t.hclen - 4, 4);
+
+    for (i = 0; i < t.hclen; i++) put_bits(w, t.cl_len[clen_order[i]], 3);
+
+    for (i = 0; i < t.nrle; i++) {
+      put_bits(w, cl_code[t.rle_sym[i]], t.cl_len[t.rle_sym[i]]);
+      put_bits(w, t.rle_ext[i], rle_ext_bits[t.rle_sym[i]]);
+    }
+
+    put_symbols(w, pt, lo, hi, t.ll_len, ll_code, t.d_len, d_code);
+  }
+}
+
+/*
+ * 反復が進まなくなった場合は、最良の結果の頻度の一部を他の記号の頻度で
+ * 置き換えて局所解から抜け出す(zopfli と同じ)
+ */
+static void
+randomize_freq(uint32_t* freq, int n, uint32_t* seed)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    *seed = *seed * 1103515245U + 12345U;
+
+    if (((*seed >> 16) % 3) == 0) {
+      *seed   = *seed * 1103515245U + 12345U;
+      freq[i] = freq[(*seed >> 16) % n];
+    }
+  }
+}
+
+/*
+ * [ks, ke) の範囲の反復。最も小さくなった記号の並びを lit, dist に置き、
+ * その数を返す。
+ */
+static size_t
+iterate_parse(part_t* pt, cost_t* cm, work_t* wk, size_t ks, size_t ke,
+              uint16_t* lit, uint16_t* dist)
+{
+  uint32_t ll[NUM_LITLEN];
+  uint32_t dc[NUM_DIST];
+  uint32_t best_ll[NUM_LITLEN];
+  uint32_t best_dc[NUM_DIST];
+  tree_t t;
+  size_t best;
+  size_t prev;
+  size_t ret;
+  size_t m;
+  int i;
+
+  best = 0;
+  prev = 0;
+  ret  = 0;
+
+  for (i = 0; i < pt->iterations || i == 0; i++) {
+    m = optimal_parse(pt, cm, wk, ks, ke);
+
+    count_symbols(wk->lit, wk->dist, 0, m, ll, dc);
+    build_tree(&t, ll, dc);
+
+    if (best == 0 || t.bits < best) {
+      best = t.bits;
+      ret  = m;
+
+      memcpy(lit, wk->lit, m * sizeof(uint16_t));
+      memcpy(dist, wk->dist, m * sizeof(uint16_t));
+      memcpy(best_ll, ll, sizeof(ll));
+      memcpy(best_dc, dc, sizeof(dc));
+    }
+
+    if (t.bits == prev) {
+      memcpy(ll, best_ll, sizeof(ll));
+      memcpy(dc, best_dc, sizeof(dc));
+
+      randomize_freq(ll, NUM_LITLEN, &wk->seed);
+      randomize_freq(dc, NUM_DIST, &wk->seed);
+      ll[END_OF_BLOCK] = 1;
+    }
+
+    prev = t.bits;
+    stat_cost(cm, ll, dc);
+  }
+
+  return ret;
+}
+
+/*
+ * パート全体で反復して記号の並びを求めてブロックに分け、ブロック毎に
+ * その範囲だけで反復し直す(記号の頻度はブロック毎に異なるため)。最後に
+ * もう一度ブロックに分ける。
+ */
+static int
+parse_part(part_t* pt)
+{
+  uint32_t ll[NUM_LITLEN];
+  uint32_t dc[NUM_DIST];
+  work_t wk;
+  cost_t cm;
+  uint16_t* lit;
+  uint16_t* dist;
+  size_t n;
+  size_t k;
+  size_t lo;
+  size_t ks;
+  size_t ke;
+  size_t m;
+  size_t i;
+  int ret;
+  int b;
+
+  n = pt->end - pt->start;
+
+  memset(&wk, 0, sizeof(wk));
+
+  wk.same      = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+  wk.cost      = (float*)malloc((n + 1) * sizeof(float));
+  wk.from_len  = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+  wk.from_dist = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+  wk.lit       = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+  wk.dist      = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+  wk.seed      = 1;
+
+  pt->lit    = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+  pt->dist   = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+  pt->bounds = (size_t*)malloc((n / SPLIT_MIN + 2) * sizeof(size_t));
+
+  lit  = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+  dist = (uint16_t*)malloc((n + 1) * sizeof(uint16_t));
+
+  ret = -1;
+
+  if (wk.same && wk.cost && wk.from_len && wk.from_dist && wk.lit &&
+      wk.dist && pt->lit && pt->dist && pt->bounds && lit && dist) {
+    wk.same[n] = 0;
+
+    for (k = n; k > 0; k--) {
+      if (k < n && pt->src[pt->start + k - 1] == pt->src[pt->start + k]) {
+        wk.same[k - 1] = (wk.same[k] < 0xffff)? wk.same[k] + 1: 0xffff;
+      } else {
+        wk.same[k - 1] = 0;
+      }
+    }
+
+    fixed_cost(&cm);
+
+    pt->nsyms = iterate_parse(pt, &cm, &wk, 0, n, pt->lit, pt->dist);
+
+    split_blocks(pt, 0, pt->nsyms, range_bits(pt, 0, pt->nsyms));
+
+    if (pt->nblocks > 1) {
+      lo = 0;
+      ks = 0;
+      m  = 0;
+
+      for (b = 0; b < pt->nblocks; b++) {
+        ke = ks;
+        for (i = lo; i < pt->bounds[b]; i++) {
+          ke += (pt->dist[i] == 0)? 1: pt->lit[i];
+        }
+
+        count_symbols(pt->lit, pt->dist, lo, pt->bounds[b], ll, dc);
+        stat_cost(&cm, ll, dc);
+
+        m += iterate_parse(pt, &cm, &wk, ks, ke, lit + m, dist + m);
+
+        lo = pt->bounds[b];
+        ks = ke;
+      }
+
+      free(pt->lit);
+      free(pt->dist);
+
+      pt->lit     = lit;
+      pt->dist    = dist;
+      pt->nsyms   = m;
+      pt->nblocks = 0;
+      lit         = NULL;
+      dist        = NULL;
+
+      split_blocks(pt, 0, pt->nsyms, range_bits(pt, 0, pt->nsyms));
+    }
+
+    ret = 0;
+  }
+
+  if (wk.same != NULL) free(wk.same);
+  if (wk.cost != NULL) free(wk.cost);
+  if (wk.from_len != NULL) free(wk.from_len);
+  if (wk.from_dist != NULL) free(wk.from_dist);
+  if (wk.lit != NULL) free(wk.lit);
+  if (wk.dist != NULL) free(wk.dist);
+  if (lit != NULL) free(lit);
+  if (dist != NULL) free(dist);
+
+  return ret;
+}
+
+static void
+part_job(void* _od, int idx)
+{
+  odeflate_t* od;
+  part_t* pt;
+  size_t n;
+  size_t pos;
+  size_t lo;
+  size_t i;
+  int b;
+
+  od = (odeflate_t*)_od;
+  pt = od->parts + idx;
+
+  if (find_matches(pt) != 0 || parse_part(pt) != 0) {
+    pt->failed = !0;
+    return;
+  }
+
+  // 一致の記録はここで不要になる
+  free(pt->pairs);
+  free(pt->offsets);
+  pt->pairs   = NULL;
+  pt->offsets = NULL;
+
+  /*
+   * 各ブロックは無圧縮ブロックより大きくならないので、その合計を出力先の
+   * 大きさとする
+   */
+  n = pt->end - pt->start;
+
+  pt->out.capa = n + 10 * (n / STORED_MAX + pt->nblocks + 2) + 16;
+  pt->out.buf  = (uint8_t*)malloc(pt->out.capa);
+
+  if (pt->out.buf == NULL) {
+    pt->failed = !0;
+    return;
+  }
+
+  pos = pt->start;
+  lo  = 0;
+
+  for (b = 0; b < pt->nblocks; b++) {
+    n = 0;
+    for (i = lo; i < pt->bounds[b]; i++) {
+      n += (pt->dist[i] == 0)? 1: pt->lit[i];
+    }
+
+    write_block(pt, lo, pt->bounds[b], pt->src + pos, n,
+                pt->last && b == pt->nblocks - 1);
+
+    pos += n;
+    lo   = pt->bounds[b];
+  }
+
+  if (pt->last) {
+    align_bits(&pt->out);
+
+  } else {
+    // 空の無圧縮ブロックでバイト境界に揃える
+    put_bits(&pt->out, 0, 3);
+    align_bits(&pt->out);
+    put_bits(&pt->out, 0x0000, 16);
+    put_bits(&pt->out, 0xffff, 16);
+  }
+
+  if (pt->out.failed) pt->failed = !0;
+}
+
+static void
+part_free(part_t* pt)
+{
+  if (pt->offsets != NULL) free(pt->offsets);
+  if (pt->pairs != NULL) free(pt->pairs);
+  if (pt->lit != NULL) free(pt->lit);
+  if (pt->dist != NULL) free(pt->dist);
+  if (pt->bounds != NULL) free(pt->bounds);
+  if (pt->out.buf != NULL) free(pt->out.buf);
+}
+
+/*
+ * raw deflate ストリーム(最後のブロックに BFINAL を立てる)を作る。*dst は
+ * 呼び出し側で free() する。
+ */
+int
+odeflate(uint8_t** dst, size_t* size,
+         const uint8_t* src, size_t len,
+         int iterations, int chain, int threads)
+{
+  odeflate_t od;
+  bitw_t w;
+  int ret;
+  int j;
+
+  memset(&od, 0, sizeof(od));
+  memset(&w, 0, sizeof(w));
+
+  od.src        = src;
+  od.len        = len;
+  od.iterations = iterations;
+  od.chain      = chain;
+  od.nparts     = (int)((len + PART_SIZE - 1) / PART_SIZE);
+
+  if (od.nparts < 1) od.nparts = 1;
+
+  od.parts = (part_t*)calloc(od.nparts, sizeof(part_t));
+  if (od.parts == NULL) return -1;
+
+  for (j = 0; j < od.nparts; j++) {
+    od.parts[j].src        = src;
+    od.parts[j].len        = len;
+    od.parts[j].start      = (size_t)j * PART_SIZE;
+    od.parts[j].end        = (j == od.nparts - 1)? len: (size_t)(j + 1) * PART_SIZE;
+    od.parts[j].iterations = iterations;
+    od.parts[j].chain      = chain;
+    od.parts[j].last       = (j == od.nparts - 1);
+  }
+
+  parallel_for(threads, od.nparts, part_job, &od);
+
+  ret = 0;
+
+  for (j = 0; j < od.nparts; j++) {
+    if (od.parts[j].failed) ret = -1;
+    w.capa += od.parts[j].out.size;
+  }
+
+  /*
+   * パート毎の出力を連結する(各パートはバイト境界で終わっている)
+   */
+  if (ret == 0) {
+    w.buf = (uint8_t*)malloc(w.capa);
+    if (w.buf == NULL) ret = -1;
+  }
+
+  if (ret == 0) {
+    for (j = 0; j < od.nparts; j++) {
+      memcpy(w.buf + w.size, od.parts[j].out.buf, od.parts[j].out.size);
+      w.size += od.parts[j].out.size;
+    }
+
+    *dst  = w.buf;
+    *size = w.size;
+  }
+
+  for (j = 0; j < od.nparts; j++) part_free(od.parts + j);
+  free(od.parts);
+
+  return ret;
+}
@@ -0,0 +1,22 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+/*
+ * iterative optimal parsing deflate (:optimize mode)
+ */
+
+#ifndef __ODEFLATE_H__
+#define __ODEFLATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern void odeflate_init(void);
+extern int odeflate(uint8_t** dst, size_t* size,
+                    const uint8_t* src, size_t len,
+                    int iterations, int chain, int threads);
+
+#endif /* !defined(__ODEFLATE_H__) */
@@ -0,0 +1,269 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* defined(HAVE_PTHREAD_H) */
+
+#define MAX_THREADS                 64
+
+struct __parallel_thread__ {
+  parallel_func_t func;
+  void* arg;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_t th;
+#endif /* defined(HAVE_PTHREAD_H) */
+};
+
+/*
+ * ジョブの番号の範囲 [head, tail) をスレッド毎のキューとして持ち、自分の
+ * キューは先頭から取り出す。空になったら残りの最も多いキューの後半を
+ * 奪って処理を続ける(work stealing)。
+ */
+typedef struct __loop__ loop_t;
+
+typedef struct {
+  loop_t* lp;
+  int head;
+  int tail;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t mutex;
+#endif /* defined(HAVE_PTHREAD_H) */
+} queue_t;
+
+struct __loop__ {
+  parallel_job_t job;
+  void* arg;
+  int nqueues;
+  queue_t queue[MAX_THREADS];
+};
+
+#ifdef HAVE_PTHREAD_H
+#define LOCK(q)                     pthread_mutex_lock(&(q)->mutex)
+#define UNLOCK(q)                   pthread_mutex_unlock(&(q)->mutex)
+#else /* defined(HAVE_PTHREAD_H) */
+#define LOCK(q)
+#define UNLOCK(q)
+#endif /* defined(HAVE_PTHREAD_H) */
+
+int
+parallel_num_cpus(void)
+{
+  long ret;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  ret = sysconf(_SC_NPROCESSORS_ONLN);
+#else /* defined(_SC_NPROCESSORS_ONLN) */
+  ret = 1;
+#endif /* defined(_SC_NPROCESSORS_ONLN) */
+
+  if (ret < 1) ret = 1;
+  if (ret > MAX_THREADS) ret = MAX_THREADS;
+
+  return (int)ret;
+}
+
+static int
+pop_job(queue_t* q)
+{
+  int ret;
+
+  LOCK(q);
+  ret = (q->head < q->tail)? q->head++: -1;
+  UNLOCK(q);
+
+  return ret;
+}
+
+static int
+steal_jobs(queue_t* q)
+{
+  loop_t* lp;
+  queue_t* victim;
+  int rest;
+  int head;
+  int n;
+  int i;
+
+  lp = q->lp;
+
+  for (;;) {
+    victim = NULL;
+    rest   = 0;
+
+    // 残りの最も多いキューを探す(ロック無しで読むので目安)
+    for (i = 0; i < lp->nqueues; i++) {
+      n = lp->queue[i].tail - lp->queue[i].head;
+      if (&lp->queue[i] != q && n > rest) {
+        victim = &lp->queue[i];
+        rest   = n;
+      }
+    }
+
+    if (victim == NULL) break;
+
+    LOCK(victim);
+
+    n = victim->tail - victim->head;
+    if (n > 0) {
+      n    -= n / 2;
+      head  = victim->tail - n;
+      victim->tail = head;
+    }
+
+    UNLOCK(victim);
+
+    if (n > 0) {
+      LOCK(q);
+      q->head = head;
+      q->tail = head + n;
+      UNLOCK(q);
+
+      return !0;
+    }
+  }
+
+  return 0;
+}
+
+static void*
+worker(void* _q)
+{
+  queue_t* q;
+  int idx;
+
+  q = (queue_t*)_q;
+
+  do {
+    while ((idx = pop_job(q)) >= 0) {
+      q->lp->job(q->lp->arg, idx);
+    }
+  } while (steal_jobs(q));
+
+  return NULL;
+}
+
+/*
+ * job(arg, 0) 〜 job(arg, njobs - 1) を最大 nthreads 本のスレッドで実行する。
+ * 呼び出したスレッドも処理に参加し、全てのジョブが終わるまで戻らない。
+ * 生成できなかったスレッドの分も、他のスレッドが奪って処理する。
+ */
+void
+parallel_for(int nthreads, int njobs, parallel_job_t job, void* arg)
+{
+  loop_t lp;
+  int i;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_t th[MAX_THREADS];
+  int n;
+#endif /* defined(HAVE_PTHREAD_H) */
+
+  if (njobs <= 0) return;
+
+#ifdef HAVE_PTHREAD_H
+  if (nthreads > njobs) nthreads = njobs;
+  if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+  if (nthreads < 1) nthreads = 1;
+#else /* defined(HAVE_PTHREAD_H) */
+  nthreads = 1;
+#endif /* defined(HAVE_PTHREAD_H) */
+
+  lp.job     = job;
+  lp.arg     = arg;
+  lp.nqueues = nthreads;
+
+  // 最初は連続した範囲を均等に割り当てる
+  for (i = 0; i < nthreads; i++) {
+    lp.queue[i].lp   = &lp;
+    lp.queue[i].head = (int)(((long)njobs * i) / nthreads);
+    lp.queue[i].tail = (int)(((long)njobs * (i + 1)) / nthreads);
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&lp.queue[i].mutex, NULL);
+#endif /* defined(HAVE_PTHREAD_H) */
+  }
+
+#ifdef HAVE_PTHREAD_H
+  for (n = 1; n < nthreads; n++) {
+    if (pthread_create(&th[n], NULL, worker, &lp.queue[n]) != 0) break;
+  }
+
+  worker(&lp.queue[0]);
+
+  for (i = 1; i < n; i++) {
+    pthread_join(th[i], NULL);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_destroy(&lp.queue[i].mutex);
+  }
+#else /* defined(HAVE_PTHREAD_H) */
+  worker(&lp.queue[0]);
+#endif /* defined(HAVE_PTHREAD_H) */
+}
+
+#ifdef HAVE_PTHREAD_H
+static void*
+trampoline(void* _th)
+{
+  parallel_thread_t* th;
+
+  th = (parallel_thread_t*)_th;
+  th->func(th->arg);
+
+  return NULL;
+}
+#endif /* defined(HAVE_PTHREAD_H) */
+
+/*
+ * func(arg) を新しいスレッドで実行する(parallel_join() で終了を待つ)。
+ * スレッドが生成できない場合は NULL を返す。
+ */
+parallel_thread_t*
+parallel_spawn(parallel_func_t func, void* arg)
+{
+#ifdef HAVE_PTHREAD_H
+  parallel_thread_t* ret;
+
+  ret = (parallel_thread_t*)malloc(sizeof(parallel_thread_t));
+
+  if (ret != NULL) {
+    ret->func = func;
+    ret->arg  = arg;
+
+    if (pthread_create(&ret->th, NULL, trampoline, ret) != 0) {
+      free(ret);
+      ret = NULL;
+    }
+  }
+
+  return ret;
+#else /* defined(HAVE_PTHREAD_H) */
+  (void)func;
+  (void)arg;
+
+  return NULL;
+#endif /* defined(HAVE_PTHREAD_H) */
+}
+
+void
+parallel_join(parallel_thread_t* th)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_join(th->th, NULL);
+  free(th);
+#else /* defined(HAVE_PTHREAD_H) */
+  (void)th;
+#endif /* defined(HAVE_PTHREAD_H) */
+}
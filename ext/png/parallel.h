@@ -0,0 +1,23 @@
+/*
+ * PNG encode/decode library for Ruby
+ *
+ *  Copyright (C) 2016 Hiroshi Kuwagata <kgt9221@gmail.com>
+ */
+
+/*
+ * work-stealing parallel loop (used without GVL)
+ */
+
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+typedef void (*parallel_job_t)(void* arg, int idx);
+typedef void (*parallel_func_t)(void* arg);
+typedef struct __parallel_thread__ parallel_thread_t;
+
+extern int parallel_num_cpus(void);
+extern void parallel_for(int nthreads, int njobs, parallel_job_t job, void* arg);
+extern parallel_thread_t* parallel_spawn(parallel_func_t func, void* arg);
+extern void parallel_join(parallel_thread_t* th);
+
+#endif /* !defined(__PARALLEL_H__) */
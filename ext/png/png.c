@@ -10,16 +10,67 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <ctype.h>
 #include <setjmp.h>
 #include <time.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif /* defined(HAVE_SYS_MMAN_H) */
+
+#ifdef HAVE_SYS_UIO_H
+#include <poll.h>
+#include <sys/uio.h>
+#endif /* defined(HAVE_SYS_UIO_H) */
 
 #include <png.h>
 #include <zlib.h>
 
+#include "fdeflate.h"
+#include "filter.h"
+#include "odeflate.h"
+#include "parallel.h"
+
 #include "ruby.h"
 #include "ruby/version.h"
+#include "ruby/thread.h"
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include "ruby/io/buffer.h"
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+#include "ruby/memory_view.h"
+#endif /* defined(HAVE_RUBY_MEMORY_VIEW_H) */
+
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+#include "ruby/io.h"
+#include "ruby/fiber/scheduler.h"
+#endif /* defined(HAVE_RUBY_FIBER_SCHEDULER_H) */
+
+#if defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING) || \
+    defined(HAVE_RB_IO_BUFFER_GET_MUTABLE)
+#define SUPPORT_IO_BUFFER
+#endif
+
+#ifdef HAVE_RUBY_MEMORY_VIEW_H
+#define SUPPORT_MEMORY_VIEW
+#endif
+
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT) && defined(HAVE_RB_IO_WAIT)
+#define SUPPORT_FIBER_SCHEDULER
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#define SUPPORT_MMAP
+#endif
 
 #define N(x)                        (sizeof(x)/sizeof(*x))
 
@@ -32,6 +83,14 @@
 #define API_SIMPLIFIED              1
 #define API_CLASSIC                 2
 
+#define ERR_MSG_SIZE                256
+
+#ifdef HAVE_RB_INTERNED_STR_CSTR
+#define FROZEN_STR(cstr)            rb_interned_str_cstr(cstr)
+#else /* defined(HAVE_RB_INTERNED_STR_CSTR) */
+#define FROZEN_STR(cstr)            rb_str_freeze(rb_str_new_cstr(cstr))
+#endif /* defined(HAVE_RB_INTERNED_STR_CSTR) */
+
 #define EQ_STR(val,str)             (rb_to_id(val) == rb_intern(str))
 #define EQ_INT(val,n)               (FIX2INT(val) == n)
 
@@ -39,55 +98,201 @@
    do { \
      (ptr)->ibuf     = (idat);\
      (ptr)->obuf     = (odat);\
-     (ptr)->error    = Qnil;\
-     (ptr)->warn_msg = Qnil;\
+     (ptr)->error[0] = '\0';\
+     warn_buf_clear(&(ptr)->warn);\
    } while (0)
 
 #define CLR_DATA(ptr) \
    do { \
      (ptr)->ibuf     = Qnil;\
      (ptr)->obuf     = Qnil;\
-     (ptr)->error    = Qnil;\
-     (ptr)->warn_msg = Qnil;\
+     warn_buf_clear(&(ptr)->warn);\
    } while (0)
 
 static VALUE module;
 static VALUE encoder_klass;
 static VALUE decoder_klass;
 static VALUE meta_klass;
+static VALUE image_klass;
 
 static ID id_meta;
+static ID id_width;
+static ID id_height;
 static ID id_stride;
+static ID id_depth;
+static ID id_ctype;
+static ID id_imeth;
+static ID id_cmeth;
+static ID id_fmeth;
 static ID id_format;
 static ID id_pixfmt;
 static ID id_ncompo;
+static ID id_gamma;
+static ID id_lazy;
+static ID id_localtime;
+static ID id_utc;
+static ID id_chunks;
 
 typedef struct {
   uint8_t* ptr;
   size_t size;
-  int pos;
+  size_t pos;
 } mem_io_t;
 
+/*
+ * encoder output sink
+ */
 typedef struct {
-  /*
-   * for raw level chunk access
-   */
-	png_structp ctx;   // as 'context'
-	png_infop info; 
+  VALUE str;         // destination String (nil if the memory is fixed)
+  uint8_t* ptr;
+  size_t size;       // capacity
+  size_t pos;
+  int borrowed;      // destination is supplied by the caller
+  int locked;        // destination String is locked by rb_str_locktmp()
+  size_t request;    // requested capacity (for grow)
+  int state;         // status of rb_protect() at grow
+
+  int to_fd;         // output to a file descriptor (ptr is the write buffer)
+  int fd;
+  int owned;         // fd is opened by the sink
+  int flush_rows;    // value for png_set_flush() (0: not set)
+  size_t total;      // number of bytes written to the fd
+} out_sink_t;
+
+/*
+ * encoder input source
+ */
+#define SRC_NONE                    0
+#define SRC_IO_BUFFER               1
+#define SRC_MEMORY_VIEW             2
+
+typedef struct {
+  const uint8_t* ptr;
+  size_t size;
+  int locked;        // kind of the locked source (SRC_*)
+  VALUE obj;         // locked object
+
+#ifdef SUPPORT_MEMORY_VIEW
+  rb_memory_view_t view;
+#endif /* defined(SUPPORT_MEMORY_VIEW) */
+} in_source_t;
+
+/*
+ * libpng のコールバックは GVL を解放した状態で呼ばれるので、警告メッセージは
+ * Ruby のオブジェクトではなく C の文字列として溜めておく('\n' 区切り)。
+ */
+typedef struct {
+  char* ptr;
+  size_t size;
+} warn_buf_t;
+
+/*
+ * エンコーダ/デコーダ毎のメモリプール。libpng の構造体や zlib の
+ * deflate/inflate の状態は呼び出しの度に生成/破棄されるので、解放された
+ * ブロックをここに保持しておき、次回の確保時に再利用する
+ * (png_create_{read,write}_struct_2() で登録する)。
+ */
+#define POOL_SLOTS                  16
+
+typedef union {
+  size_t size;       // capacity of the block
+  double align1;
+  void* align2;
+} pool_header_t;
+
+typedef struct {
+  pool_header_t* slot[POOL_SLOTS];
+  int num;
+} mem_pool_t;
+
+/*
+ * zlib parameters used for an encode (:compression => :AUTO resolves the
+ * level and the strategy per call)
+ */
+#define C_LEVEL_AUTO                (-2)
+#define C_STRATEGY_NONE             (-1)
+
+/*
+ * value of :filter (FILTER_NONE ~ FILTER_PAETH are defined in filter.h)
+ */
+#define FILTER_DEFAULT              (-1)
+#define FILTER_ADAPTIVE             5
+#define FILTER_CALLBACK             6
+
+/*
+ * value of :optimize (0: off, true: OPTIMIZE_DEFAULT)
+ */
+#define OPTIMIZE_DEFAULT            2
+#define OPTIMIZE_MAX                4
+
+typedef struct {
+  int level;
+  int strategy;      // C_STRATEGY_NONE: chosen by libpng
+  int window;        // window bits (9~15)
+  int mem_level;     // 1~9
+} zparam_t;
+
+/*
+ * row streaming writer (Encoder#start / #write_rows / #finish) context
+ */
+typedef struct {
+  png_structp ctx;   // as 'context'
+  png_infop info;
+
+  png_uint_32 rows;  // number of written rows
+
+  VALUE io;          // destination IO (or nil)
+  VALUE proc;        // destination block (or nil)
 
+  mem_io_t out;      // pending output
+} png_writer_t;
+
+typedef struct {
   png_uint_32 width;
   png_uint_32 stride;
   png_uint_32 height;
-  png_uint_32 data_size;
+  size_t data_size;
   int num_comp;
   int with_time;
 
+  /*
+   * size given to #initialize (#encode can override it per call)
+   */
+  png_uint_32 conf_width;
+  png_uint_32 conf_height;
+  png_uint_32 conf_stride;  // value of :stride (0 if not specified)
+
   int c_type;   // as 'color type'
   int i_meth;   // as 'interlace method'
-  int c_level;  // as 'compression level'
+  int c_level;  // as 'compression level' (or C_LEVEL_AUTO)
+  int c_strat;  // as 'compression strategy'
+  int c_window; // as 'compression window bits'
+  int c_mem;    // as 'compression memory level'
   int f_type;   // as 'filter type'
+  size_t idat_size;  // maximum size of IDAT chunk (0: libpng default)
+
+  /*
+   * row filter (:filter)
+   */
+  int filter;           // FILTER_* (FILTER_DEFAULT: not specified)
+  VALUE filter_proc;    // per-row callback (or nil)
+  uint8_t* row_filters; // filter of each row decided by the callback
+  size_t row_filters_capa;
+  int threads;  // number of threads for filtering and deflate
+  int restart;  // emit restart points (rsPT chunk)
+  int fast;     // use the single pass deflate (:fast)
+  int optimize; // level of the size optimization (:optimize, 0: off)
+
+  /*
+   * position of the image in the input given to #encode (:offset/:region)
+   */
+  size_t offset;  // byte offset of the first pixel
+  int partial;    // input may be larger than the image
 
   png_byte** rows;
+  size_t rows_capa;
+  mem_pool_t pool;
+
   png_text* text;
   int num_text;
   double gamma;
@@ -95,19 +300,53 @@ typedef struct {
   VALUE ibuf;
   VALUE obuf;
 
-  VALUE error;
-  VALUE warn_msg;
+  in_source_t in;
+  out_sink_t out;
+
+  char error[ERR_MSG_SIZE];
+  warn_buf_t warn;
+  int busy;
+
+  png_writer_t* writer;
 } png_encoder_t;
 
+/*
+ * progressive reader (Decoder#feed) context
+ */
+typedef struct {
+  png_structp ctx;   // as 'context'
+  png_infop info;
+
+  png_uint_32 width;
+  png_uint_32 height;
+  size_t stride;
+  int interlaced;
+
+  VALUE proc;        // block given to the first #feed (or nil)
+  VALUE obuf;        // output raster (or nil)
+  uint8_t* base;     // head of the output raster
+  int need_meta;     // output raster is created as PNG::Image
+
+  int finished;
+  int state;         // status of rb_protect() in the callbacks
+} png_stream_t;
+
 typedef union {
   struct {
     int api_type;
     int format;
     int need_meta;
     double display_gamma;
-
-    VALUE error;
-    VALUE warn_msg;
+    int threads;
+    int scale_denom;
+
+    char error[ERR_MSG_SIZE];
+    warn_buf_t warn;
+    int busy;
+    png_stream_t* stream;
+    mem_pool_t pool;
+    png_byte** row_buf;
+    size_t row_capa;
   } common;
 
   struct {
@@ -118,9 +357,16 @@ typedef union {
     int format;
     int need_meta;
     double display_gamma;
+    int threads;
+    int scale_denom;
 
-    VALUE error;
-    VALUE warn_msg;
+    char error[ERR_MSG_SIZE];
+    warn_buf_t warn;
+    int busy;
+    png_stream_t* stream;
+    mem_pool_t pool;
+    png_byte** row_buf;
+    size_t row_capa;
 
     /*
      * classic api context
@@ -156,14 +402,22 @@ typedef union {
     int format;
     int need_meta;
     double display_gamma;
+    int threads;
+    int scale_denom;
 
-    VALUE error;
-    VALUE warn_msg;
+    char error[ERR_MSG_SIZE];
+    warn_buf_t warn;
+    int busy;
+    png_stream_t* stream;
+    mem_pool_t pool;
+    png_byte** row_buf;
+    size_t row_capa;
 
     /*
      * simplified api context
      */
     png_image* ctx;
+    png_image image;
   } simplified;
 } png_decoder_t;
 
@@ -172,10 +426,14 @@ static const char* decoder_opt_keys[] ={
   "without_meta",    // bool (default: false)
   "api_type",        // string ("simplified" or "classic")
   "display_gamma",   // float
+  "threads",         // int >0 or true (default: 1)
+  "scale_denom",     // 1, 2, 4 or 8 (default: 1)
 };
 
 static ID decoder_opt_ids[N(decoder_opt_keys)];
 
+static const png_color black_background = {0, 0, 0};
+
 static const char* encoder_opt_keys[] ={
   "pixel_format",    // alias of "color_type"
   "interlace",       // bool (default: false)
@@ -184,17 +442,92 @@ static const char* encoder_opt_keys[] ={
   "time",            // bool (default: true)
   "gamma",           // float
   "stride",          // int >0
+  "threads",         // int >0 or true (default: 1)
+  "restart_points",  // bool (default: false)
+  "strategy",        // String or Symbol
+  "window_bits",     // int 9~15 (default: 15)
+  "mem_level",       // int 1~9 (default: 8)
+  "idat_size",       // int >=6
+  "filter",          // String, Symbol, int 0~4 or callable
+  "fast",            // bool (default: false)
+  "optimize",        // bool or int 0~4 (default: 0)
 };
 
 static ID encoder_opt_ids[N(encoder_opt_keys)];
 
+static void
+warn_buf_push(warn_buf_t* buf, const char* msg)
+{
+  size_t len;
+  char* p;
+
+  len = strlen(msg);
+  p   = (char*)realloc(buf->ptr, buf->size + len + 1);
+
+  if (p != NULL) {
+    memcpy(p + buf->size, msg, len);
+    p[buf->size + len] = '\n';
+
+    buf->ptr   = p;
+    buf->size += len + 1;
+  }
+}
+
+static void
+warn_buf_clear(warn_buf_t* buf)
+{
+  if (buf->ptr != NULL) free(buf->ptr);
+
+  buf->ptr  = NULL;
+  buf->size = 0;
+}
+
+static VALUE
+warn_buf_to_ary(warn_buf_t* buf)
+{
+  VALUE ret;
+
+  if (buf->size > 0) {
+    ret = rb_str_split(rb_str_new(buf->ptr, buf->size - 1), "\n");
+  } else {
+    ret = Qnil;
+  }
+
+  return ret;
+}
+
 static void
 mem_io_write_data(png_structp ctx, png_bytep src, png_size_t size)
 {
-  VALUE buf;
+  mem_io_t* io;
+  size_t capa;
+  uint8_t* p;
+
+  io = (mem_io_t*)png_get_io_ptr(ctx);
+
+  if (io->pos + size > io->size) {
+    capa = (io->size > 0)? io->size: 4096;
+    while (capa < io->pos + size) capa *= 2;
+
+    p = (uint8_t*)realloc(io->ptr, capa);
+    if (p == NULL) png_error(ctx, "no memory");
+
+    io->ptr  = p;
+    io->size = capa;
+  }
+
+  memcpy(io->ptr + io->pos, src, size);
+  io->pos += size;
+}
+
+static void
+mem_io_free(mem_io_t* io)
+{
+  if (io->ptr != NULL) free(io->ptr);
 
-  buf = (VALUE)png_get_io_ptr(ctx);
-  rb_str_buf_cat(buf, (const char *)src, size);
+  io->ptr  = NULL;
+  io->size = 0;
+  io->pos  = 0;
 }
 
 static void
@@ -219,197 +552,4008 @@ mem_io_flush(png_structp ctx)
   // ignore
 }
 
-static char*
-clone_cstr(VALUE s)
+static VALUE
+sink_grow_body(VALUE _arg)
 {
-  char* ret;
-  size_t sz;
+  out_sink_t* sink;
 
-  sz  = RSTRING_LEN(s);
+  sink = (out_sink_t*)_arg;
 
-  ret = (char*)malloc(sz + 1);
-  if (ret == NULL) NOMEMORY_ERROR("no memory");
+  if (sink->locked) {
+    rb_str_unlocktmp(sink->str);
+    sink->locked = 0;
+  }
 
-  memcpy(ret, RSTRING_PTR(s), sz);
-  ret[sz] = '\0';
+  rb_str_set_len(sink->str, sink->pos);
+  rb_str_modify_expand(sink->str, sink->request - sink->pos);
 
-  return ret;
+  if (sink->borrowed) {
+    rb_str_locktmp(sink->str);
+    sink->locked = !0;
+  }
+
+  sink->ptr  = (uint8_t*)RSTRING_PTR(sink->str);
+  sink->size = rb_str_capacity(sink->str);
+
+  return Qnil;
 }
 
-static VALUE
-create_runtime_error(const char* fmt, ...)
+static void*
+sink_grow_with_gvl(void* arg)
 {
-  VALUE ret;
-  va_list ap;
+  out_sink_t* sink;
 
-  va_start(ap, fmt);
-  ret = rb_exc_new_str(rb_eRuntimeError, rb_vsprintf(fmt, ap));
-  va_end(ap);
+  sink = (out_sink_t*)arg;
 
-  return ret;
+  rb_protect(sink_grow_body, (VALUE)sink, &sink->state);
+  if (sink->state != 0) rb_set_errinfo(Qnil);
+
+  return NULL;
 }
 
-static VALUE
-create_argument_error(const char* fmt, ...)
+/*
+ * ファイルディスクリプタへの書き出し(Encoder#encode_to)
+ *
+ * バッファに溜まったデータと新しいデータを writev() でまとめて書き出す。
+ * GVL を解放した状態で呼ばれるので Ruby の API は使わない。成功時は 0、
+ * 失敗時は errno の値を返す。
+ */
+static int
+sink_drain(out_sink_t* sink, const uint8_t* src, size_t size)
 {
-  VALUE ret;
-  va_list ap;
+#ifdef HAVE_SYS_UIO_H
+  struct iovec iov[2];
+  struct pollfd pfd;
+  int n;
+  int i;
+  ssize_t len;
 
-  va_start(ap, fmt);
-  ret = rb_exc_new_str(rb_eArgError, rb_vsprintf(fmt, ap));
-  va_end(ap);
+  n = 0;
 
-  return ret;
-}
+  if (sink->pos > 0) {
+    iov[n].iov_base = sink->ptr;
+    iov[n].iov_len  = sink->pos;
+    n++;
+  }
 
-static VALUE
-create_type_error(const char* fmt, ...)
-{
-  VALUE ret;
-  va_list ap;
+  if (size > 0) {
+    iov[n].iov_base = (void*)src;
+    iov[n].iov_len  = size;
+    n++;
+  }
 
-  va_start(ap, fmt);
-  ret = rb_exc_new_str(rb_eTypeError, rb_vsprintf(fmt, ap));
-  va_end(ap);
+  i = 0;
 
-  return ret;
-}
+  while (i < n) {
+    len = writev(sink->fd, iov + i, n - i);
 
-static VALUE
-create_range_error(const char* fmt, ...)
-{
-  VALUE ret;
-  va_list ap;
+    if (len < 0) {
+      if (errno == EINTR) continue;
 
-  va_start(ap, fmt);
-  ret = rb_exc_new_str(rb_eRangeError, rb_vsprintf(fmt, ap));
-  va_end(ap);
+      // ノンブロッキングの fd(Ruby の IO.pipe 等)は書き込めるまで待つ
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        pfd.fd     = sink->fd;
+        pfd.events = POLLOUT;
+        poll(&pfd, 1, -1);
+        continue;
+      }
 
-  return ret;
-}
+      return errno;
+    }
 
-#if 0
-static VALUE
-create_not_implement_error(const char* fmt, ...)
-{
-  VALUE ret;
-  va_list ap;
+    sink->total += len;
 
-  va_start(ap, fmt);
-  ret = rb_exc_new_str(rb_eNotImpError, rb_vsprintf(fmt, ap));
-  va_end(ap);
+    while (i < n && (size_t)len >= iov[i].iov_len) {
+      len -= iov[i].iov_len;
+      i++;
+    }
 
-  return ret;
-}
-#endif
+    if (i < n) {
+      iov[i].iov_base = (uint8_t*)iov[i].iov_base + len;
+      iov[i].iov_len -= len;
+    }
+  }
 
-static VALUE
-create_memory_error()
-{
-  return rb_exc_new_str(rb_eRangeError, rb_str_new_cstr("no memory"));
+  sink->pos = 0;
+
+  return 0;
+#else /* defined(HAVE_SYS_UIO_H) */
+  return ENOSYS;
+#endif /* defined(HAVE_SYS_UIO_H) */
 }
 
-void
-text_info_free(png_text* text, int n)
+static void
+sink_write_error(png_structp ctx, int err)
 {
-  int i;
-
-  if (text != NULL) {
-    for (i = 0; i < n; i++) {
-      if (text[i].key != NULL) {
-        free(text[i].key);
-      }
+  char msg[ERR_MSG_SIZE];
 
-      if (text[i].text != NULL) {
-        free(text[i].text);
-      }
-    }
-
-    free(text);
-  }
+  snprintf(msg, sizeof(msg), "write failed (%s)", strerror(err));
+  png_error(ctx, msg);
 }
 
 static void
-rb_encoder_mark(void* _ptr)
+sink_write_data(png_structp ctx, png_bytep src, png_size_t size)
 {
-  png_encoder_t* ptr;
+  out_sink_t* sink;
+  size_t capa;
+  int err;
 
-  ptr = (png_encoder_t*)_ptr;
+  sink = (out_sink_t*)png_get_io_ptr(ctx);
 
-  if (ptr->ibuf != Qnil) {
-    rb_gc_mark(ptr->ibuf);
+  if (sink->to_fd && sink->pos + size > sink->size) {
+    err = sink_drain(sink, src, size);
+    if (err != 0) sink_write_error(ctx, err);
+    return;
   }
 
-  if (ptr->obuf != Qnil) {
-    rb_gc_mark(ptr->obuf);
-  }
+  if (sink->pos + size > sink->size) {
+    if (sink->str == Qnil) png_error(ctx, "output buffer too small");
 
-  if (ptr->error != Qnil) {
-    rb_gc_mark(ptr->error);
-  }
+    // バッチ処理のワーカスレッド(Ruby のスレッドではない)からは拡張できない
+    if (!ruby_native_thread_p()) png_error(ctx, "output buffer too small");
 
-  if (ptr->warn_msg != Qnil) {
-    rb_gc_mark(ptr->warn_msg);
+    /*
+     * 見積りを越えた場合は倍々で拡張する(Ruby の API を使うので GVL を
+     * 確保してから行う)。
+     */
+    capa = (sink->size > 0)? sink->size: 4096;
+    while (capa < sink->pos + size) capa *= 2;
+
+    sink->request = capa;
+    rb_thread_call_with_gvl(sink_grow_with_gvl, sink);
+
+    if (sink->state != 0) png_error(ctx, "no memory");
   }
+
+  memcpy(sink->ptr + sink->pos, src, size);
+  sink->pos += size;
 }
 
 static void
-rb_encoder_free(void* _ptr)
+sink_flush_data(png_structp ctx)
 {
-  png_encoder_t* ptr;
-
-  ptr = (png_encoder_t*)_ptr;
+  out_sink_t* sink;
+  int err;
 
-  if (ptr->ctx != NULL) {
-    if (ptr->rows != NULL) {
-      png_free(ptr->ctx, ptr->rows);
-    }
+  sink = (out_sink_t*)png_get_io_ptr(ctx);
 
-    png_destroy_write_struct(&ptr->ctx, &ptr->info);
+  if (sink->to_fd && sink->pos > 0) {
+    err = sink_drain(sink, NULL, 0);
+    if (err != 0) sink_write_error(ctx, err);
   }
+}
 
-  if (ptr->text != NULL) {
-    text_info_free(ptr->text, ptr->num_text);
+static void
+sink_setup_fd(out_sink_t* sink, int fd, int owned, size_t bufsize)
+{
+  memset(sink, 0, sizeof(*sink));
+
+  sink->str   = Qnil;
+  sink->ptr   = (uint8_t*)malloc(bufsize);
+  sink->size  = bufsize;
+  sink->to_fd = !0;
+  sink->fd    = fd;
+  sink->owned = owned;
+
+  if (sink->ptr == NULL) {
+    if (owned) close(fd);
+    memset(sink, 0, sizeof(*sink));
+    sink->str = Qnil;
+    NOMEMORY_ERROR("no memory");
   }
-
-  ptr->ibuf     = Qnil;
-  ptr->obuf     = Qnil;
-  ptr->error    = Qnil;
-  ptr->warn_msg = Qnil;
-
-  free(ptr);
 }
 
-static size_t
-rb_encoder_size(const void* _ptr)
+static void
+sink_setup(out_sink_t* sink, VALUE dst, size_t estimate)
 {
-  size_t ret;
-  png_encoder_t* ptr;
-  int i;
+  void* ptr;
+  size_t size;
 
-  ptr = (png_encoder_t*)_ptr;
+  memset(sink, 0, sizeof(*sink));
 
-  ret  = sizeof(png_encoder_t);
-  // ret += sizeof(png_struct);
-  // ret += sizeof(png_info);
-  ret += (sizeof(png_byte*) * ptr->width);
+  if (NIL_P(dst)) {
+    sink->str  = rb_str_buf_new(estimate);
+    sink->ptr  = (uint8_t*)RSTRING_PTR(sink->str);
+    sink->size = rb_str_capacity(sink->str);
 
-  ret += sizeof(png_text) * ptr->num_text;
+  } else if (RB_TYPE_P(dst, T_STRING)) {
+    /*
+     * 呼び出し元から与えられた文字列は、既に確保されている領域をそのまま
+     * 使用する(足りない場合のみ拡張する)。
+     */
+    rb_str_modify(dst);
+    rb_str_set_len(dst, 0);
+    rb_str_locktmp(dst);
 
-  for (i = 0; i < ptr->num_text; i++) {
-    ret += (strlen(ptr->text[i].key) + ptr->text[i].text_length);
-  }
+    sink->str      = dst;
+    sink->ptr      = (uint8_t*)RSTRING_PTR(dst);
+    sink->size     = rb_str_capacity(dst);
+    sink->borrowed = !0;
+    sink->locked   = !0;
 
-  return ret;
-}
+#ifdef SUPPORT_IO_BUFFER
+  } else if (rb_obj_is_kind_of(dst, rb_cIOBuffer)) {
+    rb_io_buffer_lock(dst);
 
-#if RUBY_API_VERSION_CODE > 20600
-static const rb_data_type_t png_encoder_data_type = {
-  "libpng-ruby encoder object",     // wrap_struct_name
+    sink->str      = Qnil;
+    sink->borrowed = !0;
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+    rb_io_buffer_get_bytes_for_writing(dst, &ptr, &size);
+#else /* defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING) */
+    rb_io_buffer_get_mutable(dst, &ptr, &size);
+#endif /* defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING) */
+
+    sink->ptr      = (uint8_t*)ptr;
+    sink->size     = size;
+#endif /* defined(SUPPORT_IO_BUFFER) */
+
+  } else {
+    TYPE_ERROR("unsupported output buffer");
+  }
+}
+
+static VALUE
+sink_finish(out_sink_t* sink, VALUE dst)
+{
+  VALUE ret;
+
+  if (sink->to_fd) {
+    return SIZET2NUM(sink->total);
+  }
+
+  if (sink->locked) {
+    rb_str_unlocktmp(sink->str);
+    sink->locked = 0;
+  }
+
+  if (sink->str != Qnil) {
+    rb_str_set_len(sink->str, sink->pos);
+
+    // 自前で確保した場合は余った領域を一度だけ縮小して返す
+    if (!sink->borrowed) rb_str_resize(sink->str, sink->pos);
+
+    ret = sink->str;
+
+  } else {
+    ret = rb_funcall(dst, rb_intern("slice"), 2, INT2FIX(0), SIZET2NUM(sink->pos));
+  }
+
+  return ret;
+}
+
+static void
+sink_release(out_sink_t* sink, VALUE dst)
+{
+  if (sink->locked) {
+    rb_str_unlocktmp(sink->str);
+  }
+
+  if (sink->to_fd) {
+    free(sink->ptr);
+    if (sink->owned) close(sink->fd);
+
+  }
+#ifdef SUPPORT_IO_BUFFER
+  else if (sink->borrowed && sink->str == Qnil) {
+    rb_io_buffer_unlock(dst);
+  }
+#endif /* defined(SUPPORT_IO_BUFFER) */
+
+  memset(sink, 0, sizeof(*sink));
+  sink->str = Qnil;
+}
+
+#ifdef SUPPORT_MEMORY_VIEW
+/*
+ * strides が NULL の場合は連続した領域を意味する
+ * (rb_memory_view_is_contiguous() はこの場合を扱えない)
+ */
+static int
+view_is_contiguous(rb_memory_view_t* view)
+{
+  return (view->strides == NULL || rb_memory_view_is_contiguous(view));
+}
+#endif /* defined(SUPPORT_MEMORY_VIEW) */
+
+/*
+ * 入力の取り出し。String は凍結した共有文字列を、IO::Buffer と MemoryView を
+ * 公開するオブジェクトはロックした上でその領域をそのまま使う(コピーしない)。
+ * 保持すべきオブジェクトを返す(ロックは source_release() で解除する)。
+ */
+static VALUE
+source_bind(in_source_t* src, VALUE data)
+{
+  VALUE ret;
+  const void* ptr;
+  size_t size;
+
+  memset(src, 0, sizeof(*src));
+  src->obj = Qnil;
+
+  if (RB_TYPE_P(data, T_STRING)) {
+    ret       = rb_str_new_frozen(data);
+    src->ptr  = (const uint8_t*)RSTRING_PTR(ret);
+    src->size = RSTRING_LEN(ret);
+
+#ifdef SUPPORT_IO_BUFFER
+  } else if (rb_obj_is_kind_of(data, rb_cIOBuffer)) {
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+    rb_io_buffer_get_bytes_for_reading(data, &ptr, &size);
+#else /* defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING) */
+    rb_io_buffer_get_immutable(data, &ptr, &size);
+#endif /* defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING) */
+
+    rb_io_buffer_lock(data);
+
+    ret         = data;
+    src->ptr    = (const uint8_t*)ptr;
+    src->size   = size;
+    src->obj    = data;
+    src->locked = SRC_IO_BUFFER;
+#endif /* defined(SUPPORT_IO_BUFFER) */
+
+#ifdef SUPPORT_MEMORY_VIEW
+  } else if (rb_memory_view_available_p(data)) {
+    if (!rb_memory_view_get(data, &src->view, RUBY_MEMORY_VIEW_SIMPLE)) {
+      TYPE_ERROR("image data is not readable");
+    }
+
+    if (!view_is_contiguous(&src->view)) {
+      rb_memory_view_release(&src->view);
+      ARGUMENT_ERROR("image data is not contiguous");
+    }
+
+    ret         = data;
+    src->ptr    = (const uint8_t*)src->view.data;
+    src->size   = src->view.byte_size;
+    src->obj    = data;
+    src->locked = SRC_MEMORY_VIEW;
+#endif /* defined(SUPPORT_MEMORY_VIEW) */
+
+  } else {
+    TYPE_ERROR("unsupported image data");
+  }
+
+  return ret;
+}
+
+static void
+source_release(in_source_t* src)
+{
+  switch (src->locked) {
+#ifdef SUPPORT_IO_BUFFER
+  case SRC_IO_BUFFER:
+    rb_io_buffer_unlock(src->obj);
+    break;
+#endif /* defined(SUPPORT_IO_BUFFER) */
+
+#ifdef SUPPORT_MEMORY_VIEW
+  case SRC_MEMORY_VIEW:
+    rb_memory_view_release(&src->view);
+    break;
+#endif /* defined(SUPPORT_MEMORY_VIEW) */
+
+  default:
+    break;
+  }
+
+  memset(src, 0, sizeof(*src));
+  src->obj = Qnil;
+}
+
+static png_voidp
+pool_malloc(png_structp ctx, png_alloc_size_t size)
+{
+  mem_pool_t* pool;
+  pool_header_t* blk;
+  int best;
+  int i;
+
+  pool = (mem_pool_t*)png_get_mem_ptr(ctx);
+  best = -1;
+
+  /*
+   * 要求サイズ以上で最も小さいブロックを探す(大きすぎるものは使わない)
+   */
+  for (i = 0; i < pool->num; i++) {
+    if (pool->slot[i]->size < size) continue;
+    if (pool->slot[i]->size > (size * 4) + 256) continue;
+
+    if (best < 0 || pool->slot[i]->size < pool->slot[best]->size) {
+      best = i;
+    }
+  }
+
+  if (best >= 0) {
+    blk              = pool->slot[best];
+    pool->slot[best] = pool->slot[--pool->num];
+
+  } else {
+    blk = (pool_header_t*)malloc(sizeof(pool_header_t) + size);
+    if (blk == NULL) return NULL;
+
+    blk->size = size;
+  }
+
+  return (png_voidp)(blk + 1);
+}
+
+static void
+pool_free(png_structp ctx, png_voidp ptr)
+{
+  mem_pool_t* pool;
+  pool_header_t* blk;
+
+  if (ptr == NULL) return;
+
+  pool = (mem_pool_t*)png_get_mem_ptr(ctx);
+  blk  = (pool_header_t*)ptr - 1;
+
+  if (pool->num < POOL_SLOTS) {
+    pool->slot[pool->num++] = blk;
+  } else {
+    free(blk);
+  }
+}
+
+static void
+pool_clear(mem_pool_t* pool)
+{
+  while (pool->num > 0) {
+    free(pool->slot[--pool->num]);
+  }
+}
+
+/*
+ * 行ポインタ配列はエンコーダ/デコーダで保持しておき、足りない場合のみ拡張する
+ */
+static png_byte**
+grow_row_buf(png_byte*** buf, size_t* capa, size_t height)
+{
+  png_byte** rows;
+
+  if (*capa < height) {
+    rows = (png_byte**)realloc(*buf, height * sizeof(*rows));
+    if (rows == NULL) NOMEMORY_ERROR("no memory");
+
+    *buf  = rows;
+    *capa = height;
+  }
+
+  return *buf;
+}
+
+static char*
+clone_cstr(VALUE s)
+{
+  char* ret;
+  size_t sz;
+
+  sz  = RSTRING_LEN(s);
+
+  ret = (char*)malloc(sz + 1);
+  if (ret == NULL) NOMEMORY_ERROR("no memory");
+
+  memcpy(ret, RSTRING_PTR(s), sz);
+  ret[sz] = '\0';
+
+  return ret;
+}
+
+static VALUE
+create_runtime_error(const char* fmt, ...)
+{
+  VALUE ret;
+  va_list ap;
+
+  va_start(ap, fmt);
+  ret = rb_exc_new_str(rb_eRuntimeError, rb_vsprintf(fmt, ap));
+  va_end(ap);
+
+  return ret;
+}
+
+static VALUE
+create_argument_error(const char* fmt, ...)
+{
+  VALUE ret;
+  va_list ap;
+
+  va_start(ap, fmt);
+  ret = rb_exc_new_str(rb_eArgError, rb_vsprintf(fmt, ap));
+  va_end(ap);
+
+  return ret;
+}
+
+static VALUE
+create_type_error(const char* fmt, ...)
+{
+  VALUE ret;
+  va_list ap;
+
+  va_start(ap, fmt);
+  ret = rb_exc_new_str(rb_eTypeError, rb_vsprintf(fmt, ap));
+  va_end(ap);
+
+  return ret;
+}
+
+static VALUE
+create_range_error(const char* fmt, ...)
+{
+  VALUE ret;
+  va_list ap;
+
+  va_start(ap, fmt);
+  ret = rb_exc_new_str(rb_eRangeError, rb_vsprintf(fmt, ap));
+  va_end(ap);
+
+  return ret;
+}
+
+static VALUE
+create_not_implement_error(const char* fmt, ...)
+{
+  VALUE ret;
+  va_list ap;
+
+  va_start(ap, fmt);
+  ret = rb_exc_new_str(rb_eNotImpError, rb_vsprintf(fmt, ap));
+  va_end(ap);
+
+  return ret;
+}
+
+static VALUE
+create_memory_error()
+{
+  return rb_exc_new_str(rb_eRangeError, rb_str_new_cstr("no memory"));
+}
+
+#ifdef SUPPORT_FIBER_SCHEDULER
+typedef struct {
+  void* (*func)(void*);
+  void* arg;
+  int fd;            // write side of the notification pipe
+} async_call_t;
+
+static void
+async_worker(void* _ac)
+{
+  async_call_t* ac;
+
+  ac = (async_call_t*)_ac;
+  ac->func(ac->arg);
+
+  while (write(ac->fd, "", 1) < 0 && errno == EINTR);
+}
+
+static VALUE
+async_wait_body(VALUE io)
+{
+  while (!RTEST(rb_io_wait(io, INT2FIX(RUBY_IO_READABLE), Qnil)));
+
+  return Qnil;
+}
+
+static void*
+async_join_nogvl(void* th)
+{
+  parallel_join((parallel_thread_t*)th);
+
+  return NULL;
+}
+
+static int
+call_in_worker(void* (*func)(void*), void* arg)
+{
+  VALUE pipe;
+  async_call_t ac;
+  parallel_thread_t* th;
+  int state;
+
+  pipe    = rb_funcall(rb_cIO, rb_intern("pipe"), 0);
+  state   = 0;
+  ac.func = func;
+  ac.arg  = arg;
+  ac.fd   = NUM2INT(rb_funcall(RARRAY_AREF(pipe, 1), rb_intern("fileno"), 0));
+
+  th = parallel_spawn(async_worker, &ac);
+
+  if (th != NULL) {
+    /*
+     * 待機中に例外が発生した場合(ファイバの停止等)も、ワーカが処理中の
+     * データを解放する訳にはいかないので、終了を待ってから再送出する。
+     */
+    rb_protect(async_wait_body, RARRAY_AREF(pipe, 0), &state);
+    rb_thread_call_without_gvl(async_join_nogvl, th, NULL, NULL);
+  }
+
+  rb_io_close(RARRAY_AREF(pipe, 0));
+  rb_io_close(RARRAY_AREF(pipe, 1));
+
+  if (state != 0) rb_jump_tag(state);
+
+  return (th != NULL);
+}
+#endif /* defined(SUPPORT_FIBER_SCHEDULER) */
+
+/*
+ * GVL を解放して func を実行する。Fiber スケジューラが設定されている場合は
+ * ワーカスレッドで実行し、完了するまで呼び出したファイバだけを待機させる
+ * (その間もスケジューラは他のファイバを動かせる)。func から
+ * rb_thread_call_with_gvl() を呼び出す可能性がある場合は使用できない。
+ */
+static void
+call_without_gvl(void* (*func)(void*), void* arg)
+{
+#ifdef SUPPORT_FIBER_SCHEDULER
+  if (rb_fiber_scheduler_current() != Qnil) {
+    if (call_in_worker(func, arg)) return;
+  }
+#endif /* defined(SUPPORT_FIBER_SCHEDULER) */
+
+  rb_thread_call_without_gvl(func, arg, RUBY_UBF_PROCESS, NULL);
+}
+
+void
+text_info_free(png_text* text, int n)
+{
+  int i;
+
+  if (text != NULL) {
+    for (i = 0; i < n; i++) {
+      if (text[i].key != NULL) {
+        free(text[i].key);
+      }
+
+      if (text[i].text != NULL) {
+        free(text[i].text);
+      }
+    }
+
+    free(text);
+  }
+}
+
+static void
+rb_encoder_mark(void* _ptr)
+{
+  png_encoder_t* ptr;
+
+  ptr = (png_encoder_t*)_ptr;
+
+  if (ptr->ibuf != Qnil) {
+    rb_gc_mark(ptr->ibuf);
+  }
+
+  if (ptr->obuf != Qnil) {
+    rb_gc_mark(ptr->obuf);
+  }
+
+  if (RTEST(ptr->out.str)) {
+    rb_gc_mark(ptr->out.str);
+  }
+
+  if (ptr->filter_proc != Qnil) {
+    rb_gc_mark(ptr->filter_proc);
+  }
+
+  if (ptr->writer != NULL) {
+    if (ptr->writer->io != Qnil) {
+      rb_gc_mark(ptr->writer->io);
+    }
+
+    if (ptr->writer->proc != Qnil) {
+      rb_gc_mark(ptr->writer->proc);
+    }
+  }
+}
+
+static void
+writer_free(png_writer_t* wr)
+{
+  if (wr->ctx != NULL) {
+    png_destroy_write_struct(&wr->ctx, &wr->info);
+  }
+
+  mem_io_free(&wr->out);
+
+  free(wr);
+}
+
+static void
+rb_encoder_free(void* _ptr)
+{
+  png_encoder_t* ptr;
+
+  ptr = (png_encoder_t*)_ptr;
+
+  if (ptr->rows != NULL) {
+    free(ptr->rows);
+  }
+
+  if (ptr->row_filters != NULL) {
+    free(ptr->row_filters);
+  }
+
+  if (ptr->text != NULL) {
+    text_info_free(ptr->text, ptr->num_text);
+  }
+
+  if (ptr->writer != NULL) {
+    writer_free(ptr->writer);
+  }
+
+  pool_clear(&ptr->pool);
+
+  warn_buf_clear(&ptr->warn);
+
+  ptr->ibuf     = Qnil;
+  ptr->obuf     = Qnil;
+
+  free(ptr);
+}
+
+static size_t
+rb_encoder_size(const void* _ptr)
+{
+  size_t ret;
+  png_encoder_t* ptr;
+  int i;
+
+  ptr = (png_encoder_t*)_ptr;
+
+  ret  = sizeof(png_encoder_t);
+  ret += (sizeof(png_byte*) * ptr->rows_capa);
+  ret += ptr->row_filters_capa;
+
+  ret += sizeof(png_text) * ptr->num_text;
+
+  for (i = 0; i < ptr->num_text; i++) {
+    ret += (strlen(ptr->text[i].key) + ptr->text[i].text_length);
+  }
+
+  return ret;
+}
+
+#if RUBY_API_VERSION_CODE > 20600
+static const rb_data_type_t png_encoder_data_type = {
+  "libpng-ruby encoder object",     // wrap_struct_name
+  {
+    rb_encoder_mark,                 // function.dmark
+    rb_encoder_free,                 // function.dfree
+    rb_encoder_size,                 // function.dsize
+    NULL,                            // function.dcompact
+    {NULL},                          // function.reserved
+  },
+  NULL,                              // parent
+  NULL,                              // data
+  (VALUE)RUBY_TYPED_FREE_IMMEDIATELY // flags
+};
+#else /* RUBY_API_VERSION_CODE > 20600 */
+static const rb_data_type_t png_encoder_data_type = {
+  "libpng-ruby encoder object",     // wrap_struct_name
+  {
+    rb_encoder_mark,                 // function.dmark
+    rb_encoder_free,                 // function.dfree
+    rb_encoder_size,                 // function.dsize
+    {NULL, NULL},                    // function.reserved
+  },
+  NULL,                              // parent
+  NULL,                              // data
+  (VALUE)RUBY_TYPED_FREE_IMMEDIATELY // flags
+};
+#endif /* RUBY_API_VERSION_CODE > 20600 */
+
+
+static VALUE
+rb_encoder_alloc(VALUE self)
+{
+  png_encoder_t* ptr;
+
+  ptr = ALLOC(png_encoder_t);
+  memset(ptr, 0, sizeof(*ptr));
+
+  ptr->c_type    = PNG_COLOR_TYPE_RGB;
+  ptr->i_meth    = PNG_INTERLACE_NONE;
+  ptr->c_level   = Z_DEFAULT_COMPRESSION;
+  ptr->c_strat   = C_STRATEGY_NONE;
+  ptr->c_window  = 15;
+  ptr->c_mem     = 8;
+  ptr->f_type    = PNG_FILTER_TYPE_BASE;
+  ptr->filter    = FILTER_DEFAULT;
+  ptr->filter_proc = Qnil;
+  ptr->num_comp  = 3;
+  ptr->with_time = !0;
+  ptr->gamma     = NAN;
+  ptr->threads   = 1;
+
+  return TypedData_Wrap_Struct(encoder_klass, &png_encoder_data_type, ptr);
+}
+
+static VALUE
+eval_encoder_opt_pixel_format(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int type;
+  int comp;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    type = PNG_COLOR_TYPE_RGB;
+    comp = 3;
+    break;
+
+  case T_STRING:
+  case T_SYMBOL:
+    if (EQ_STR(opt, "GRAY") || EQ_STR(opt, "GRAYSCALE")) {
+      type = PNG_COLOR_TYPE_GRAY;
+      comp = 1;
+
+    } else if (EQ_STR(opt, "GA")) {
+      type = PNG_COLOR_TYPE_GA;
+      comp = 2;
+
+    } else if (EQ_STR(opt, "RGB")) {
+      type = PNG_COLOR_TYPE_RGB;
+      comp = 3;
+
+    } else if (EQ_STR(opt, "RGBA")) {
+      type = PNG_COLOR_TYPE_RGBA;
+      comp = 4;
+
+    } else {
+      ret = create_argument_error(":pixel_format invalid value");
+    } 
+    break;
+
+  default:
+    ret = create_type_error(":pixel_format invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) {
+    ptr->c_type   = type;
+    ptr->num_comp = comp;
+  }
+
+  return ret;
+}
+
+static VALUE
+eval_encoder_opt_interlace(png_encoder_t* ptr, VALUE opt)
+{
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    ptr->i_meth = PNG_INTERLACE_NONE;
+    break;
+
+  default:
+    ptr->i_meth = (RTEST(opt))? PNG_INTERLACE_ADAM7: PNG_INTERLACE_NONE;
+    break;
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_encoder_opt_compression(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int lv;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    lv = Z_DEFAULT_COMPRESSION;
+    break;
+
+  case T_STRING:
+  case T_SYMBOL:
+    if (EQ_STR(opt, "NO_COMPRESSION")) {
+      lv = Z_NO_COMPRESSION;
+
+    } else if (EQ_STR(opt, "BEST_SPEED")) {
+      lv = Z_BEST_SPEED;
+
+    } else if (EQ_STR(opt, "BEST_COMPRESSION")) {
+      lv = Z_BEST_COMPRESSION;
+
+    } else if (EQ_STR(opt, "DEFAULT")) {
+      lv = Z_DEFAULT_COMPRESSION;
+
+    } else if (EQ_STR(opt, "AUTO")) {
+      lv = C_LEVEL_AUTO;
+
+    } else {
+      ret = create_argument_error(":compress is invalid value");
+    }
+    break;
+
+  case T_FIXNUM:
+    lv = FIX2INT(opt);
+    if (lv < 0 || lv > 9) {
+      ret = create_range_error(":compress out of range");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":compress invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) {
+    ptr->c_level = lv;
+  }
+
+  return ret;
+}
+
+static VALUE
+capitalize(VALUE str)
+{
+  VALUE tmp;
+  int i;
+
+  tmp = rb_str_split(rb_funcall(str, rb_intern("to_s"), 0), "_");
+
+  for (i = 0; i < RARRAY_LEN(tmp); i++) {
+    rb_funcall(RARRAY_AREF(tmp, i), rb_intern("capitalize!"), 0);
+  }
+
+  return rb_ary_join(tmp, rb_str_new_cstr(" "));
+}
+
+struct convert_text_rb2c_arg {
+  VALUE src;
+  png_text* dst;
+};
+
+static VALUE
+convert_text_rb2c(VALUE _arg)
+{
+  struct convert_text_rb2c_arg* arg;
+  VALUE src;
+  png_text* dst;
+  VALUE keys;
+  int i;
+  VALUE key;
+  VALUE val;
+
+  arg  = (struct convert_text_rb2c_arg*)_arg;
+  src  = arg->src;
+  dst  = arg->dst;
+
+  /*
+   * 途中で例外が発生する可能性があるので資源回収できる様に
+   * 0クリアを最初に済ませておく。
+   */
+  keys = rb_funcall(src, rb_intern("keys"), 0);
+
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    key  = rb_ary_entry(keys, i);
+    val  = rb_hash_aref(src, key);
+
+    if (TYPE(key) != T_STRING && TYPE(key) != T_SYMBOL) {
+      ARGUMENT_ERROR(":type is invalid structure");
+    }
+
+    if (TYPE(val) != T_STRING && TYPE(val) != T_SYMBOL) {
+      ARGUMENT_ERROR(":type is invalid structure");
+    }
+
+    key = capitalize(key);
+    if (RSTRING_LEN(key) >= 0 && RSTRING_LEN(key) <= 79) {
+      dst[i].compression = PNG_TEXT_COMPRESSION_NONE;
+      dst[i].key         = clone_cstr(key);
+      dst[i].text        = clone_cstr(val);
+      dst[i].text_length = RSTRING_LEN(val);
+
+    } else {
+      ARGUMENT_ERROR("keyword in :text is too long");
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_encoder_opt_text(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  png_text* text;
+  size_t size;
+  struct convert_text_rb2c_arg arg;
+  int state;
+
+  ret   = Qnil;
+  text  = NULL;
+  size  = 0;
+  state = 0;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    // ignore
+    break;
+
+  case T_HASH:
+    size = RHASH_SIZE(opt);
+    if (size == 0) break;
+
+    text = (png_text*)malloc(sizeof(png_text) * size);
+    if (text == NULL) {
+      ret = create_memory_error();
+      break;
+    }
+
+    arg.src = opt;
+    arg.dst = text;
+
+    rb_protect(convert_text_rb2c, (VALUE)&arg, &state);
+
+    if (state != 0) {
+      ret = rb_errinfo();
+      rb_set_errinfo(Qnil);
+      text_info_free(text, size);
+    }
+    break;
+
+  default:
+    ret = create_type_error(":text invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) {
+    ptr->text     = text;
+    ptr->num_text = size;
+  }
+
+  return ret;
+}
+
+static VALUE
+eval_encoder_opt_time(png_encoder_t* ptr, VALUE opt)
+{
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    ptr->with_time = !0;
+    break;
+
+  default:
+    ptr->with_time = RTEST(opt);
+    break;
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_encoder_opt_gamma(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  double gamma;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    gamma = NAN;
+    break;
+
+  case T_FIXNUM:
+  case T_FLOAT:
+  case T_RATIONAL:
+    gamma = NUM2DBL(opt);
+    break;
+
+  default:
+    ret = create_type_error(":gamma invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->gamma = gamma;
+
+  return ret;
+}
+
+/*
+ * :threads の評価(エンコーダ/デコーダ及びバッチ処理で共通)
+ */
+static VALUE
+eval_threads(VALUE opt, int* dst)
+{
+  VALUE ret;
+  int threads;
+
+  ret     = Qnil;
+  threads = 1;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+  case T_NIL:
+  case T_FALSE:
+    threads = 1;
+    break;
+
+  case T_TRUE:
+    threads = parallel_num_cpus();
+    break;
+
+  case T_FIXNUM:
+    if (FIX2LONG(opt) >= 1) {
+      threads = (FIX2LONG(opt) > 64)? 64: (int)FIX2LONG(opt);
+
+    } else {
+      ret = create_range_error(":threads less equal zero");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":threads invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) *dst = threads;
+
+  return ret;
+}
+
+static VALUE
+eval_encoder_opt_threads(png_encoder_t* ptr, VALUE opt)
+{
+  return eval_threads(opt, &ptr->threads);
+}
+
+static VALUE
+eval_encoder_opt_restart_points(png_encoder_t* ptr, VALUE opt)
+{
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    ptr->restart = 0;
+    break;
+
+  default:
+    ptr->restart = RTEST(opt);
+    break;
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_encoder_opt_fast(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    ptr->fast = 0;
+    break;
+
+  default:
+    if (RTEST(opt) && ptr->i_meth != PNG_INTERLACE_NONE) {
+      ret = create_argument_error(":fast is not supported with interlace");
+    } else {
+      ptr->fast = RTEST(opt);
+    }
+    break;
+  }
+
+  return ret;
+}
+
+static VALUE
+eval_encoder_opt_optimize(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int lv;
+
+  ret = Qnil;
+  lv  = 0;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+  case T_NIL:
+  case T_FALSE:
+    lv = 0;
+    break;
+
+  case T_TRUE:
+    lv = OPTIMIZE_DEFAULT;
+    break;
+
+  case T_FIXNUM:
+    lv = FIX2INT(opt);
+    if (lv < 0 || lv > OPTIMIZE_MAX) {
+      ret = create_range_error(":optimize out of range");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":optimize invalid type");
+    break;
+  }
+
+  if (!RTEST(ret) && lv > 0) {
+    if (ptr->i_meth != PNG_INTERLACE_NONE) {
+      ret = create_argument_error(":optimize is not supported with interlace");
+
+    } else if (ptr->restart) {
+      ret = create_argument_error(":optimize is not supported with "
+                                  ":restart_points");
+
+    } else if (ptr->fast) {
+      ret = create_argument_error(":optimize and :fast are exclusive");
+
+    } else if (ptr->c_level != Z_DEFAULT_COMPRESSION ||
+               ptr->c_strat != C_STRATEGY_NONE ||
+               ptr->c_window != 15 || ptr->c_mem != 8) {
+      /*
+       * zlib のパラメータは試験の中で選ぶので、指定されたものとは組み合わせ
+       * られない
+       */
+      ret = create_argument_error(":optimize is not supported with "
+                                  ":compression, :strategy, :window_bits "
+                                  "or :mem_level");
+    }
+  }
+
+  if (!RTEST(ret)) ptr->optimize = lv;
+
+  return ret;
+}
+
+static VALUE
+eval_encoder_opt_stride(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  png_uint_32 stride;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    stride = 0;
+    break;
+
+  case T_FIXNUM:
+    if (FIX2LONG(opt) >= (ptr->width * ptr->num_comp)) {
+      stride = FIX2LONG(opt);
+
+    } else {
+      ret = create_argument_error(":stride too little");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":stride invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->conf_stride = stride;
+
+  return ret;
+}
+
+static VALUE
+eval_encoder_opt_strategy(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int strat;
+
+  ret   = Qnil;
+  strat = C_STRATEGY_NONE;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    strat = C_STRATEGY_NONE;
+    break;
+
+  case T_STRING:
+  case T_SYMBOL:
+    if (EQ_STR(opt, "DEFAULT")) {
+      strat = Z_DEFAULT_STRATEGY;
+
+    } else if (EQ_STR(opt, "FILTERED")) {
+      strat = Z_FILTERED;
+
+    } else if (EQ_STR(opt, "HUFFMAN_ONLY")) {
+      strat = Z_HUFFMAN_ONLY;
+
+    } else if (EQ_STR(opt, "RLE")) {
+      strat = Z_RLE;
+
+    } else if (EQ_STR(opt, "FIXED")) {
+      strat = Z_FIXED;
+
+    } else {
+      ret = create_argument_error(":strategy invalid value");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":strategy invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->c_strat = strat;
+
+  return ret;
+}
+
+/*
+ * zlib は raw deflate で 8 を受け付けないので、窓サイズは 9 以上とする
+ */
+static VALUE
+eval_encoder_opt_window_bits(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int bits;
+
+  ret  = Qnil;
+  bits = 15;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    bits = 15;
+    break;
+
+  case T_FIXNUM:
+    bits = FIX2INT(opt);
+    if (bits < 9 || bits > 15) {
+      ret = create_range_error(":window_bits out of range");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":window_bits invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->c_window = bits;
+
+  return ret;
+}
+
+static VALUE
+eval_encoder_opt_mem_level(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int lv;
+
+  ret = Qnil;
+  lv  = 8;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    lv = 8;
+    break;
+
+  case T_FIXNUM:
+    lv = FIX2INT(opt);
+    if (lv < 1 || lv > 9) {
+      ret = create_range_error(":mem_level out of range");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":mem_level invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->c_mem = lv;
+
+  return ret;
+}
+
+static const struct {
+  const char* name;
+  int type;
+} filter_names[] = {
+  {"NONE",     FILTER_NONE},
+  {"SUB",      FILTER_SUB},
+  {"UP",       FILTER_UP},
+  {"AVG",      FILTER_AVG},
+  {"AVERAGE",  FILTER_AVG},
+  {"PAETH",    FILTER_PAETH},
+  {"ADAPTIVE", FILTER_ADAPTIVE},
+};
+
+/*
+ * フィルタの指定(名前は大文字/小文字を区別しない)を FILTER_* に変換する。
+ * 不正な値の場合は例外オブジェクトを返す。
+ */
+static VALUE
+get_filter_type(VALUE val, int* dst)
+{
+  VALUE ret;
+  const char* name;
+  int i;
+
+  ret = Qnil;
+
+  switch (TYPE(val)) {
+  case T_STRING:
+  case T_SYMBOL:
+    name = rb_id2name(rb_to_id(val));
+
+    for (i = 0; i < (int)N(filter_names); i++) {
+      if (STRCASECMP(name, filter_names[i].name) == 0) {
+        *dst = filter_names[i].type;
+        break;
+      }
+    }
+
+    if (i == (int)N(filter_names)) {
+      ret = create_argument_error(":filter invalid value");
+    }
+    break;
+
+  case T_FIXNUM:
+    if (FIX2INT(val) >= FILTER_NONE && FIX2INT(val) <= FILTER_PAETH) {
+      *dst = FIX2INT(val);
+    } else {
+      ret = create_range_error(":filter out of range");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":filter invalid type");
+    break;
+  }
+
+  return ret;
+}
+
+static VALUE
+eval_encoder_opt_filter(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  VALUE proc;
+  int filter;
+
+  ret  = Qnil;
+  proc = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    filter = FILTER_DEFAULT;
+    break;
+
+  case T_STRING:
+  case T_SYMBOL:
+  case T_FIXNUM:
+    ret = get_filter_type(opt, &filter);
+    break;
+
+  default:
+    if (!rb_respond_to(opt, rb_intern("call"))) {
+      ret = create_type_error(":filter invalid type");
+
+    } else if (ptr->i_meth != PNG_INTERLACE_NONE) {
+      ret = create_argument_error("per-row :filter is not supported "
+                                  "with interlace");
+
+    } else {
+      filter = FILTER_CALLBACK;
+      proc   = opt;
+    }
+    break;
+  }
+
+  if (!RTEST(ret)) {
+    ptr->filter      = filter;
+    ptr->filter_proc = proc;
+  }
+
+  return ret;
+}
+
+static VALUE
+eval_encoder_opt_idat_size(png_encoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  long size;
+
+  ret  = Qnil;
+  size = 0;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    size = 0;
+    break;
+
+  case T_FIXNUM:
+    size = FIX2LONG(opt);
+    if (size < 6 || size > PNG_UINT_31_MAX) {
+      ret = create_range_error(":idat_size out of range");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":idat_size invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->idat_size = (size_t)size;
+
+  return ret;
+}
+
+static void
+encode_error(png_structp ctx, png_const_charp msg)
+{
+  png_encoder_t* ptr;
+
+  ptr = (png_encoder_t*)png_get_error_ptr(ctx);
+
+  snprintf(ptr->error, sizeof(ptr->error), "encode error:%s", msg);
+
+  longjmp(png_jmpbuf(ctx), 1);
+}
+
+static void
+encode_warn(png_structp ctx, png_const_charp msg)
+{
+  png_encoder_t* ptr;
+
+  ptr = (png_encoder_t*)png_get_error_ptr(ctx);
+
+  warn_buf_push(&ptr->warn, msg);
+}
+
+/*
+ * 画像サイズの設定(:stride が指定されていない場合は幅から求める)
+ */
+static VALUE
+set_encoder_size(png_encoder_t* ptr, long wd, long ht)
+{
+  png_uint_32 stride;
+
+  if (wd <= 0) {
+    return create_range_error("image width less equal zero");
+  }
+
+  if (ht <= 0) {
+    return create_range_error("image height less equal zero");
+  }
+
+  if (wd > PNG_USER_WIDTH_MAX || ht > PNG_USER_HEIGHT_MAX) {
+    return create_range_error("image size too large");
+  }
+
+  if (ptr->conf_stride == 0) {
+    stride = (png_uint_32)wd * ptr->num_comp;
+
+  } else if (ptr->conf_stride >= wd * ptr->num_comp) {
+    stride = ptr->conf_stride;
+
+  } else {
+    return create_argument_error(":stride too little");
+  }
+
+  ptr->width     = (png_uint_32)wd;
+  ptr->height    = (png_uint_32)ht;
+  ptr->stride    = stride;
+  ptr->data_size = (size_t)stride * ptr->height;
+  ptr->offset    = 0;
+  ptr->partial   = 0;
+
+  return Qnil;
+}
+
+/*
+ * 入力中の画像の位置の設定(#encode の :offset と :region)
+ *
+ * :region を指定した場合は、set_encoder_size() で設定したサイズを入力
+ * (キャンバス)のサイズとして扱い、その中の矩形をエンコードする。行の
+ * 間隔(stride)はキャンバスのものをそのまま使うので、入力はコピーしない。
+ * どちらかを指定した場合は、入力が必要な大きさより大きくてもよい。
+ */
+static VALUE
+set_encoder_region(png_encoder_t* ptr, VALUE offset, VALUE region)
+{
+  long v[4];
+  size_t off;
+  VALUE tmp;
+  int i;
+
+  if ((offset == Qundef || NIL_P(offset)) &&
+      (region == Qundef || NIL_P(region))) {
+    return Qnil;
+  }
+
+  off = 0;
+
+  if (offset != Qundef && !NIL_P(offset)) {
+    if (!FIXNUM_P(offset)) {
+      return create_type_error(":offset invalid type");
+    }
+
+    if (FIX2LONG(offset) < 0) {
+      return create_range_error(":offset is negative");
+    }
+
+    off = FIX2LONG(offset);
+  }
+
+  if (region != Qundef && !NIL_P(region)) {
+    if (!RB_TYPE_P(region, T_ARRAY)) {
+      return create_type_error(":region invalid type");
+    }
+
+    if (RARRAY_LEN(region) != 4) {
+      return create_argument_error(":region must be [x, y, width, height]");
+    }
+
+    for (i = 0; i < 4; i++) {
+      tmp = RARRAY_AREF(region, i);
+
+      if (!FIXNUM_P(tmp)) {
+        return create_type_error(":region invalid type");
+      }
+
+      v[i] = FIX2LONG(tmp);
+    }
+
+    if (v[0] < 0 || v[1] < 0) {
+      return create_range_error(":region position is negative");
+    }
+
+    if (v[2] <= 0 || v[3] <= 0) {
+      return create_range_error(":region size is not positive");
+    }
+
+    if (v[0] + v[2] > (long)ptr->width || v[1] + v[3] > (long)ptr->height) {
+      return create_argument_error(":region is out of the image");
+    }
+
+    off += ((size_t)v[1] * ptr->stride) + ((size_t)v[0] * ptr->num_comp);
+
+    ptr->width  = (png_uint_32)v[2];
+    ptr->height = (png_uint_32)v[3];
+  }
+
+  ptr->offset    = off;
+  ptr->partial   = !0;
+  ptr->data_size = off + ((size_t)ptr->stride * (ptr->height - 1)) +
+                   ((size_t)ptr->width * ptr->num_comp);
+
+  return Qnil;
+}
+
+static VALUE
+set_encoder_context(png_encoder_t* ptr, int wd, int ht, VALUE opt)
+{
+  VALUE ret;
+
+  VALUE opts[N(encoder_opt_ids)];
+
+  /*
+   * initialize
+   */
+  ret = Qnil;
+
+  /*
+   * argument check
+   */
+  do {
+    if (wd <= 0) {
+      ret = create_range_error("image width less equal zero");
+      break;
+    }
+
+    if (ht <= 0) {
+      ret = create_range_error("image height less equal zero");
+      break;
+    }
+  } while (0);
+
+  /*
+   * parse options
+   */
+  if (!RTEST(ret)) do {
+    rb_get_kwargs(opt, encoder_opt_ids, 0, N(encoder_opt_ids), opts);
+
+    // オプション評価で使用するので前もって設定しておく
+    ptr->width  = wd;
+    ptr->height = ht;
+
+    ret = eval_encoder_opt_pixel_format(ptr, opts[0]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_interlace(ptr, opts[1]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_compression(ptr, opts[2]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_text(ptr, opts[3]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_time(ptr, opts[4]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_gamma(ptr, opts[5]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_stride(ptr, opts[6]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_threads(ptr, opts[7]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_restart_points(ptr, opts[8]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_strategy(ptr, opts[9]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_window_bits(ptr, opts[10]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_mem_level(ptr, opts[11]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_idat_size(ptr, opts[12]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_filter(ptr, opts[13]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_fast(ptr, opts[14]);
+    if (RTEST(ret)) break;
+
+    ret = eval_encoder_opt_optimize(ptr, opts[15]);
+    if (RTEST(ret)) break;
+  } while (0);
+
+  /*
+   * set image size
+   *
+   * libpng の構造体はエンコードの度に生成する(メモリはプールから確保
+   * されるので、二回目以降の生成はほぼコストがかからない)。
+   */
+  if (!RTEST(ret)) {
+    ret = set_encoder_size(ptr, wd, ht);
+  }
+
+  if (!RTEST(ret)) {
+    ptr->conf_width  = ptr->width;
+    ptr->conf_height = ptr->height;
+    ptr->ibuf        = Qnil;
+    ptr->obuf        = Qnil;
+  }
+
+  return ret;
+}
+
+static VALUE
+rb_encoder_initialize(int argc, VALUE* argv, VALUE self)
+{
+  png_encoder_t* ptr;
+  VALUE exc;
+  VALUE wd;
+  VALUE ht;
+  VALUE opts;
+
+  /*
+   * initialize
+   */
+  exc = Qnil;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, png_encoder_t, &png_encoder_data_type, ptr);
+
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "2:", &wd, &ht, &opts);
+
+  /*
+   * check argument
+   */
+  do {
+    if (TYPE(wd) != T_FIXNUM) {
+      exc = create_argument_error("invalid width");
+      break;
+    }
+
+    if (TYPE(ht) != T_FIXNUM) {
+      exc = create_argument_error("invalid height");
+      break;
+    }
+  } while (0);
+
+  /*
+   * set context
+   */
+  if (!RTEST(exc)) {
+    exc = set_encoder_context(ptr, FIX2INT(wd), FIX2INT(ht), opts);
+  }
+
+  /*
+   * post process
+   */
+  if (RTEST(exc)) rb_exc_raise(exc);
+
+  return self;
+}
+
+static void
+init_zparam(png_encoder_t* ptr, zparam_t* zp)
+{
+  // :AUTO は encode_nogvl() で選び直す(行ストリーミングでは既定値を使う)
+  zp->level     = (ptr->c_level == C_LEVEL_AUTO)?
+                    Z_DEFAULT_COMPRESSION: ptr->c_level;
+  zp->strategy  = ptr->c_strat;
+  zp->window    = ptr->c_window;
+  zp->mem_level = ptr->c_mem;
+}
+
+static void
+set_write_info(png_encoder_t* ptr,
+               png_structp ctx, png_infop info, const zparam_t* zp)
+{
+  png_set_IHDR(ctx,
+               info,
+               ptr->width,
+               ptr->height,
+               8,
+               ptr->c_type,
+               ptr->i_meth,
+               PNG_COMPRESSION_TYPE_BASE,
+               PNG_FILTER_TYPE_BASE);
+
+  if (ptr->text) {
+    png_set_text(ctx, info, ptr->text, ptr->num_text);
+  }
+
+  if (ptr->with_time) {
+    time_t tm;
+    png_time png_time;
+
+    time(&tm);
+    png_convert_from_time_t(&png_time, tm);
+    png_set_tIME(ctx, info, &png_time);
+  }
+
+  if (!isnan(ptr->gamma)) {
+    png_set_gAMA(ctx, info, ptr->gamma);
+  }
+
+  png_set_compression_level(ctx, zp->level);
+  png_set_compression_window_bits(ctx, zp->window);
+  png_set_compression_mem_level(ctx, zp->mem_level);
+
+  if (zp->strategy != C_STRATEGY_NONE) {
+    png_set_compression_strategy(ctx, zp->strategy);
+  }
+
+  if (ptr->idat_size > 0) {
+    png_set_compression_buffer_size(ctx, ptr->idat_size);
+  }
+
+  /*
+   * libpng で書き出す場合(インタレース、行ストリーミング)のフィルタ指定
+   * (行毎の指定はこの経路では使えない)
+   */
+  switch (ptr->filter) {
+  case FILTER_NONE:
+    png_set_filter(ctx, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+    break;
+
+  case FILTER_SUB:
+    png_set_filter(ctx, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+    break;
+
+  case FILTER_UP:
+    png_set_filter(ctx, PNG_FILTER_TYPE_BASE, PNG_FILTER_UP);
+    break;
+
+  case FILTER_AVG:
+    png_set_filter(ctx, PNG_FILTER_TYPE_BASE, PNG_FILTER_AVG);
+    break;
+
+  case FILTER_PAETH:
+    png_set_filter(ctx, PNG_FILTER_TYPE_BASE, PNG_FILTER_PAETH);
+    break;
+
+  case FILTER_ADAPTIVE:
+    png_set_filter(ctx, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+    break;
+  }
+}
+
+static png_structp
+create_write_struct(png_encoder_t* ptr)
+{
+  return png_create_write_struct_2(PNG_LIBPNG_VER_STRING,
+                                   ptr,
+                                   encode_error,
+                                   encode_warn,
+                                   &ptr->pool,
+                                   pool_malloc,
+                                   pool_free);
+}
+
+/*
+ * 並列エンコード(:threads)
+ *
+ * ヘッダ部分(IHDR, tEXt 等)は libpng で書き出し、IDAT は自前で生成する。
+ * 行を一定サイズのストリップに分割し、フィルタ処理と deflate をストリップ
+ * 単位で並列に行う。各ストリップは直前の 32KiB を辞書として raw deflate で
+ * 圧縮し、Z_SYNC_FLUSH でバイト境界に揃えて連結する(pigz と同じ方式)。
+ * Adler-32 はストリップ毎に求めたものを adler32_combine() で合成する。
+ */
+#define STRIP_SIZE                  (256 * 1024)
+#define DICT_SIZE                   32768
+
+typedef struct {
+  uint8_t* data;     // compressed data
+  size_t size;
+  size_t len;        // length of the filtered data
+  uLong adler;
+} strip_t;
+
+typedef struct {
+  png_encoder_t* ptr;
+
+  size_t rowbytes;   // bytes per row (without filter type byte)
+  size_t fstride;    // rowbytes + 1
+  int strip_rows;    // rows per strip
+  int nstrips;
+  int level;
+  int strategy;
+  int window;
+  int mem_level;
+  int filter;        // FILTER_* (never FILTER_DEFAULT)
+  int fast;          // filter and compress each strip in one job (:fast)
+  int optimize;      // level of :optimize (0: off)
+  int restart;       // strips are independent (restart points)
+
+  uint8_t* filtered;
+  uint8_t* zero;     // previous row of the first row
+  strip_t* strips;
+
+  int failed;
+} pdeflate_t;
+
+static inline uint8_t
+paeth_predictor(int a, int b, int c)
+{
+  int p;
+  int pa;
+  int pb;
+  int pc;
+
+  p  = a + b - c;
+  pa = abs(p - a);
+  pb = abs(p - b);
+  pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc) return (uint8_t)a;
+  if (pb <= pc) return (uint8_t)b;
+
+  return (uint8_t)c;
+}
+
+static void
+unfilter_row(int type, uint8_t* cur, const uint8_t* prv, size_t n, int bpp)
+{
+  size_t i;
+
+  switch (type) {
+  case FILTER_NONE:
+    break;
+
+  case FILTER_SUB:
+    for (i = bpp; i < n; i++) cur[i] += cur[i - bpp];
+    break;
+
+  case FILTER_UP:
+    for (i = 0; i < n; i++) cur[i] += prv[i];
+    break;
+
+  case FILTER_AVG:
+    for (i = 0; i < (size_t)bpp; i++) cur[i] += prv[i] >> 1;
+    for (; i < n; i++) cur[i] += (cur[i - bpp] + prv[i]) >> 1;
+    break;
+
+  case FILTER_PAETH:
+    for (i = 0; i < (size_t)bpp; i++) cur[i] += prv[i];
+    for (; i < n; i++) {
+      cur[i] += paeth_predictor(cur[i - bpp], prv[i], prv[i - bpp]);
+    }
+    break;
+  }
+}
+
+/*
+ * :filter の指定から画像全体のフィルタを決める(未指定の場合は :fast なら
+ * FAST_FILTER、無圧縮なら None、それ以外は行毎に選択する)
+ */
+#define FAST_FILTER                 FILTER_SUB
+
+static int
+get_filter_mode(png_encoder_t* ptr, const zparam_t* zp)
+{
+  if (ptr->filter != FILTER_DEFAULT) return ptr->filter;
+  if (ptr->fast) return FAST_FILTER;
+
+  return (zp->level != Z_NO_COMPRESSION)? FILTER_ADAPTIVE: FILTER_NONE;
+}
+
+/*
+ * 一行分のフィルタ処理(dst[0] にフィルタの種類を置く)。last より後の
+ * フィルタは使わない。
+ */
+static void
+encode_filter_row(png_encoder_t* ptr, int mode, png_uint_32 y,
+                  uint8_t* dst, const uint8_t* prv, int last)
+{
+  size_t rowbytes;
+  int type;
+
+  rowbytes = (size_t)ptr->width * ptr->num_comp;
+  type     = (mode == FILTER_CALLBACK)? ptr->row_filters[y]: mode;
+
+  if (type == FILTER_ADAPTIVE) {
+    filter_select(dst, ptr->rows[y], prv, rowbytes, ptr->num_comp, last);
+
+  } else {
+    if (type > last) type = last;
+
+    dst[0] = (uint8_t)type;
+    filter_apply(type, dst + 1, ptr->rows[y], prv, rowbytes, ptr->num_comp);
+  }
+}
+
+static void
+pdeflate_filter_job(void* _pd, int idx)
+{
+  pdeflate_t* pd;
+  png_encoder_t* ptr;
+  const uint8_t* prv;
+  png_uint_32 y;
+  png_uint_32 y1;
+  int last;
+
+  pd  = (pdeflate_t*)_pd;
+  ptr = pd->ptr;
+
+  y  = idx * pd->strip_rows;
+  y1 = y + pd->strip_rows;
+  if (y1 > ptr->height) y1 = ptr->height;
+
+  for (; y < y1; y++) {
+    prv = (y > 0)? ptr->rows[y - 1]: pd->zero;
+
+    /*
+     * リスタートポイントを付ける場合、ストリップの先頭行は前の行を参照
+     * しないフィルタ(None か Sub)に限定する
+     */
+    last = (pd->restart && y == (png_uint_32)idx * pd->strip_rows)?
+              FILTER_SUB: FILTER_PAETH;
+
+    encode_filter_row(ptr, pd->filter, y,
+                      pd->filtered + (y * pd->fstride), prv, last);
+  }
+}
+
+/*
+ * zlib の長さは uInt (32bit) なので、4GiB を越えるストリップ(単一スレッド
+ * では画像全体が一つのストリップになる)は分割して渡す
+ */
+static uLong
+strip_adler32(const uint8_t* src, size_t len)
+{
+#ifdef HAVE_ADLER32_Z
+  return adler32_z(adler32(0L, Z_NULL, 0), src, len);
+#else /* defined(HAVE_ADLER32_Z) */
+  uLong ret;
+  size_t n;
+
+  ret = adler32(0L, Z_NULL, 0);
+
+  while (len > 0) {
+    n    = (len > UINT_MAX)? UINT_MAX: len;
+    ret  = adler32(ret, src, (uInt)n);
+    src += n;
+    len -= n;
+  }
+
+  return ret;
+#endif /* defined(HAVE_ADLER32_Z) */
+}
+
+static void
+pdeflate_deflate_job(void* _pd, int idx)
+{
+  pdeflate_t* pd;
+  strip_t* st;
+  z_stream z;
+  uint8_t* src;
+  uint8_t* buf;
+  size_t off;
+  size_t dic;
+  size_t capa;
+  size_t used;
+  size_t rest;
+  size_t n;
+  int last;
+  int flush;
+  int err;
+
+  pd   = (pdeflate_t*)_pd;
+  st   = pd->strips + idx;
+  off  = (size_t)idx * pd->strip_rows * pd->fstride;
+  src  = pd->filtered + off;
+  last = (idx == pd->nstrips - 1);
+
+  st->adler = strip_adler32(src, st->len);
+
+  memset(&z, 0, sizeof(z));
+
+  if (deflateInit2(&z, pd->level, Z_DEFLATED,
+                   -pd->window, pd->mem_level, pd->strategy) != Z_OK) {
+    pd->failed = !0;
+    return;
+  }
+
+  if (off > 0 && !pd->restart) {
+    dic = (off < DICT_SIZE)? off: DICT_SIZE;
+    deflateSetDictionary(&z, src - dic, dic);
+  }
+
+  capa = deflateBound(&z, st->len) + 64;
+  buf  = (uint8_t*)malloc(capa);
+
+  z.next_in   = src;
+  z.avail_in  = 0;
+  z.next_out  = buf;
+  z.avail_out = 0;
+  rest        = st->len;
+
+  /*
+   * 入出力とも uInt に収まる大きさ毎に渡し、全ての入力を渡し終えてから
+   * フラッシュする
+   */
+  while (buf != NULL) {
+    if (z.avail_in == 0 && rest > 0) {
+      n           = (rest > UINT_MAX)? UINT_MAX: rest;
+      z.avail_in  = (uInt)n;
+      rest       -= n;
+    }
+
+    if (z.avail_out == 0) {
+      used = z.next_out - buf;
+
+      /*
+       * 出力が見積りを越えた場合(通常は起きない)は領域を拡張して続ける
+       */
+      if (used == capa) {
+        st->data = (uint8_t*)realloc(buf, capa * 2);
+        if (st->data == NULL) {
+          free(buf);
+          buf = NULL;
+          break;
+        }
+
+        buf   = st->data;
+        capa *= 2;
+      }
+
+      z.next_out  = buf + used;
+      z.avail_out = (capa - used > UINT_MAX)? UINT_MAX: (uInt)(capa - used);
+    }
+
+    if (rest > 0) {
+      flush = Z_NO_FLUSH;
+    } else {
+      flush = (last)? Z_FINISH: Z_SYNC_FLUSH;
+    }
+
+    err = deflate(&z, flush);
+
+    if (last && err == Z_STREAM_END) break;
+
+    if (err != Z_OK && err != Z_BUF_ERROR) {
+      free(buf);
+      buf = NULL;
+      break;
+    }
+
+    if (!last && rest == 0 && z.avail_in == 0 && z.avail_out > 0) break;
+  }
+
+  st->data = buf;
+  st->size = (buf != NULL)? (size_t)(z.next_out - buf): 0;
+
+  if (buf == NULL) pd->failed = !0;
+
+  deflateEnd(&z);
+}
+
+static void
+pdeflate_fast_job(void* _pd, int idx)
+{
+  pdeflate_t* pd;
+  strip_t* st;
+  uint8_t* src;
+  size_t capa;
+
+  pd  = (pdeflate_t*)_pd;
+  st  = pd->strips + idx;
+  src = pd->filtered + ((size_t)idx * pd->strip_rows * pd->fstride);
+
+  pdeflate_filter_job(pd, idx);
+
+  st->adler = strip_adler32(src, st->len);
+
+  capa     = fdeflate_bound(st->len, pd->fstride);
+  st->data = (uint8_t*)malloc(capa);
+
+  if (st->data != NULL) {
+    st->size = fdeflate_strip(st->data, capa, src, st->len,
+                              pd->fstride, pd->ptr->num_comp,
+                              idx == pd->nstrips - 1);
+  }
+
+  if (st->size == 0) pd->failed = !0;
+}
+
+static int
+pdeflate_init(pdeflate_t* pd, png_encoder_t* ptr, const zparam_t* zp)
+{
+  int i;
+
+  memset(pd, 0, sizeof(*pd));
+
+  pd->ptr        = ptr;
+  pd->rowbytes   = (size_t)ptr->width * ptr->num_comp;
+  pd->fstride    = pd->rowbytes + 1;
+  pd->strip_rows = (int)(STRIP_SIZE / pd->fstride);
+
+  if (pd->strip_rows < 1) pd->strip_rows = 1;
+
+  /*
+   * 単一スレッドでは分割しない(一つの deflate ストリームにする)。:fast は
+   * ストリップ単位でフィルタ処理と圧縮を続けて行う(キャッシュに載った
+   * まま圧縮する)ので、分割したままとする。
+   */
+  if ((ptr->threads <= 1 || ptr->optimize) && !ptr->restart && !ptr->fast) {
+    pd->strip_rows = ptr->height;
+  }
+
+  pd->nstrips    = (ptr->height + pd->strip_rows - 1) / pd->strip_rows;
+  pd->level      = (ptr->fast)? Z_BEST_SPEED: zp->level;
+  pd->window     = zp->window;
+  pd->optimize   = ptr->optimize;
+
+  if (ptr->optimize) {
+    pd->level  = Z_BEST_COMPRESSION;
+    pd->window = MAX_WBITS;
+  }
+
+  pd->mem_level  = zp->mem_level;
+  pd->filter     = get_filter_mode(ptr, zp);
+  pd->fast       = ptr->fast;
+  pd->restart    = ptr->restart;
+
+  if (zp->strategy != C_STRATEGY_NONE) {
+    pd->strategy = zp->strategy;
+  } else {
+    pd->strategy = (pd->filter != FILTER_NONE)? Z_FILTERED: Z_DEFAULT_STRATEGY;
+  }
+
+  pd->filtered   = (uint8_t*)malloc(pd->fstride * ptr->height);
+  pd->zero       = (uint8_t*)calloc(1, pd->rowbytes);
+  pd->strips     = (strip_t*)calloc(pd->nstrips, sizeof(strip_t));
+
+  if (!pd->filtered || !pd->zero || !pd->strips) return -1;
+
+  for (i = 0; i < pd->nstrips; i++) {
+    pd->strips[i].len = pd->strip_rows * pd->fstride;
+  }
+
+  pd->strips[pd->nstrips - 1].len = \
+      (ptr->height - ((pd->nstrips - 1) * pd->strip_rows)) * pd->fstride;
+
+  return 0;
+}
+
+static void
+pdeflate_free(pdeflate_t* pd)
+{
+  int i;
+
+  if (pd->strips != NULL) {
+    for (i = 0; i < pd->nstrips; i++) {
+      if (pd->strips[i].data) free(pd->strips[i].data);
+    }
+
+    free(pd->strips);
+  }
+
+  if (pd->filtered != NULL) free(pd->filtered);
+  if (pd->zero != NULL) free(pd->zero);
+
+  memset(pd, 0, sizeof(*pd));
+}
+
+/*
+ * 出力サイズの最適化(:optimize)
+ *
+ * 画像全体(一つのストリップ)を、フィルタと zlib のパラメータの組み合わせ
+ * 毎に試験的に圧縮し、最も小さいものを採る。フィルタ処理はフィルタ毎に
+ * 一度だけ pd->filtered に行い(画像の複製は作らない)、そのフィルタの
+ * zlib のパラメータ毎の試験は :threads に従って並列に行う。
+ *
+ * レベル 3 以上では、試験で最も小さくなったフィルタでフィルタ処理を
+ * やり直し、反復による最適化を行う deflate (odeflate.c) でも圧縮して、
+ * 試験の結果と比べて小さい方を採る。
+ */
+static const int optimize_filters[] = {
+  FILTER_NONE,
+  FILTER_SUB,
+  FILTER_UP,
+  FILTER_AVG,
+  FILTER_PAETH,
+  FILTER_ADAPTIVE,
+};
+
+static const struct {
+  int strategy;
+  int mem_level;
+  int min_level;     // the lowest :optimize level that tries this
+} optimize_zparams[] = {
+  {Z_FILTERED, 9, 1},
+  {Z_DEFAULT_STRATEGY, 9, 1},
+  {Z_FILTERED, 8, 2},
+  {Z_DEFAULT_STRATEGY, 8, 2},
+  {Z_RLE, 9, 2},
+  {Z_HUFFMAN_ONLY, 9, 2},
+};
+
+static const struct {
+  int iterations;    // 0: odeflate is not used
+  int chain;         // length limit of the hash chain
+} optimize_passes[OPTIMIZE_MAX + 1] = {
+  {0, 0},
+  {0, 0},
+  {0, 0},
+  {5, 1024},
+  {15, 8192},
+};
+
+typedef struct {
+  pdeflate_t* pd;
+  int filters[N(optimize_filters)];
+  int nfilters;
+  int zparams[N(optimize_zparams)];
+  int nzparams;
+  strip_t* results;  // for each trial of the current filter (data == NULL: failed)
+} optimize_t;
+
+static void
+optimize_trial_job(void* _op, int idx)
+{
+  optimize_t* op;
+  pdeflate_t t;
+  int z;
+
+  op = (optimize_t*)_op;
+  z  = op->zparams[idx];
+
+  /*
+   * 試験毎に pdeflate_t の複製を作り、zlib のパラメータと結果の
+   * ストリップだけを差し替えて既存の処理を使う(フィルタ処理の結果は
+   * 共有して読むだけ)
+   */
+  t           = *op->pd;
+  t.strategy  = optimize_zparams[z].strategy;
+  t.mem_level = optimize_zparams[z].mem_level;
+  t.strips    = op->results + idx;
+
+  pdeflate_deflate_job(&t, 0);
+}
+
+static void
+pdeflate_optimize(pdeflate_t* pd)
+{
+  optimize_t op;
+  strip_t best;
+  uint8_t* data;
+  size_t size;
+  int filter;
+  int lv;
+  int i;
+  int j;
+
+  memset(&op, 0, sizeof(op));
+
+  lv    = pd->optimize;
+  op.pd = pd;
+
+  if (pd->ptr->filter != FILTER_DEFAULT) {
+    op.filters[op.nfilters++] = pd->ptr->filter;
+  } else {
+    for (i = 0; i < (int)N(optimize_filters); i++) {
+      op.filters[op.nfilters++] = optimize_filters[i];
+    }
+  }
+
+  for (i = 0; i < (int)N(optimize_zparams); i++) {
+    if (optimize_zparams[i].min_level <= lv) op.zparams[op.nzparams++] = i;
+  }
+
+  op.results = (strip_t*)calloc(op.nzparams, sizeof(strip_t));
+
+  if (op.results == NULL) {
+    pd->failed = !0;
+    return;
+  }
+
+  memset(&best, 0, sizeof(best));
+  filter = FILTER_DEFAULT;
+
+  for (i = 0; i < op.nfilters; i++) {
+    pd->filter = op.filters[i];
+    pdeflate_filter_job(pd, 0);
+
+    for (j = 0; j < op.nzparams; j++) {
+      memset(op.results + j, 0, sizeof(strip_t));
+      op.results[j].len = pd->strips[0].len;
+    }
+
+    parallel_for(pd->ptr->threads, op.nzparams, optimize_trial_job, &op);
+
+    // 最も小さいものだけを残す
+    for (j = 0; j < op.nzparams; j++) {
+      if (op.results[j].data == NULL) continue;
+
+      if (best.data == NULL || op.results[j].size < best.size) {
+        if (best.data != NULL) free(best.data);
+
+        best   = op.results[j];
+        filter = pd->filter;
+
+      } else {
+        free(op.results[j].data);
+      }
+    }
+  }
+
+  free(op.results);
+
+  if (best.data != NULL && optimize_passes[lv].iterations > 0) {
+    // 最後に試したフィルタでなければフィルタ処理をやり直す
+    if (pd->filter != filter) {
+      pd->filter = filter;
+      pdeflate_filter_job(pd, 0);
+    }
+
+    if (odeflate(&data, &size, pd->filtered, pd->strips[0].len,
+                 optimize_passes[lv].iterations, optimize_passes[lv].chain,
+                 pd->ptr->threads) == 0) {
+      if (size < best.size) {
+        free(best.data);
+
+        best.data = data;
+        best.size = size;
+
+      } else {
+        free(data);
+      }
+    }
+  }
+
+  if (best.data != NULL) {
+    pd->strips[0] = best;
+
+  } else {
+    pd->failed = !0;
+  }
+}
+
+static void
+pdeflate_run(pdeflate_t* pd)
+{
+  if (pd->optimize) {
+    pdeflate_optimize(pd);
+    return;
+  }
+
+  if (pd->fast) {
+    parallel_for(pd->ptr->threads, pd->nstrips, pdeflate_fast_job, pd);
+    return;
+  }
+
+  parallel_for(pd->ptr->threads, pd->nstrips, pdeflate_filter_job, pd);
+  if (pd->failed) return;
+
+  parallel_for(pd->ptr->threads, pd->nstrips, pdeflate_deflate_job, pd);
+}
+
+/*
+ * リスタートポイント(rsPT チャンク)
+ *
+ *   uint32  ストリップ毎の行数
+ *   uint32  ストリップ毎の圧縮データのサイズ(ストリップ数分)
+ *
+ * 各ストリップは zlib ヘッダ(2バイト)の直後から順に並ぶ。ストリップは
+ * 辞書を使わずに圧縮し、先頭行は前の行を参照しないので、それぞれ単独で
+ * 展開できる。名前は補助/プライベート/コピー不可のチャンクとしている。
+ */
+#define RESTART_CHUNK_NAME          "rsPT"
+
+static void
+put_uint32(uint8_t* p, png_uint_32 val)
+{
+  p[0] = (uint8_t)(val >> 24);
+  p[1] = (uint8_t)(val >> 16);
+  p[2] = (uint8_t)(val >> 8);
+  p[3] = (uint8_t)(val);
+}
+
+static void
+write_restart_chunk(pdeflate_t* pd, png_structp ctx)
+{
+  uint8_t buf[4];
+  int i;
+
+  png_write_chunk_start(ctx,
+                        (png_const_bytep)RESTART_CHUNK_NAME,
+                        (png_uint_32)(4 * (pd->nstrips + 1)));
+
+  put_uint32(buf, pd->strip_rows);
+  png_write_chunk_data(ctx, buf, 4);
+
+  for (i = 0; i < pd->nstrips; i++) {
+    put_uint32(buf, (png_uint_32)pd->strips[i].size);
+    png_write_chunk_data(ctx, buf, 4);
+  }
+
+  png_write_chunk_end(ctx);
+}
+
+/*
+ * :idat_size 指定時はストリップの境界に関係なく、指定サイズ毎に IDAT を
+ * 区切って書き出す
+ */
+static void
+write_split_idat(pdeflate_t* pd, png_structp ctx,
+                 const uint8_t* head, size_t head_size,
+                 const uint8_t* tail, size_t tail_size)
+{
+  const uint8_t* src;
+  size_t total;
+  size_t room;       // remaining bytes of the current chunk
+  size_t left;       // remaining bytes of the current piece
+  size_t n;
+  int i;
+
+  total = head_size + tail_size;
+  for (i = 0; i < pd->nstrips; i++) total += pd->strips[i].size;
+
+  room = 0;
+
+  for (i = -1; i <= pd->nstrips; i++) {
+    if (i < 0) {
+      src  = head;
+      left = head_size;
+
+    } else if (i == pd->nstrips) {
+      src  = tail;
+      left = tail_size;
+
+    } else {
+      src  = pd->strips[i].data;
+      left = pd->strips[i].size;
+    }
+
+    while (left > 0) {
+      if (room == 0) {
+        room   = (total < pd->ptr->idat_size)? total: pd->ptr->idat_size;
+        total -= room;
+        png_write_chunk_start(ctx, (png_const_bytep)"IDAT", (png_uint_32)room);
+      }
+
+      n = (left < room)? left: room;
+      png_write_chunk_data(ctx, src, n);
+
+      src  += n;
+      left -= n;
+      room -= n;
+
+      if (room == 0) png_write_chunk_end(ctx);
+    }
+  }
+}
+
+/*
+ * zlib ヘッダとトレイラを付けて IDAT チャンクとして書き出す(ストリップ毎に
+ * 一つの IDAT にする)
+ */
+static void
+pdeflate_write(pdeflate_t* pd, png_structp ctx)
+{
+  uint8_t head[2];
+  uint8_t tail[4];
+  uLong adler;
+  size_t size;
+  int flevel;
+  int i;
+
+  switch (pd->level) {
+  case 0:
+  case 1:
+    flevel = 0;
+    break;
+
+  case 2:
+  case 3:
+  case 4:
+  case 5:
+    flevel = 1;
+    break;
+
+  case 6:
+  case Z_DEFAULT_COMPRESSION:
+    flevel = 2;
+    break;
+
+  default:
+    flevel = 3;
+    break;
+  }
+
+  head[0] = (uint8_t)(((pd->window - 8) << 4) | Z_DEFLATED);
+  head[1] = (uint8_t)(flevel << 6);
+  head[1] += 31 - (((head[0] << 8) + head[1]) % 31);
+
+  adler = adler32(0L, Z_NULL, 0);
+
+  for (i = 0; i < pd->nstrips; i++) {
+    adler = adler32_combine(adler, pd->strips[i].adler, pd->strips[i].len);
+  }
+
+  tail[0] = (uint8_t)(adler >> 24);
+  tail[1] = (uint8_t)(adler >> 16);
+  tail[2] = (uint8_t)(adler >> 8);
+  tail[3] = (uint8_t)(adler);
+
+  if (pd->restart) write_restart_chunk(pd, ctx);
+
+  if (pd->ptr->idat_size > 0) {
+    write_split_idat(pd, ctx, head, sizeof(head), tail, sizeof(tail));
+    png_write_chunk(ctx, (png_const_bytep)"IEND", NULL, 0);
+    return;
+  }
+
+  for (i = 0; i < pd->nstrips; i++) {
+    size = pd->strips[i].size;
+
+    if (i == 0) size += sizeof(head);
+    if (i == pd->nstrips - 1) size += sizeof(tail);
+
+    png_write_chunk_start(ctx, (png_const_bytep)"IDAT", (png_uint_32)size);
+
+    if (i == 0) png_write_chunk_data(ctx, head, sizeof(head));
+
+    png_write_chunk_data(ctx, pd->strips[i].data, pd->strips[i].size);
+
+    if (i == pd->nstrips - 1) png_write_chunk_data(ctx, tail, sizeof(tail));
+
+    png_write_chunk_end(ctx);
+  }
+
+  png_write_chunk(ctx, (png_const_bytep)"IEND", NULL, 0);
+}
+
+/*
+ * 圧縮パラメータの自動選択(:compression => :AUTO)
+ *
+ * 画像の上端・中央・下端から行を抜き出してフィルタ処理し、各候補の設定で
+ * 試験的に圧縮する。候補は速い順に並べてあり、最も小さい結果に対して
+ * AUTO_SIZE_BUDGET(%) 以内に収まる最初の候補を採用する。試験圧縮は
+ * :threads に従って候補毎に並列に行う。
+ */
+#define AUTO_SAMPLES                3
+#define AUTO_SAMPLE_SIZE            (32 * 1024)
+#define AUTO_SIZE_BUDGET            105
+
+static const struct {
+  int level;
+  int strategy;
+} auto_candidates[] = {
+  {Z_BEST_SPEED, Z_HUFFMAN_ONLY},
+  {Z_BEST_SPEED, Z_RLE},
+  {Z_BEST_SPEED, Z_FILTERED},
+  {3, Z_FILTERED},
+  {6, Z_FILTERED},
+  {Z_BEST_COMPRESSION, Z_FILTERED},
+};
+
+typedef struct {
+  const zparam_t* zp;
+  uint8_t* data;                    // filtered rows of the samples
+  size_t len[AUTO_SAMPLES];         // bytes of each sample (0: unused)
+  size_t size[N(auto_candidates)];  // compressed size (0: failed)
+} auto_tune_t;
+
+static int
+auto_sample(png_encoder_t* ptr, auto_tune_t* at)
+{
+  png_uint_32 top[AUTO_SAMPLES];
+  png_uint_32 rows;
+  png_uint_32 y;
+  size_t rowbytes;
+  size_t fstride;
+  uint8_t* zero;
+  uint8_t* dst;
+  int mode;
+  int num;
+  int i;
+
+  rowbytes = (size_t)ptr->width * ptr->num_comp;
+  fstride  = rowbytes + 1;
+  rows     = (png_uint_32)(AUTO_SAMPLE_SIZE / fstride);
+
+  if (rows < 1) rows = 1;
+
+  if (ptr->height <= rows * AUTO_SAMPLES) {
+    // 小さな画像は全体を一つのサンプルとする
+    num    = 1;
+    rows   = ptr->height;
+    top[0] = 0;
+
+  } else {
+    num    = AUTO_SAMPLES;
+    top[0] = 0;
+    top[1] = (ptr->height - rows) / 2;
+    top[2] = ptr->height - rows;
+  }
+
+  at->data = (uint8_t*)malloc(fstride * rows * num);
+  zero     = (uint8_t*)calloc(1, rowbytes);
+  mode     = get_filter_mode(ptr, at->zp);
+
+  if (at->data && zero) {
+    dst = at->data;
+
+    for (i = 0; i < num; i++) {
+      for (y = top[i]; y < top[i] + rows; y++) {
+        encode_filter_row(ptr, mode, y, dst,
+                          (y > 0)? ptr->rows[y - 1]: zero, FILTER_PAETH);
+        dst += fstride;
+      }
+
+      at->len[i] = fstride * rows;
+    }
+  }
+
+  if (zero != NULL) free(zero);
+
+  return (at->len[0] > 0)? 0: -1;
+}
+
+static void
+auto_trial_job(void* _at, int idx)
+{
+  auto_tune_t* at;
+  z_stream z;
+  uint8_t* src;
+  uint8_t* buf;
+  size_t capa;
+  size_t total;
+  int strat;
+  int i;
+
+  at    = (auto_tune_t*)_at;
+  strat = (at->zp->strategy != C_STRATEGY_NONE)?
+            at->zp->strategy: auto_candidates[idx].strategy;
+
+  memset(&z, 0, sizeof(z));
+
+  if (deflateInit2(&z, auto_candidates[idx].level, Z_DEFLATED,
+                   -at->zp->window, at->zp->mem_level, strat) != Z_OK) {
+    return;
+  }
+
+  capa  = deflateBound(&z, at->len[0]);
+  buf   = (uint8_t*)malloc(capa);
+  src   = at->data;
+  total = 0;
+
+  for (i = 0; buf != NULL && i < AUTO_SAMPLES && at->len[i] > 0; i++) {
+    z.next_in   = src;
+    z.avail_in  = at->len[i];
+    z.next_out  = buf;
+    z.avail_out = capa;
+
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+      total = 0;
+      break;
+    }
+
+    total += capa - z.avail_out;
+    src   += at->len[i];
+
+    deflateReset(&z);
+  }
+
+  at->size[idx] = total;
+
+  if (buf != NULL) free(buf);
+  deflateEnd(&z);
+}
+
+static void
+tune_zparam(png_encoder_t* ptr, zparam_t* zp)
+{
+  auto_tune_t at;
+  size_t best;
+  int i;
+
+  memset(&at, 0, sizeof(at));
+  at.zp = zp;
+
+  /*
+   * メモリが確保できない等で試験できなかった場合は既定値のまま
+   */
+  if (auto_sample(ptr, &at) == 0) {
+    parallel_for(ptr->threads,
+                 (int)N(auto_candidates), auto_trial_job, &at);
+
+    best = 0;
+
+    for (i = 0; i < (int)N(auto_candidates); i++) {
+      if (at.size[i] > 0 && (best == 0 || at.size[i] < best)) {
+        best = at.size[i];
+      }
+    }
+
+    for (i = 0; best > 0 && i < (int)N(auto_candidates); i++) {
+      if (at.size[i] > 0 && at.size[i] * 100 <= best * AUTO_SIZE_BUDGET) {
+        zp->level = auto_candidates[i].level;
+
+        if (zp->strategy == C_STRATEGY_NONE) {
+          zp->strategy = auto_candidates[i].strategy;
+        }
+        break;
+      }
+    }
+  }
+
+  if (at.data != NULL) free(at.data);
+}
+
+static void
+encode_parallel(png_encoder_t* ptr,
+                png_structp ctx, png_infop info, pdeflate_t* pd,
+                const zparam_t* zp)
+{
+  if (pdeflate_init(pd, ptr, zp) != 0) {
+    png_error(ctx, "no memory");
+  }
+
+  pdeflate_run(pd);
+
+  if (pd->failed) {
+    png_error(ctx, "parallel deflate failed");
+  }
+
+  png_write_info(ctx, info);
+  pdeflate_write(pd, ctx);
+}
+
+static void*
+encode_nogvl(void* arg)
+{
+  png_encoder_t* ptr;
+  png_structp ctx;
+  png_infop info;
+  pdeflate_t pd;
+  zparam_t zp;
+
+  /*
+   * initialize
+   */
+  ptr = (png_encoder_t*)arg;
+
+  memset(&pd, 0, sizeof(pd));
+
+  init_zparam(ptr, &zp);
+  if (ptr->c_level == C_LEVEL_AUTO && !ptr->fast && !ptr->optimize) {
+    tune_zparam(ptr, &zp);
+  }
+
+  /*
+   * GVL を解放した状態で実行されるので、ここでは Ruby の API を呼び出しては
+   * ならない。エラーは ptr->error にメッセージとして残して戻る。
+   */
+  ctx = create_write_struct(ptr);
+  if (ctx == NULL) {
+    snprintf(ptr->error, sizeof(ptr->error),
+             "png_create_write_struct() failed");
+    return NULL;
+  }
+
+  info = png_create_info_struct(ctx);
+  if (info == NULL) {
+    png_destroy_write_struct(&ctx, NULL);
+    snprintf(ptr->error, sizeof(ptr->error),
+             "png_create_info_struct() failed");
+    return NULL;
+  }
+
+  if (setjmp(png_jmpbuf(ctx))) {
+    // ignore (the error message is stored in ptr->error)
+
+  } else {
+    set_write_info(ptr, ctx, info, &zp);
+
+    png_set_write_fn(ctx,
+                     (png_voidp)&ptr->out,
+                     (png_rw_ptr)sink_write_data,
+                     (png_flush_ptr)sink_flush_data);
+
+    /*
+     * :filter を指定した場合も自前のフィルタ処理を使う。インタレースは
+     * 並列化(及びリスタートポイント、自前のフィルタ処理)の対象外
+     * (libpng で処理する)
+     */
+    if ((ptr->threads > 1 || ptr->restart || ptr->fast || ptr->optimize ||
+         ptr->filter != FILTER_DEFAULT) &&
+        ptr->i_meth == PNG_INTERLACE_NONE) {
+      encode_parallel(ptr, ctx, info, &pd, &zp);
+
+    } else {
+      if (ptr->out.flush_rows > 0) png_set_flush(ctx, ptr->out.flush_rows);
+
+      png_set_rows(ctx, info, ptr->rows);
+      png_write_png(ctx, info, PNG_TRANSFORM_IDENTITY, NULL);
+    }
+
+    sink_flush_data(ctx);
+  }
+
+  // longjmp で戻ってきた場合もここで解放する
+  pdeflate_free(&pd);
+  png_destroy_write_struct(&ctx, &info);
+
+  return NULL;
+}
+
+/*
+ * 出力サイズの見積り(deflateBound 相当の上限値にチャンクのオーバーヘッドを
+ * 加えたもの)。出力先はこの大きさで確保しておき、最後に一度だけ縮小する。
+ */
+static size_t
+estimate_output_size(png_encoder_t* ptr)
+{
+  size_t ret;
+  size_t raw;
+  size_t zbuf;
+  int i;
+
+  raw  = ((size_t)ptr->width * ptr->num_comp + 1) * ptr->height;
+
+  if (ptr->i_meth == PNG_INTERLACE_ADAM7) {
+    raw += ptr->height;
+  }
+
+  /*
+   * 窓サイズやメモリレベルを既定値より小さくした場合は compressBound() が
+   * 上限にならないので、zlib の deflateBound() と同じ保守的な式を使う
+   */
+  if (ptr->c_window == 15 && ptr->c_mem >= 8) {
+    ret = compressBound(raw);
+  } else {
+    ret = raw + (raw >> 3) + (raw >> 8) + (raw >> 9) + 4 + 6;
+  }
+
+  zbuf = (ptr->idat_size > 0)? ptr->idat_size: PNG_ZBUF_SIZE;
+
+  ret += ((ret / zbuf) + 1) * 12;                 // IDAT
+  ret += 8 + 25 + 12;                             // signature, IHDR, IEND
+
+  if (ptr->with_time) ret += 19;                  // tIME
+  if (!isnan(ptr->gamma)) ret += 16;              // gAMA
+
+  for (i = 0; i < ptr->num_text; i++) {           // tEXt
+    ret += 12 + strlen(ptr->text[i].key) + 1 + ptr->text[i].text_length;
+  }
+
+  return ret;
+}
+
+static void
+encode_prepare(png_encoder_t* ptr)
+{
+  png_uint_32 i;
+  png_byte* bytes;
+
+  // #encode_to では出力先(fd)は設定済み
+  if (!ptr->out.to_fd) {
+    sink_setup(&ptr->out, ptr->obuf, estimate_output_size(ptr));
+  }
+
+  grow_row_buf(&ptr->rows, &ptr->rows_capa, ptr->height);
+
+  bytes = (png_byte*)ptr->in.ptr + ptr->offset;
+  for (i = 0; i < ptr->height; i++) {
+    ptr->rows[i] = bytes;
+    bytes += ptr->stride;
+  }
+}
+
+/*
+ * :filter に手続きを指定した場合は、行毎のフィルタをエンコードの前に
+ * (GVL を保持した状態で)決めておく。手続きには行のデータと行番号を渡す。
+ */
+static VALUE
+set_row_filters(VALUE arg)
+{
+  png_encoder_t* ptr;
+  uint8_t* buf;
+  VALUE row;
+  VALUE exc;
+  png_uint_32 y;
+  int type;
+
+  ptr = (png_encoder_t*)arg;
+
+  if (ptr->filter != FILTER_CALLBACK) return Qnil;
+
+  if (ptr->row_filters_capa < ptr->height) {
+    buf = (uint8_t*)realloc(ptr->row_filters, ptr->height);
+    if (buf == NULL) NOMEMORY_ERROR("no memory");
+
+    ptr->row_filters      = buf;
+    ptr->row_filters_capa = ptr->height;
+  }
+
+  for (y = 0; y < ptr->height; y++) {
+    row = rb_str_new((const char*)ptr->rows[y],
+                     (long)ptr->width * ptr->num_comp);
+    exc = get_filter_type(rb_funcall(ptr->filter_proc,
+                                     rb_intern("call"), 2, row, UINT2NUM(y)),
+                          &type);
+    if (RTEST(exc)) rb_exc_raise(exc);
+
+    ptr->row_filters[y] = (uint8_t)type;
+  }
+
+  return Qnil;
+}
+
+/*
+ * エンコード結果の取り出し(エラーの場合は例外オブジェクトを返す)
+ */
+static VALUE
+encode_finish(png_encoder_t* ptr)
+{
+  VALUE ret;
+
+  if (ptr->error[0] != '\0') {
+    ret = create_runtime_error("%s", ptr->error);
+
+  } else {
+    ret = sink_finish(&ptr->out, ptr->obuf);
+
+    if (RB_TYPE_P(ret, T_STRING)) {
+      rb_ivar_set(ret, rb_intern("warn"), warn_buf_to_ary(&ptr->warn));
+    }
+  }
+
+  return ret;
+}
+
+static VALUE
+encode_body(VALUE arg)
+{
+  VALUE ret;
+  png_encoder_t* ptr;
+
+  /*
+   * initialize
+   */
+  ptr = (png_encoder_t*)arg;
+
+  /*
+   * prepare
+   */
+  encode_prepare(ptr);
+  set_row_filters((VALUE)ptr);
+
+  /*
+   * do encode (without GVL)
+   *
+   * 出力先の拡張(GVL が必要)が起こり得る場合はワーカスレッドでは行わない
+   */
+  if (ptr->out.str == Qnil || ptr->out.size >= estimate_output_size(ptr)) {
+    call_without_gvl(encode_nogvl, ptr);
+  } else {
+    rb_thread_call_without_gvl(encode_nogvl, ptr, RUBY_UBF_PROCESS, NULL);
+  }
+
+  /*
+   * post process
+   */
+  ret = encode_finish(ptr);
+  if (rb_obj_is_kind_of(ret, rb_eException)) rb_exc_raise(ret);
+
+  return ret;
+}
+
+static VALUE
+encode_ensure(VALUE arg)
+{
+  png_encoder_t* ptr;
+
+  ptr = (png_encoder_t*)arg;
+
+  sink_release(&ptr->out, ptr->obuf);
+  source_release(&ptr->in);
+  CLR_DATA(ptr);
+
+  // #encode で一時的に変更したサイズを元に戻す
+  set_encoder_size(ptr, ptr->conf_width, ptr->conf_height);
+
+  ptr->busy = 0;
+
+  return Qundef;
+}
+
+static VALUE
+check_data_size(png_encoder_t* ptr, size_t size)
+{
+  VALUE ret;
+
+  ret = Qnil;
+
+  if (size < ptr->data_size) {
+    ret = create_argument_error("image data too short");
+
+  } else if (size > ptr->data_size && !ptr->partial) {
+    ret = create_argument_error("image data too large");
+  }
+
+  return ret;
+}
+
+static VALUE
+rb_encoder_encode(int argc, VALUE* argv, VALUE self)
+{
+  static ID keys[4];
+
+  png_encoder_t* ptr;
+  VALUE data;
+  VALUE out;
+  VALUE opts;
+  VALUE vals[4];
+  VALUE exc;
+  long wd;
+  long ht;
+
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "11:", &data, &out, &opts);
+
+  if (!keys[0]) {
+    keys[0] = rb_intern_const("width");
+    keys[1] = rb_intern_const("height");
+    keys[2] = rb_intern_const("offset");
+    keys[3] = rb_intern_const("region");
+  }
+
+  rb_get_kwargs(opts, keys, 0, 4, vals);
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, png_encoder_t, &png_encoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  if (ptr->busy) {
+    RUNTIME_ERROR("encoder is busy");
+  }
+
+  wd = (vals[0] == Qundef)? (long)ptr->conf_width: NUM2LONG(vals[0]);
+  ht = (vals[1] == Qundef)? (long)ptr->conf_height: NUM2LONG(vals[1]);
+
+  /*
+   * GVL 解放中に他のスレッドから変更されても影響を受けない様に、
+   * 入力データは凍結した共有文字列として(バッファの場合はロックして)
+   * 保持しておく。
+   */
+  data = source_bind(&ptr->in, data);
+
+  exc = set_encoder_size(ptr, wd, ht);
+  if (!RTEST(exc)) exc = set_encoder_region(ptr, vals[2], vals[3]);
+  if (!RTEST(exc)) exc = check_data_size(ptr, ptr->in.size);
+
+  if (RTEST(exc)) {
+    source_release(&ptr->in);
+    set_encoder_size(ptr, ptr->conf_width, ptr->conf_height);
+    rb_exc_raise(exc);
+  }
+
+  /*
+   * prepare
+   */
+  ptr->busy = !0;
+
+  SET_DATA(ptr, data, out);
+  memset(&ptr->out, 0, sizeof(ptr->out));
+
+  /*
+   * do encode
+   */
+  return rb_ensure(encode_body, (VALUE)ptr, encode_ensure, (VALUE)ptr);
+}
+
+/*
+ * ファイルへの直接出力(PNG::Encoder#encode_to)
+ *
+ * エンコード結果を文字列に溜めず、固定長の書き込みバッファ経由で fd に
+ * 書き出す。出力先にパスを与えた場合はここで開いて閉じる。IO を与えた
+ * 場合は Ruby 側のバッファを先に書き出してから、その fd に直接書き込む。
+ */
+#define DEFAULT_WRITE_BUFFER        (64 * 1024)
+
+typedef struct {
+  png_encoder_t* ptr;
+  VALUE dst;
+  VALUE data;
+  size_t bufsize;
+  int flush_rows;
+} encode_to_arg_t;
+
+static VALUE
+encode_to_body(VALUE _arg)
+{
+  encode_to_arg_t* arg;
+  png_encoder_t* ptr;
+  VALUE exc;
+  VALUE path;
+  int fd;
+  int owned;
+
+  arg = (encode_to_arg_t*)_arg;
+  ptr = arg->ptr;
+
+  /*
+   * bind input
+   */
+  ptr->ibuf = source_bind(&ptr->in, arg->data);
+
+  exc = check_data_size(ptr, ptr->in.size);
+  if (RTEST(exc)) rb_exc_raise(exc);
+
+  /*
+   * open destination
+   */
+  if (rb_obj_is_kind_of(arg->dst, rb_cIO)) {
+    arg->dst = rb_io_get_write_io(arg->dst);
+
+    rb_io_flush(arg->dst);
+
+    fd    = NUM2INT(rb_funcall(arg->dst, rb_intern("fileno"), 0));
+    owned = 0;
+
+  } else {
+    path = arg->dst;
+    FilePathValue(path);
+
+    fd = rb_cloexec_open(StringValueCStr(path),
+                         O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      rb_sys_fail_str(path);
+    }
+
+    owned = !0;
+  }
+
+  sink_setup_fd(&ptr->out, fd, owned, arg->bufsize);
+  ptr->out.flush_rows = arg->flush_rows;
+
+  /*
+   * do encode
+   */
+  return encode_body((VALUE)ptr);
+}
+
+static VALUE
+rb_encoder_encode_to(int argc, VALUE* argv, VALUE self)
+{
+  static ID keys[2];
+
+  png_encoder_t* ptr;
+  VALUE opts;
+  VALUE vals[2];
+  encode_to_arg_t arg;
+
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "2:", &arg.dst, &arg.data, &opts);
+
+  if (!keys[0]) {
+    keys[0] = rb_intern_const("buffer_size");
+    keys[1] = rb_intern_const("flush_rows");
+  }
+
+  rb_get_kwargs(opts, keys, 0, 2, vals);
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, png_encoder_t, &png_encoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  if (ptr->busy) {
+    RUNTIME_ERROR("encoder is busy");
+  }
+
+  arg.ptr        = ptr;
+  arg.bufsize    = DEFAULT_WRITE_BUFFER;
+  arg.flush_rows = 0;
+
+  if (vals[0] != Qundef && !NIL_P(vals[0])) {
+    if (NUM2LONG(vals[0]) <= 0) {
+      RANGE_ERROR(":buffer_size is not positive");
+    }
+
+    arg.bufsize = NUM2SIZET(vals[0]);
+  }
+
+  if (vals[1] != Qundef && !NIL_P(vals[1])) {
+    if (NUM2INT(vals[1]) <= 0) {
+      RANGE_ERROR(":flush_rows is not positive");
+    }
+
+    arg.flush_rows = NUM2INT(vals[1]);
+  }
+
+  /*
+   * do encode
+   *
+   * 入力の取り出しと出力先のオープンも rb_ensure() の内側で行う
+   * (途中で例外が発生した場合の後始末は encode_ensure() に任せる)
+   */
+  ptr->busy = !0;
+
+  SET_DATA(ptr, Qnil, Qnil);
+  memset(&ptr->in, 0, sizeof(ptr->in));
+  memset(&ptr->out, 0, sizeof(ptr->out));
+  ptr->out.str = Qnil;
+
+  return rb_ensure(encode_to_body, (VALUE)&arg, encode_ensure, (VALUE)ptr);
+}
+
+/*
+ * バッチエンコード(PNG::Encoder.encode_many)
+ *
+ * 各ジョブの準備(入力の確認と出力先の確保)と結果の取り出しは GVL を確保した
+ * 状態で行い、エンコードそのものは GVL を解放してスレッドプールで行う。
+ * ジョブ毎のエラーは例外オブジェクトとして結果に格納する。
+ */
+typedef struct {
+  VALUE jobs;
+  VALUE ret;
+  png_encoder_t** items;   // NULL for the failed jobs
+  long num;
+  int threads;
+} batch_enc_t;
+
+/*
+ * 出力先の確保と行毎のフィルタの決定(例外が発生し得るので rb_protect() の
+ * 内側で行う)
+ */
+static VALUE
+batch_enc_setup(VALUE arg)
+{
+  encode_prepare((png_encoder_t*)arg);
+  set_row_filters(arg);
+
+  return Qnil;
+}
+
+static VALUE
+batch_enc_prepare(VALUE _job)
+{
+  VALUE job;
+  VALUE enc;
+  VALUE data;
+  VALUE exc;
+  png_encoder_t* ptr;
+  int state;
+
+  job = rb_check_array_type(_job);
+
+  if (NIL_P(job) || RARRAY_LEN(job) != 2) {
+    ARGUMENT_ERROR("job must be [encoder, data]");
+  }
+
+  enc  = RARRAY_AREF(job, 0);
+  data = RARRAY_AREF(job, 1);
+
+  TypedData_Get_Struct(enc, png_encoder_t, &png_encoder_data_type, ptr);
+
+  if (ptr->busy) {
+    RUNTIME_ERROR("encoder is busy");
+  }
+
+  data = source_bind(&ptr->in, data);
+
+  exc = check_data_size(ptr, ptr->in.size);
+  if (RTEST(exc)) {
+    source_release(&ptr->in);
+    rb_exc_raise(exc);
+  }
+
+  SET_DATA(ptr, data, Qnil);
+  memset(&ptr->out, 0, sizeof(ptr->out));
+  ptr->out.str = Qnil;
+
+  rb_protect(batch_enc_setup, (VALUE)ptr, &state);
+  if (state) {
+    sink_release(&ptr->out, Qnil);
+    source_release(&ptr->in);
+    CLR_DATA(ptr);
+    rb_jump_tag(state);
+  }
+
+  ptr->busy = !0;
+
+  // 変換後の配列を返す(以降は元のジョブを参照しない)
+  return job;
+}
+
+static void
+batch_enc_job(void* _arg, int idx)
+{
+  batch_enc_t* arg;
+
+  arg = (batch_enc_t*)_arg;
+
+  if (arg->items[idx]) encode_nogvl(arg->items[idx]);
+}
+
+static void*
+batch_enc_nogvl(void* _arg)
+{
+  batch_enc_t* arg;
+
+  arg = (batch_enc_t*)_arg;
+
+  parallel_for(arg->threads, (int)arg->num, batch_enc_job, arg);
+
+  return NULL;
+}
+
+static VALUE
+batch_enc_body(VALUE _arg)
+{
+  batch_enc_t* arg;
+  VALUE job;
+  long i;
+  int state;
+
+  arg = (batch_enc_t*)_arg;
+
+  for (i = 0; i < arg->num; i++) {
+    job = RARRAY_AREF(arg->jobs, i);
+
+    // 生成に失敗したジョブとして渡された例外はそのまま結果にする
+    if (rb_obj_is_kind_of(job, rb_eException)) {
+      rb_ary_store(arg->ret, i, job);
+      continue;
+    }
+
+    job = rb_protect(batch_enc_prepare, job, &state);
+
+    if (state == 0) {
+      // #to_ary で変換した配列はエンコーダを GC から守るために保持する
+      rb_ary_store(arg->jobs, i, job);
+      TypedData_Get_Struct(RARRAY_AREF(job, 0), png_encoder_t,
+                           &png_encoder_data_type, arg->items[i]);
+
+    } else {
+      rb_ary_store(arg->ret, i, rb_errinfo());
+      rb_set_errinfo(Qnil);
+    }
+  }
+
+  call_without_gvl(batch_enc_nogvl, arg);
+
+  for (i = 0; i < arg->num; i++) {
+    if (arg->items[i]) {
+      rb_ary_store(arg->ret, i, encode_finish(arg->items[i]));
+    }
+  }
+
+  return arg->ret;
+}
+
+static VALUE
+batch_enc_ensure(VALUE _arg)
+{
+  batch_enc_t* arg;
+  long i;
+
+  arg = (batch_enc_t*)_arg;
+
+  for (i = 0; i < arg->num; i++) {
+    if (arg->items[i]) encode_ensure((VALUE)arg->items[i]);
+  }
+
+  xfree(arg->items);
+
+  return Qundef;
+}
+
+static VALUE
+rb_encoder_s_encode_many(int argc, VALUE* argv, VALUE self)
+{
+  static ID keys[1];
+
+  batch_enc_t arg;
+  VALUE jobs;
+  VALUE opts;
+  VALUE vals[1];
+  VALUE exc;
+  VALUE ret;
+
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "1:", &jobs, &opts);
+
+  if (!keys[0]) {
+    keys[0] = rb_intern_const("threads");
+  }
+
+  rb_get_kwargs(opts, keys, 0, 1, vals);
+
+  /*
+   * argument check
+   */
+  Check_Type(jobs, T_ARRAY);
+
+  exc = eval_threads((vals[0] == Qundef)? Qtrue: vals[0], &arg.threads);
+  if (RTEST(exc)) rb_exc_raise(exc);
+
+  /*
+   * do encode
+   */
+  arg.jobs  = rb_ary_dup(jobs);
+  arg.num   = RARRAY_LEN(arg.jobs);
+  arg.ret   = rb_ary_new_capa(arg.num);
+  arg.items = ZALLOC_N(png_encoder_t*, arg.num);
+
+  ret = rb_ensure(batch_enc_body, (VALUE)&arg, batch_enc_ensure, (VALUE)&arg);
+
+  RB_GC_GUARD(arg.jobs);
+
+  return ret;
+}
+
+#define WRITER_START                1
+#define WRITER_ROWS                 2
+#define WRITER_END                  3
+
+typedef struct {
+  png_encoder_t* ptr;
+  int op;
+  VALUE data;
+  int done;
+} writer_arg_t;
+
+static void*
+writer_nogvl(void* _arg)
+{
+  writer_arg_t* arg;
+  png_encoder_t* ptr;
+  png_writer_t* wr;
+  png_byte* p;
+  png_uint_32 n;
+  zparam_t zp;
+
+  arg = (writer_arg_t*)_arg;
+  ptr = arg->ptr;
+  wr  = ptr->writer;
+
+  if (setjmp(png_jmpbuf(wr->ctx))) {
+    // ignore (the error message is stored in ptr->error)
+
+  } else {
+    switch (arg->op) {
+    case WRITER_START:
+      init_zparam(ptr, &zp);
+      set_write_info(ptr, wr->ctx, wr->info, &zp);
+      png_write_info(wr->ctx, wr->info);
+      break;
+
+    case WRITER_ROWS:
+      p = (png_byte*)RSTRING_PTR(arg->data);
+      n = RSTRING_LEN(arg->data) / ptr->stride;
+
+      while (n-- > 0) {
+        png_write_row(wr->ctx, p);
+        p += ptr->stride;
+        wr->rows++;
+      }
+      break;
+
+    case WRITER_END:
+      png_write_end(wr->ctx, wr->info);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+writer_flush(png_writer_t* wr)
+{
+  VALUE data;
+
+  if (wr->out.pos > 0) {
+    data = rb_str_new((const char*)wr->out.ptr, wr->out.pos);
+    wr->out.pos = 0;
+
+    if (wr->io != Qnil) {
+      rb_funcall(wr->io, rb_intern("write"), 1, data);
+    } else {
+      rb_funcall(wr->proc, rb_intern("call"), 1, data);
+    }
+  }
+}
+
+static VALUE
+writer_body(VALUE _arg)
+{
+  writer_arg_t* arg;
+  png_encoder_t* ptr;
+
+  arg = (writer_arg_t*)_arg;
+  ptr = arg->ptr;
+
+  ptr->error[0] = '\0';
+
+  rb_thread_call_without_gvl(writer_nogvl, arg, RUBY_UBF_PROCESS, NULL);
+
+  if (ptr->error[0] != '\0') {
+    rb_exc_raise(create_runtime_error("%s", ptr->error));
+  }
+
+  writer_flush(ptr->writer);
+
+  arg->done = !0;
+
+  return Qnil;
+}
+
+static VALUE
+writer_ensure(VALUE _arg)
+{
+  writer_arg_t* arg;
+  png_encoder_t* ptr;
+
+  arg = (writer_arg_t*)_arg;
+  ptr = arg->ptr;
+
+  /*
+   * 失敗した場合と書き込みを終えた場合はストリームを破棄する
+   */
+  if (!arg->done || arg->op == WRITER_END) {
+    writer_free(ptr->writer);
+    ptr->writer = NULL;
+  }
+
+  warn_buf_clear(&ptr->warn);
+
+  ptr->busy = 0;
+
+  return Qundef;
+}
+
+static void
+writer_call(png_encoder_t* ptr, int op, VALUE data)
+{
+  writer_arg_t arg;
+
+  ptr->busy = !0;
+
+  arg.ptr  = ptr;
+  arg.op   = op;
+  arg.data = data;
+  arg.done = 0;
+
+  rb_ensure(writer_body, (VALUE)&arg, writer_ensure, (VALUE)&arg);
+
+  RB_GC_GUARD(data);
+}
+
+static png_encoder_t*
+get_idle_encoder(VALUE self)
+{
+  png_encoder_t* ptr;
+
+  TypedData_Get_Struct(self, png_encoder_t, &png_encoder_data_type, ptr);
+
+  if (ptr->busy) {
+    RUNTIME_ERROR("encoder is busy");
+  }
+
+  return ptr;
+}
+
+static VALUE
+rb_encoder_start(int argc, VALUE* argv, VALUE self)
+{
+  png_encoder_t* ptr;
+  png_writer_t* wr;
+  VALUE io;
+  VALUE proc;
+
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "01&", &io, &proc);
+
+  /*
+   * strip object
+   */
+  ptr = get_idle_encoder(self);
+
+  /*
+   * argument check
+   */
+  if (ptr->writer != NULL) {
+    RUNTIME_ERROR("stream already started");
+  }
+
+  if (io == Qnil && proc == Qnil) {
+    ARGUMENT_ERROR("destination not specified");
+  }
+
+  if (ptr->i_meth != PNG_INTERLACE_NONE) {
+    ARGUMENT_ERROR("interlace is not supported by row streaming");
+  }
+
+  if (ptr->filter == FILTER_CALLBACK) {
+    ARGUMENT_ERROR("per-row :filter is not supported by row streaming");
+  }
+
+  if (ptr->fast) {
+    ARGUMENT_ERROR(":fast is not supported by row streaming");
+  }
+
+  if (ptr->optimize) {
+    ARGUMENT_ERROR(":optimize is not supported by row streaming");
+  }
+
+  /*
+   * create writer
+   */
+  wr = (png_writer_t*)malloc(sizeof(png_writer_t));
+  if (wr == NULL) NOMEMORY_ERROR("no memory");
+
+  memset(wr, 0, sizeof(*wr));
+
+  wr->io   = io;
+  wr->proc = (io == Qnil)? proc: Qnil;
+
+  wr->ctx  = create_write_struct(ptr);
+  if (wr->ctx == NULL) {
+    free(wr);
+    RUNTIME_ERROR("png_create_write_struct() failed");
+  }
+
+  wr->info = png_create_info_struct(wr->ctx);
+  if (wr->info == NULL) {
+    writer_free(wr);
+    RUNTIME_ERROR("png_create_info_struct() failed");
+  }
+
+  png_set_write_fn(wr->ctx,
+                   (png_voidp)&wr->out,
+                   (png_rw_ptr)mem_io_write_data,
+                   (png_flush_ptr)mem_io_flush);
+
+  ptr->writer = wr;
+
+  /*
+   * write header
+   */
+  writer_call(ptr, WRITER_START, Qnil);
+
+  return self;
+}
+
+static VALUE
+rb_encoder_write_rows(VALUE self, VALUE data)
+{
+  png_encoder_t* ptr;
+  size_t n;
+
+  /*
+   * strip object
+   */
+  ptr = get_idle_encoder(self);
+
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+
+  if (ptr->writer == NULL) {
+    RUNTIME_ERROR("stream not started");
+  }
+
+  if (RSTRING_LEN(data) % ptr->stride != 0) {
+    ARGUMENT_ERROR("data size is not a multiple of the stride");
+  }
+
+  n = RSTRING_LEN(data) / ptr->stride;
+
+  if (ptr->writer->rows + n > ptr->height) {
+    ARGUMENT_ERROR("too many rows");
+  }
+
+  /*
+   * write rows
+   */
+  writer_call(ptr, WRITER_ROWS, rb_str_new_frozen(data));
+
+  return self;
+}
+
+static VALUE
+rb_encoder_finish(VALUE self)
+{
+  VALUE ret;
+  png_encoder_t* ptr;
+
+  /*
+   * strip object
+   */
+  ptr = get_idle_encoder(self);
+
+  /*
+   * argument check
+   */
+  if (ptr->writer == NULL) {
+    RUNTIME_ERROR("stream not started");
+  }
+
+  if (ptr->writer->rows < ptr->height) {
+    writer_free(ptr->writer);
+    ptr->writer = NULL;
+
+    RUNTIME_ERROR("rows not enough");
+  }
+
+  /*
+   * write trailer
+   */
+  ret = ptr->writer->io;
+
+  writer_call(ptr, WRITER_END, Qnil);
+
+  return ret;
+}
+
+static void
+rb_decoder_mark(void* _ptr)
+{
+  png_decoder_t* ptr;
+
+  ptr = (png_decoder_t*)_ptr;
+
+  if (ptr->common.stream != NULL) {
+    if (ptr->common.stream->proc != Qnil) {
+      rb_gc_mark(ptr->common.stream->proc);
+    }
+
+    if (ptr->common.stream->obuf != Qnil) {
+      rb_gc_mark(ptr->common.stream->obuf);
+    }
+  }
+}
+
+static png_byte**
+get_row_buf(png_decoder_t* ptr, size_t height)
+{
+  return grow_row_buf(&ptr->common.row_buf, &ptr->common.row_capa, height);
+}
+
+static void
+stream_free(png_stream_t* st)
+{
+  if (st->ctx != NULL) {
+    png_destroy_read_struct(&st->ctx, &st->info, NULL);
+  }
+
+  free(st);
+}
+
+static void
+rb_decoder_free(void* _ptr)
+{
+  png_decoder_t* ptr;
+
+  ptr = (png_decoder_t*)_ptr;
+
+  /*
+   * 中断されたまま捨てられた外部イテレータ(#each_row)は簡易APIの場合でも
+   * classic側のコンテキストを保持している
+   */
+  if (ptr->common.api_type == API_SIMPLIFIED &&
+      ptr->simplified.ctx == &ptr->simplified.image) {
+    png_image_free(ptr->simplified.ctx);
+
+  } else {
+    if (ptr->classic.ctx != NULL) {
+      png_destroy_read_struct(&ptr->classic.ctx,
+                              &ptr->classic.fsi,
+                              &ptr->classic.bsi);
+    }
+  }
+
+  if (ptr->common.stream != NULL) {
+    stream_free(ptr->common.stream);
+  }
+
+  if (ptr->common.row_buf != NULL) {
+    free(ptr->common.row_buf);
+  }
+
+  pool_clear(&ptr->common.pool);
+  warn_buf_clear(&ptr->common.warn);
+
+  free(ptr);
+}
+
+static size_t
+rb_decoder_size(const void* _ptr)
+{
+  size_t ret;
+
+  ret = sizeof(png_decoder_t);
+
+  return ret;
+}
+
+#if RUBY_API_VERSION_CODE > 20600
+static const rb_data_type_t png_decoder_data_type = {
+  "libpng-ruby decoder object",      // wrap_struct_name
   {
-    rb_encoder_mark,                 // function.dmark
-    rb_encoder_free,                 // function.dfree
-    rb_encoder_size,                 // function.dsize
+    rb_decoder_mark,                 // function.dmark
+    rb_decoder_free,                 // function.dfree
+    rb_decoder_size,                 // function.dsize
     NULL,                            // function.dcompact
     {NULL},                          // function.reserved
   },
@@ -418,12 +4562,12 @@ static const rb_data_type_t png_encoder_data_type = {
   (VALUE)RUBY_TYPED_FREE_IMMEDIATELY // flags
 };
 #else /* RUBY_API_VERSION_CODE > 20600 */
-static const rb_data_type_t png_encoder_data_type = {
-  "libpng-ruby encoder object",     // wrap_struct_name
+static const rb_data_type_t png_decoder_data_type = {
+  "libpng-ruby decoder object",      // wrap_struct_name
   {
-    rb_encoder_mark,                 // function.dmark
-    rb_encoder_free,                 // function.dfree
-    rb_encoder_size,                 // function.dsize
+    rb_decoder_mark,                 // function.dmark
+    rb_decoder_free,                 // function.dfree
+    rb_decoder_size,                 // function.dsize
     {NULL, NULL},                    // function.reserved
   },
   NULL,                              // parent
@@ -432,1418 +4576,3565 @@ static const rb_data_type_t png_encoder_data_type = {
 };
 #endif /* RUBY_API_VERSION_CODE > 20600 */
 
+static VALUE
+rb_decoder_alloc(VALUE self)
+{
+  png_decoder_t* ptr;
+
+  ptr = ALLOC(png_decoder_t);
+  memset(ptr, 0, sizeof(*ptr));
+
+  ptr->common.api_type      = API_SIMPLIFIED;
+  ptr->common.format        = PNG_FORMAT_RGB;
+  ptr->common.need_meta     = !0;
+  ptr->common.display_gamma = NAN;
+  ptr->common.threads       = 1;
+  ptr->common.scale_denom   = 1;
+
+  return TypedData_Wrap_Struct(decoder_klass, &png_decoder_data_type, ptr);
+}
+
+static VALUE
+eval_decoder_opt_api_type(png_decoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int type;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    type = API_SIMPLIFIED;
+    break;
+
+  case T_STRING:
+  case T_SYMBOL:
+    if (EQ_STR(opt, "simplified")) {
+      type = API_SIMPLIFIED;
+
+    } else if (EQ_STR(opt, "classic")) {
+      type = API_CLASSIC;
+
+    } else {
+      ret = create_argument_error(":api_type invalid value");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":api_type invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->common.api_type = type;
+
+  return ret;
+}
+
+static VALUE
+eval_decoder_opt_pixel_format(png_decoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int format;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    format = PNG_FORMAT_RGB;
+    break;
+
+  case T_STRING:
+  case T_SYMBOL:
+    if (EQ_STR(opt, "GRAY") || EQ_STR(opt, "GRAYSCALE")) {
+      format = PNG_FORMAT_GRAY;
+
+    } else if (EQ_STR(opt, "GA")) {
+      format = PNG_FORMAT_GA;
+
+    } else if (EQ_STR(opt, "AG")) {
+      format = PNG_FORMAT_AG;
+
+    } else if (EQ_STR(opt, "RGB")) {
+      format = PNG_FORMAT_RGB;
+
+    } else if (EQ_STR(opt, "BGR")) {
+      format = PNG_FORMAT_BGR;
+
+    } else if (EQ_STR(opt, "RGBA")) {
+      format = PNG_FORMAT_RGBA;
+
+    } else if (EQ_STR(opt, "ARGB")) {
+      format = PNG_FORMAT_ARGB;
+
+    } else if (EQ_STR(opt, "BGRA")) {
+      format = PNG_FORMAT_BGRA;
+
+    } else if (EQ_STR(opt, "ABGR")) {
+      format = PNG_FORMAT_ABGR;
+
+    } else {
+      ret = create_argument_error(":pixel_format invalid value");
+    }
+    break;
+
+  default:
+    ret = create_type_error(":pixel_format invalid type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->common.format = format;
+
+  return ret;
+}
+
+static VALUE
+eval_decoder_opt_without_meta(png_decoder_t* ptr, VALUE opt)
+{
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    ptr->common.need_meta = !0;
+    break;
+
+  default:
+    ptr->common.need_meta = !RTEST(opt);
+    break;
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_decoder_opt_display_gamma(png_decoder_t* ptr, VALUE opt)
+{
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    ptr->common.display_gamma = NAN;
+    break;
+
+  default:
+    ptr->common.display_gamma = NUM2DBL(opt);
+    break;
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_decoder_opt_threads(png_decoder_t* ptr, VALUE opt)
+{
+  return eval_threads(opt, &ptr->common.threads);
+}
+
+static VALUE
+eval_decoder_opt_scale_denom(png_decoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+  case T_NIL:
+    ptr->common.scale_denom = 1;
+    break;
+
+  case T_FIXNUM:
+    switch (FIX2INT(opt)) {
+    case 1:
+    case 2:
+    case 4:
+    case 8:
+      ptr->common.scale_denom = FIX2INT(opt);
+      break;
+
+    default:
+      ret = create_argument_error(":scale_denom invalid value");
+      break;
+    }
+    break;
+
+  default:
+    ret = create_type_error(":scale_denom invalid type");
+    break;
+  }
+
+  return ret;
+}
+
+static VALUE
+set_decoder_context(png_decoder_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  VALUE opts[N(decoder_opt_ids)];
+
+  /*
+   * initialize
+   */
+  ret = Qnil;
+
+  /*
+   * parse options
+   */
+  do {
+    rb_get_kwargs(opt, decoder_opt_ids, 0, N(decoder_opt_ids), opts);
+
+    ret = eval_decoder_opt_api_type(ptr, opts[2]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_opt_pixel_format(ptr, opts[0]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_opt_without_meta(ptr, opts[1]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_opt_display_gamma(ptr, opts[3]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_opt_threads(ptr, opts[4]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_opt_scale_denom(ptr, opts[5]);
+    if (RTEST(ret)) break;
+  } while (0);
+
+  return ret;
+}
+
+static VALUE
+rb_decoder_initialize(int argc, VALUE* argv, VALUE self)
+{
+  png_decoder_t* ptr;
+  VALUE exc;
+  VALUE opts;
+
+  /*
+   * initialize
+   */
+  exc = Qnil;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, png_decoder_t, &png_decoder_data_type, ptr);
+
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  /*
+   * set context
+   */
+  exc = set_decoder_context(ptr, opts);
+
+  /*
+   * post process
+   */
+  if (RTEST(exc)) rb_exc_raise(exc);
+
+  return Qtrue;
+}
+
+static void
+decode_error(png_structp ctx, png_const_charp msg)
+{
+  png_decoder_t* ptr;
+
+  ptr = (png_decoder_t*)png_get_error_ptr(ctx);
+
+  snprintf(ptr->common.error, sizeof(ptr->common.error),
+           "decode error:%s", msg);
+
+  longjmp(png_jmpbuf(ctx), 1);
+}
+
+static void
+decode_warn(png_structp ctx, png_const_charp msg)
+{
+  png_decoder_t* ptr;
+
+  ptr = (png_decoder_t*)png_get_error_ptr(ctx);
+
+  warn_buf_push(&ptr->common.warn, msg);
+}
+
+
+static void
+set_format_transform(png_decoder_t* ptr, png_structp ctx, png_infop info)
+{
+  int format;
+  int c_type;
+  int alpha;
+  png_color_16 bg;
+
+  format = ptr->common.format;
+  c_type = png_get_color_type(ctx, info);
+  alpha  = ((c_type & PNG_COLOR_MASK_ALPHA) ||
+            png_get_valid(ctx, info, PNG_INFO_tRNS));
+
+  png_set_expand(ctx);
+  png_set_scale_16(ctx);
+
+  if (format & PNG_FORMAT_FLAG_COLOR) {
+    if (!(c_type & PNG_COLOR_MASK_COLOR)) png_set_gray_to_rgb(ctx);
+
+  } else {
+    if (c_type & PNG_COLOR_MASK_COLOR) {
+      png_set_rgb_to_gray_fixed(ctx, 1, -1, -1);
+    }
+  }
+
+  if (format & PNG_FORMAT_FLAG_ALPHA) {
+    if (!alpha) {
+      png_set_add_alpha(ctx, 0xff, (format & PNG_FORMAT_FLAG_AFIRST)?
+                                   PNG_FILLER_BEFORE: PNG_FILLER_AFTER);
+
+    } else if (format & PNG_FORMAT_FLAG_AFIRST) {
+      png_set_swap_alpha(ctx);
+    }
+
+  } else if (alpha) {
+    // simplified API と同じく黒を背景色として合成する
+    memset(&bg, 0, sizeof(bg));
+    png_set_background(ctx, &bg, PNG_BACKGROUND_GAMMA_SCREEN, 0, 1.0);
+  }
+
+  if (format & PNG_FORMAT_FLAG_BGR) png_set_bgr(ctx);
+}
+
+/*
+ * 行単位で読み出す API (#feed 等) で使用する変換の設定。simplified API を
+ * 指定している場合は :pixel_format の形式(8bit)に、classic API を指定して
+ * いる場合は decode と同じく PNG の格納形式のまま出力する。
+ */
+static void
+set_read_transform(png_decoder_t* ptr, png_structp ctx, png_infop info)
+{
+  double file_gamma;
+
+  if (ptr->common.api_type == API_SIMPLIFIED) {
+    set_format_transform(ptr, ctx, info);
+
+  } else if (!isnan(ptr->common.display_gamma)) {
+    if (!png_get_gAMA(ctx, info, &file_gamma)) {
+      file_gamma = 0.45;
+    }
+
+    png_set_gamma(ctx, ptr->common.display_gamma, file_gamma);
+  }
+}
+
+static png_structp
+create_read_struct(png_decoder_t* ptr)
+{
+  return png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+                                  ptr,
+                                  decode_error,
+                                  decode_warn,
+                                  &ptr->common.pool,
+                                  pool_malloc,
+                                  pool_free);
+}
+
+static void
+set_read_context(png_decoder_t* ptr, VALUE data)
+{
+  VALUE exc;
+  png_structp ctx;
+  png_infop fsi;
+  png_infop bsi;
+
+  do {
+    exc = Qnil;
+    ctx = NULL;
+    fsi = NULL;
+    bsi = NULL;
+
+    ctx = create_read_struct(ptr);
+    if (ctx == NULL) {
+      exc = create_runtime_error("png_create_read_struct() failed");
+      break;
+    }
+
+    fsi = png_create_info_struct(ctx);
+    if (fsi == NULL) {
+      exc = create_runtime_error("png_create_info_struct() failed");
+      break;
+    }
+
+    bsi = png_create_info_struct(ctx);
+    if (bsi == NULL) {
+      exc = create_runtime_error("png_create_info_struct() failed");
+      break;
+    }
+
+    ptr->classic.ctx     = ctx;
+    ptr->classic.fsi     = fsi;
+    ptr->classic.bsi     = bsi;
+
+    ptr->common.error[0] = '\0';
+
+    ptr->classic.io.ptr  = (uint8_t*)RSTRING_PTR(data);
+    ptr->classic.io.size = RSTRING_LEN(data);
+    ptr->classic.io.pos  = 0;
+
+    png_set_read_fn(ptr->classic.ctx,
+                    (png_voidp)&ptr->classic.io,
+                    (png_rw_ptr)mem_io_read_data);
+  } while(0);
+
+  if (RTEST(exc)) {
+    if (ctx != NULL) {
+      png_destroy_read_struct(&ctx, &fsi, &bsi);
+    }
+
+    rb_exc_raise(exc);
+  }
+}
+
+static void
+get_header_info(png_decoder_t* ptr)
+{
+  png_get_IHDR(ptr->classic.ctx,
+               ptr->classic.fsi,
+               &ptr->classic.width,
+               &ptr->classic.height,
+               &ptr->classic.depth,
+               &ptr->classic.c_type,
+               &ptr->classic.i_meth,
+               &ptr->classic.c_meth,
+               &ptr->classic.f_meth); 
+
+  png_get_tIME(ptr->classic.ctx, ptr->classic.fsi, &ptr->classic.time);
+
+  png_get_text(ptr->classic.ctx,
+               ptr->classic.fsi,
+               &ptr->classic.text,
+               &ptr->classic.num_text);
+
+  if (!png_get_gAMA(ptr->classic.ctx,
+                    ptr->classic.fsi, &ptr->classic.file_gamma)) {
+    ptr->classic.file_gamma = NAN;
+  }
+}
+
+static VALUE
+get_color_type_str(int c_type)
+{
+  const char* cstr;
+  char tmp[32];
+
+  switch (c_type) {
+  case PNG_COLOR_TYPE_GRAY:
+    cstr = "GRAY";
+    break;
+
+  case PNG_COLOR_TYPE_PALETTE:
+    cstr = "PALETTE";
+    break;
+
+  case PNG_COLOR_TYPE_RGB:
+    cstr = "RGB";
+    break;
+
+  case PNG_COLOR_TYPE_RGBA:
+    cstr = "RGBA";
+    break;
+
+  case PNG_COLOR_TYPE_GRAY_ALPHA:
+    cstr = "GA";
+    break;
+
+  default:
+    sprintf(tmp, "UNKNOWN(%d)", c_type);
+    cstr = tmp;
+    break;
+  }
+
+  return FROZEN_STR(cstr);
+}
+
+static VALUE
+get_interlace_method_str(int i_meth)
+{
+  const char* cstr;
+  char tmp[32];
+
+  switch (i_meth) {
+  case PNG_INTERLACE_NONE:
+    cstr = "NONE";
+    break;
+
+  case PNG_INTERLACE_ADAM7:
+    cstr = "ADAM7";
+    break;
+
+  default:
+    sprintf(tmp, "UNKNOWN(%d)", i_meth);
+    cstr = tmp;
+    break;
+  }
+
+  return FROZEN_STR(cstr);
+}
+
+static VALUE
+get_compression_method_str(int c_meth)
+{
+  const char* cstr;
+  char tmp[32];
+
+  switch (c_meth) {
+  case PNG_COMPRESSION_TYPE_BASE:
+    cstr = "BASE";
+    break;
+
+  default:
+    sprintf(tmp, "UNKNOWN(%d)", c_meth);
+    cstr = tmp;
+    break;
+  }
+
+  return FROZEN_STR(cstr);
+}
+
+static VALUE
+get_filter_method_str(int f_meth)
+{
+  const char* cstr;
+  char tmp[32];
+
+  switch (f_meth) {
+  case PNG_FILTER_TYPE_BASE:
+    cstr = "BASE";
+    break;
+
+  case PNG_INTRAPIXEL_DIFFERENCING:
+    cstr = "INTRAPIXEL_DIFFERENCING";
+    break;
+
+  default:
+    sprintf(tmp, "UNKNOWN(%d)", f_meth);
+    cstr = tmp;
+    break;
+  }
+
+  return FROZEN_STR(cstr);
+}
+
+/*
+ * text と time は参照されるまで Ruby のオブジェクトに変換しない。
+ * デコード時には libpng から取り出した内容をバイト列のまま Meta の隠し
+ * インスタンス変数(id_lazy)に保持しておき、最初のアクセス時に変換する。
+ */
+static VALUE
+pack_text_meta(png_decoder_t* ptr)
+{
+  VALUE ret;
+  size_t len;
+  int i;
+
+  ret = rb_str_buf_new(0);
+
+  for (i = 0; i < ptr->classic.num_text; i++) {
+    len = ptr->classic.text[i].text_length;
+
+    rb_str_cat(ret, ptr->classic.text[i].key,
+               strlen(ptr->classic.text[i].key) + 1);
+    rb_str_cat(ret, (const char*)&len, sizeof(len));
+    rb_str_cat(ret, ptr->classic.text[i].text, len);
+  }
+
+  return ret;
+}
+
+static VALUE
+unpack_text_meta(VALUE src)
+{
+  VALUE ret;
+  const char* p;
+  const char* tail;
+  char key[80];
+  size_t len;
+  size_t i;
+
+  ret  = rb_hash_new();
+  p    = RSTRING_PTR(src);
+  tail = p + RSTRING_LEN(src);
+
+  while (p < tail) {
+    /*
+     * キーワードは小文字に変換し、空白を '_' に置き換えてシンボル化する
+     */
+    for (i = 0; p[i] != '\0' && i < sizeof(key) - 1; i++) {
+      key[i] = (p[i] == ' ')? '_': (char)tolower((unsigned char)p[i]);
+    }
+
+    key[i] = '\0';
+    p     += strlen(p) + 1;
+
+    memcpy(&len, p, sizeof(len));
+    p     += sizeof(len);
+
+    rb_hash_aset(ret,
+                 ID2SYM(rb_intern(key)),
+                 rb_str_freeze(rb_str_new(p, len)));
+
+    p     += len;
+  }
+
+  rb_obj_freeze(ret);
+
+  return ret;
+}
+
+static VALUE
+unpack_time_meta(VALUE src)
+{
+  VALUE ret;
+  png_time tm;
+
+  memcpy(&tm, RSTRING_PTR(src), sizeof(tm));
+
+  ret = rb_funcall(rb_cTime,
+                   id_utc,
+                   6,
+                   INT2FIX(tm.year),
+                   INT2FIX(tm.month),
+                   INT2FIX(tm.day),
+                   INT2FIX(tm.hour),
+                   INT2FIX(tm.minute),
+                   INT2FIX(tm.second));
+
+  rb_funcall(ret, id_localtime, 0);
+
+  rb_obj_freeze(ret);
+
+  return ret;
+}
+
+static VALUE
+get_lazy_meta(VALUE self, long idx, VALUE (*unpack)(VALUE))
+{
+  VALUE lazy;
+  VALUE ret;
+
+  lazy = rb_attr_get(self, id_lazy);
+  if (NIL_P(lazy)) return Qnil;
+
+  ret = RARRAY_AREF(lazy, idx);
+
+  if (RB_TYPE_P(ret, T_STRING)) {
+    ret = (*unpack)(ret);
+
+    /*
+     * Ractor.make_shareable() 等で凍結されている場合はキャッシュせずに
+     * 都度変換する
+     */
+    if (!OBJ_FROZEN(lazy)) rb_ary_store(lazy, idx, ret);
+  }
+
+  return ret;
+}
+
+static VALUE
+rb_meta_text(VALUE self)
+{
+  return get_lazy_meta(self, 0, unpack_text_meta);
+}
+
+static VALUE
+rb_meta_time(VALUE self)
+{
+  return get_lazy_meta(self, 1, unpack_time_meta);
+}
+
+static VALUE
+create_meta(png_decoder_t* ptr)
+{
+  VALUE ret;
+  VALUE text;
+  VALUE time;
+
+  ret = rb_obj_alloc(meta_klass);
+
+  rb_ivar_set(ret, id_width, INT2FIX(ptr->classic.width));
+  rb_ivar_set(ret, id_height, INT2FIX(ptr->classic.height));
+  rb_ivar_set(ret, id_depth, INT2FIX(ptr->classic.depth));
+  rb_ivar_set(ret, id_ctype, get_color_type_str(ptr->classic.c_type));
+  rb_ivar_set(ret, id_imeth, get_interlace_method_str(ptr->classic.i_meth));
+  rb_ivar_set(ret, id_cmeth, get_compression_method_str(ptr->classic.c_meth));
+  rb_ivar_set(ret, id_fmeth, get_filter_method_str(ptr->classic.f_meth));
+
+  if (ptr->classic.text || ptr->classic.time) {
+    text = (ptr->classic.text)? pack_text_meta(ptr): Qnil;
+    time = (ptr->classic.time)?
+              rb_str_new((const char*)ptr->classic.time, sizeof(png_time)):
+              Qnil;
+
+    rb_ivar_set(ret, id_lazy, rb_assoc_new(text, time));
+  }
+
+  if (!isnan(ptr->classic.file_gamma)) {
+    rb_ivar_set(ret, id_gamma, DBL2NUM(ptr->classic.file_gamma));
+  }
+
+  rb_obj_freeze(ret);
+
+  return ret;
+}
+
+static VALUE
+create_tiny_meta(png_image* img)
+{
+  VALUE ret;
+  const char* fmt;
+  int nc;
+
+  ret = rb_obj_alloc(meta_klass);
+
+  rb_ivar_set(ret, id_width, INT2FIX(img->width));
+  rb_ivar_set(ret, id_stride, INT2FIX(PNG_IMAGE_ROW_STRIDE(*img)));
+  rb_ivar_set(ret, id_height, INT2FIX(img->height));
+
+  switch (img->format) {
+  case PNG_FORMAT_GRAY:
+    fmt = "GRAY";
+    nc  = 1;
+    break;
+
+  case PNG_FORMAT_GA:
+    fmt = "GA";
+    nc  = 2;
+    break;
+
+  case PNG_FORMAT_AG:
+    fmt = "AG";
+    nc  = 2;
+    break;
+
+  case PNG_FORMAT_RGB:
+    fmt = "RGB";
+    nc  = 3;
+    break;
+
+  case PNG_FORMAT_BGR:
+    fmt = "BGR";
+    nc  = 3;
+    break;
+
+  case PNG_FORMAT_RGBA:
+    fmt = "RGBA";
+    nc  = 4;
+    break;
+
+  case PNG_FORMAT_ARGB:
+    fmt = "ARGB";
+    nc  = 4;
+    break;
+
+  case PNG_FORMAT_BGRA:
+    fmt = "BGRA";
+    nc  = 4;
+    break;
+
+  case PNG_FORMAT_ABGR:
+    fmt = "ABGR";
+    nc  = 4;
+    break;
+
+  default:
+    fmt = "unknown";
+    nc  = 0;
+    break;
+  }
+
+  rb_ivar_set(ret, id_pixfmt, FROZEN_STR(fmt));
+  rb_ivar_set(ret, id_ncompo, INT2FIX(nc));
+
+  rb_obj_freeze(ret);
+
+  return ret;
+}
+
+static void
+clear_read_context(png_decoder_t* ptr)
+{
+  if (ptr->classic.ctx != NULL) {
+    png_destroy_read_struct(&ptr->classic.ctx,
+                            &ptr->classic.fsi,
+                            &ptr->classic.bsi);
+
+    ptr->classic.ctx  = NULL;
+    ptr->classic.fsi  = NULL;
+    ptr->classic.bsi  = NULL;
+
+    ptr->classic.text = NULL;
+    ptr->classic.time = NULL;
+  }
+
+  ptr->classic.io.ptr  = NULL;
+  ptr->classic.io.size = 0;
+  ptr->classic.io.pos  = 0;
+}
+
+typedef struct {
+  png_decoder_t* ptr;
+  VALUE data;
+} read_header_arg_t ;
+
+static VALUE
+read_header_body(VALUE _arg)
+{
+  read_header_arg_t* arg;
+  png_decoder_t* ptr;
+  VALUE data;
+
+  /*
+   * initialize
+   */
+  arg  = (read_header_arg_t*)_arg;
+  ptr  = arg->ptr;
+  data = arg->data;
+
+  /*
+   * set context
+   */
+  set_read_context(ptr, data);
+
+  /*
+   * read header
+   */
+  if (setjmp(png_jmpbuf(ptr->classic.ctx))) {
+    rb_exc_raise(create_runtime_error("%s", ptr->common.error));
+
+  } else {
+    png_read_info(ptr->classic.ctx, ptr->classic.fsi);
+    get_header_info(ptr);
+  }
+
+  return create_meta(ptr);
+}
+
+static VALUE
+read_header_ensure(VALUE _arg)
+{
+  png_decoder_t* ptr;
+
+  ptr = (png_decoder_t*)_arg;
+
+  clear_read_context(ptr);
+  warn_buf_clear(&ptr->common.warn);
+
+  ptr->common.busy = 0;
+
+  return Qundef;
+}
+
+static VALUE
+rb_decoder_read_header(VALUE self, VALUE data)
+{
+  VALUE ret;
+  png_decoder_t* ptr;
+  read_header_arg_t arg;
+
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+
+  if (RSTRING_LEN(data) < 8) {
+    RUNTIME_ERROR("data too short.");
+  }
+
+  if (png_sig_cmp((png_const_bytep)RSTRING_PTR(data), 0, 8)) {
+    RUNTIME_ERROR("Invalid PNG signature.");
+  }
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, png_decoder_t, &png_decoder_data_type, ptr);
+
+  if (ptr->common.busy) {
+    RUNTIME_ERROR("decoder is busy");
+  }
+
+  /*
+   * call read header funciton
+   */
+  ptr->common.busy = !0;
+
+  arg.ptr  = ptr;
+  arg.data = data;
+
+  ret = rb_ensure(read_header_body, (VALUE)&arg,
+                  read_header_ensure, (VALUE)ptr);
+
+  return ret;
+}
+
+/*
+ * IHDR の直接解析(PNG.probe)
+ *
+ * libpng の構造体を作らずに、先頭 33 バイト(シグネチャと IHDR)だけを
+ * 読んで CRC と値を検査する。チャンク表を求められた場合は各チャンクの
+ * ヘッダ(長さと種別)だけを辿る(IHDR 以外の CRC は検査しない)。
+ */
+#define IHDR_END                    (8 + 8 + 13 + 4)
+
+typedef struct {
+  png_uint_32 width;
+  png_uint_32 height;
+  int depth;
+  int c_type;
+  int i_meth;
+  int c_meth;
+  int f_meth;
+} ihdr_t;
+
+static png_uint_32
+get_be32(const uint8_t* p)
+{
+  return ((png_uint_32)p[0] << 24) | ((png_uint_32)p[1] << 16) |
+         ((png_uint_32)p[2] << 8) | (png_uint_32)p[3];
+}
+
+static int
+get_num_components(int c_type)
+{
+  switch (c_type) {
+  case PNG_COLOR_TYPE_GRAY_ALPHA:
+    return 2;
+
+  case PNG_COLOR_TYPE_RGB:
+    return 3;
+
+  case PNG_COLOR_TYPE_RGBA:
+    return 4;
+
+  default:
+    return 1;
+  }
+}
+
+/*
+ * 成功時は NULL、失敗時はエラーメッセージを返す
+ */
+static const char*
+parse_ihdr(const uint8_t* p, size_t size, ihdr_t* dst)
+{
+  int ok;
+
+  if (size < 8 || png_sig_cmp((png_const_bytep)p, 0, 8)) {
+    return "Invalid PNG signature.";
+  }
+
+  if (size < IHDR_END) {
+    return "data too short.";
+  }
+
+  if (get_be32(p + 8) != 13 || memcmp(p + 12, "IHDR", 4)) {
+    return "IHDR not found.";
+  }
+
+  if (crc32(0, p + 12, 4 + 13) != get_be32(p + 29)) {
+    return "IHDR CRC error.";
+  }
+
+  dst->width  = get_be32(p + 16);
+  dst->height = get_be32(p + 20);
+  dst->depth  = p[24];
+  dst->c_type = p[25];
+  dst->c_meth = p[26];
+  dst->f_meth = p[27];
+  dst->i_meth = p[28];
+
+  if (dst->width == 0 || dst->width > PNG_UINT_31_MAX ||
+      dst->height == 0 || dst->height > PNG_UINT_31_MAX) {
+    return "invalid image size.";
+  }
+
+  switch (dst->c_type) {
+  case PNG_COLOR_TYPE_GRAY:
+    ok = (dst->depth == 1 || dst->depth == 2 || dst->depth == 4 ||
+          dst->depth == 8 || dst->depth == 16);
+    break;
+
+  case PNG_COLOR_TYPE_PALETTE:
+    ok = (dst->depth == 1 || dst->depth == 2 || dst->depth == 4 ||
+          dst->depth == 8);
+    break;
+
+  case PNG_COLOR_TYPE_RGB:
+  case PNG_COLOR_TYPE_GRAY_ALPHA:
+  case PNG_COLOR_TYPE_RGBA:
+    ok = (dst->depth == 8 || dst->depth == 16);
+    break;
+
+  default:
+    ok = 0;
+    break;
+  }
+
+  if (!ok) {
+    return "invalid bit depth or color type.";
+  }
+
+  if (dst->i_meth > PNG_INTERLACE_ADAM7) {
+    return "invalid interlace method.";
+  }
+
+  return NULL;
+}
 
 static VALUE
-rb_encoder_alloc(VALUE self)
+create_ihdr_meta(ihdr_t* ihdr)
 {
-  png_encoder_t* ptr;
+  VALUE ret;
 
-  ptr = ALLOC(png_encoder_t);
-  memset(ptr, 0, sizeof(*ptr));
+  ret = rb_obj_alloc(meta_klass);
 
-  ptr->c_type    = PNG_COLOR_TYPE_RGB;
-  ptr->i_meth    = PNG_INTERLACE_NONE;
-  ptr->c_level   = Z_DEFAULT_COMPRESSION;
-  ptr->f_type    = PNG_FILTER_TYPE_BASE;
-  ptr->num_comp  = 3;
-  ptr->with_time = !0;
-  ptr->gamma     = NAN;
+  rb_ivar_set(ret, id_width, UINT2NUM(ihdr->width));
+  rb_ivar_set(ret, id_height, UINT2NUM(ihdr->height));
+  rb_ivar_set(ret, id_depth, INT2FIX(ihdr->depth));
+  rb_ivar_set(ret, id_ctype, get_color_type_str(ihdr->c_type));
+  rb_ivar_set(ret, id_imeth, get_interlace_method_str(ihdr->i_meth));
+  rb_ivar_set(ret, id_cmeth, get_compression_method_str(ihdr->c_meth));
+  rb_ivar_set(ret, id_fmeth, get_filter_method_str(ihdr->f_meth));
+  rb_ivar_set(ret, id_ncompo, INT2FIX(get_num_components(ihdr->c_type)));
+
+  return ret;
+}
+
+/*
+ * チャンク表([種別, 位置, データ長] の配列)の作成
+ */
+static VALUE
+probe_chunks_str(const uint8_t* p, size_t size)
+{
+  VALUE ret;
+  size_t pos;
+  png_uint_32 len;
+
+  ret = rb_ary_new();
+  pos = 8;
+
+  while (pos + 8 <= size) {
+    len = get_be32(p + pos);
+
+    if (len > PNG_UINT_31_MAX || pos + 12 + len > size) {
+      RUNTIME_ERROR("truncated chunk.");
+    }
+
+    rb_ary_push(ret, rb_ary_new_from_args(3,
+                                          rb_str_new((char*)p + pos + 4, 4),
+                                          SIZET2NUM(pos),
+                                          UINT2NUM(len)));
+
+    if (!memcmp(p + pos + 4, "IEND", 4)) break;
+
+    pos += 12 + len;
+  }
+
+  return ret;
+}
+
+static VALUE
+probe_read(VALUE io, long size)
+{
+  VALUE ret;
+
+  ret = rb_funcall(io, rb_intern("read"), 1, LONG2NUM(size));
+
+  if (NIL_P(ret)) {
+    ret = rb_str_new(NULL, 0);
+  }
+
+  StringValue(ret);
+
+  return ret;
+}
+
+static VALUE
+probe_chunks_io(VALUE io)
+{
+  VALUE ret;
+  VALUE tmp;
+  size_t pos;
+  png_uint_32 len;
+  int seek;
+  const uint8_t* p;
+
+  ret  = rb_ary_new();
+  seek = rb_obj_is_kind_of(io, rb_cFile);
+
+  // IHDR は読み込み済み
+  rb_ary_push(ret, rb_ary_new_from_args(3, rb_str_new_cstr("IHDR"),
+                                        INT2FIX(8), INT2FIX(13)));
+  pos = IHDR_END;
+
+  while (1) {
+    tmp = probe_read(io, 8);
+    if (RSTRING_LEN(tmp) == 0) break;
+
+    if (RSTRING_LEN(tmp) < 8) {
+      RUNTIME_ERROR("truncated chunk.");
+    }
+
+    p   = (const uint8_t*)RSTRING_PTR(tmp);
+    len = get_be32(p);
+
+    if (len > PNG_UINT_31_MAX) {
+      RUNTIME_ERROR("truncated chunk.");
+    }
+
+    rb_ary_push(ret, rb_ary_new_from_args(3,
+                                          rb_str_new((char*)p + 4, 4),
+                                          SIZET2NUM(pos),
+                                          UINT2NUM(len)));
+
+    if (!memcmp(p + 4, "IEND", 4)) break;
+
+    /*
+     * ファイルは読み飛ばす(seek は終端を越えても失敗しないので、途切れて
+     * いない事は CRC の最後の 1 バイトを読んで確かめる)
+     */
+    if (seek) {
+      rb_funcall(io, rb_intern("seek"), 2,
+                 LONG2NUM((long)len + 3), INT2FIX(SEEK_CUR));
+
+      if (RSTRING_LEN(probe_read(io, 1)) < 1) {
+        RUNTIME_ERROR("truncated chunk.");
+      }
+    } else {
+      tmp = probe_read(io, (long)len + 4);
+
+      if (RSTRING_LEN(tmp) < (long)len + 4) {
+        RUNTIME_ERROR("truncated chunk.");
+      }
+    }
+
+    pos += 12 + len;
+  }
+
+  return ret;
+}
+
+static VALUE
+rb_png_probe(int argc, VALUE* argv, VALUE self)
+{
+  static ID keys[1];
+
+  VALUE src;
+  VALUE opts;
+  VALUE chunks;
+  VALUE data;
+  VALUE ret;
+  const char* err;
+  ihdr_t ihdr;
+
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "1:", &src, &opts);
+
+  if (!keys[0]) {
+    keys[0] = rb_intern_const("chunks");
+  }
+
+  rb_get_kwargs(opts, keys, 0, 1, &chunks);
+
+  /*
+   * read IHDR
+   */
+  if (RB_TYPE_P(src, T_STRING)) {
+    data = src;
+  } else if (rb_respond_to(src, rb_intern("read"))) {
+    data = probe_read(src, IHDR_END);
+  } else {
+    TYPE_ERROR("data must be String or IO");
+  }
+
+  err = parse_ihdr((const uint8_t*)RSTRING_PTR(data), RSTRING_LEN(data), &ihdr);
+  if (err != NULL) {
+    RUNTIME_ERROR(err);
+  }
+
+  ret = create_ihdr_meta(&ihdr);
+
+  /*
+   * chunk table
+   */
+  if (chunks != Qundef && RTEST(chunks)) {
+    if (data == src) {
+      rb_ivar_set(ret, id_chunks,
+                  probe_chunks_str((const uint8_t*)RSTRING_PTR(data),
+                                   RSTRING_LEN(data)));
+    } else {
+      rb_ivar_set(ret, id_chunks, probe_chunks_io(src));
+    }
+  }
+
+  RB_GC_GUARD(data);
+
+  return rb_obj_freeze(ret);
+}
+
+/*
+ * ヘッダの一括読み込み(PNG.scan_headers)
+ *
+ * 各ファイルの先頭(既定では 64KiB)だけを pread() で読み込み、ワーカ
+ * スレッドで png_read_info() を行う。Ruby のオブジェクト(PNG::Meta または
+ * 例外オブジェクト)は全てのファイルを処理した後に GVL を確保した状態で
+ * まとめて生成する。IDAT までのチャンクが先頭に収まらない場合は、読み込む
+ * 大きさを倍にして読み直す(上限 16MiB)。
+ */
+#define SCAN_PREFIX                 (64 * 1024)
+#define SCAN_PREFIX_MAX             (16 * 1024 * 1024)
+
+typedef struct {
+  const char* path;
+  int err;                    // errno of open/read (0: success)
+  char error[ERR_MSG_SIZE];   // libpng error message
+  mem_io_t io;
+  int short_read;             // libpng ran out of the read data
+
+  ihdr_t ihdr;
+  double gamma;
+  int has_time;
+  png_time time;
+  char* text;                 // packed as pack_text_meta()
+  size_t text_size;
+  int has_text;
+} scan_item_t;
+
+typedef struct {
+  VALUE paths;
+  VALUE ret;
+  scan_item_t* items;
+  long num;
+  int threads;
+} scan_arg_t;
+
+static void
+scan_error(png_structp ctx, png_const_charp msg)
+{
+  scan_item_t* item;
+
+  item = (scan_item_t*)png_get_error_ptr(ctx);
+
+  snprintf(item->error, sizeof(item->error), "%s", msg);
+
+  longjmp(png_jmpbuf(ctx), 1);
+}
+
+static void
+scan_warn(png_structp ctx, png_const_charp msg)
+{
+  // ignore
+}
+
+static void
+scan_read_data(png_structp ctx, png_bytep dst, png_size_t size)
+{
+  scan_item_t* item;
+
+  item = (scan_item_t*)png_get_io_ptr(ctx);
+
+  if (item->io.pos + size > item->io.size) {
+    item->short_read = !0;
+    png_error(ctx, "data not enough.");
+  }
+
+  memcpy(dst, item->io.ptr + item->io.pos, size);
+  item->io.pos += size;
+}
+
+static void
+scan_pack_text(png_structp ctx, scan_item_t* item, png_text* text, int num)
+{
+  size_t size;
+  size_t len;
+  char* p;
+  int i;
+
+  size = 0;
+
+  for (i = 0; i < num; i++) {
+    size += strlen(text[i].key) + 1 + sizeof(len) + text[i].text_length;
+  }
+
+  item->text = (char*)malloc(size + 1);
+  if (item->text == NULL) png_error(ctx, "no memory");
+
+  p = item->text;
+
+  for (i = 0; i < num; i++) {
+    len = text[i].text_length;
+
+    memcpy(p, text[i].key, strlen(text[i].key) + 1);
+    p += strlen(text[i].key) + 1;
+
+    memcpy(p, &len, sizeof(len));
+    p += sizeof(len);
+
+    memcpy(p, text[i].text, len);
+    p += len;
+  }
+
+  item->text_size = size;
+  item->has_text  = !0;
+}
+
+static int
+scan_parse(scan_item_t* item, uint8_t* buf, size_t size)
+{
+  png_structp ctx;
+  png_infop info;
+  png_text* text;
+  png_time* time;
+  int num;
+  int ret;
+
+  item->error[0]   = '\0';
+  item->short_read = 0;
+  item->has_time   = 0;
+  item->has_text   = 0;
+  item->gamma      = NAN;
+
+  if (item->text != NULL) {
+    free(item->text);
+    item->text = NULL;
+  }
+
+  ctx = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                               item, scan_error, scan_warn);
+  if (ctx == NULL) {
+    snprintf(item->error, sizeof(item->error),
+             "png_create_read_struct() failed");
+    return -1;
+  }
+
+  info = png_create_info_struct(ctx);
+  if (info == NULL) {
+    png_destroy_read_struct(&ctx, NULL, NULL);
+    snprintf(item->error, sizeof(item->error),
+             "png_create_info_struct() failed");
+    return -1;
+  }
+
+  if (setjmp(png_jmpbuf(ctx))) {
+    ret = -1;
+
+  } else {
+    item->io.ptr  = buf;
+    item->io.size = size;
+    item->io.pos  = 0;
+
+    png_set_read_fn(ctx, item, (png_rw_ptr)scan_read_data);
+    png_read_info(ctx, info);
+
+    png_get_IHDR(ctx, info,
+                 &item->ihdr.width,
+                 &item->ihdr.height,
+                 &item->ihdr.depth,
+                 &item->ihdr.c_type,
+                 &item->ihdr.i_meth,
+                 &item->ihdr.c_meth,
+                 &item->ihdr.f_meth);
+
+    if (png_get_tIME(ctx, info, &time)) {
+      item->time     = *time;
+      item->has_time = !0;
+    }
+
+    if (png_get_text(ctx, info, &text, &num) > 0) {
+      scan_pack_text(ctx, item, text, num);
+    }
+
+    if (!png_get_gAMA(ctx, info, &item->gamma)) {
+      item->gamma = NAN;
+    }
+
+    ret = 0;
+  }
+
+  png_destroy_read_struct(&ctx, &info, NULL);
+
+  return ret;
+}
+
+static void
+scan_job(void* _arg, int idx)
+{
+  scan_arg_t* arg;
+  scan_item_t* item;
+  uint8_t* buf;
+  uint8_t* tmp;
+  size_t size;
+  size_t got;
+  ssize_t n;
+  int fd;
+
+  arg  = (scan_arg_t*)_arg;
+  item = arg->items + idx;
+
+#ifdef O_CLOEXEC
+  fd = open(item->path, O_RDONLY | O_CLOEXEC);
+#else /* defined(O_CLOEXEC) */
+  fd = open(item->path, O_RDONLY);
+#endif /* defined(O_CLOEXEC) */
+
+  if (fd < 0) {
+    item->err = errno;
+    return;
+  }
+
+  buf  = NULL;
+  size = SCAN_PREFIX;
+  got  = 0;
+  n    = 0;
+
+  while (1) {
+    tmp = (uint8_t*)realloc(buf, size);
+    if (tmp == NULL) {
+      item->err = ENOMEM;
+      break;
+    }
+
+    buf = tmp;
+
+    while (got < size) {
+#ifdef HAVE_PREAD
+      n = pread(fd, buf + got, size - got, (off_t)got);
+#else /* defined(HAVE_PREAD) */
+      n = read(fd, buf + got, size - got);
+#endif /* defined(HAVE_PREAD) */
+
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+
+      got += n;
+    }
+
+    if (n < 0) {
+      item->err = errno;
+      break;
+    }
+
+    if (scan_parse(item, buf, got) == 0) break;
+
+    // 先頭に収まらなかった場合のみ読み直す
+    if (!item->short_read || got < size || size >= SCAN_PREFIX_MAX) break;
+
+    size *= 2;
+  }
+
+  if (buf != NULL) free(buf);
+  close(fd);
+}
+
+static void*
+scan_nogvl(void* _arg)
+{
+  scan_arg_t* arg;
 
-  return TypedData_Wrap_Struct(encoder_klass, &png_encoder_data_type, ptr);
+  arg = (scan_arg_t*)_arg;
+
+  parallel_for(arg->threads, (int)arg->num, scan_job, arg);
+
+  return NULL;
 }
 
 static VALUE
-eval_encoder_opt_pixel_format(png_encoder_t* ptr, VALUE opt)
+create_scan_meta(scan_item_t* item)
 {
   VALUE ret;
-  int type;
-  int comp;
+  VALUE text;
+  VALUE time;
 
-  ret = Qnil;
+  ret = create_ihdr_meta(&item->ihdr);
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    type = PNG_COLOR_TYPE_RGB;
-    comp = 3;
-    break;
+  if (item->has_text || item->has_time) {
+    text = (item->has_text)? rb_str_new(item->text, item->text_size): Qnil;
+    time = (item->has_time)?
+              rb_str_new((const char*)&item->time, sizeof(png_time)):
+              Qnil;
 
-  case T_STRING:
-  case T_SYMBOL:
-    if (EQ_STR(opt, "GRAY") || EQ_STR(opt, "GRAYSCALE")) {
-      type = PNG_COLOR_TYPE_GRAY;
-      comp = 1;
+    rb_ivar_set(ret, id_lazy, rb_assoc_new(text, time));
+  }
 
-    } else if (EQ_STR(opt, "GA")) {
-      type = PNG_COLOR_TYPE_GA;
-      comp = 2;
+  if (!isnan(item->gamma)) {
+    rb_ivar_set(ret, id_gamma, DBL2NUM(item->gamma));
+  }
 
-    } else if (EQ_STR(opt, "RGB")) {
-      type = PNG_COLOR_TYPE_RGB;
-      comp = 3;
+  return rb_obj_freeze(ret);
+}
 
-    } else if (EQ_STR(opt, "RGBA")) {
-      type = PNG_COLOR_TYPE_RGBA;
-      comp = 4;
+static VALUE
+scan_body(VALUE _arg)
+{
+  scan_arg_t* arg;
+  scan_item_t* item;
+  VALUE path;
+  long i;
 
-    } else {
-      ret = create_argument_error(":pixel_format invalid value");
-    } 
-    break;
+  arg = (scan_arg_t*)_arg;
 
-  default:
-    ret = create_type_error(":pixel_format invalid type");
-    break;
-  }
+  call_without_gvl(scan_nogvl, arg);
 
-  if (!RTEST(ret)) {
-    ptr->c_type   = type;
-    ptr->num_comp = comp;
+  for (i = 0; i < arg->num; i++) {
+    item = arg->items + i;
+    path = RARRAY_AREF(arg->paths, i);
+
+    if (item->err != 0) {
+      rb_ary_push(arg->ret, rb_syserr_new_str(item->err, path));
+
+    } else if (item->error[0] != '\0') {
+      rb_ary_push(arg->ret, create_runtime_error("%s: %s",
+                                                 item->error,
+                                                 RSTRING_PTR(path)));
+
+    } else {
+      rb_ary_push(arg->ret, create_scan_meta(item));
+    }
   }
 
-  return ret;
+  return arg->ret;
 }
 
 static VALUE
-eval_encoder_opt_interlace(png_encoder_t* ptr, VALUE opt)
+scan_ensure(VALUE _arg)
 {
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    ptr->i_meth = PNG_INTERLACE_NONE;
-    break;
+  scan_arg_t* arg;
+  long i;
 
-  default:
-    ptr->i_meth = (RTEST(opt))? PNG_INTERLACE_ADAM7: PNG_INTERLACE_NONE;
-    break;
+  arg = (scan_arg_t*)_arg;
+
+  for (i = 0; i < arg->num; i++) {
+    if (arg->items[i].text != NULL) free(arg->items[i].text);
   }
 
-  return Qnil;
+  xfree(arg->items);
+
+  return Qundef;
 }
 
 static VALUE
-eval_encoder_opt_compression(png_encoder_t* ptr, VALUE opt)
+rb_png_scan_headers(int argc, VALUE* argv, VALUE self)
 {
+  static ID keys[1];
+
+  scan_arg_t arg;
+  VALUE paths;
+  VALUE opts;
+  VALUE vals[1];
+  VALUE exc;
+  VALUE path;
   VALUE ret;
-  int lv;
+  long i;
 
-  ret = Qnil;
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "1:", &paths, &opts);
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    lv = Z_DEFAULT_COMPRESSION;
-    break;
+  if (!keys[0]) {
+    keys[0] = rb_intern_const("threads");
+  }
 
-  case T_STRING:
-  case T_SYMBOL:
-    if (EQ_STR(opt, "NO_COMPRESSION")) {
-      lv = Z_NO_COMPRESSION;
+  rb_get_kwargs(opts, keys, 0, 1, vals);
 
-    } else if (EQ_STR(opt, "BEST_SPEED")) {
-      lv = Z_BEST_SPEED;
+  /*
+   * argument check
+   */
+  Check_Type(paths, T_ARRAY);
 
-    } else if (EQ_STR(opt, "BEST_COMPRESSION")) {
-      lv = Z_BEST_COMPRESSION;
+  exc = eval_threads((vals[0] == Qundef)? Qtrue: vals[0], &arg.threads);
+  if (RTEST(exc)) rb_exc_raise(exc);
 
-    } else if (EQ_STR(opt, "DEFAULT")) {
-      lv = Z_DEFAULT_COMPRESSION;
+  /*
+   * ワーカスレッドから参照するので、パスは凍結した複製として保持しておく
+   */
+  arg.num   = RARRAY_LEN(paths);
+  arg.paths = rb_ary_new_capa(arg.num);
+  arg.ret   = rb_ary_new_capa(arg.num);
 
-    } else {
-      ret = create_argument_error(":compress is invalid value");
-    }
-    break;
+  for (i = 0; i < arg.num; i++) {
+    path = RARRAY_AREF(paths, i);
+    FilePathValue(path);
 
-  case T_FIXNUM:
-    lv = FIX2INT(opt);
-    if (lv < 0 || lv > 9) {
-      ret = create_range_error(":compress out of range");
-    }
-    break;
+    path = rb_str_dup(path);
+    StringValueCStr(path);
 
-  default:
-    ret = create_type_error(":compress invalid type");
-    break;
+    rb_ary_push(arg.paths, rb_obj_freeze(path));
   }
 
-  if (!RTEST(ret)) {
-    ptr->c_level = lv;
+  arg.items = ZALLOC_N(scan_item_t, arg.num);
+
+  for (i = 0; i < arg.num; i++) {
+    arg.items[i].path = RSTRING_PTR(RARRAY_AREF(arg.paths, i));
   }
 
+  /*
+   * do scan
+   */
+  ret = rb_ensure(scan_body, (VALUE)&arg, scan_ensure, (VALUE)&arg);
+
+  RB_GC_GUARD(arg.paths);
+
   return ret;
 }
 
+/*
+ * デコード結果の生成。メタ情報を付ける場合は PNG::Image(String の
+ * サブクラス)として生成する(メタ情報は id_meta に保持する)。
+ */
 static VALUE
-capitalize(VALUE str)
+create_result(size_t size, int need_meta)
 {
-  VALUE tmp;
-  int i;
-
-  tmp = rb_str_split(rb_funcall(str, rb_intern("to_s"), 0), "_");
+  VALUE ret;
 
-  for (i = 0; i < RARRAY_LEN(tmp); i++) {
-    rb_funcall(RARRAY_AREF(tmp, i), rb_intern("capitalize!"), 0);
+  if (need_meta) {
+    ret = rb_obj_alloc(image_klass);
+    rb_str_modify_expand(ret, size);
+  } else {
+    ret = rb_str_buf_new(size);
   }
 
-  return rb_ary_join(tmp, rb_str_new_cstr(" "));
-}
+  rb_str_set_len(ret, size);
 
-struct convert_text_rb2c_arg {
-  VALUE src;
-  png_text* dst;
-};
+  return ret;
+}
 
 static VALUE
-convert_text_rb2c(VALUE _arg)
+rb_image_meta(VALUE self)
 {
-  struct convert_text_rb2c_arg* arg;
-  VALUE src;
-  png_text* dst;
-  VALUE keys;
-  int i;
-  VALUE key;
-  VALUE val;
+  return rb_attr_get(self, id_meta);
+}
 
-  arg  = (struct convert_text_rb2c_arg*)_arg;
-  src  = arg->src;
-  dst  = arg->dst;
+#ifdef SUPPORT_MEMORY_VIEW
+/*
+ * PNG::Image の MemoryView ([height, width, num_components] の三次元配列)
+ *
+ * 要素の大きさはメタ情報と文字列の長さから求める(8bit: "C", 16bit: "S>")。
+ * 1画素が1バイトに満たない画像や、メタ情報と長さが一致しない画像は公開
+ * しない。
+ */
+typedef struct {
+  ssize_t shape[3];
+  ssize_t strides[3];
+} image_view_t;
 
-  /*
-   * 途中で例外が発生する可能性があるので資源回収できる様に
-   * 0クリアを最初に済ませておく。
-   */
-  keys = rb_funcall(src, rb_intern("keys"), 0);
+static int
+image_view_dims(VALUE self, ssize_t* dims)
+{
+  VALUE meta;
+  VALUE tmp;
+  const char* ctype;
+  long wd;
+  long ht;
+  long nc;
+  long bytes;
 
-  for (i = 0; i < RARRAY_LEN(keys); i++) {
-    key  = rb_ary_entry(keys, i);
-    val  = rb_hash_aref(src, key);
+  meta = rb_attr_get(self, id_meta);
+  if (NIL_P(meta)) return 0;
 
-    if (TYPE(key) != T_STRING && TYPE(key) != T_SYMBOL) {
-      ARGUMENT_ERROR(":type is invalid structure");
-    }
+  wd = NUM2LONG(rb_attr_get(meta, id_width));
+  ht = NUM2LONG(rb_attr_get(meta, id_height));
 
-    if (TYPE(val) != T_STRING && TYPE(val) != T_SYMBOL) {
-      ARGUMENT_ERROR(":type is invalid structure");
-    }
+  tmp = rb_attr_get(meta, id_ncompo);
 
-    key = capitalize(key);
-    if (RSTRING_LEN(key) >= 0 && RSTRING_LEN(key) <= 79) {
-      dst[i].compression = PNG_TEXT_COMPRESSION_NONE;
-      dst[i].key         = clone_cstr(key);
-      dst[i].text        = clone_cstr(val);
-      dst[i].text_length = RSTRING_LEN(val);
+  if (!NIL_P(tmp)) {
+    nc = NUM2LONG(tmp);
 
+  } else {
+    // classic API のメタ情報には num_components が無いので色形式から求める
+    tmp = rb_attr_get(meta, id_ctype);
+    if (NIL_P(tmp)) return 0;
+
+    ctype = StringValueCStr(tmp);
+
+    if (!strcmp(ctype, "RGBA")) {
+      nc = 4;
+    } else if (!strcmp(ctype, "RGB")) {
+      nc = 3;
+    } else if (!strcmp(ctype, "GA")) {
+      nc = 2;
     } else {
-      ARGUMENT_ERROR("keyword in :text is too long");
+      nc = 1;
     }
   }
 
-  return Qnil;
+  if (wd <= 0 || ht <= 0 || nc <= 0) return 0;
+
+  bytes = RSTRING_LEN(self) / (wd * ht * nc);
+
+  if (bytes != 1 && bytes != 2) return 0;
+  if (RSTRING_LEN(self) != wd * ht * nc * bytes) return 0;
+
+  dims[0] = ht;
+  dims[1] = wd;
+  dims[2] = nc;
+  dims[3] = bytes;
+
+  return !0;
+}
+
+static bool
+image_view_get(VALUE self, rb_memory_view_t* view, int flags)
+{
+  image_view_t* iv;
+  ssize_t dims[4];
+  int readonly;
+
+  if (!image_view_dims(self, dims)) return false;
+
+  readonly = !(flags & RUBY_MEMORY_VIEW_WRITABLE);
+
+  if (!readonly) {
+    if (OBJ_FROZEN(self)) return false;
+    rb_str_modify(self);
+  }
+
+  if (!rb_memory_view_init_as_byte_array(view, self, RSTRING_PTR(self),
+                                         RSTRING_LEN(self), readonly)) {
+    return false;
+  }
+
+  iv = ALLOC(image_view_t);
+
+  iv->shape[0]   = dims[0];
+  iv->shape[1]   = dims[1];
+  iv->shape[2]   = dims[2];
+  iv->strides[2] = dims[3];
+  iv->strides[1] = dims[2] * dims[3];
+  iv->strides[0] = dims[1] * dims[2] * dims[3];
+
+  view->format           = (dims[3] == 1)? "C": "S>";
+  view->item_size        = dims[3];
+  view->item_desc.components = NULL;
+  view->item_desc.length = 0;
+  view->ndim             = 3;
+  view->shape            = iv->shape;
+  view->strides          = iv->strides;
+  view->private_data     = iv;
+
+  return true;
+}
+
+static bool
+image_view_release(VALUE self, rb_memory_view_t* view)
+{
+  xfree(view->private_data);
+
+  return true;
+}
+
+static bool
+image_view_available_p(VALUE self)
+{
+  ssize_t dims[4];
+
+  return image_view_dims(self, dims);
 }
 
+static const rb_memory_view_entry_t image_view_entry = {
+  image_view_get,
+  image_view_release,
+  image_view_available_p,
+};
+#endif /* defined(SUPPORT_MEMORY_VIEW) */
+
+#define DST_NONE                    0
+#define DST_STRING                  1
+#define DST_IO_BUFFER               2
+#define DST_MEMORY_VIEW             3
+
+typedef struct {
+  png_decoder_t* ptr;
+  VALUE data;
+  void* dst;
+
+  VALUE buf;         // output target (nil: allocate new String)
+  size_t offset;     // offset of the first row in the target
+  size_t stride;     // bytes per row in the target (0: packed)
+  int locked;        // kind of the locked target (DST_*)
+
+  int crop;          // decode only the region below (:region)
+  png_uint_32 rx;
+  png_uint_32 ry;
+  png_uint_32 rw;
+  png_uint_32 rh;
+  int npass;         // number of passes (1 or 7 if interlaced)
+  int depth;         // bits per pixel of the decoded rows
+  png_byte* scratch; // work rows for the region/scaled decode
+
+  int scale;         // denominator of the scale (:scale_denom)
+  png_uint_32 ow;    // output size of the region/scaled decode
+  png_uint_32 oh;
+
+#ifdef SUPPORT_MEMORY_VIEW
+  rb_memory_view_t view;
+#endif /* defined(SUPPORT_MEMORY_VIEW) */
+} decode_arg_t;
+
+/*
+ * 出力先の確保。呼び出し元から出力先が与えられている場合は、ヘッダから
+ * 求めた必要サイズを満たしているかを確認した上でロックして使用する
+ * (ロックは decode_*_ensure() から release_output() で解除する)。
+ */
 static VALUE
-eval_encoder_opt_text(png_encoder_t* ptr, VALUE opt)
+bind_output(decode_arg_t* arg, size_t row_bytes, size_t height)
 {
   VALUE ret;
-  png_text* text;
+  uint8_t* base;
   size_t size;
-  struct convert_text_rb2c_arg arg;
-  int state;
+  size_t need;
+  void* p;
 
-  ret   = Qnil;
-  text  = NULL;
-  size  = 0;
-  state = 0;
+  if (arg->stride == 0) {
+    arg->stride = row_bytes;
+  }
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    // ignore
-    break;
+  if (arg->stride < row_bytes) {
+    ARGUMENT_ERROR("stride is smaller than the row size");
+  }
 
-  case T_HASH:
-    size = RHASH_SIZE(opt);
-    if (size == 0) break;
+  need = arg->offset + (arg->stride * (height - 1)) + row_bytes;
 
-    text = (png_text*)malloc(sizeof(png_text) * size);
-    if (text == NULL) {
-      ret = create_memory_error();
-      break;
+  if (NIL_P(arg->buf)) {
+    ret  = create_result(need, arg->ptr->common.need_meta);
+    base = (uint8_t*)RSTRING_PTR(ret);
+    size = need;
+
+  } else if (RB_TYPE_P(arg->buf, T_STRING)) {
+    rb_str_modify(arg->buf);
+
+    ret  = arg->buf;
+    base = (uint8_t*)RSTRING_PTR(ret);
+    size = RSTRING_LEN(ret);
+
+    if (size >= need) {
+      rb_str_locktmp(ret);
+      arg->locked = DST_STRING;
     }
 
-    arg.src = opt;
-    arg.dst = text;
+#ifdef SUPPORT_IO_BUFFER
+  } else if (rb_obj_is_kind_of(arg->buf, rb_cIOBuffer)) {
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+    rb_io_buffer_get_bytes_for_writing(arg->buf, &p, &size);
+#else /* defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING) */
+    rb_io_buffer_get_mutable(arg->buf, &p, &size);
+#endif /* defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING) */
 
-    rb_protect(convert_text_rb2c, (VALUE)&arg, &state);
+    ret  = arg->buf;
+    base = (uint8_t*)p;
 
-    if (state != 0) {
-      ret = rb_errinfo();
-      rb_set_errinfo(Qnil);
-      text_info_free(text, size);
+    if (size >= need) {
+      rb_io_buffer_lock(ret);
+      arg->locked = DST_IO_BUFFER;
     }
-    break;
+#endif /* defined(SUPPORT_IO_BUFFER) */
 
-  default:
-    ret = create_type_error(":text invalid type");
-    break;
-  }
+#ifdef SUPPORT_MEMORY_VIEW
+  } else if (rb_memory_view_available_p(arg->buf)) {
+    if (!rb_memory_view_get(arg->buf,
+                            &arg->view, RUBY_MEMORY_VIEW_WRITABLE)) {
+      TYPE_ERROR("output buffer is not writable");
+    }
 
-  if (!RTEST(ret)) {
-    ptr->text     = text;
-    ptr->num_text = size;
-  }
+    arg->locked = DST_MEMORY_VIEW;
 
-  return ret;
-}
+    if (!view_is_contiguous(&arg->view)) {
+      ARGUMENT_ERROR("output buffer is not contiguous");
+    }
 
-static VALUE
-eval_encoder_opt_time(png_encoder_t* ptr, VALUE opt)
-{
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    ptr->with_time = !0;
-    break;
+    ret  = arg->buf;
+    base = (uint8_t*)arg->view.data;
+    size = arg->view.byte_size;
+#endif /* defined(SUPPORT_MEMORY_VIEW) */
 
-  default:
-    ptr->with_time = RTEST(opt);
-    break;
+  } else {
+    TYPE_ERROR("unsupported output buffer");
+  }
+
+  if (size < need) {
+    ARGUMENT_ERROR("output buffer too small");
   }
 
-  return Qnil;
+  arg->dst = base + arg->offset;
+
+  return ret;
 }
 
-static VALUE
-eval_encoder_opt_gamma(png_encoder_t* ptr, VALUE opt)
+static void
+release_output(decode_arg_t* arg)
 {
-  VALUE ret;
-  double gamma;
-
-  ret = Qnil;
+  switch (arg->locked) {
+  case DST_STRING:
+    rb_str_unlocktmp(arg->buf);
+    break;
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    gamma = NAN;
+#ifdef SUPPORT_IO_BUFFER
+  case DST_IO_BUFFER:
+    rb_io_buffer_unlock(arg->buf);
     break;
+#endif /* defined(SUPPORT_IO_BUFFER) */
 
-  case T_FIXNUM:
-  case T_FLOAT:
-  case T_RATIONAL:
-    gamma = NUM2DBL(opt);
+#ifdef SUPPORT_MEMORY_VIEW
+  case DST_MEMORY_VIEW:
+    rb_memory_view_release(&arg->view);
     break;
+#endif /* defined(SUPPORT_MEMORY_VIEW) */
 
   default:
-    ret = create_type_error(":gamma invalid type");
     break;
   }
 
-  if (!RTEST(ret)) ptr->gamma = gamma;
+  arg->locked = DST_NONE;
+}
 
-  return ret;
+static void*
+decode_simplified_api_nogvl(void* _arg)
+{
+  decode_arg_t* arg;
+  png_decoder_t* ptr;
+
+  arg = (decode_arg_t*)_arg;
+  ptr = arg->ptr;
+
+  /*
+   * アルファチャネルを落とす場合、背景色を指定しないと出力バッファの
+   * 内容(未初期化)に対して合成されてしまうので黒を背景色として指定する。
+   */
+  png_image_finish_read(ptr->simplified.ctx,
+                        &black_background,
+                        arg->dst,
+                        arg->stride / PNG_IMAGE_PIXEL_COMPONENT_SIZE(
+                                          ptr->simplified.ctx->format),
+                        NULL);
+
+  return NULL;
 }
 
 static VALUE
-eval_encoder_opt_stride(png_encoder_t* ptr, VALUE opt)
+decode_simplified_api_body(VALUE _arg)
 {
   VALUE ret;
-  png_uint_32 stride;
 
-  ret = Qnil;
+  decode_arg_t* arg;
+  png_decoder_t* ptr;
+  VALUE data;
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    stride = ptr->width * ptr->num_comp;
-    break;
+  /*
+   * initialize
+   */
+  arg  = (decode_arg_t*)_arg;
+  ptr  = arg->ptr;
+  data = arg->data;
 
-  case T_FIXNUM:
-    if (FIX2LONG(opt) >= (ptr->width * ptr->num_comp)) {
-      stride = FIX2LONG(opt);
+  /*
+   * call simplified API
+   */
+  do {
+    ptr->simplified.ctx = &ptr->simplified.image;
+    memset(ptr->simplified.ctx, 0, sizeof(png_image));
 
-    } else {
-      ret = create_argument_error(":stride too little");
+    ptr->simplified.ctx->version = PNG_IMAGE_VERSION;
+
+    png_image_begin_read_from_memory(ptr->simplified.ctx,
+                                     RSTRING_PTR(data), RSTRING_LEN(data));
+    if (PNG_IMAGE_FAILED(*ptr->simplified.ctx)) {
+      RUNTIME_ERROR("png_image_begin_read_from_memory() failed");
     }
-    break;
 
-  default:
-    ret = create_type_error(":stride invalid type");
-    break;
-  }
+    ptr->simplified.ctx->format = ptr->common.format;
+
+    ret = bind_output(arg,
+                      PNG_IMAGE_ROW_STRIDE(*ptr->simplified.ctx) *
+                      PNG_IMAGE_PIXEL_COMPONENT_SIZE(ptr->common.format),
+                      ptr->simplified.ctx->height);
+
+    call_without_gvl(decode_simplified_api_nogvl, arg);
+
+    if (PNG_IMAGE_FAILED(*ptr->simplified.ctx)) {
+      RUNTIME_ERROR("png_image_finish_read() failed");
+    }
 
-  if (!RTEST(ret)) ptr->stride = stride;
+    if (NIL_P(arg->buf) && ptr->common.need_meta) {
+      rb_ivar_set(ret, id_meta, create_tiny_meta(ptr->simplified.ctx));
+      }
+  } while(0);
 
   return ret;
 }
 
-static void
-encode_error(png_structp ctx, png_const_charp msg)
+static VALUE
+decode_simplified_api_ensure(VALUE _arg)
 {
-  png_encoder_t* ptr;
+  decode_arg_t* arg;
+  png_decoder_t* ptr;
 
-  ptr = (png_encoder_t*)png_get_error_ptr(ctx);
+  arg = (decode_arg_t*)_arg;
+  ptr = arg->ptr;
+
+  release_output(arg);
+
+  if (ptr->simplified.ctx) {
+    png_image_free(ptr->simplified.ctx);
+  }
 
-  ptr->error = create_runtime_error("encode error:%s", msg);
+  ptr->simplified.ctx = NULL;
+  ptr->common.busy    = 0;
 
-  longjmp(png_jmpbuf(ptr->ctx), 1);
+  return Qundef;
 }
 
-static void
-encode_warn(png_structp ctx, png_const_charp msg)
-{
-  png_encoder_t* ptr;
+/*
+ * リスタートポイント(rsPT チャンク)付きの PNG の並列デコード
+ *
+ * ストリップ毎に独立して展開とフィルタの復元を行う。チャンクの内容と
+ * 実際のデータが一致しない場合(Adler-32 の不一致も含む)は失敗として
+ * 扱い、呼び出し元で libpng による通常のデコードにフォールバックする。
+ */
+typedef struct {
+  png_byte** rows;
+  png_uint_32 height;
+  size_t rowbytes;
+  int bpp;
 
-  ptr = (png_encoder_t*)png_get_error_ptr(ctx);
+  const uint8_t* zdata;  // zlib stream (concatenated IDAT data)
+  uint8_t* zbuf;         // allocated if IDAT is split into some chunks
+  size_t zsize;
 
-  if (ptr->warn_msg != Qnil) {
-    ptr->warn_msg = rb_ary_new();
-  }
+  png_uint_32 strip_rows;
+  int nstrips;
+  size_t* offset;        // offset of each strip in zdata (nstrips + 1)
+  uLong* adler;
 
-  rb_ary_push(ptr->warn_msg, rb_str_new_cstr(msg));
+  int failed;
+} restart_t;
+
+static png_uint_32
+get_uint32(const uint8_t* p)
+{
+  return ((png_uint_32)p[0] << 24) | ((png_uint_32)p[1] << 16) |
+         ((png_uint_32)p[2] << 8) | (png_uint_32)p[3];
 }
 
-static VALUE
-set_encoder_context(png_encoder_t* ptr, int wd, int ht, VALUE opt)
+/*
+ * 入力から IDAT のデータを集める(CRC もここで確認する)
+ */
+static int
+collect_idat(restart_t* rs, const uint8_t* src, size_t size)
 {
-  VALUE ret;
+  const uint8_t* head;
+  const uint8_t* tail;
+  size_t pos;
+  size_t len;
+  size_t total;
+  int n;
+
+  head  = NULL;
+  total = 0;
+  n     = 0;
+
+  for (pos = 8; pos + 12 <= size; pos += len + 12) {
+    len = get_uint32(src + pos);
+    if (len > size - pos - 12) return -1;
+
+    if (memcmp(src + pos + 4, "IDAT", 4) != 0) {
+      if (head != NULL) break;
+      continue;
+    }
 
-  png_structp ctx;
-  png_infop info;
-  png_byte** rows;
+    if (crc32(crc32(0L, Z_NULL, 0), src + pos + 4, len + 4) !=
+        get_uint32(src + pos + 8 + len)) {
+      return -1;
+    }
 
-  VALUE opts[N(encoder_opt_ids)];
+    if (head == NULL) head = src + pos;
 
-  /*
-   * initialize
-   */
-  ret = Qnil;
-  ctx  = NULL;
-  info = NULL;
-  rows = NULL;
+    total += len;
+    n++;
+  }
+
+  if (head == NULL) return -1;
 
   /*
-   * argument check
+   * IDAT の後のチャンク(tEXt や tIME)は png_read_end() でしか読めない
+   * ので、IDAT の直後が IEND の場合に限る(それ以外は逐次のデコードで
+   * 読む)
    */
-  do {
-    if (wd <= 0) {
-      ret = create_range_error("image width less equal zero");
-      break;
-    }
+  if (pos + 12 > size || get_uint32(src + pos) != 0 ||
+      memcmp(src + pos + 4, "IEND", 4) != 0 ||
+      crc32(crc32(0L, Z_NULL, 0), src + pos + 4, 4) !=
+                                              get_uint32(src + pos + 8)) {
+    return -1;
+  }
 
-    if (ht <= 0) {
-      ret = create_range_error("image height less equal zero");
-      break;
-    }
-  } while (0);
+  if (n == 1) {
+    rs->zdata = head + 8;
+    rs->zsize = total;
 
-  /*
-   * parse options
-   */
-  if (!RTEST(ret)) do {
-    rb_get_kwargs(opt, encoder_opt_ids, 0, N(encoder_opt_ids), opts);
+  } else {
+    rs->zbuf = (uint8_t*)malloc(total);
+    if (rs->zbuf == NULL) return -1;
 
-    // オプション評価で使用するので前もって設定しておく
-    ptr->width  = wd;
-    ptr->height = ht;
+    tail  = src + pos;
+    total = 0;
 
-    ret = eval_encoder_opt_pixel_format(ptr, opts[0]);
-    if (RTEST(ret)) break;
+    for (pos = head - src; src + pos < tail; pos += len + 12) {
+      len = get_uint32(src + pos);
+      memcpy(rs->zbuf + total, src + pos + 8, len);
+      total += len;
+    }
 
-    ret = eval_encoder_opt_interlace(ptr, opts[1]);
-    if (RTEST(ret)) break;
+    rs->zdata = rs->zbuf;
+    rs->zsize = total;
+  }
 
-    ret = eval_encoder_opt_compression(ptr, opts[2]);
-    if (RTEST(ret)) break;
+  return 0;
+}
 
-    ret = eval_encoder_opt_text(ptr, opts[3]);
-    if (RTEST(ret)) break;
+static void
+restart_job(void* _rs, int idx)
+{
+  restart_t* rs;
+  z_stream z;
+  uint8_t* tmp;
+  uint8_t* src;
+  png_uint_32 y0;
+  png_uint_32 y1;
+  png_uint_32 y;
+  size_t len;
+  int last;
+  int err;
+
+  rs   = (restart_t*)_rs;
+  y0   = idx * rs->strip_rows;
+  y1   = y0 + rs->strip_rows;
+  last = (idx == rs->nstrips - 1);
+
+  if (y1 > rs->height) y1 = rs->height;
+
+  len = (y1 - y0) * (rs->rowbytes + 1);
+  tmp = (uint8_t*)malloc(len);
+
+  if (tmp == NULL) {
+    rs->failed = !0;
+    return;
+  }
 
-    ret = eval_encoder_opt_time(ptr, opts[4]);
-    if (RTEST(ret)) break;
+  memset(&z, 0, sizeof(z));
 
-    ret = eval_encoder_opt_gamma(ptr, opts[5]);
-    if (RTEST(ret)) break;
+  if (inflateInit2(&z, -15) != Z_OK) {
+    free(tmp);
+    rs->failed = !0;
+    return;
+  }
 
-    ret = eval_encoder_opt_stride(ptr, opts[6]);
-    if (RTEST(ret)) break;
-  } while (0);
+  z.next_in   = (Bytef*)(rs->zdata + rs->offset[idx]);
+  z.avail_in  = rs->offset[idx + 1] - rs->offset[idx];
+  z.next_out  = tmp;
+  z.avail_out = len;
+
+  err = inflate(&z, last? Z_FINISH: Z_SYNC_FLUSH);
+  inflateEnd(&z);
 
   /*
-   * create PNG context
+   * 入力が余った場合はストリップの区切りが記録と合っていないので失敗と
+   * する(逐次のデコードにフォールバックする)
    */
-  if (!RTEST(ret)) do {
-    ctx = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                                  ptr,
-                                  encode_error,
-                                  encode_warn);
-    if (ctx == NULL) {
-      ret = create_runtime_error("png_create_read_struct() failed");
-      break;
-    }
+  if (z.avail_out != 0 || z.avail_in != 0 ||
+      (last && err != Z_STREAM_END) ||
+      (!last && err != Z_OK && err != Z_BUF_ERROR)) {
+    free(tmp);
+    rs->failed = !0;
+    return;
+  }
 
-    info = png_create_info_struct(ctx);
-    if (info == NULL) {
-      ret = create_runtime_error("png_create_info_structt() failed");
-      break;
-    }
+  rs->adler[idx] = adler32(adler32(0L, Z_NULL, 0), tmp, len);
 
-    rows = png_malloc(ctx, ht * sizeof(png_byte*));
-    if (rows == NULL) {
-      ret = create_memory_error("png_malloc() failed");
+  for (y = y0, src = tmp; y < y1; y++, src += rs->rowbytes + 1) {
+    if (src[0] > FILTER_PAETH || (y == y0 && src[0] > FILTER_SUB)) {
+      rs->failed = !0;
       break;
     }
 
-    memset(rows, 0, ht * sizeof(png_byte*));
-
-    ptr->data_size = ptr->stride * ptr->height;
-    ptr->ctx       = ctx;
-    ptr->info      = info;
-    ptr->rows      = rows;
-    ptr->ibuf      = Qnil;
-    ptr->obuf      = Qnil;
-    ptr->error     = Qnil;
-    ptr->warn_msg  = Qnil;
-  } while(0);
-
-  /*
-   * post process
-   */
-  if (RTEST(ret)) {
-    if (ctx != NULL) png_destroy_write_struct(&ctx, &info);
-    if (rows != NULL) png_free(ctx, rows);
+    memcpy(rs->rows[y], src + 1, rs->rowbytes);
+    unfilter_row(src[0], rs->rows[y],
+                 (y > y0)? rs->rows[y - 1]: NULL, rs->rowbytes, rs->bpp);
   }
 
-  return ret;
+  free(tmp);
 }
 
-static VALUE
-rb_encoder_initialize(int argc, VALUE* argv, VALUE self)
+static int
+decode_restart(decode_arg_t* arg)
 {
-  png_encoder_t* ptr;
-  VALUE exc;
-  VALUE wd;
-  VALUE ht;
-  VALUE opts;
+  png_decoder_t* ptr;
+  restart_t rs;
+  png_unknown_chunkp chunks;
+  const uint8_t* p;
+  uLong adler;
+  int n;
+  int i;
 
-  /*
-   * initialize
-   */
-  exc = Qnil;
+  ptr = arg->ptr;
 
   /*
-   * strip object
+   * 対象は 8bit のパレット以外のノンインタレース画像で、変換を伴わない
+   * 場合に限る
    */
-  TypedData_Get_Struct(self, png_encoder_t, &png_encoder_data_type, ptr);
+  if (png_get_bit_depth(ptr->classic.ctx, ptr->classic.fsi) != 8 ||
+      png_get_interlace_type(ptr->classic.ctx, ptr->classic.fsi) !=
+                                                    PNG_INTERLACE_NONE ||
+      (png_get_color_type(ptr->classic.ctx, ptr->classic.fsi) &
+                                                    PNG_COLOR_MASK_PALETTE) ||
+      !isnan(ptr->common.display_gamma)) {
+    return 0;
+  }
 
-  /*
-   * parse argument
-   */
-  rb_scan_args(argc, argv, "2:", &wd, &ht, &opts);
+  n = png_get_unknown_chunks(ptr->classic.ctx, ptr->classic.fsi, &chunks);
+
+  for (i = 0; i < n; i++) {
+    if (memcmp(chunks[i].name, RESTART_CHUNK_NAME, 4) == 0) break;
+  }
+
+  if (i == n || chunks[i].size < 8 || chunks[i].size % 4 != 0) return 0;
+
+  memset(&rs, 0, sizeof(rs));
+
+  p              = chunks[i].data;
+  rs.rows        = ptr->classic.rows;
+  rs.height      = png_get_image_height(ptr->classic.ctx, ptr->classic.fsi);
+  rs.rowbytes    = png_get_rowbytes(ptr->classic.ctx, ptr->classic.fsi);
+  rs.bpp         = png_get_channels(ptr->classic.ctx, ptr->classic.fsi);
+  rs.strip_rows  = get_uint32(p);
+  rs.nstrips     = (int)(chunks[i].size / 4) - 1;
+
+  if (rs.strip_rows == 0 ||
+      (rs.height + rs.strip_rows - 1) / rs.strip_rows != (png_uint_32)rs.nstrips) {
+    return 0;
+  }
 
-  /*
-   * check argument
-   */
   do {
-    if (TYPE(wd) != T_FIXNUM) {
-      exc = create_argument_error("invalid width");
+    rs.failed = !0;
+
+    if (collect_idat(&rs, (const uint8_t*)RSTRING_PTR(arg->data),
+                     RSTRING_LEN(arg->data))) {
       break;
     }
 
-    if (TYPE(ht) != T_FIXNUM) {
-      exc = create_argument_error("invalid height");
+    /*
+     * zlib ヘッダ(辞書の指定は無い事)とストリップの配置を確認する
+     */
+    if (rs.zsize < 6 || (rs.zdata[0] & 0x0f) != Z_DEFLATED ||
+        (rs.zdata[1] & 0x20) || ((rs.zdata[0] << 8) | rs.zdata[1]) % 31) {
       break;
     }
+
+    rs.offset = (size_t*)malloc(sizeof(size_t) * (rs.nstrips + 1));
+    rs.adler  = (uLong*)malloc(sizeof(uLong) * rs.nstrips);
+    if (rs.offset == NULL || rs.adler == NULL) break;
+
+    rs.offset[0] = 2;
+
+    for (i = 0; i < rs.nstrips; i++) {
+      rs.offset[i + 1] = rs.offset[i] + get_uint32(p + 4 + (i * 4));
+    }
+
+    if (rs.offset[rs.nstrips] + 4 != rs.zsize) break;
+
+    /*
+     * 並列に展開
+     */
+    rs.failed = 0;
+    parallel_for(ptr->common.threads, rs.nstrips, restart_job, &rs);
+
+    if (rs.failed) break;
+
+    adler = adler32(0L, Z_NULL, 0);
+
+    for (i = 0; i < rs.nstrips; i++) {
+      adler = adler32_combine(adler, rs.adler[i],
+              (z_off_t)(rs.rowbytes + 1) *
+              ((i == rs.nstrips - 1)?
+                  rs.height - (i * rs.strip_rows): rs.strip_rows));
+    }
+
+    if (adler != get_uint32(rs.zdata + rs.zsize - 4)) rs.failed = !0;
   } while (0);
 
-  /*
-   * set context
-   */
-  if (!RTEST(exc)) {
-    exc = set_encoder_context(ptr, FIX2INT(wd), FIX2INT(ht), opts);
+  if (rs.zbuf) free(rs.zbuf);
+  if (rs.offset) free(rs.offset);
+  if (rs.adler) free(rs.adler);
+
+  return !rs.failed;
+}
+
+/*
+ * 領域指定(:region)の評価
+ */
+static void
+set_region(decode_arg_t* arg, VALUE region)
+{
+  long v[4];
+  int i;
+
+  arg->crop    = 0;
+  arg->scratch = NULL;
+
+  if (region == Qundef || NIL_P(region)) return;
+
+  Check_Type(region, T_ARRAY);
+
+  if (RARRAY_LEN(region) != 4) {
+    ARGUMENT_ERROR(":region must be [x, y, width, height]");
+  }
+
+  for (i = 0; i < 4; i++) {
+    v[i] = NUM2LONG(RARRAY_AREF(region, i));
+
+    if (v[i] > PNG_UINT_31_MAX) {
+      RANGE_ERROR(":region is too large");
+    }
+  }
+
+  if (v[0] < 0 || v[1] < 0) {
+    RANGE_ERROR(":region position is negative");
+  }
+
+  if (v[2] <= 0 || v[3] <= 0) {
+    RANGE_ERROR(":region size is not positive");
   }
 
-  /*
-   * post process
-   */
-  if (RTEST(exc)) rb_exc_raise(exc);
+  arg->crop = !0;
+  arg->rx   = (png_uint_32)v[0];
+  arg->ry   = (png_uint_32)v[1];
+  arg->rw   = (png_uint_32)v[2];
+  arg->rh   = (png_uint_32)v[3];
+}
+
+/*
+ * 行データから指定した列の画素を取り出す(1画素が 8bit 未満の場合は
+ * ビット単位で詰め直す)
+ */
+static void
+copy_pixels(uint8_t* dst, const uint8_t* src, size_t x, size_t w, int depth)
+{
+  size_t pos;
+  size_t n;
+  size_t i;
+
+  if (depth >= 8) {
+    memcpy(dst, src + (x * (depth / 8)), w * (depth / 8));
 
-  return self;
+  } else {
+    pos = x * depth;
+    n   = w * depth;
+
+    memset(dst, 0, (n + 7) / 8);
+
+    for (i = 0; i < n; i++, pos++) {
+      if (src[pos / 8] & (0x80 >> (pos % 8))) dst[i / 8] |= 0x80 >> (i % 8);
+    }
+  }
 }
 
+/*
+ * 領域指定時の出力先の確保。ノンインタレースの場合は作業用の行バッファを
+ * 1行分だけ、インタレースの場合はパス間で行を保持する必要があるので
+ * 領域の行数 + 1行分(領域外の行用)を確保する。
+ */
 static VALUE
-do_encode(VALUE arg)
+bind_region(decode_arg_t* arg, size_t rowbytes)
 {
-  png_encoder_t* ptr;
-  png_uint_32 i;
-  png_byte* bytes;
+  VALUE ret;
+  png_decoder_t* ptr;
 
-  /*
-   * initialize
-   */
-  ptr = (png_encoder_t*)arg;
+  ptr = arg->ptr;
+
+  if (arg->rx + (size_t)arg->rw > ptr->classic.width ||
+      arg->ry + (size_t)arg->rh > ptr->classic.height) {
+    ARGUMENT_ERROR("region is out of the image");
+  }
 
-  if (setjmp(png_jmpbuf(ptr->ctx))) {
-    rb_exc_raise(ptr->error);
+  arg->depth = png_get_bit_depth(ptr->classic.ctx, ptr->classic.fsi) *
+               png_get_channels(ptr->classic.ctx, ptr->classic.fsi);
 
-  } else {
-    png_set_IHDR(ptr->ctx,
-                 ptr->info,
-                 ptr->width,
-                 ptr->height,
-                 8,
-                 ptr->c_type,
-                 ptr->i_meth,
-                 PNG_COMPRESSION_TYPE_BASE,
-                 PNG_FILTER_TYPE_BASE);
+  arg->ow = arg->rw;
+  arg->oh = arg->rh;
 
-    if (ptr->text) {
-      png_set_text(ptr->ctx, ptr->info, ptr->text, ptr->num_text);
-    }
+  ret = bind_output(arg, (((size_t)arg->rw * arg->depth) + 7) / 8, arg->rh);
 
-    if (ptr->with_time) {
-      time_t tm;
-      png_time png_time;
+  arg->scratch = (png_byte*)xmalloc(rowbytes *
+                                    ((arg->npass > 1)? arg->rh + 1: 1));
 
-      time(&tm);
-      png_convert_from_time_t(&png_time, tm);
-      png_set_tIME(ptr->ctx, ptr->info, &png_time);
-    }
+  return ret;
+}
 
-    if (!isnan(ptr->gamma)) {
-      png_set_gAMA(ptr->ctx, ptr->info, ptr->gamma);
-    }
+static void*
+decode_region_nogvl(void* _arg)
+{
+  decode_arg_t* arg;
+  png_decoder_t* ptr;
+  size_t rowbytes;
+  png_byte* out;
+  png_byte* row;
+  png_uint_32 y;
+  png_uint_32 i;
+  int pass;
 
-    png_set_compression_level(ptr->ctx, ptr->c_level);
+  arg = (decode_arg_t*)_arg;
+  ptr = arg->ptr;
 
-    png_set_write_fn(ptr->ctx,
-                     (png_voidp)ptr->obuf,
-                     (png_rw_ptr)mem_io_write_data,
-                     (png_flush_ptr)mem_io_flush);
+  if (setjmp(png_jmpbuf(ptr->classic.ctx))) {
+    // ignore (the error message is stored in ptr->common.error)
 
-    bytes = (png_byte*)RSTRING_PTR(ptr->ibuf);
-    for (i = 0; i < ptr->height; i++) {
-      ptr->rows[i] = bytes;
-      bytes += ptr->stride;
+  } else {
+    rowbytes = png_get_rowbytes(ptr->classic.ctx, ptr->classic.fsi);
+    out      = arg->scratch + ((arg->npass > 1)? rowbytes * arg->rh: 0);
+
+    for (pass = 0; pass < arg->npass; pass++) {
+      for (y = 0; y < ptr->classic.height; y++) {
+        /*
+         * 最後のパスでは領域より後ろの行は読まずに打ち切る
+         * (png_read_end() も呼ばない)
+         */
+        if (y >= arg->ry + arg->rh) {
+          if (pass == arg->npass - 1) break;
+          row = out;
+
+        } else if (y < arg->ry) {
+          row = out;
+
+        } else {
+          row = (arg->npass > 1)?
+                  arg->scratch + (rowbytes * (y - arg->ry)): arg->scratch;
+        }
+
+        png_read_row(ptr->classic.ctx, row, NULL);
+
+        if (arg->npass == 1 && y >= arg->ry) {
+          copy_pixels((uint8_t*)arg->dst + (arg->stride * (y - arg->ry)),
+                      row, arg->rx, arg->rw, arg->depth);
+        }
+      }
     }
 
-    png_set_rows(ptr->ctx, ptr->info, ptr->rows);
-    png_write_png(ptr->ctx, ptr->info, PNG_TRANSFORM_IDENTITY, NULL);
+    if (arg->npass > 1) {
+      for (i = 0; i < arg->rh; i++) {
+        copy_pixels((uint8_t*)arg->dst + (arg->stride * i),
+                    arg->scratch + (rowbytes * i), arg->rx, arg->rw,
+                    arg->depth);
+      }
+    }
   }
 
-  return Qnil;
+  return NULL;
 }
 
+/*
+ * 縮小デコード時の出力先の確保。ノンインタレースの場合は入力1行分の作業
+ * バッファと出力1行分の累積用バッファを確保する(インタレースの場合は
+ * パス毎の縮小画像から直接画素を拾うので作業バッファは1行分のみ)。
+ */
 static VALUE
-rb_encoder_encode(VALUE self, VALUE data)
+bind_scaled(decode_arg_t* arg, size_t rowbytes)
 {
   VALUE ret;
-  VALUE exc;
-  png_encoder_t* ptr;
-  int state;
+  png_decoder_t* ptr;
+  size_t nc;
 
-  /*
-   * initialize
-   */
-  ret   = rb_str_buf_new(0);
-  exc   = Qnil;
-  state = 0;
+  ptr = arg->ptr;
 
-  /*
-   * strip object
-   */
-  TypedData_Get_Struct(self, png_encoder_t, &png_encoder_data_type, ptr);
+  arg->depth = png_get_channels(ptr->classic.ctx, ptr->classic.fsi) * 8;
+  arg->ow    = (ptr->classic.width + arg->scale - 1) / arg->scale;
+  arg->oh    = (ptr->classic.height + arg->scale - 1) / arg->scale;
 
-  /*
-   * argument check
-   */
-  Check_Type(data, T_STRING);
+  nc  = (size_t)arg->ow * (arg->depth / 8);
+  ret = bind_output(arg, nc, arg->oh);
 
-  if (RSTRING_LEN(data) < ptr->data_size) {
-    ARGUMENT_ERROR("image data too short");
-  }
+  rowbytes = (rowbytes + 7) & ~(size_t)7;
+  arg->scratch = (png_byte*)xmalloc(rowbytes + (sizeof(uint32_t) * nc));
 
-  if (RSTRING_LEN(data) > ptr->data_size) {
-    ARGUMENT_ERROR("image data too large");
-  }
+  return ret;
+}
 
-  /*
-   * prepare
-   */
-  SET_DATA(ptr, data, ret);
+/*
+ * ノンインタレース画像の縮小(scale x scale 画素の平均)。libpng から
+ * 出てきた行を順に累積し、scale 行毎に出力行を確定する。
+ */
+static void
+scale_rows(decode_arg_t* arg, size_t rowbytes)
+{
+  png_decoder_t* ptr;
+  png_byte* row;
+  uint32_t* acc;
+  uint8_t* dst;
+  size_t nc;
+  size_t x;
+  png_uint_32 y;
+  png_uint_32 n;
+  size_t cw;
+  int bpp;
+  int c;
+
+  ptr = arg->ptr;
+  bpp = arg->depth / 8;
+  nc  = (size_t)arg->ow * bpp;
+  row = arg->scratch;
+  acc = (uint32_t*)(arg->scratch + ((rowbytes + 7) & ~(size_t)7));
+
+  memset(acc, 0, sizeof(uint32_t) * nc);
+
+  for (y = 0; y < ptr->classic.height; y++) {
+    png_read_row(ptr->classic.ctx, row, NULL);
+
+    for (x = 0; x < ptr->classic.width; x++) {
+      for (c = 0; c < bpp; c++) {
+        acc[((x / arg->scale) * bpp) + c] += row[(x * bpp) + c];
+      }
+    }
 
-  /*
-   * do encode
-   */
-  if (!RTEST(exc)) {
-    rb_protect(do_encode, (VALUE)ptr, &state);
-  }
+    if ((y + 1) % arg->scale != 0 && y + 1 != ptr->classic.height) continue;
 
-  /*
-   * post process
-   */
-  if(state == 0) {
-    rb_ivar_set(ret, rb_intern("warn"), ptr->warn_msg);
-  }  
- 
-  CLR_DATA(ptr);
- 
-  if (state != 0) {
-    rb_jump_tag(state);
-  }
+    n   = (y % arg->scale) + 1;
+    dst = (uint8_t*)arg->dst + (arg->stride * (y / arg->scale));
 
-  /*
-   * post process
-   */
-  ptr->ibuf = Qnil;
-  ptr->obuf = Qnil;
-  
-  if (RTEST(exc)) rb_exc_raise(exc);
+    for (x = 0; x < arg->ow; x++) {
+      cw = (x == arg->ow - 1)?
+              ptr->classic.width - (x * arg->scale): (size_t)arg->scale;
+      if (cw > (size_t)arg->scale) cw = arg->scale;
 
-  return ret;
+      for (c = 0; c < bpp; c++) {
+        dst[(x * bpp) + c] =
+             (acc[(x * bpp) + c] + ((n * cw) / 2)) / (n * cw);
+      }
+    }
+
+    memset(acc, 0, sizeof(uint32_t) * nc);
+  }
 }
 
+/*
+ * インタレース画像の縮小。Adam7 の各パスは 8x8 の格子の決まった位置の
+ * 画素を持つので、縮小後の画素に当たる位置(scale 毎の格子点)が揃うパス
+ * (1/8: 1パス目まで, 1/4: 3パス目まで, 1/2: 5パス目まで)だけを読んで
+ * 打ち切る(平均ではなく格子点の画素を使う)。
+ */
 static void
-rb_decoder_mark(void* _ptr)
+scale_passes(decode_arg_t* arg)
 {
-  // nothing
+  png_decoder_t* ptr;
+  png_byte* row;
+  uint8_t* dst;
+  png_uint_32 pw;
+  png_uint_32 ph;
+  png_uint_32 r;
+  png_uint_32 c;
+  png_uint_32 x;
+  png_uint_32 y;
+  int npass;
+  int pass;
+  int bpp;
+
+  ptr   = arg->ptr;
+  bpp   = arg->depth / 8;
+  row   = arg->scratch;
+  npass = (arg->scale == 8)? 1: (arg->scale == 4)? 3: 5;
+
+  for (pass = 0; pass < npass; pass++) {
+    pw = PNG_PASS_COLS(ptr->classic.width, pass);
+    ph = PNG_PASS_ROWS(ptr->classic.height, pass);
+
+    if (pw == 0) continue;
+
+    for (r = 0; r < ph; r++) {
+      png_read_row(ptr->classic.ctx, row, NULL);
+
+      y = PNG_PASS_START_ROW(pass) + (r << PNG_PASS_ROW_SHIFT(pass));
+      if (y % arg->scale != 0) continue;
+
+      dst = (uint8_t*)arg->dst + (arg->stride * (y / arg->scale));
+
+      for (c = 0; c < pw; c++) {
+        x = PNG_PASS_START_COL(pass) + (c << PNG_PASS_COL_SHIFT(pass));
+        if (x % arg->scale != 0) continue;
+
+        memcpy(dst + ((x / arg->scale) * bpp), row + (c * bpp), bpp);
+      }
+    }
+  }
 }
 
-static void
-rb_decoder_free(void* _ptr)
+static void*
+decode_scaled_nogvl(void* _arg)
 {
+  decode_arg_t* arg;
   png_decoder_t* ptr;
 
-  ptr = (png_decoder_t*)_ptr;
+  arg = (decode_arg_t*)_arg;
+  ptr = arg->ptr;
 
-  if (ptr->common.api_type == API_SIMPLIFIED) {
-    if (ptr->simplified.ctx) {
-      png_image_free(ptr->simplified.ctx);
-      xfree(ptr->simplified.ctx);
-    }
+  if (setjmp(png_jmpbuf(ptr->classic.ctx))) {
+    // ignore (the error message is stored in ptr->common.error)
 
-  } else {
-   if (ptr->classic.ctx != NULL) {
-      if (ptr->classic.rows != NULL) {
-        png_free(ptr->classic.ctx, ptr->classic.rows);
-      }
+  } else if (png_get_interlace_type(ptr->classic.ctx, ptr->classic.fsi) !=
+                                                        PNG_INTERLACE_NONE) {
+    scale_passes(arg);
 
-      png_destroy_read_struct(&ptr->classic.ctx,
-                              &ptr->classic.fsi,
-                              &ptr->classic.bsi);
-    }
+  } else {
+    scale_rows(arg, png_get_rowbytes(ptr->classic.ctx, ptr->classic.fsi));
   }
 
-  free(ptr);
+  return NULL;
 }
 
-static size_t
-rb_decoder_size(const void* _ptr)
+static void*
+decode_classic_api_nogvl(void* _arg)
 {
-  size_t ret;
+  decode_arg_t* arg;
+  png_decoder_t* ptr;
 
-  ret = sizeof(png_decoder_t);
+  arg = (decode_arg_t*)_arg;
+  ptr = arg->ptr;
 
-  return ret;
-}
+  /*
+   * GVL を解放した状態で実行されるので、ここでは Ruby の API を呼び出しては
+   * ならない。エラーは ptr->common.error にメッセージとして残して戻る。
+   */
+  if (setjmp(png_jmpbuf(ptr->classic.ctx))) {
+    // ignore (the error message is stored in ptr->common.error)
 
-#if RUBY_API_VERSION_CODE > 20600
-static const rb_data_type_t png_decoder_data_type = {
-  "libpng-ruby decoder object",      // wrap_struct_name
-  {
-    rb_decoder_mark,                 // function.dmark
-    rb_decoder_free,                 // function.dfree
-    rb_decoder_size,                 // function.dsize
-    NULL,                            // function.dcompact
-    {NULL},                          // function.reserved
-  },
-  NULL,                              // parent
-  NULL,                              // data
-  (VALUE)RUBY_TYPED_FREE_IMMEDIATELY // flags
-};
-#else /* RUBY_API_VERSION_CODE > 20600 */
-static const rb_data_type_t png_decoder_data_type = {
-  "libpng-ruby decoder object",      // wrap_struct_name
-  {
-    rb_decoder_mark,                 // function.dmark
-    rb_decoder_free,                 // function.dfree
-    rb_decoder_size,                 // function.dsize
-    {NULL, NULL},                    // function.reserved
-  },
-  NULL,                              // parent
-  NULL,                              // data
-  (VALUE)RUBY_TYPED_FREE_IMMEDIATELY // flags
-};
-#endif /* RUBY_API_VERSION_CODE > 20600 */
+  } else if (ptr->common.threads > 1 && decode_restart(arg)) {
+    // decoded in parallel (IDAT is followed only by IEND)
+
+  } else {
+    png_read_image(ptr->classic.ctx, ptr->classic.rows);
+    png_read_end(ptr->classic.ctx, ptr->classic.fsi);
+  }
 
+  return NULL;
+}
+
+/*
+ * classic API によるデコード結果のメタ情報(領域指定時や縮小時は出力の
+ * 大きさを示す)。simplified API の指定で領域や縮小のデコードを行った
+ * 場合は simplified API と同じ形式のメタ情報を返す。
+ */
 static VALUE
-rb_decoder_alloc(VALUE self)
+create_partial_meta(decode_arg_t* arg)
 {
   png_decoder_t* ptr;
+  png_image img;
 
-  ptr = ALLOC(png_decoder_t);
-  memset(ptr, 0, sizeof(*ptr));
+  ptr = arg->ptr;
 
-  ptr->common.api_type      = API_SIMPLIFIED;
-  ptr->common.format        = PNG_FORMAT_RGB;
-  ptr->common.need_meta     = !0;
-  ptr->common.display_gamma = NAN;
+  if (ptr->common.api_type == API_SIMPLIFIED) {
+    memset(&img, 0, sizeof(img));
 
-  return TypedData_Wrap_Struct(decoder_klass, &png_decoder_data_type, ptr);
+    img.width  = arg->ow;
+    img.height = arg->oh;
+    img.format = ptr->common.format;
+
+    return create_tiny_meta(&img);
+  }
+
+  get_header_info(ptr);
+
+  if (arg->crop || arg->scale > 1) {
+    ptr->classic.width  = arg->ow;
+    ptr->classic.height = arg->oh;
+  }
+
+  return create_meta(ptr);
 }
 
 static VALUE
-eval_decoder_opt_api_type(png_decoder_t* ptr, VALUE opt)
+decode_classic_api_body(VALUE _arg)
 {
   VALUE ret;
-  int type;
-
-  ret = Qnil;
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    type = API_SIMPLIFIED;
-    break;
+  decode_arg_t* arg;
+  png_decoder_t* ptr;
+  VALUE data;
 
-  case T_STRING:
-  case T_SYMBOL:
-    if (EQ_STR(opt, "simplified")) {
-      type = API_SIMPLIFIED;
+  size_t stride;
 
-    } else if (EQ_STR(opt, "classic")) {
-      type = API_CLASSIC;
+  png_uint_32 i;
+  png_byte* p;
 
-    } else {
-      ret = create_argument_error(":api_type invalid value");
-    }
-    break;
+  /*
+   * initialize
+   */
+  arg  = (decode_arg_t*)_arg;
+  ptr  = arg->ptr;
+  data = arg->data;
 
-  default:
-    ret = create_type_error(":api_type invalid type");
-    break;
-  }
+  /*
+   * set context
+   */
+  set_read_context(ptr, data);
 
-  if (!RTEST(ret)) ptr->common.api_type = type;
+  /*
+   * read basic info
+   */
+  if (setjmp(png_jmpbuf(ptr->classic.ctx))) {
+    rb_exc_raise(create_runtime_error("%s", ptr->common.error));
 
-  return ret;
-}
+  } else {
+    if (ptr->common.threads > 1) {
+      png_set_keep_unknown_chunks(ptr->classic.ctx,
+                                  PNG_HANDLE_CHUNK_ALWAYS,
+                                  (png_const_bytep)RESTART_CHUNK_NAME, 1);
+    }
 
-static VALUE
-eval_decoder_opt_pixel_format(png_decoder_t* ptr, VALUE opt)
-{
-  VALUE ret;
-  int format;
+    png_read_info(ptr->classic.ctx, ptr->classic.fsi);
 
-  ret = Qnil;
+    /*
+     * gamma correction
+     */
+    set_read_transform(ptr, ptr->classic.ctx, ptr->classic.fsi);
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    format = PNG_FORMAT_RGB;
-    break;
+    if (arg->crop) {
+      arg->npass = png_set_interlace_handling(ptr->classic.ctx);
 
-  case T_STRING:
-  case T_SYMBOL:
-    if (EQ_STR(opt, "GRAY") || EQ_STR(opt, "GRAYSCALE")) {
-      format = PNG_FORMAT_GRAY;
+    } else if (arg->scale > 1) {
+      // 縮小は 8bit のサンプルに対して行う
+      png_set_expand(ptr->classic.ctx);
+      png_set_scale_16(ptr->classic.ctx);
+    }
 
-    } else if (EQ_STR(opt, "GA")) {
-      format = PNG_FORMAT_GA;
+    png_read_update_info(ptr->classic.ctx, ptr->classic.fsi);
+  }
 
-    } else if (EQ_STR(opt, "AG")) {
-      format = PNG_FORMAT_AG;
+  /*
+   * get image size
+   */
+  ptr->classic.width  = \
+      png_get_image_width(ptr->classic.ctx, ptr->classic.fsi);
 
-    } else if (EQ_STR(opt, "RGB")) {
-      format = PNG_FORMAT_RGB;
+  ptr->classic.height = \
+      png_get_image_height(ptr->classic.ctx, ptr->classic.fsi);
 
-    } else if (EQ_STR(opt, "BGR")) {
-      format = PNG_FORMAT_BGR;
+  stride = png_get_rowbytes(ptr->classic.ctx, ptr->classic.fsi);
 
-    } else if (EQ_STR(opt, "RGBA")) {
-      format = PNG_FORMAT_RGBA;
+  if (arg->crop) {
+    /*
+     * region decode (read row by row without GVL)
+     */
+    ret = bind_region(arg, stride);
+    call_without_gvl(decode_region_nogvl, arg);
 
-    } else if (EQ_STR(opt, "ARGB")) {
-      format = PNG_FORMAT_ARGB;
+  } else if (arg->scale > 1) {
+    /*
+     * scaled decode (read row by row without GVL)
+     */
+    ret = bind_scaled(arg, stride);
+    call_without_gvl(decode_scaled_nogvl, arg);
 
-    } else if (EQ_STR(opt, "BGRA")) {
-      format = PNG_FORMAT_BGRA;
+  } else {
+    /*
+     * bind output memory
+     */
+    ret = bind_output(arg, stride, ptr->classic.height);
 
-    } else if (EQ_STR(opt, "ABGR")) {
-      format = PNG_FORMAT_ABGR;
+    /*
+     * alloc rows
+     */
+    ptr->classic.rows = get_row_buf(ptr, ptr->classic.height);
 
-    } else {
-      ret = create_argument_error(":pixel_format invalid value");
+    p = (png_byte*)arg->dst;
+    for (i = 0; i < ptr->classic.height; i++) {
+      ptr->classic.rows[i] = p;
+      p += arg->stride;
     }
-    break;
 
-  default:
-    ret = create_type_error(":pixel_format invalid type");
-    break;
+    /*
+     * read image (without GVL)
+     */
+    call_without_gvl(decode_classic_api_nogvl, arg);
   }
 
-  if (!RTEST(ret)) ptr->common.format = format;
+  if (ptr->common.error[0] != '\0') {
+    rb_exc_raise(create_runtime_error("%s", ptr->common.error));
+  }
+
+  if (NIL_P(arg->buf) && ptr->classic.need_meta) {
+    rb_ivar_set(ret, id_meta, create_partial_meta(arg));
+  }
 
   return ret;
 }
 
 static VALUE
-eval_decoder_opt_without_meta(png_decoder_t* ptr, VALUE opt)
+decode_classic_api_ensure(VALUE _arg)
 {
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    ptr->common.need_meta = !0;
-    break;
+  decode_arg_t* arg;
+  png_decoder_t* ptr;
 
-  default:
-    ptr->common.need_meta = !RTEST(opt);
-    break;
+  arg = (decode_arg_t*)_arg;
+  ptr = arg->ptr;
+
+  release_output(arg);
+
+  if (arg->scratch) {
+    xfree(arg->scratch);
+    arg->scratch = NULL;
   }
 
-  return Qnil;
-}
+  ptr->classic.rows = NULL;
 
-static VALUE
-eval_decoder_opt_display_gamma(png_decoder_t* ptr, VALUE opt)
-{
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    ptr->common.display_gamma = NAN;
-    break;
+  clear_read_context(ptr);
+  warn_buf_clear(&ptr->common.warn);
 
-  default:
-    ptr->common.display_gamma = NUM2DBL(opt);
-    break;
-  }
+  ptr->common.busy = 0;
 
-  return Qnil;
+  return Qundef;
 }
 
 static VALUE
-set_decoder_context(png_decoder_t* ptr, VALUE opt)
+do_decode(VALUE self, VALUE data, decode_arg_t* arg)
 {
   VALUE ret;
-  VALUE opts[N(decoder_opt_ids)];
+  png_decoder_t* ptr;
 
   /*
-   * initialize
+   * argument check
    */
-  ret = Qnil;
+  Check_Type(data, T_STRING);
+
+  if (png_sig_cmp((png_const_bytep)RSTRING_PTR(data), 0, 8)) {
+    RUNTIME_ERROR("Invalid PNG signature.");
+  }
 
   /*
-   * parse options
+   * strip object
    */
-  do {
-    rb_get_kwargs(opt, decoder_opt_ids, 0, N(decoder_opt_ids), opts);
+  TypedData_Get_Struct(self, png_decoder_t, &png_decoder_data_type, ptr);
 
-    ret = eval_decoder_opt_api_type(ptr, opts[2]);
-    if (RTEST(ret)) break;
+  if (ptr->common.busy) {
+    RUNTIME_ERROR("decoder is busy");
+  }
 
-    ret = eval_decoder_opt_pixel_format(ptr, opts[0]);
-    if (RTEST(ret)) break;
+  if (arg->crop && ptr->common.scale_denom > 1) {
+    ARGUMENT_ERROR(":region can not be used with :scale_denom");
+  }
 
-    ret = eval_decoder_opt_without_meta(ptr, opts[1]);
-    if (RTEST(ret)) break;
+  /*
+   * call decode funcs
+   */
+  ptr->common.busy = !0;
 
-    ret = eval_decoder_opt_display_gamma(ptr, opts[3]);
-    if (RTEST(ret)) break;
-  } while (0);
+  /*
+   * GVL 解放中に他のスレッドから変更されても影響を受けない様に、
+   * 入力データは凍結した共有文字列として保持しておく。
+   */
+  arg->ptr    = ptr;
+  arg->data   = rb_str_new_frozen(data);
+  arg->dst    = NULL;
+  arg->locked = DST_NONE;
+  arg->scale  = ptr->common.scale_denom;
+
+  /*
+   * 領域指定や縮小の場合は行単位で読む必要があるので、simplified API の
+   * 指定でも classic API の処理で(:pixel_format の変換を設定して)
+   * デコードする。
+   */
+  if (ptr->common.api_type == API_SIMPLIFIED && !arg->crop && arg->scale == 1) {
+    ret = rb_ensure(decode_simplified_api_body, (VALUE)arg,
+                    decode_simplified_api_ensure, (VALUE)arg);
+
+  } else {
+    ret = rb_ensure(decode_classic_api_body, (VALUE)arg,
+                    decode_classic_api_ensure, (VALUE)arg);
+  }
+
+  RB_GC_GUARD(arg->data);
 
   return ret;
 }
 
 static VALUE
-rb_decoder_initialize(int argc, VALUE* argv, VALUE self)
+rb_decoder_decode(int argc, VALUE* argv, VALUE self)
 {
-  png_decoder_t* ptr;
-  VALUE exc;
+  static ID keys[1];
+
+  VALUE data;
   VALUE opts;
+  VALUE vals[1];
+  decode_arg_t arg;
 
   /*
-   * initialize
+   * parse argument
    */
-  exc = Qnil;
+  rb_scan_args(argc, argv, "1:", &data, &opts);
 
-  /*
-   * strip object
-   */
-  TypedData_Get_Struct(self, png_decoder_t, &png_decoder_data_type, ptr);
+  if (!keys[0]) {
+    keys[0] = rb_intern_const("region");
+  }
 
-  /*
-   * parse argument
-   */
-  rb_scan_args(argc, argv, "0:", &opts);
+  rb_get_kwargs(opts, keys, 0, 1, vals);
 
   /*
-   * set context
+   * do decode
    */
-  exc = set_decoder_context(ptr, opts);
+  arg.buf    = Qnil;
+  arg.offset = 0;
+  arg.stride = 0;
 
-  /*
-   * post process
-   */
-  if (RTEST(exc)) rb_exc_raise(exc);
+  set_region(&arg, vals[0]);
 
-  return Qtrue;
+  return do_decode(self, data, &arg);
 }
 
-static void
-decode_error(png_structp ctx, png_const_charp msg)
+static VALUE
+rb_decoder_decode_into(int argc, VALUE* argv, VALUE self)
 {
-  png_decoder_t* ptr;
-
-  ptr = (png_decoder_t*)png_get_error_ptr(ctx);
+  static ID keys[3];
 
-  ptr->common.error = create_runtime_error("decode error:%s", msg);
+  VALUE data;
+  VALUE buf;
+  VALUE opts;
+  VALUE vals[3];
+  decode_arg_t arg;
 
-  longjmp(png_jmpbuf(ptr->classic.ctx), 1);
-}
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "2:", &data, &buf, &opts);
 
-static void
-decode_warn(png_structp ctx, png_const_charp msg)
-{
-  png_decoder_t* ptr;
+  if (!keys[0]) {
+    keys[0] = rb_intern_const("offset");
+    keys[1] = rb_intern_const("stride");
+    keys[2] = rb_intern_const("region");
+  }
 
-  ptr = (png_decoder_t*)png_get_error_ptr(ctx);
+  rb_get_kwargs(opts, keys, 0, 3, vals);
 
-  if (ptr->common.warn_msg != Qnil) {
-    ptr->common.warn_msg = rb_ary_new();
+  /*
+   * argument check
+   */
+  if (NIL_P(buf)) {
+    ARGUMENT_ERROR("output buffer not specified");
   }
 
-  rb_ary_push(ptr->common.warn_msg, rb_str_new_cstr(msg));
-}
-
+  arg.buf    = buf;
+  arg.offset = 0;
+  arg.stride = 0;
 
-static void
-set_read_context(png_decoder_t* ptr, VALUE data)
-{
-  VALUE exc;
-  png_structp ctx;
-  png_infop fsi;
-  png_infop bsi;
+  if (vals[0] != Qundef && !NIL_P(vals[0])) {
+    if (NUM2LONG(vals[0]) < 0) {
+      RANGE_ERROR(":offset is negative");
+    }
 
-  do {
-    exc = Qnil;
-    ctx = NULL;
-    fsi = NULL;
-    bsi = NULL;
+    arg.offset = NUM2SIZET(vals[0]);
+  }
 
-    ctx = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-                                 ptr,
-                                 decode_error,
-                                 decode_warn);
-    if (ctx == NULL) {
-      exc = create_runtime_error("png_create_read_struct() failed");
-      break;
+  if (vals[1] != Qundef && !NIL_P(vals[1])) {
+    if (NUM2LONG(vals[1]) <= 0) {
+      RANGE_ERROR(":stride is not positive");
     }
 
-    fsi = png_create_info_struct(ctx);
-    if (fsi == NULL) {
-      exc = create_runtime_error("png_create_info_struct() failed");
-      break;
-    }
+    arg.stride = NUM2SIZET(vals[1]);
+  }
 
-    bsi = png_create_info_struct(ctx);
-    if (bsi == NULL) {
-      exc = create_runtime_error("png_create_info_struct() failed");
-      break;
-    }
+  set_region(&arg, vals[2]);
 
-    ptr->classic.ctx     = ctx;
-    ptr->classic.fsi     = fsi;
-    ptr->classic.bsi     = bsi;
+  /*
+   * do decode
+   */
+  do_decode(self, data, &arg);
 
-    ptr->classic.io.ptr  = (uint8_t*)RSTRING_PTR(data);
-    ptr->classic.io.size = RSTRING_LEN(data);
-    ptr->classic.io.pos  = 0;
+  return buf;
+}
 
-    png_set_read_fn(ptr->classic.ctx,
-                    (png_voidp)&ptr->classic.io,
-                    (png_rw_ptr)mem_io_read_data);
-  } while(0);
+/*
+ * ファイルからのデコード(PNG::Decoder#decode_file / #read_header_file)
+ *
+ * 通常ファイルは読み込み専用でマップし、そのメモリを指す文字列をデコーダに
+ * 渡す(ヒープへの読み込みを省く)。マップできないファイル(パイプやデバイス
+ * 等)は IO.binread で読み込む。マップは関数を抜ける時点で解除するので、
+ * 渡した文字列は外部に残さないこと。
+ */
+typedef struct {
+  VALUE self;
+  int argc;
+  VALUE* argv;
+  VALUE (*func)(int argc, VALUE* argv, VALUE self);
 
-  if (RTEST(exc)) {
-    if (ctx != NULL) {
-      png_destroy_read_struct(&ctx, &fsi, &bsi);
-    }
+  void* addr;
+  size_t size;
+} map_arg_t;
 
-    rb_exc_raise(exc);
-  }
+static VALUE
+map_body(VALUE _arg)
+{
+  map_arg_t* arg;
+
+  arg = (map_arg_t*)_arg;
+
+  arg->argv[0] = rb_obj_freeze(rb_str_new_static(arg->addr, arg->size));
+
+  return arg->func(arg->argc, arg->argv, arg->self);
 }
 
-static void
-get_header_info(png_decoder_t* ptr)
+static VALUE
+map_ensure(VALUE _arg)
 {
-  png_get_IHDR(ptr->classic.ctx,
-               ptr->classic.fsi,
-               &ptr->classic.width,
-               &ptr->classic.height,
-               &ptr->classic.depth,
-               &ptr->classic.c_type,
-               &ptr->classic.i_meth,
-               &ptr->classic.c_meth,
-               &ptr->classic.f_meth); 
+#ifdef SUPPORT_MMAP
+  map_arg_t* arg;
 
-  png_get_tIME(ptr->classic.ctx, ptr->classic.fsi, &ptr->classic.time);
+  arg = (map_arg_t*)_arg;
 
-  png_get_text(ptr->classic.ctx,
-               ptr->classic.fsi,
-               &ptr->classic.text,
-               &ptr->classic.num_text);
+  munmap(arg->addr, arg->size);
+#endif /* defined(SUPPORT_MMAP) */
 
-  if (!png_get_gAMA(ptr->classic.ctx,
-                    ptr->classic.fsi, &ptr->classic.file_gamma)) {
-    ptr->classic.file_gamma = NAN;
-  }
+  return Qundef;
 }
 
 static VALUE
-get_color_type_str(png_decoder_t* ptr)
+call_with_file(int argc, VALUE* argv, VALUE self,
+               VALUE (*func)(int argc, VALUE* argv, VALUE self))
 {
-  const char* cstr;
-  char tmp[32];
+  VALUE path;
+  map_arg_t arg;
 
-  switch (ptr->classic.c_type) {
-  case PNG_COLOR_TYPE_GRAY:
-    cstr = "GRAY";
-    break;
+  path = argv[0];
+  FilePathValue(path);
 
-  case PNG_COLOR_TYPE_PALETTE:
-    cstr = "PALETTE";
-    break;
+  memset(&arg, 0, sizeof(arg));
 
-  case PNG_COLOR_TYPE_RGB:
-    cstr = "RGB";
-    break;
+#ifdef SUPPORT_MMAP
+  {
+    int fd;
+    struct stat st;
 
-  case PNG_COLOR_TYPE_RGBA:
-    cstr = "RGBA";
-    break;
+    fd = rb_cloexec_open(StringValueCStr(path), O_RDONLY, 0);
+    if (fd < 0) {
+      rb_sys_fail_str(path);
+    }
 
-  case PNG_COLOR_TYPE_GRAY_ALPHA:
-    cstr = "GA";
-    break;
+    if (fstat(fd, &st) < 0) {
+      close(fd);
+      rb_sys_fail_str(path);
+    }
 
-  default:
-    sprintf(tmp, "UNKNOWN(%d)", ptr->classic.c_type);
-    cstr = tmp;
-    break;
+    if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (uint64_t)st.st_size <= (uint64_t)LONG_MAX) {
+      arg.size = (size_t)st.st_size;
+      arg.addr = mmap(NULL, arg.size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+      if (arg.addr == MAP_FAILED) {
+        arg.addr = NULL;
+      }
+    }
+
+    close(fd);
+  }
+
+  if (arg.addr != NULL) {
+#ifdef HAVE_MADVISE
+    madvise(arg.addr, arg.size, MADV_SEQUENTIAL);
+#endif /* defined(HAVE_MADVISE) */
+
+    arg.self = self;
+    arg.argc = argc;
+    arg.argv = argv;
+    arg.func = func;
+
+    return rb_ensure(map_body, (VALUE)&arg, map_ensure, (VALUE)&arg);
   }
+#endif /* defined(SUPPORT_MMAP) */
+
+  argv[0] = rb_funcall(rb_cIO, rb_intern("binread"), 1, path);
 
-  return rb_str_freeze(rb_str_new_cstr(cstr));
+  return func(argc, argv, self);
 }
 
 static VALUE
-get_interlace_method_str(png_decoder_t* ptr)
+read_header_func(int argc, VALUE* argv, VALUE self)
 {
-  const char* cstr;
-  char tmp[32];
-
-  switch (ptr->classic.i_meth) {
-  case PNG_INTERLACE_NONE:
-    cstr = "NONE";
-    break;
-
-  case PNG_INTERLACE_ADAM7:
-    cstr = "ADAM7";
-    break;
-
-  default:
-    sprintf(tmp, "UNKNOWN(%d)", ptr->classic.i_meth);
-    cstr = tmp;
-    break;
-  }
+  return rb_decoder_read_header(self, argv[0]);
+}
 
-  return rb_str_freeze(rb_str_new_cstr(cstr));
+static VALUE
+rb_decoder_read_header_file(VALUE self, VALUE path)
+{
+  return call_with_file(1, &path, self, read_header_func);
 }
 
 static VALUE
-get_compression_method_str(png_decoder_t* ptr)
+decode_file_func(int argc, VALUE* argv, VALUE self)
 {
-  const char* cstr;
-  char tmp[32];
+  decode_arg_t arg;
 
-  switch (ptr->classic.c_meth) {
-  case PNG_COMPRESSION_TYPE_BASE:
-    cstr = "BASE";
-    break;
+  arg.buf    = Qnil;
+  arg.offset = 0;
+  arg.stride = 0;
 
-  default:
-    sprintf(tmp, "UNKNOWN(%d)", ptr->classic.c_meth);
-    cstr = tmp;
-    break;
-  }
+  set_region(&arg, argv[1]);
 
-  return rb_str_freeze(rb_str_new_cstr(cstr));
+  return do_decode(self, argv[0], &arg);
 }
 
 static VALUE
-get_filter_method_str(png_decoder_t* ptr)
+rb_decoder_decode_file(int argc, VALUE* argv, VALUE self)
 {
-  const char* cstr;
-  char tmp[32];
+  static ID keys[1];
 
-  switch (ptr->classic.f_meth) {
-  case PNG_FILTER_TYPE_BASE:
-    cstr = "BASE";
-    break;
+  VALUE path;
+  VALUE opts;
+  VALUE args[2];
 
-  case PNG_INTRAPIXEL_DIFFERENCING:
-    cstr = "INTRAPIXEL_DIFFERENCING";
-    break;
+  /*
+   * parse argument
+   */
+  rb_scan_args(argc, argv, "1:", &path, &opts);
 
-  default:
-    sprintf(tmp, "UNKNOWN(%d)", ptr->classic.f_meth);
-    cstr = tmp;
-    break;
+  if (!keys[0]) {
+    keys[0] = rb_intern_const("region");
   }
 
-  return rb_str_freeze(rb_str_new_cstr(cstr));
+  rb_get_kwargs(opts, keys, 0, 1, &args[1]);
+
+  /*
+   * do decode
+   */
+  args[0] = path;
+
+  return call_with_file(2, args, self, decode_file_func);
 }
 
-static VALUE
-create_text_meta(png_decoder_t* ptr)
-{
+/*
+ * バッチデコード(PNG::Decoder#decode_many)
+ *
+ * 入力毎に simplified API の png_image を用意し、ヘッダの読み込みと
+ * デコードの二段階をスレッドプールで処理する。出力先の文字列は間で
+ * (GVL を確保した状態で)生成する。入力毎のエラーは例外オブジェクトとして
+ * 結果に格納する。
+ */
+typedef struct {
+  const char* src;       // NULL if the input is rejected
+  size_t size;
+  png_image image;
+  void* dst;
+  int failed;
+} batch_item_t;
+
+typedef struct {
+  png_decoder_t* ptr;
+  VALUE inputs;          // frozen copies of the inputs
   VALUE ret;
-  VALUE key;
-  VALUE val;
+  batch_item_t* items;
+  long num;
+  int pass;
+} batch_dec_t;
 
-  int i;
+static void
+batch_dec_job(void* _arg, int idx)
+{
+  batch_dec_t* arg;
+  batch_item_t* item;
 
-  ret = rb_hash_new();
+  arg  = (batch_dec_t*)_arg;
+  item = arg->items + idx;
 
-  for (i = 0; i < ptr->classic.num_text; i++) {
-    key = rb_str_new2(ptr->classic.text[i].key);
-    val = rb_str_new(ptr->classic.text[i].text,
-                     ptr->classic.text[i].text_length);
+  if (item->src == NULL || item->failed) return;
 
-    rb_str_freeze(key);
-    rb_str_freeze(val);
+  if (arg->pass == 1) {
+    item->image.version = PNG_IMAGE_VERSION;
 
-    rb_funcall(key, rb_intern("downcase!"), 0);
-    rb_funcall(key, rb_intern("gsub!"), 2, rb_str_new2(" "), rb_str_new2("_"));
+    png_image_begin_read_from_memory(&item->image, item->src, item->size);
+    if (PNG_IMAGE_FAILED(item->image)) {
+      item->failed = !0;
+    } else {
+      item->image.format = arg->ptr->common.format;
+    }
 
-    rb_hash_aset(ret, rb_to_symbol(key), val);
+  } else {
+    png_image_finish_read(&item->image,
+                          &black_background, item->dst, 0, NULL);
+    if (PNG_IMAGE_FAILED(item->image)) item->failed = !0;
   }
-
-  rb_obj_freeze(ret);
-
-  return ret;
 }
 
-static VALUE
-create_time_meta(png_decoder_t* ptr)
+static void*
+batch_dec_nogvl(void* _arg)
 {
-  VALUE ret;
+  batch_dec_t* arg;
 
-  ret = rb_funcall(rb_cTime,
-                   rb_intern("utc"),
-                   6,
-                   INT2FIX(ptr->classic.time->year),
-                   INT2FIX(ptr->classic.time->month),
-                   INT2FIX(ptr->classic.time->day),
-                   INT2FIX(ptr->classic.time->hour),
-                   INT2FIX(ptr->classic.time->minute),
-                   INT2FIX(ptr->classic.time->second));
+  arg = (batch_dec_t*)_arg;
 
-  rb_funcall(ret, rb_intern("localtime"), 0);
+  parallel_for(arg->ptr->common.threads, (int)arg->num, batch_dec_job, arg);
 
-  rb_obj_freeze(ret);
+  return NULL;
+}
 
-  return ret;
+static VALUE
+batch_dec_error(batch_item_t* item, const char* func)
+{
+  return create_runtime_error("%s failed (%s)", func, item->image.message);
 }
 
 static VALUE
-create_meta(png_decoder_t* ptr)
+batch_dec_body(VALUE _arg)
 {
+  batch_dec_t* arg;
+  batch_item_t* item;
+  VALUE data;
   VALUE ret;
+  long i;
 
-  ret = rb_obj_alloc(meta_klass);
+  arg = (batch_dec_t*)_arg;
 
-  rb_ivar_set(ret, rb_intern("@width"), INT2FIX(ptr->classic.width));
-  rb_ivar_set(ret, rb_intern("@height"), INT2FIX(ptr->classic.height));
-  rb_ivar_set(ret, rb_intern("@bit_depth"), INT2FIX(ptr->classic.depth));
-  rb_ivar_set(ret, rb_intern("@color_type"), get_color_type_str(ptr));
+  /*
+   * check inputs
+   */
+  for (i = 0; i < arg->num; i++) {
+    data = RARRAY_AREF(arg->inputs, i);
 
-  rb_ivar_set(ret, rb_intern("@interlace_method"),
-              get_interlace_method_str(ptr));
+    if (!RB_TYPE_P(data, T_STRING)) {
+      rb_ary_store(arg->ret, i, create_type_error("input is not a String"));
 
-  rb_ivar_set(ret, rb_intern("@compression_method"),
-              get_compression_method_str(ptr));
+    } else if (RSTRING_LEN(data) < 8 ||
+               png_sig_cmp((png_const_bytep)RSTRING_PTR(data), 0, 8)) {
+      rb_ary_store(arg->ret, i,
+                   create_runtime_error("Invalid PNG signature."));
 
-  rb_ivar_set(ret, rb_intern("@filter_method"), get_filter_method_str(ptr));
+    } else {
+      data = rb_str_new_frozen(data);
+      rb_ary_store(arg->inputs, i, data);
 
-  if (ptr->classic.text) {
-    rb_ivar_set(ret, rb_intern("@text"), create_text_meta(ptr));
+      arg->items[i].src  = RSTRING_PTR(data);
+      arg->items[i].size = RSTRING_LEN(data);
+    }
   }
 
-  if (ptr->classic.time) {
-    rb_ivar_set(ret, rb_intern("@time"), create_time_meta(ptr));
+  /*
+   * read headers
+   */
+  arg->pass = 1;
+  call_without_gvl(batch_dec_nogvl, arg);
+
+  for (i = 0; i < arg->num; i++) {
+    item = arg->items + i;
+    if (item->src == NULL) continue;
+
+    if (item->failed) {
+      ret = batch_dec_error(item, "png_image_begin_read_from_memory()");
+
+    } else {
+      ret = create_result(PNG_IMAGE_SIZE(item->image),
+                          arg->ptr->common.need_meta);
+      item->dst = RSTRING_PTR(ret);
+    }
+
+    rb_ary_store(arg->ret, i, ret);
   }
 
-  if (!isnan(ptr->classic.file_gamma)) {
-    rb_ivar_set(ret,
-                rb_intern("@file_gamma"),
-                DBL2NUM(ptr->classic.file_gamma));
+  /*
+   * decode
+   */
+  arg->pass = 2;
+  call_without_gvl(batch_dec_nogvl, arg);
+
+  for (i = 0; i < arg->num; i++) {
+    item = arg->items + i;
+    if (item->dst == NULL) continue;
+
+    if (item->failed) {
+      rb_ary_store(arg->ret, i,
+                   batch_dec_error(item, "png_image_finish_read()"));
+
+    } else if (arg->ptr->common.need_meta) {
+      rb_ivar_set(RARRAY_AREF(arg->ret, i),
+                  id_meta, create_tiny_meta(&item->image));
+    }
   }
 
-  rb_obj_freeze(ret);
+  return arg->ret;
+}
 
-  return ret;
+static VALUE
+batch_dec_ensure(VALUE _arg)
+{
+  batch_dec_t* arg;
+  long i;
+
+  arg = (batch_dec_t*)_arg;
+
+  for (i = 0; i < arg->num; i++) {
+    png_image_free(&arg->items[i].image);
+  }
+
+  xfree(arg->items);
+
+  arg->ptr->common.busy = 0;
+
+  return Qundef;
 }
 
 static VALUE
-create_tiny_meta(png_decoder_t* ptr)
+rb_decoder_decode_many(VALUE self, VALUE inputs)
 {
+  batch_dec_t arg;
+  png_decoder_t* ptr;
   VALUE ret;
-  const char* fmt;
-  int nc;
 
-  ret = rb_obj_alloc(meta_klass);
+  /*
+   * argument check
+   */
+  Check_Type(inputs, T_ARRAY);
 
-  rb_ivar_set(ret, rb_intern("@width"),
-              INT2FIX(ptr->simplified.ctx->width));
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, png_decoder_t, &png_decoder_data_type, ptr);
 
-  rb_ivar_set(ret, id_stride,
-              INT2FIX(PNG_IMAGE_ROW_STRIDE(*ptr->simplified.ctx)));
+  if (ptr->common.busy) {
+    RUNTIME_ERROR("decoder is busy");
+  }
 
-  rb_ivar_set(ret, rb_intern("@height"),
-              INT2FIX(ptr->simplified.ctx->height));
+  if (ptr->common.scale_denom > 1) {
+    rb_exc_raise(create_not_implement_error(
+                        ":scale_denom is not supported by #decode_many"));
+  }
 
-  switch (ptr->common.format) {
-  case PNG_FORMAT_GRAY:
-    fmt = "GRAY";
-    nc  = 1;
-    break;
+  /*
+   * do decode
+   */
+  ptr->common.busy = !0;
 
-  case PNG_FORMAT_GA:
-    fmt = "GA";
-    nc  = 2;
-    break;
+  arg.ptr    = ptr;
+  arg.inputs = rb_ary_dup(inputs);
+  arg.num    = RARRAY_LEN(arg.inputs);
+  arg.ret    = rb_ary_new_capa(arg.num);
+  arg.items  = ZALLOC_N(batch_item_t, arg.num);
+  arg.pass   = 0;
 
-  case PNG_FORMAT_AG:
-    fmt = "AG";
-    nc  = 2;
-    break;
+  ret = rb_ensure(batch_dec_body, (VALUE)&arg, batch_dec_ensure, (VALUE)&arg);
 
-  case PNG_FORMAT_RGB:
-    fmt = "RGB";
-    nc  = 3;
-    break;
+  RB_GC_GUARD(arg.inputs);
 
-  case PNG_FORMAT_BGR:
-    fmt = "BGR";
-    nc  = 3;
-    break;
+  return ret;
+}
 
-  case PNG_FORMAT_RGBA:
-    fmt = "RGBA";
-    nc  = 4;
-    break;
+/*
+ * 行単位の列挙(PNG::Decoder#each_row / #each_row_batch)
+ *
+ * ノンインタレースの場合は指定行数ずつ GVL を解放して png_read_row() で
+ * 読み出してはブロックに渡すので、画像全体を保持しない。インタレースの
+ * 場合は全てのパスを読む必要があるので画像全体を作業領域に展開してから
+ * 列挙する。ブロックに渡す文字列は使い回す(呼び出し毎に内容が変わる)。
+ */
+#define EACH_ROW_BATCH              16
 
-  case PNG_FORMAT_ARGB:
-    fmt = "ARGB";
-    nc  = 4;
-    break;
+typedef struct {
+  png_decoder_t* ptr;
+  VALUE data;
+  VALUE buf;          // String passed to the block (reused)
+  long nrows;         // rows per batch
+  int batch;          // yield batches (#each_row_batch)
+  int locked;         // buf is locked by rb_str_locktmp()
+
+  size_t rowbytes;
+  png_byte* work;     // whole image (interlaced) or rows read at once
+  png_byte* dst;      // destination of each_row_nogvl()
+  png_uint_32 count;  // number of rows to read
+  int whole;          // read whole image
+} each_row_arg_t;
+
+static void*
+each_row_nogvl(void* _arg)
+{
+  each_row_arg_t* arg;
+  png_decoder_t* ptr;
+  png_uint_32 i;
 
-  case PNG_FORMAT_BGRA:
-    fmt = "BGRA";
-    nc  = 4;
-    break;
+  arg = (each_row_arg_t*)_arg;
+  ptr = arg->ptr;
 
-  case PNG_FORMAT_ABGR:
-    fmt = "ABGR";
-    nc  = 4;
-    break;
+  if (setjmp(png_jmpbuf(ptr->classic.ctx))) {
+    // ignore (the error message is stored in ptr->common.error)
 
-  default:
-    fmt = "unknown";
-    nc  = 0;
-    break;
+  } else if (arg->whole) {
+    png_read_image(ptr->classic.ctx, ptr->classic.rows);
+
+  } else {
+    for (i = 0; i < arg->count; i++) {
+      png_read_row(ptr->classic.ctx, arg->dst + (arg->rowbytes * i), NULL);
+    }
   }
 
-  rb_ivar_set(ret, id_pixfmt, rb_str_freeze(rb_str_new_cstr(fmt)));
-  rb_ivar_set(ret, id_ncompo, INT2FIX(nc));
+  return NULL;
+}
 
-  rb_obj_freeze(ret);
+static void
+each_row_read(each_row_arg_t* arg, png_byte* dst, png_uint_32 count)
+{
+  arg->dst   = dst;
+  arg->count = count;
 
-  return ret;
+  call_without_gvl(each_row_nogvl, arg);
+
+  if (arg->ptr->common.error[0] != '\0') {
+    rb_exc_raise(create_runtime_error("%s", arg->ptr->common.error));
+  }
 }
 
 static void
-clear_read_context(png_decoder_t* ptr)
+each_row_yield(each_row_arg_t* arg, const png_byte* src,
+               png_uint_32 y, png_uint_32 count)
 {
-  if (ptr->classic.ctx != NULL) {
-    png_destroy_read_struct(&ptr->classic.ctx,
-                            &ptr->classic.fsi,
-                            &ptr->classic.bsi);
+  png_uint_32 i;
 
-    ptr->classic.ctx  = NULL;
-    ptr->classic.fsi  = NULL;
-    ptr->classic.bsi  = NULL;
+  if (arg->batch) {
+    if (src != NULL) {
+      rb_str_resize(arg->buf, arg->rowbytes * count);
+      memcpy(RSTRING_PTR(arg->buf), src, arg->rowbytes * count);
+    }
 
-    ptr->classic.text = NULL;
-    ptr->classic.time = NULL;
-  }
+    rb_yield_values(3, arg->buf, UINT2NUM(y), UINT2NUM(count));
 
-  ptr->classic.io.ptr  = NULL;
-  ptr->classic.io.size = 0;
-  ptr->classic.io.pos  = 0;
-}
+  } else {
+    for (i = 0; i < count; i++) {
+      rb_str_resize(arg->buf, arg->rowbytes);
+      memcpy(RSTRING_PTR(arg->buf), src + (arg->rowbytes * i), arg->rowbytes);
 
-typedef struct {
-  png_decoder_t* ptr;
-  VALUE data;
-} read_header_arg_t ;
+      rb_yield_values(2, arg->buf, UINT2NUM(y + i));
+    }
+  }
+}
 
 static VALUE
-read_header_body(VALUE _arg)
+each_row_body(VALUE _arg)
 {
-  read_header_arg_t* arg;
+  each_row_arg_t* arg;
   png_decoder_t* ptr;
-  VALUE data;
-
-  /*
-   * initialize
-   */
-  arg  = (read_header_arg_t*)_arg;
-  ptr  = arg->ptr;
-  data = arg->data;
+  png_uint_32 height;
+  png_uint_32 y;
+  png_uint_32 n;
+  png_uint_32 i;
 
-  /*
-   * set context
-   */
-  set_read_context(ptr, data);
+  arg = (each_row_arg_t*)_arg;
+  ptr = arg->ptr;
 
   /*
    * read header
    */
+  set_read_context(ptr, arg->data);
+
   if (setjmp(png_jmpbuf(ptr->classic.ctx))) {
-    rb_exc_raise(ptr->common.error);
+    rb_exc_raise(create_runtime_error("%s", ptr->common.error));
+
+  } else {
+    png_read_info(ptr->classic.ctx, ptr->classic.fsi);
+    set_read_transform(ptr, ptr->classic.ctx, ptr->classic.fsi);
+
+    arg->whole = (png_set_interlace_handling(ptr->classic.ctx) > 1);
+
+    png_read_update_info(ptr->classic.ctx, ptr->classic.fsi);
+  }
+
+  height        = png_get_image_height(ptr->classic.ctx, ptr->classic.fsi);
+  arg->rowbytes = png_get_rowbytes(ptr->classic.ctx, ptr->classic.fsi);
+  arg->buf      = rb_str_buf_new(arg->rowbytes * arg->nrows);
+
+  if (arg->whole) {
+    /*
+     * interlaced: decode whole image, then enumerate
+     */
+    arg->work = (png_byte*)xmalloc(arg->rowbytes * height);
+
+    ptr->classic.rows = get_row_buf(ptr, height);
+    for (i = 0; i < height; i++) {
+      ptr->classic.rows[i] = arg->work + (arg->rowbytes * i);
+    }
+
+    each_row_read(arg, NULL, 0);
+
+    for (y = 0; y < height; y += n) {
+      n = ((height - y) < arg->nrows)? (height - y): (png_uint_32)arg->nrows;
+      each_row_yield(arg, arg->work + (arg->rowbytes * y), y, n);
+    }
+
+  } else if (arg->batch) {
+    /*
+     * non-interlaced batch: read rows into the String directly
+     */
+    for (y = 0; y < height; y += n) {
+      n = ((height - y) < arg->nrows)? (height - y): (png_uint_32)arg->nrows;
+
+      rb_str_resize(arg->buf, arg->rowbytes * n);
+      rb_str_locktmp(arg->buf);
+      arg->locked = !0;
+
+      each_row_read(arg, (png_byte*)RSTRING_PTR(arg->buf), n);
+
+      rb_str_unlocktmp(arg->buf);
+      arg->locked = 0;
+
+      each_row_yield(arg, NULL, y, n);
+    }
 
   } else {
-    png_read_info(ptr->classic.ctx, ptr->classic.fsi);
-    get_header_info(ptr);
+    /*
+     * non-interlaced: read some rows at once, then yield each row
+     */
+    arg->work = (png_byte*)xmalloc(arg->rowbytes * arg->nrows);
+
+    for (y = 0; y < height; y += n) {
+      n = ((height - y) < arg->nrows)? (height - y): (png_uint_32)arg->nrows;
+
+      each_row_read(arg, arg->work, n);
+      each_row_yield(arg, arg->work, y, n);
+    }
   }
 
-  return create_meta(ptr);
+  return Qnil;
 }
 
 static VALUE
-read_header_ensure(VALUE _arg)
+each_row_ensure(VALUE _arg)
 {
-  clear_read_context((png_decoder_t*)_arg);
+  each_row_arg_t* arg;
+  png_decoder_t* ptr;
+
+  arg = (each_row_arg_t*)_arg;
+  ptr = arg->ptr;
+
+  if (arg->locked) rb_str_unlocktmp(arg->buf);
+  if (arg->work) xfree(arg->work);
+
+  ptr->classic.rows = NULL;
+
+  clear_read_context(ptr);
+  warn_buf_clear(&ptr->common.warn);
+
+  ptr->common.busy = 0;
 
   return Qundef;
 }
 
 static VALUE
-rb_decoder_read_header(VALUE self, VALUE data)
+do_each_row(VALUE self, VALUE data, long nrows, int batch)
 {
-  VALUE ret;
+  each_row_arg_t arg;
   png_decoder_t* ptr;
-  read_header_arg_t arg;
 
   /*
    * argument check
    */
   Check_Type(data, T_STRING);
 
-  if (RSTRING_LEN(data) < 8) {
-    RUNTIME_ERROR("data too short.");
-  }
-
-  if (png_sig_cmp((png_const_bytep)RSTRING_PTR(data), 0, 8)) {
+  if (RSTRING_LEN(data) < 8 ||
+      png_sig_cmp((png_const_bytep)RSTRING_PTR(data), 0, 8)) {
     RUNTIME_ERROR("Invalid PNG signature.");
   }
 
@@ -1852,219 +8143,366 @@ rb_decoder_read_header(VALUE self, VALUE data)
    */
   TypedData_Get_Struct(self, png_decoder_t, &png_decoder_data_type, ptr);
 
+  if (ptr->common.busy) {
+    RUNTIME_ERROR("decoder is busy");
+  }
+
+  if (ptr->common.scale_denom > 1) {
+    rb_exc_raise(create_not_implement_error(
+                        ":scale_denom is not supported by #each_row"));
+  }
+
   /*
-   * call read header funciton
+   * do enumerate
    */
-  arg.ptr  = ptr;
-  arg.data = data;
+  ptr->common.busy = !0;
 
-  ret = rb_ensure(read_header_body, (VALUE)&arg,
-                  read_header_ensure, (VALUE)ptr);
+  memset(&arg, 0, sizeof(arg));
 
-  return ret;
+  arg.ptr   = ptr;
+  arg.data  = rb_str_new_frozen(data);
+  arg.buf   = Qnil;
+  arg.nrows = nrows;
+  arg.batch = batch;
+
+  rb_ensure(each_row_body, (VALUE)&arg, each_row_ensure, (VALUE)&arg);
+
+  RB_GC_GUARD(arg.data);
+  RB_GC_GUARD(arg.buf);
+
+  return self;
+}
+
+static VALUE
+rb_decoder_each_row(VALUE self, VALUE data)
+{
+  RETURN_ENUMERATOR(self, 1, &data);
+
+  return do_each_row(self, data, EACH_ROW_BATCH, 0);
 }
 
 static VALUE
-rb_decode_result_meta(VALUE self)
+rb_decoder_each_row_batch(VALUE self, VALUE data, VALUE nrows)
 {
-  return rb_ivar_get(self, id_meta);
+  VALUE argv[2];
+
+  argv[0] = data;
+  argv[1] = nrows;
+
+  RETURN_ENUMERATOR(self, 2, argv);
+
+  if (NUM2LONG(nrows) <= 0 || NUM2LONG(nrows) > PNG_UINT_31_MAX) {
+    RANGE_ERROR("number of rows is out of range");
+  }
+
+  return do_each_row(self, data, NUM2LONG(nrows), !0);
 }
 
 typedef struct {
   png_decoder_t* ptr;
-  VALUE data;
-} decode_arg_t;
+  png_bytep src;
+  VALUE row;
+  png_uint_32 y;
+} stream_yield_arg_t;
 
 static VALUE
-decode_simplified_api_body(VALUE _arg)
+stream_alloc_body(VALUE _arg)
 {
-  VALUE ret;
+  png_stream_t* st;
+  size_t size;
 
-  decode_arg_t* arg;
+  st   = (png_stream_t*)_arg;
+  size = st->stride * st->height;
+
+  st->obuf = create_result(size, st->need_meta);
+
+  st->base = (uint8_t*)RSTRING_PTR(st->obuf);
+
+  return Qnil;
+}
+
+static void*
+stream_alloc_with_gvl(void* arg)
+{
+  png_stream_t* st;
+
+  st = (png_stream_t*)arg;
+
+  rb_protect(stream_alloc_body, (VALUE)st, &st->state);
+
+  return NULL;
+}
+
+static VALUE
+stream_yield_body(VALUE _arg)
+{
+  stream_yield_arg_t* arg;
+  png_stream_t* st;
+  png_uint_32 y;
+
+  arg = (stream_yield_arg_t*)_arg;
+  st  = arg->ptr->common.stream;
+
+  if (arg->row != Qnil) {
+    rb_funcall(st->proc, rb_intern("call"), 2, arg->row, INT2FIX(arg->y));
+
+  } else {
+    // interlace 画像は全ての行が揃った時点でまとめて渡す
+    for (y = 0; y < st->height; y++) {
+      rb_funcall(st->proc, rb_intern("call"), 2,
+                 rb_str_new((const char*)st->base + (y * st->stride),
+                            st->stride),
+                 INT2FIX(y));
+    }
+  }
+
+  return Qnil;
+}
+
+static void*
+stream_yield_with_gvl(void* _arg)
+{
+  stream_yield_arg_t* arg;
+  png_stream_t* st;
+
+  arg = (stream_yield_arg_t*)_arg;
+  st  = arg->ptr->common.stream;
+
+  rb_protect(stream_yield_body, (VALUE)arg, &st->state);
+
+  return NULL;
+}
+
+static void
+stream_info_callback(png_structp ctx, png_infop info)
+{
   png_decoder_t* ptr;
-  VALUE data;
+  png_stream_t* st;
+  int passes;
 
-  size_t stride;
-  size_t size;
+  ptr = (png_decoder_t*)png_get_progressive_ptr(ctx);
+  st  = ptr->common.stream;
 
-  /*
-   * initialize
-   */
-  arg  = (decode_arg_t*)_arg;
-  ptr  = arg->ptr;
-  data = arg->data;
+  set_read_transform(ptr, ctx, info);
+
+  passes = png_set_interlace_handling(ctx);
+  png_read_update_info(ctx, info);
+
+  st->width      = png_get_image_width(ctx, info);
+  st->height     = png_get_image_height(ctx, info);
+  st->stride     = png_get_rowbytes(ctx, info);
+  st->interlaced = (passes > 1);
 
   /*
-   * call simplified API
+   * ブロックが与えられていない場合と interlace 画像の場合は出力先の
+   * バッファを確保する(Ruby のオブジェクトを生成するので GVL を確保する)。
    */
-  do {
-    ptr->simplified.ctx = (png_imagep)xmalloc(sizeof(png_image));
-    memset(ptr->simplified.ctx, 0, sizeof(png_image));
+  if (st->proc == Qnil || st->interlaced) {
+    rb_thread_call_with_gvl(stream_alloc_with_gvl, st);
+    if (st->state != 0) png_error(ctx, "interrupted");
+  }
+}
 
-    ptr->simplified.ctx->version = PNG_IMAGE_VERSION;
+static VALUE
+stream_new_row(VALUE _arg)
+{
+  stream_yield_arg_t* arg;
+  png_stream_t* st;
 
-    png_image_begin_read_from_memory(ptr->simplified.ctx,
-                                     RSTRING_PTR(data), RSTRING_LEN(data));
-    if (PNG_IMAGE_FAILED(*ptr->simplified.ctx)) {
-      RUNTIME_ERROR("png_image_begin_read_from_memory() failed");
-    }
+  arg = (stream_yield_arg_t*)_arg;
+  st  = arg->ptr->common.stream;
 
-    ptr->simplified.ctx->format = ptr->common.format;
+  return rb_str_new((const char*)arg->src, st->stride);
+}
 
-    stride = PNG_IMAGE_ROW_STRIDE(*ptr->simplified.ctx);
-    size   = PNG_IMAGE_BUFFER_SIZE(*ptr->simplified.ctx, stride);
-    ret    = rb_str_buf_new(size);
-    rb_str_set_len(ret, size);
+static void*
+stream_deliver_row_with_gvl(void* _arg)
+{
+  stream_yield_arg_t* arg;
+  png_stream_t* st;
 
-    png_image_finish_read(ptr->simplified.ctx,
-                          NULL, RSTRING_PTR(ret), stride, NULL);
-    if (PNG_IMAGE_FAILED(*ptr->simplified.ctx)) {
-      RUNTIME_ERROR("png_image_finish_read() failed");
-    }
+  arg = (stream_yield_arg_t*)_arg;
+  st  = arg->ptr->common.stream;
 
-    if (ptr->common.need_meta) {
-      rb_ivar_set(ret, id_meta, create_tiny_meta(ptr));
-      rb_define_singleton_method(ret, "meta", rb_decode_result_meta, 0);
-    }
-  } while(0);
+  arg->row = rb_protect(stream_new_row, (VALUE)arg, &st->state);
 
-  return ret;
+  if (st->state == 0) {
+    rb_protect(stream_yield_body, (VALUE)arg, &st->state);
+  }
+
+  return NULL;
 }
 
-static VALUE
-decode_simplified_api_ensure(VALUE _arg)
+static void
+stream_row_callback(png_structp ctx,
+                    png_bytep row, png_uint_32 y, int pass)
 {
   png_decoder_t* ptr;
+  png_stream_t* st;
+  stream_yield_arg_t arg;
 
-  ptr = (png_decoder_t*)_arg;
+  ptr = (png_decoder_t*)png_get_progressive_ptr(ctx);
+  st  = ptr->common.stream;
 
-  if (ptr->simplified.ctx) {
-    png_image_free(ptr->simplified.ctx);
-    xfree(ptr->simplified.ctx);
+  if (row == NULL || y >= st->height) return;
+
+  if (st->obuf != Qnil) {
+    png_progressive_combine_row(ctx, st->base + (y * st->stride), row);
   }
 
-  ptr->simplified.ctx = NULL;
+  if (st->proc != Qnil && !st->interlaced) {
+    arg.ptr = ptr;
+    arg.src = row;
+    arg.row = Qnil;
+    arg.y   = y;
 
-  return Qundef;
+    rb_thread_call_with_gvl(stream_deliver_row_with_gvl, &arg);
+    if (st->state != 0) png_error(ctx, "interrupted");
+  }
 }
 
-static VALUE
-decode_classic_api_body(VALUE _arg)
+static void
+stream_end_callback(png_structp ctx, png_infop info)
 {
-  VALUE ret;
-
-  decode_arg_t* arg;
   png_decoder_t* ptr;
-  VALUE data;
+  png_stream_t* st;
+  stream_yield_arg_t arg;
 
-  size_t stride;
+  ptr = (png_decoder_t*)png_get_progressive_ptr(ctx);
+  st  = ptr->common.stream;
 
-  png_uint_32 i;
-  png_byte* p;
+  st->finished = !0;
 
-  double file_gamma;
+  if (st->proc != Qnil && st->interlaced) {
+    arg.ptr = ptr;
+    arg.src = NULL;
+    arg.row = Qnil;
+    arg.y   = 0;
 
-  /*
-   * initialize
-   */
-  arg  = (decode_arg_t*)_arg;
-  ptr  = arg->ptr;
-  data = arg->data;
+    rb_thread_call_with_gvl(stream_yield_with_gvl, &arg);
+    if (st->state != 0) png_error(ctx, "interrupted");
+  }
+}
 
-  /*
-   * set context
-   */
-  set_read_context(ptr, data);
+static void
+start_stream(png_decoder_t* ptr, VALUE proc)
+{
+  png_stream_t* st;
 
-  /*
-   * read basic info
-   */
-  if (setjmp(png_jmpbuf(ptr->classic.ctx))) {
-    rb_exc_raise(ptr->common.error);
+  st = (png_stream_t*)malloc(sizeof(png_stream_t));
+  if (st == NULL) NOMEMORY_ERROR("no memory");
 
-  } else {
-    png_read_info(ptr->classic.ctx, ptr->classic.fsi);
+  memset(st, 0, sizeof(*st));
 
-    /*
-     * gamma correction
-     */
-    if (!isnan(ptr->common.display_gamma)) {
-      if (!png_get_gAMA(ptr->classic.ctx, ptr->classic.fsi, &file_gamma)) {
-        file_gamma = 0.45;
-      }
+  st->proc      = proc;
+  st->obuf      = Qnil;
+  st->need_meta = ptr->common.need_meta;
 
-      png_set_gamma(ptr->classic.ctx, ptr->common.display_gamma, file_gamma);
-    }
+  st->ctx = create_read_struct(ptr);
+  if (st->ctx == NULL) {
+    free(st);
+    RUNTIME_ERROR("png_create_read_struct() failed");
+  }
 
-    png_read_update_info(ptr->classic.ctx, ptr->classic.fsi);
+  st->info = png_create_info_struct(st->ctx);
+  if (st->info == NULL) {
+    stream_free(st);
+    RUNTIME_ERROR("png_create_info_struct() failed");
+  }
 
-    /*
-     * get image size
-     */
+  png_set_progressive_read_fn(st->ctx,
+                              ptr,
+                              stream_info_callback,
+                              stream_row_callback,
+                              stream_end_callback);
 
-    ptr->classic.width  = \
-        png_get_image_width(ptr->classic.ctx, ptr->classic.fsi);
+  ptr->common.stream = st;
+}
 
-    ptr->classic.height = \
-        png_get_image_height(ptr->classic.ctx, ptr->classic.fsi);
+static void
+stop_stream(png_decoder_t* ptr)
+{
+  if (ptr->common.stream != NULL) {
+    stream_free(ptr->common.stream);
+    ptr->common.stream = NULL;
+  }
+}
 
-    stride = png_get_rowbytes(ptr->classic.ctx, ptr->classic.fsi);
+static void*
+feed_nogvl(void* _arg)
+{
+  decode_arg_t* arg;
+  png_decoder_t* ptr;
+  png_stream_t* st;
 
-    /*
-     * alloc return memory
-     */
-    ret  = rb_str_buf_new(stride * ptr->classic.height);
-    rb_str_set_len(ret, stride * ptr->classic.height);
+  arg = (decode_arg_t*)_arg;
+  ptr = arg->ptr;
+  st  = ptr->common.stream;
 
-    /*
-     * alloc rows
-     */
-    ptr->classic.rows = png_malloc(ptr->classic.ctx,
-                                   ptr->classic.height * sizeof(png_byte*));
-    if (ptr->classic.rows == NULL) {
-      NOMEMORY_ERROR("no memory");
-    }
+  if (setjmp(png_jmpbuf(st->ctx))) {
+    // ignore (the error message is stored in ptr->common.error)
 
-    p = (png_byte*)RSTRING_PTR(ret);
-    for (i = 0; i < ptr->classic.height; i++) {
-      ptr->classic.rows[i] = p;
-      p += stride;
-    }
+  } else {
+    png_process_data(st->ctx,
+                     st->info,
+                     (png_bytep)RSTRING_PTR(arg->data),
+                     RSTRING_LEN(arg->data));
+  }
 
-    png_read_image(ptr->classic.ctx, ptr->classic.rows);
-    png_read_end(ptr->classic.ctx, ptr->classic.fsi);
+  return NULL;
+}
 
-    if (ptr->classic.need_meta) {
-      get_header_info(ptr);
-      rb_ivar_set(ret, id_meta, create_meta(ptr));
-      rb_define_singleton_method(ret, "meta", rb_decode_result_meta, 0);
-    }
+static VALUE
+feed_body(VALUE _arg)
+{
+  decode_arg_t* arg;
+  png_decoder_t* ptr;
+  png_stream_t* st;
+  int state;
+
+  arg = (decode_arg_t*)_arg;
+  ptr = arg->ptr;
+  st  = ptr->common.stream;
+
+  ptr->common.error[0] = '\0';
+
+  rb_thread_call_without_gvl(feed_nogvl, arg, RUBY_UBF_PROCESS, NULL);
+
+  /*
+   * コールバック内で例外が発生した場合や libpng がエラーを通知した場合は
+   * ストリームを破棄してから例外を再送出する。
+   */
+  if (st->state != 0) {
+    state = st->state;
+    stop_stream(ptr);
+    rb_jump_tag(state);
   }
 
-  return ret;
+  if (ptr->common.error[0] != '\0') {
+    stop_stream(ptr);
+    rb_exc_raise(create_runtime_error("%s", ptr->common.error));
+  }
+
+  return (st->finished)? Qtrue: Qfalse;
 }
 
 static VALUE
-decode_classic_api_ensure(VALUE _arg)
+feed_ensure(VALUE _arg)
 {
   png_decoder_t* ptr;
 
   ptr = (png_decoder_t*)_arg;
 
-  if (ptr->classic.rows) {
-    png_free(ptr->classic.ctx, ptr->classic.rows);
-    ptr->classic.rows = NULL;
-  }
+  warn_buf_clear(&ptr->common.warn);
 
-  clear_read_context(ptr);
+  ptr->common.busy = 0;
 
   return Qundef;
 }
 
 static VALUE
-rb_decoder_decode(VALUE self, VALUE data)
+rb_decoder_feed(VALUE self, VALUE data)
 {
-  VALUE ret;
   png_decoder_t* ptr;
   decode_arg_t arg;
 
@@ -2073,30 +8511,83 @@ rb_decoder_decode(VALUE self, VALUE data)
    */
   Check_Type(data, T_STRING);
 
-  if (png_sig_cmp((png_const_bytep)RSTRING_PTR(data), 0, 8)) {
-    RUNTIME_ERROR("Invalid PNG signature.");
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, png_decoder_t, &png_decoder_data_type, ptr);
+
+  if (ptr->common.busy) {
+    RUNTIME_ERROR("decoder is busy");
   }
 
+  if (ptr->common.scale_denom > 1) {
+    rb_exc_raise(create_not_implement_error(
+                        ":scale_denom is not supported by #feed"));
+  }
+
+  if (ptr->common.stream == NULL) {
+    start_stream(ptr, rb_block_given_p()? rb_block_proc(): Qnil);
+
+  } else if (ptr->common.stream->finished) {
+    RUNTIME_ERROR("stream already finished");
+  }
+
+  /*
+   * call process data
+   */
+  ptr->common.busy = !0;
+
+  arg.ptr  = ptr;
+  arg.data = rb_str_new_frozen(data);
+  arg.dst  = NULL;
+
+  return rb_ensure(feed_body, (VALUE)&arg, feed_ensure, (VALUE)ptr);
+}
+
+static VALUE
+rb_decoder_finish(VALUE self)
+{
+  VALUE ret;
+  png_decoder_t* ptr;
+  png_decoder_t tmp;
+  png_stream_t* st;
+
   /*
    * strip object
    */
   TypedData_Get_Struct(self, png_decoder_t, &png_decoder_data_type, ptr);
 
+  if (ptr->common.busy) {
+    RUNTIME_ERROR("decoder is busy");
+  }
+
+  st = ptr->common.stream;
+
+  if (st == NULL) {
+    RUNTIME_ERROR("stream not started");
+  }
+
+  if (!st->finished) {
+    stop_stream(ptr);
+    RUNTIME_ERROR("data not enough.");
+  }
+
   /*
-   * call decode funcs
+   * ブロックを与えていた場合、行データは既に渡し終えているので nil を返す
    */
-  arg.ptr  = ptr;
-  arg.data = data;
+  ret = (st->proc == Qnil)? st->obuf: Qnil;
 
-  if (ptr->common.api_type == API_SIMPLIFIED) {
-    ret = rb_ensure(decode_simplified_api_body, (VALUE)&arg,
-                    decode_simplified_api_ensure, (VALUE)ptr);
+  if (ret != Qnil && ptr->common.need_meta) {
+    tmp             = *ptr;
+    tmp.classic.ctx = st->ctx;
+    tmp.classic.fsi = st->info;
 
-  } else {
-    ret = rb_ensure(decode_classic_api_body, (VALUE)&arg,
-                    decode_classic_api_ensure, (VALUE)ptr);
+    get_header_info(&tmp);
+    rb_ivar_set(ret, id_meta, create_meta(&tmp));
   }
 
+  stop_stream(ptr);
+
   return ret;
 }
 
@@ -2111,12 +8602,25 @@ Init_png()
   rb_ext_ractor_safe(true);
 #endif /* defined(HAVE_RB_EXT_RACTOR_SAFE) */
 
+  filter_init();
+  fdeflate_init();
+  odeflate_init();
+
   module = rb_define_module("PNG");
+  rb_define_const(module, "FILTER_ENGINE", FROZEN_STR(filter_engine()));
+  rb_define_singleton_method(module, "probe", rb_png_probe, -1);
+  rb_define_singleton_method(module, "scan_headers", rb_png_scan_headers, -1);
 
   encoder_klass = rb_define_class_under(module, "Encoder", rb_cObject);
   rb_define_alloc_func(encoder_klass, rb_encoder_alloc);
   rb_define_method(encoder_klass, "initialize", rb_encoder_initialize, -1);
-  rb_define_method(encoder_klass, "encode", rb_encoder_encode, 1);
+  rb_define_method(encoder_klass, "encode", rb_encoder_encode, -1);
+  rb_define_method(encoder_klass, "encode_to", rb_encoder_encode_to, -1);
+  rb_define_singleton_method(encoder_klass, "encode_many",
+                             rb_encoder_s_encode_many, -1);
+  rb_define_method(encoder_klass, "start", rb_encoder_start, -1);
+  rb_define_method(encoder_klass, "write_rows", rb_encoder_write_rows, 1);
+  rb_define_method(encoder_klass, "finish", rb_encoder_finish, 0);
   rb_define_alias(encoder_klass, "compress", "encode");
   rb_define_alias(encoder_klass, "<<", "encode");
 
@@ -2124,7 +8628,17 @@ Init_png()
   rb_define_alloc_func(decoder_klass, rb_decoder_alloc);
   rb_define_method(decoder_klass, "initialize", rb_decoder_initialize, -1);
   rb_define_method(decoder_klass, "read_header", rb_decoder_read_header, 1);
-  rb_define_method(decoder_klass, "decode", rb_decoder_decode, 1);
+  rb_define_method(decoder_klass, "decode", rb_decoder_decode, -1);
+  rb_define_method(decoder_klass, "decode_into", rb_decoder_decode_into, -1);
+  rb_define_method(decoder_klass, "decode_file", rb_decoder_decode_file, -1);
+  rb_define_method(decoder_klass, "read_header_file",
+                   rb_decoder_read_header_file, 1);
+  rb_define_method(decoder_klass, "decode_many", rb_decoder_decode_many, 1);
+  rb_define_method(decoder_klass, "each_row", rb_decoder_each_row, 1);
+  rb_define_method(decoder_klass, "each_row_batch",
+                   rb_decoder_each_row_batch, 2);
+  rb_define_method(decoder_klass, "feed", rb_decoder_feed, 1);
+  rb_define_method(decoder_klass, "finish", rb_decoder_finish, 0);
   rb_define_alias(decoder_klass, "decompress", "decode");
   rb_define_alias(decoder_klass, "<<", "decode");
 
@@ -2139,9 +8653,16 @@ Init_png()
   rb_define_attr(meta_klass, "filter_method", 1, 0);
   rb_define_attr(meta_klass, "pixel_format", 1, 0);
   rb_define_attr(meta_klass, "num_components", 1, 0);
-  rb_define_attr(meta_klass, "text", 1, 0);
-  rb_define_attr(meta_klass, "time", 1, 0);
+  rb_define_method(meta_klass, "text", rb_meta_text, 0);
+  rb_define_method(meta_klass, "time", rb_meta_time, 0);
   rb_define_attr(meta_klass, "file_gamma", 1, 0);
+  rb_define_attr(meta_klass, "chunks", 1, 0);
+
+  image_klass = rb_define_class_under(module, "Image", rb_cString);
+  rb_define_method(image_klass, "meta", rb_image_meta, 0);
+#ifdef SUPPORT_MEMORY_VIEW
+  rb_memory_view_register(image_klass, &image_view_entry);
+#endif /* defined(SUPPORT_MEMORY_VIEW) */
 
   for (i = 0; i < (int)N(encoder_opt_keys); i++) {
     encoder_opt_ids[i] = rb_intern_const(encoder_opt_keys[i]);
@@ -2151,9 +8672,21 @@ Init_png()
     decoder_opt_ids[i] = rb_intern_const(decoder_opt_keys[i]);
   }
 
-  id_meta    = rb_intern_const("@meta");
-  id_stride  = rb_intern_const("@stride");
-  id_format  = rb_intern_const("@format");
-  id_pixfmt  = rb_intern_const("@pixel_format");
-  id_ncompo  = rb_intern_const("@num_components");
+  id_meta      = rb_intern_const("@meta");
+  id_width     = rb_intern_const("@width");
+  id_height    = rb_intern_const("@height");
+  id_stride    = rb_intern_const("@stride");
+  id_depth     = rb_intern_const("@bit_depth");
+  id_ctype     = rb_intern_const("@color_type");
+  id_imeth     = rb_intern_const("@interlace_method");
+  id_cmeth     = rb_intern_const("@compression_method");
+  id_fmeth     = rb_intern_const("@filter_method");
+  id_format    = rb_intern_const("@format");
+  id_pixfmt    = rb_intern_const("@pixel_format");
+  id_ncompo    = rb_intern_const("@num_components");
+  id_gamma     = rb_intern_const("@file_gamma");
+  id_lazy      = rb_intern_const("lazy");
+  id_localtime = rb_intern_const("localtime");
+  id_utc       = rb_intern_const("utc");
+  id_chunks    = rb_intern_const("@chunks");
 }
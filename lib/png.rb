@@ -9,16 +9,27 @@ require "png/png"
 
 module PNG
   class << self
+    #
+    # module functions reuse decoders kept per thread (per fiber) and per
+    # option set, so repeated calls do not rebuild the decoder.
+    #
+    DECODER_POOL_KEY  = :__png_decoder_pool__
+    DECODER_POOL_SIZE = 8
+
     def read_header(data)
-      return PNG::Decoder.new.read_header(data)
+      return pooled_decoder({}).read_header(data)
+    end
+
+    def decode(png, region: nil, **opt)
+      return pooled_decoder(opt).decode(png, :region => region)
     end
 
-    def decode(png, **opt)
-      return PNG::Decoder.new(**opt) << png
+    def read_header_file(path)
+      return pooled_decoder({}).read_header_file(path)
     end
 
-    def decode_file(path, **opt)
-      return PNG.decode(IO.binread(path), **opt)
+    def decode_file(path, region: nil, **opt)
+      return pooled_decoder(opt).decode_file(path, :region => region)
     end
 
     def encode(w, h, raw, **opt)
@@ -28,5 +39,41 @@ module PNG
     def encode_file(w, h, path, **opt)
       return PNG.encode(w, h, IO.binread(path), **opt)
     end
+
+    #
+    # batch functions: the whole batch is processed by a native thread pool
+    # (sized to the number of CPUs by default). the results are returned in
+    # the order of the inputs, and a failed item is returned as an exception
+    # object instead of raising it.
+    #
+    def decode_many(inputs, **opt)
+      return PNG::Decoder.new(:threads => true, **opt).decode_many(inputs)
+    end
+
+    def encode_many(jobs, threads: true)
+      jobs = jobs.map { |w, h, raw, opt|
+        begin
+          [PNG::Encoder.new(w, h, **(opt || {})), raw]
+        rescue => e
+          e
+        end
+      }
+
+      return PNG::Encoder.encode_many(jobs, :threads => threads)
+    end
+
+    private
+
+    def pooled_decoder(opt)
+      pool = (Thread.current[DECODER_POOL_KEY] ||= {})
+      ret  = pool[opt]
+
+      if not ret
+        pool.clear if pool.size >= DECODER_POOL_SIZE
+        ret = pool[opt.dup.freeze] = PNG::Decoder.new(**opt)
+      end
+
+      return ret
+    end
   end
 end
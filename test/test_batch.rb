@@ -0,0 +1,128 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestBatch < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+  TYPES    = ["GRAY", "GA", "RGB", "RGBA"]
+
+  data("default", nil)
+  data("single thread", 1)
+  data("4 threads", 4)
+
+  test "decode_many" do |threads|
+    pngs = TYPES.map { |type| (DATA_DIR + "sample_#{type}.png").binread }
+    opt  = (threads)? {:threads => threads}: {}
+    exp  = pngs.map { |png| PNG.decode(png, :pixel_format => :RGBA) }
+
+    ret  = PNG.decode_many(pngs * 4, :pixel_format => :RGBA, **opt)
+
+    assert_equal(exp * 4, ret)
+    assert_equal(128, ret[0].meta.width)
+    assert_equal(133, ret[0].meta.height)
+    assert_equal("RGBA", ret[0].meta.pixel_format)
+  end
+
+  test "decode_many without meta" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    ret = PNG.decode_many([png], :without_meta => true)
+
+    assert_instance_of(String, ret[0])
+    assert_equal(PNG.decode(png), ret[0])
+  end
+
+  test "decode_many with bad items" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    ret = PNG.decode_many([png, "not a png", 1, png[0, 200], png])
+
+    assert_equal(5, ret.size)
+    assert_equal(PNG.decode(png), ret[0])
+    assert_kind_of(RuntimeError, ret[1])
+    assert_kind_of(TypeError, ret[2])
+    assert_kind_of(RuntimeError, ret[3])
+    assert_equal(PNG.decode(png), ret[4])
+  end
+
+  test "decode_many (empty)" do
+    assert_equal([], PNG.decode_many([]))
+  end
+
+  data("default", nil)
+  data("4 threads", 4)
+
+  test "encode_many" do |threads|
+    jobs = TYPES.map { |type|
+      raw = (DATA_DIR + "sample_#{type}.bin").binread
+      [128, 133, raw, {:pixel_format => type}]
+    }
+    opt  = (threads)? {:threads => threads}: {}
+    ret  = PNG.encode_many(jobs * 3, **opt)
+
+    assert_equal(12, ret.size)
+
+    ret.each_with_index { |png, i|
+      job = jobs[i % 4]
+      assert_equal(job[2], PNG.decode(png, :pixel_format => job[3][:pixel_format]))
+    }
+  end
+
+  test "encode_many with bad items" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    ret = PNG.encode_many([
+      [128, 133, raw],
+      [128, 133, raw[0, 100]],
+      [128, 133, raw, {:pixel_format => :FOO}],
+      [0, 133, raw],
+      [128, 133, nil],
+      [128, 133, raw, {:compression => 9}],
+    ])
+
+    assert_equal(6, ret.size)
+    assert_equal(raw, PNG.decode(ret[0]))
+    assert_kind_of(ArgumentError, ret[1])
+    assert_kind_of(Exception, ret[2])
+    assert_kind_of(Exception, ret[3])
+    assert_kind_of(TypeError, ret[4])
+    assert_equal(raw, PNG.decode(ret[5]))
+  end
+
+  test "encode_many with same encoder" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    enc = PNG::Encoder.new(128, 133)
+    ret = PNG::Encoder.encode_many([[enc, raw], [enc, raw]])
+
+    assert_equal(raw, PNG.decode(ret[0]))
+    assert_kind_of(RuntimeError, ret[1])
+
+    # the encoder is usable after the batch
+    assert_equal(raw, PNG.decode(enc << raw))
+  end
+
+  test "encode_many with to_ary job" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    job = Object.new
+    job.define_singleton_method(:to_ary) {[PNG::Encoder.new(128, 133), raw]}
+
+    ret = PNG::Encoder.encode_many([job, job])
+
+    assert_equal(raw, PNG.decode(ret[0]))
+    assert_equal(raw, PNG.decode(ret[1]))
+  end
+
+  test "encode_many with failing setup" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    enc = PNG::Encoder.new(128, 133, :filter => proc {raise "boom"})
+    ret = PNG::Encoder.encode_many([[enc, raw]])
+
+    assert_equal("boom", ret[0].message)
+
+    # the data and the encoder are released (not "encoder is busy")
+    assert_nothing_raised {raw << "x"}
+    assert_equal("boom", PNG::Encoder.encode_many([[enc, raw.chop]])[0].message)
+  end
+
+  test "bad :threads" do
+    assert_raise_kind_of(RangeError) {PNG.encode_many([], :threads => 0)}
+    assert_raise_kind_of(TypeError) {PNG.decode_many([], :threads => "1")}
+  end
+end
@@ -0,0 +1,95 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestDecodeInto < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  setup do
+    @png = (DATA_DIR + "sample_RGB.png").binread
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+  end
+
+  data("simplified", :simplified)
+  data("classic", :classic)
+
+  test "into String" do |api|
+    dec = PNG::Decoder.new(:api_type => api)
+    exp = dec << @png
+    buf = "\0".b * exp.bytesize
+
+    ret = assert_nothing_raised {dec.decode_into(@png, buf)}
+
+    assert_same(buf, ret)
+    assert_equal(exp, buf)
+
+    # reuse the same buffer
+    buf[0, 10] = "\xff".b * 10
+    dec.decode_into(@png, buf)
+    assert_equal(exp, buf)
+  end
+
+  data("simplified", :simplified)
+  data("classic", :classic)
+
+  test "with offset and stride" do |api|
+    dec = PNG::Decoder.new(:api_type => api)
+    exp = dec << @png
+    buf = "\xaa".b * (16 + (128 * 3 + 8) * 133)
+
+    dec.decode_into(@png, buf, offset: 16, stride: 128 * 3 + 8)
+
+    assert_equal("\xaa".b * 16, buf[0, 16])
+
+    133.times { |y|
+      row = buf.byteslice(16 + (y * (128 * 3 + 8)), 128 * 3 + 8)
+
+      assert_equal(exp.byteslice(y * 128 * 3, 128 * 3), row[0, 128 * 3])
+      assert_equal("\xaa".b * 8, row[128 * 3, 8])
+    }
+  end
+
+  test "into IO::Buffer" do
+    omit("IO::Buffer is not available") if not defined?(IO::Buffer)
+
+    dec = PNG::Decoder.new
+    buf = IO::Buffer.new(@raw.bytesize)
+
+    ret = assert_nothing_raised {dec.decode_into(@png, buf)}
+
+    assert_same(buf, ret)
+    assert_equal(dec << @png, buf.get_string)
+  end
+
+  test "errors" do
+    dec = PNG::Decoder.new
+    len = (dec << @png).bytesize
+
+    assert_raise_kind_of(ArgumentError) {
+      dec.decode_into(@png, "\0".b * (len - 1))
+    }
+
+    assert_raise_kind_of(ArgumentError) {
+      dec.decode_into(@png, "\0".b * len, offset: 1)
+    }
+
+    assert_raise_kind_of(ArgumentError) {
+      dec.decode_into(@png, "\0".b * len * 2, stride: 10)
+    }
+
+    assert_raise_kind_of(RangeError) {
+      dec.decode_into(@png, "\0".b * len, offset: -1)
+    }
+
+    assert_raise_kind_of(FrozenError) {
+      dec.decode_into(@png, ("\0".b * len).freeze)
+    }
+
+    assert_raise_kind_of(TypeError) {dec.decode_into(@png, 1)}
+
+    # the buffer is not left locked
+    buf = "\0".b * len
+    dec.decode_into(@png, buf)
+    assert_nothing_raised {buf << "x"}
+  end
+end
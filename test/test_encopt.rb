@@ -237,4 +237,62 @@ class TestEncodeOption < Test::Unit::TestCase
       PNG::Encoder.new(128, 133, :gamma => arg[0])
     }
   end
+
+  #
+  # :threads
+  #
+  data("1", 1)
+  data("2", 2)
+  data("7", 7)
+  data("true", true)
+  data("false", false)
+
+  test ":threads" do |val|
+    dat = (DATA_DIR + "sample_RGBA.bin").binread
+
+    # small strips are used to split the image into many pieces
+    big = dat * 40
+
+    enc = assert_nothing_raised {
+      PNG::Encoder.new(128, 133 * 40, :pixel_format => :RGBA, :threads => val)
+    }
+
+    png = assert_nothing_raised {
+      enc << big
+    }
+
+    assert_true(big.bytesize > png.bytesize)
+    assert_equal(big, PNG.decode(png, :pixel_format => :RGBA))
+  end
+
+  data("GRAY", :GRAY)
+  data("GA", :GA)
+  data("RGB", :RGB)
+  data("level 0", [:RGB, 0])
+  data("level 9", [:RGB, 9])
+  data("interlace", [:RGB, 6, true])
+
+  test ":threads with other options" do |arg|
+    fmt, lv, il = arg
+
+    dat = (DATA_DIR + "sample_#{fmt}.bin").binread
+    png = PNG.encode(128, 133, dat,
+                     :pixel_format => fmt, :threads => 4,
+                     :compression => lv || 6, :interlace => !!il,
+                     :text => {:title => "test"})
+
+    assert_equal(dat, PNG.decode(png, :pixel_format => fmt))
+    assert_equal({:title => "test"}, PNG.read_header(png).text)
+  end
+
+  data("0", [0, RangeError])
+  data("-1", [-1, RangeError])
+  data("string", ["2", TypeError])
+  data("float", [2.0, TypeError])
+
+  test "bad :threads" do |arg|
+    assert_raise_kind_of(arg[1]) {
+      PNG::Encoder.new(128, 133, :threads => arg[0])
+    }
+  end
 end
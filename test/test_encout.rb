@@ -0,0 +1,68 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestEncodeOutput < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  setup do
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+    @exp = PNG.encode(128, 133, @raw, :time => false)
+  end
+
+  def enc
+    # without tIME so that the output does not depend on the clock
+    return PNG::Encoder.new(128, 133, :time => false)
+  end
+
+  test "into String" do
+    buf = String.new(capacity: 4096)
+
+    png = assert_nothing_raised {enc.encode(@raw, buf)}
+
+    assert_same(buf, png)
+    assert_equal(@exp, png)
+
+    # reuse the same buffer
+    png = enc.encode(@raw, buf)
+    assert_same(buf, png)
+    assert_equal(@exp, png)
+
+    png = enc.encode(@raw, buf)
+    assert_same(buf, png)
+    assert_equal(@raw, PNG.decode(png))
+  end
+
+  test "into small String" do
+    buf = "".b
+    png = enc.encode(@raw, buf)
+
+    assert_same(buf, png)
+    assert_equal(@raw, PNG.decode(png))
+  end
+
+  test "into IO::Buffer" do
+    omit("IO::Buffer is not available") if not defined?(IO::Buffer)
+
+    buf = IO::Buffer.new(@exp.bytesize + 100)
+
+    png = assert_nothing_raised {enc.encode(@raw, buf)}
+
+    assert_kind_of(IO::Buffer, png)
+    assert_equal(@exp.bytesize, png.size)
+    assert_equal(@exp, png.get_string)
+  end
+
+  test "into too small IO::Buffer" do
+    omit("IO::Buffer is not available") if not defined?(IO::Buffer)
+
+    assert_raise_kind_of(RuntimeError) {
+      enc.encode(@raw, IO::Buffer.new(100))
+    }
+  end
+
+  test "bad output" do
+    assert_raise_kind_of(FrozenError) {enc.encode(@raw, "".freeze)}
+    assert_raise_kind_of(TypeError) {enc.encode(@raw, 1)}
+  end
+end
@@ -0,0 +1,101 @@
+require 'test/unit'
+require 'pathname'
+require 'tempfile'
+require 'png'
+
+class TestEncodeTo < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  setup do
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+  end
+
+  def enc(**opt)
+    return PNG::Encoder.new(128, 133, :time => false, **opt)
+  end
+
+  test "to path" do
+    Tempfile.create("encto") { |f|
+      n = enc.encode_to(f.path, @raw)
+
+      assert_equal(File.size(f.path), n)
+      assert_equal(enc << @raw, File.binread(f.path))
+
+      # truncate the existing file
+      enc.encode_to(Pathname(f.path), "\0" * @raw.bytesize)
+      assert_equal("\0" * @raw.bytesize, PNG.decode_file(f.path))
+    }
+  end
+
+  test "to IO" do
+    Tempfile.create("encto") { |f|
+      f.binmode
+      f.write("head")
+
+      n = enc.encode_to(f, @raw)
+      f.write("tail")
+      f.flush
+
+      dat = File.binread(f.path)
+
+      assert_equal("head", dat[0, 4])
+      assert_equal("tail", dat[-4..-1])
+      assert_equal(enc << @raw, dat[4, n])
+    }
+  end
+
+  data("tiny buffer", [1, nil])
+  data("small buffer", [100, nil])
+  data("flush rows", [4096, 8])
+  data("interlace", [4096, 8, true])
+  data("parallel", [4096, nil, false, 2])
+
+  test "buffer size" do |arg|
+    size, rows, interlace, threads = arg
+    opt = {:interlace => interlace || false, :threads => threads || 1}
+
+    Tempfile.create("encto") { |f|
+      n = enc(**opt).encode_to(f.path, @raw,
+                               :buffer_size => size, :flush_rows => rows)
+
+      assert_equal(File.size(f.path), n)
+      assert_equal(@raw, PNG.decode_file(f.path))
+
+      if not rows
+        assert_equal(enc(**opt) << @raw, File.binread(f.path))
+      end
+    }
+  end
+
+  test "to pipe" do
+    raw = Random.new(1).bytes(512 * 512 * 3)
+    enc = PNG::Encoder.new(512, 512, :compression => 0)
+
+    IO.pipe { |rd, wr|
+      th  = Thread.new {rd.read}
+      enc.encode_to(wr, raw, :buffer_size => 1024)
+      wr.close
+
+      assert_equal(raw, PNG.decode(th.value))
+    }
+  end
+
+  test "errors" do
+    assert_raise_kind_of(Errno::ENOENT) {enc.encode_to("/nonexistent/a.png", @raw)}
+    assert_raise_kind_of(TypeError) {enc.encode_to(nil, @raw)}
+    assert_raise_kind_of(ArgumentError) {enc.encode_to("/dev/null", @raw[1..])}
+    assert_raise_kind_of(RangeError) {
+      enc.encode_to("/dev/null", @raw, :buffer_size => 0)
+    }
+    assert_raise_kind_of(RangeError) {
+      enc.encode_to("/dev/null", @raw, :flush_rows => -1)
+    }
+
+    if File.exist?("/dev/full")
+      assert_raise_kind_of(RuntimeError) {enc.encode_to("/dev/full", @raw)}
+    end
+
+    # the encoder is usable after the errors
+    assert_equal(@raw, PNG.decode(enc << @raw))
+  end
+end
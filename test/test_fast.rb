@@ -0,0 +1,88 @@
+require 'test/unit'
+require 'pathname'
+require 'zlib'
+require 'png'
+
+class TestFast < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  def idat(png)
+    ret = "".b
+    pos = 8
+
+    while pos < png.bytesize
+      len  = png.byteslice(pos, 4).unpack1("N")
+      ret << png.byteslice(pos + 8, len) if png.byteslice(pos + 4, 4) == "IDAT"
+      pos += len + 12
+    end
+
+    return ret
+  end
+
+  setup do
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+  end
+
+  data("GRAY", ["GRAY", 1])
+  data("GA", ["GA", 2])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "round trip" do |arg|
+    [1, 5, 33, 97, 1000].each { |w|
+      raw = Random.new(w).bytes(w * 300 * arg[1]).bytes.map {|v| v & 0x0f}.pack("C*")
+
+      [1, 2].each { |th|
+        png = PNG.encode(w, 300, raw, :pixel_format => arg[0],
+                         :fast => true, :threads => th)
+
+        assert_equal(raw, PNG.decode(png, :pixel_format => arg[0]),
+                     "width=#{w} threads=#{th}")
+      }
+    }
+  end
+
+  test "sample image" do
+    png = PNG.encode(128, 133, @raw, :fast => true)
+
+    assert_equal(@raw, PNG.decode(png))
+    assert_equal(128 * 133 * 3 + 133, Zlib::Inflate.inflate(idat(png)).bytesize)
+    assert_operator(png.bytesize, :<, @raw.bytesize)
+
+    # with a fixed filter
+    png = PNG.encode(128, 133, @raw, :fast => true, :filter => :paeth)
+    assert_equal(@raw, PNG.decode(png))
+  end
+
+  test "flat and random images" do
+    # long runs in many strips
+    raw = "\x20\x40\x60".b * (1500 * 1000)
+    png = PNG.encode(1500, 1000, raw, :fast => true)
+    assert_equal(raw, PNG.decode(png))
+    assert_operator(png.bytesize, :<, raw.bytesize / 50)
+
+    # incompressible strips are stored
+    raw = Random.new(0).bytes(600 * 500 * 3)
+    png = PNG.encode(600, 500, raw, :fast => true)
+    assert_equal(raw, PNG.decode(png))
+    assert_operator(png.bytesize, :<, raw.bytesize + raw.bytesize / 100)
+  end
+
+  test "with restart points" do
+    raw = @raw * 40
+    png = PNG.encode(128, 133 * 40, raw, :fast => true, :restart_points => true)
+
+    dec = PNG::Decoder.new(:api_type => :classic, :threads => 2)
+    assert_equal(raw, dec << png)
+  end
+
+  test "errors" do
+    assert_raise_kind_of(ArgumentError) {
+      PNG::Encoder.new(1, 1, :fast => true, :interlace => true)
+    }
+
+    enc = PNG::Encoder.new(128, 133, :fast => true)
+    assert_raise_kind_of(ArgumentError) {enc.start {}}
+    assert_equal(@raw, PNG.decode(enc << @raw))
+  end
+end
@@ -0,0 +1,153 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestFiber < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  #
+  # minimal fiber scheduler (only what the tests need)
+  #
+  class Scheduler
+    def initialize
+      @readable = {}
+      @waiting  = {}
+      @ready    = []
+    end
+
+    def fiber(&blk)
+      fiber = Fiber.new(blocking: false, &blk)
+      fiber.resume
+      return fiber
+    end
+
+    def io_wait(io, events, timeout)
+      @readable[Fiber.current] = io
+      Fiber.yield
+      return events
+    end
+
+    def kernel_sleep(duration = nil)
+      @waiting[Fiber.current] = Process.clock_gettime(Process::CLOCK_MONOTONIC) + (duration || 0)
+      Fiber.yield
+    end
+
+    def block(blocker, timeout = nil)
+      @waiting[Fiber.current] = Process.clock_gettime(Process::CLOCK_MONOTONIC) + (timeout || 0.01)
+      Fiber.yield
+    end
+
+    def unblock(blocker, fiber)
+      @ready << fiber
+    end
+
+    def close
+      run
+    end
+
+    def run
+      while @readable.any? or @waiting.any? or @ready.any?
+        ios = @readable.values
+        now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        tmo = @waiting.values.map {|t| [t - now, 0].max}.min || 0.1
+
+        rd, = IO.select(ios, nil, nil, tmo) if ios.any?
+        sleep(tmo) if ios.empty? and @ready.empty?
+
+        @readable.select {|_, io| rd&.include?(io)}.each_key { |fiber|
+          @readable.delete(fiber)
+          fiber.resume
+        }
+
+        now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        @waiting.select {|_, t| t <= now}.each_key { |fiber|
+          @waiting.delete(fiber)
+          fiber.resume
+        }
+
+        @ready.shift.resume while @ready.any?
+      end
+    end
+  end
+
+  def with_scheduler
+    th = Thread.new {
+      Fiber.set_scheduler(Scheduler.new)
+      yield
+    }
+
+    return th.value
+  end
+
+  setup do
+    @raw = Random.new(1).bytes(1024 * 1024 * 3)
+    @png = PNG.encode(1024, 1024, @raw, :compression => 9)
+  end
+
+  data("simplified", :simplified)
+  data("classic", :classic)
+
+  test "decode in fiber" do |api|
+    ticks = 0
+    ret   = nil
+
+    with_scheduler {
+      Fiber.schedule {
+        ret = PNG::Decoder.new(:api_type => api) << @png
+      }
+
+      Fiber.schedule {
+        while not ret
+          ticks += 1
+          sleep(0.001)
+        end
+      }
+    }
+
+    assert_equal(@raw, ret)
+
+    # other fibers can run during the decode
+    assert_operator(ticks, :>, 0)
+  end
+
+  test "encode in fiber" do
+    ret = []
+
+    with_scheduler {
+      2.times {
+        Fiber.schedule {
+          ret << PNG.encode(1024, 1024, @raw, :compression => 9)
+        }
+      }
+    }
+
+    assert_equal(2, ret.size)
+    ret.each {|png| assert_equal(@raw, PNG.decode(png))}
+  end
+
+  test "errors in fiber" do
+    exc = nil
+
+    with_scheduler {
+      Fiber.schedule {
+        begin
+          PNG.decode(@png[0, @png.bytesize / 2])
+        rescue => e
+          exc = e
+        end
+      }
+    }
+
+    assert_kind_of(RuntimeError, exc)
+  end
+
+  test "batch in fiber" do
+    ret = nil
+
+    with_scheduler {
+      Fiber.schedule {ret = PNG.decode_many([@png, @png], :threads => 2)}
+    }
+
+    assert_equal([@raw, @raw], ret)
+  end
+end
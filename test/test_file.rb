@@ -0,0 +1,80 @@
+require 'test/unit'
+require 'pathname'
+require 'tempfile'
+require 'png'
+
+class TestFile < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  data("GRAY", "GRAY")
+  data("GA", "GA")
+  data("RGB", "RGB")
+  data("RGBA", "RGBA")
+
+  test "decode_file" do |fmt|
+    path = DATA_DIR + "sample_#{fmt}.png"
+    exp  = PNG.decode(path.binread, :pixel_format => fmt)
+    img  = PNG.decode_file(path.to_s, :pixel_format => fmt)
+
+    assert_equal(exp, img)
+    assert_equal(exp.meta.height, img.meta.height)
+
+    # classic API
+    dec = PNG::Decoder.new(:api_type => :classic)
+    assert_equal(dec << path.binread, dec.decode_file(path))
+  end
+
+  test "read_header_file" do
+    path = DATA_DIR + "sample_RGBA.png"
+    met  = PNG.read_header_file(path.to_s)
+
+    assert_equal(128, met.width)
+    assert_equal(133, met.height)
+    assert_equal(PNG.read_header(path.binread).stride, met.stride)
+  end
+
+  test "region" do
+    path = DATA_DIR + "sample_RGB.png"
+
+    assert_equal(PNG.decode(path.binread, :region => [3, 4, 5, 6]),
+                 PNG.decode_file(path.to_s, :region => [3, 4, 5, 6]))
+  end
+
+  test "pipe" do
+    path = DATA_DIR + "sample_RGB.png"
+    exp  = PNG.decode(path.binread)
+
+    IO.pipe { |rd, wr|
+      th = Thread.new {wr.write(path.binread); wr.close}
+      assert_equal(exp, PNG.decode_file("/dev/fd/#{rd.fileno}"))
+      th.join
+    }
+  end if File.exist?("/dev/fd")
+
+  test "errors" do
+    assert_raise_kind_of(Errno::ENOENT) {PNG.decode_file("/nonexistent.png")}
+    assert_raise_kind_of(TypeError) {PNG.decode_file(nil)}
+
+    Tempfile.create("empty") { |f|
+      assert_raise_kind_of(RuntimeError) {PNG.decode_file(f.path)}
+      assert_raise_kind_of(RuntimeError) {PNG.read_header_file(f.path)}
+    }
+
+    Tempfile.create("truncated") { |f|
+      png = (DATA_DIR + "sample_RGB.png").binread
+
+      f.write(png[0, png.bytesize / 2])
+      f.flush
+
+      assert_raise_kind_of(RuntimeError) {PNG.decode_file(f.path)}
+    }
+  end
+
+  test "repeated decode" do
+    path = (DATA_DIR + "sample_RGB.png").to_s
+    exp  = PNG.decode_file(path)
+
+    100.times {assert_equal(exp, PNG.decode_file(path))}
+    GC.start
+  end
+end
@@ -0,0 +1,144 @@
+require 'test/unit'
+require 'pathname'
+require 'zlib'
+require 'rbconfig'
+require 'png'
+
+class TestFilter < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  # filter type byte of each row
+  def row_filters(png, stride)
+    idat = "".b
+    pos  = 8
+
+    while pos < png.bytesize
+      len   = png.byteslice(pos, 4).unpack1("N")
+      idat << png.byteslice(pos + 8, len) if png.byteslice(pos + 4, 4) == "IDAT"
+      pos  += len + 12
+    end
+
+    dat = Zlib::Inflate.inflate(idat)
+
+    return (0...(dat.bytesize / (stride + 1))).map {|y| dat.getbyte(y * (stride + 1))}
+  end
+
+  setup do
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+  end
+
+  data("NONE", [:NONE, 0])
+  data("SUB", [:SUB, 1])
+  data("UP", ["UP", 2])
+  data("AVG", [:avg, 3])
+  data("PAETH", [:Paeth, 4])
+  data("integer", [4, 4])
+
+  test "fixed filter" do |arg|
+    [1, 2].each { |th|
+      png = PNG.encode(128, 133, @raw, :filter => arg[0], :threads => th)
+
+      assert_equal(@raw, PNG.decode(png))
+      assert_equal([arg[1]] * 133, row_filters(png, 128 * 3))
+    }
+
+    # interlace is written by libpng
+    png = PNG.encode(128, 133, @raw, :filter => arg[0], :interlace => true)
+    assert_equal(@raw, PNG.decode(png))
+  end
+
+  data("GRAY", ["GRAY", 1])
+  data("GA", ["GA", 2])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "adaptive" do |arg|
+    # odd widths to exercise the scalar head and tail of the vector loops
+    [1, 5, 31, 33, 97].each { |w|
+      raw = Random.new(w).bytes(w * 40 * arg[1]).bytes.map {|v| v & 0x3f}.pack("C*")
+      png = PNG.encode(w, 40, raw, :pixel_format => arg[0], :filter => :adaptive)
+
+      assert_equal(raw, PNG.decode(png, :pixel_format => arg[0]), "width=#{w}")
+    }
+  end
+
+  test "adaptive is not larger than no filter" do
+    a = PNG.encode(128, 133, @raw, :filter => :adaptive)
+    b = PNG.encode(128, 133, @raw, :filter => :none)
+
+    assert_operator(a.bytesize, :<, b.bytesize)
+  end
+
+  test "per-row callback" do
+    rows = []
+    enc  = PNG::Encoder.new(128, 133, :filter => proc { |row, y|
+      rows << row
+      (y == 0)? :adaptive: y % 5
+    })
+
+    png = enc << @raw
+    flt = row_filters(png, 128 * 3)
+
+    assert_equal(@raw, PNG.decode(png))
+    assert_equal((1...133).map {|y| y % 5}, flt[1..])
+    assert_equal(@raw, rows.join)
+
+    # lambda with restart points (first row of a strip uses None or Sub)
+    png = PNG.encode(128, 133, @raw, :restart_points => true,
+                     :filter => ->(_, y) {:paeth})
+    assert_equal(@raw, PNG.decode(png))
+    assert_equal(1, row_filters(png, 128 * 3)[0])
+  end
+
+  test "same output with every engine" do
+    script = <<~EOS
+      require 'png'
+      raw = $stdin.binmode.read
+      $stdout.binmode.write(PNG.encode(128, 133, raw, :filter => :adaptive, :time => false))
+    EOS
+
+    exp = PNG.encode(128, 133, @raw, :filter => :adaptive, :time => false)
+    cmd = [RbConfig.ruby, *$LOAD_PATH.map {|d| "-I#{d}"}, "-e", script]
+
+    %w[scalar sse2 avx2].each { |eng|
+      out = IO.popen({"PNG_FILTER_ENGINE" => eng}, cmd, "r+b") { |io|
+        io.write(@raw)
+        io.close_write
+        io.read
+      }
+
+      assert_equal(exp, out, eng)
+    }
+  end
+
+  test "engine name" do
+    assert_include(%w[scalar sse2 avx2], PNG::FILTER_ENGINE)
+    assert_true(PNG::FILTER_ENGINE.frozen?)
+  end
+
+  test "errors" do
+    assert_raise_kind_of(ArgumentError) {PNG::Encoder.new(1, 1, :filter => :foo)}
+    assert_raise_kind_of(RangeError) {PNG::Encoder.new(1, 1, :filter => 5)}
+    assert_raise_kind_of(TypeError) {PNG::Encoder.new(1, 1, :filter => 1.5)}
+    assert_raise_kind_of(ArgumentError) {
+      PNG::Encoder.new(1, 1, :interlace => true, :filter => proc {0})
+    }
+
+    enc = PNG::Encoder.new(128, 133, :filter => proc {:bogus})
+    assert_raise_kind_of(ArgumentError) {enc << @raw}
+    assert_raise_kind_of(ArgumentError) {enc.start {}}
+
+    enc = PNG::Encoder.new(128, 133, :filter => proc {raise IOError})
+    assert_raise_kind_of(IOError) {enc << @raw}
+
+    # the exception of the callback is the result of the job
+    buf = IO::Buffer.for(@raw) if defined?(IO::Buffer)
+    ret = PNG::Encoder.encode_many([[enc, buf || @raw]])
+    assert_kind_of(IOError, ret[0])
+    assert_false(buf.locked?) if buf
+
+    # the encoder is usable after the errors
+    enc = PNG::Encoder.new(128, 133, :filter => proc {|_, y| y.odd?? 1: 2})
+    assert_equal(@raw, PNG.decode(enc << @raw))
+  end
+end
@@ -0,0 +1,62 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestImage < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  setup do
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+    @png = PNG.encode(128, 133, @raw,
+                      :text => {:title => "Test image", :author => "test"},
+                      :time => true)
+  end
+
+  data("simplified", :simplified)
+  data("classic", :classic)
+
+  test "decode result" do |api|
+    img = PNG::Decoder.new(:api_type => api) << @png
+
+    assert_instance_of(PNG::Image, img)
+    assert_kind_of(String, img)
+    assert_empty(img.singleton_methods)
+    assert_equal(@raw, img)
+    assert_kind_of(PNG::Meta, img.meta)
+  end
+
+  test "without meta" do
+    raw = PNG::Decoder.new(:without_meta => true) << @png
+
+    assert_instance_of(String, raw)
+  end
+
+  test "lazy meta" do
+    met = PNG::Decoder.new(:api_type => :classic).read_header(@png)
+
+    assert_true(met.frozen?)
+    assert_equal({:title => "Test image", :author => "test"}, met.text)
+    assert_same(met.text, met.text)
+    assert_true(met.text.frozen?)
+
+    assert_kind_of(Time, met.time)
+    assert_same(met.time, met.time)
+    assert_in_delta(Time.now, met.time, 60)
+  end
+
+  test "shareable meta" do
+    met = PNG::Decoder.new(:api_type => :classic).read_header(@png)
+    Ractor.make_shareable(met)
+
+    assert_true(Ractor.shareable?(met))
+    assert_equal("Test image", met.text[:title])
+    assert_kind_of(Time, met.time)
+  end
+
+  test "meta without text and time" do
+    met = PNG.read_header(PNG.encode(128, 133, @raw, :time => false))
+
+    assert_nil(met.text)
+    assert_nil(met.time)
+  end
+end
@@ -0,0 +1,131 @@
+require 'test/unit'
+require 'pathname'
+require 'zlib'
+require 'png'
+
+class TestOptimize < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  # filter type byte of each row
+  def row_filters(png, stride)
+    idat = "".b
+    pos  = 8
+
+    while pos < png.bytesize
+      len   = png.byteslice(pos, 4).unpack1("N")
+      idat << png.byteslice(pos + 8, len) if png.byteslice(pos + 4, 4) == "IDAT"
+      pos  += len + 12
+    end
+
+    dat = Zlib::Inflate.inflate(idat)
+
+    return (0...(dat.bytesize / (stride + 1))).map {|y| dat.getbyte(y * (stride + 1))}
+  end
+
+  setup do
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+  end
+
+  data("level 1", 1)
+  data("level 2", 2)
+  data("level 3", 3)
+  data("level 4", 4)
+
+  test "round trip" do |lv|
+    png = PNG.encode(128, 133, @raw, :optimize => lv)
+
+    assert_equal(@raw, PNG.decode(png))
+    assert_operator(png.bytesize, :<=, PNG.encode(128, 133, @raw).bytesize)
+    assert_operator(png.bytesize, :<=,
+                    PNG.encode(128, 133, @raw, :compression => 9).bytesize)
+  end
+
+  data("GRAY", "GRAY")
+  data("GA", "GA")
+  data("RGBA", "RGBA")
+
+  test "pixel formats" do |fmt|
+    raw = (DATA_DIR + "sample_#{fmt}.bin").binread
+    png = PNG.encode(128, 133, raw, :pixel_format => fmt, :optimize => 3)
+
+    assert_equal(raw, PNG.decode(png, :pixel_format => fmt))
+  end
+
+  test "higher level is not larger" do
+    sizes = (1..4).map { |lv|
+      PNG.encode(128, 133, @raw, :optimize => lv, :threads => 2).bytesize
+    }
+
+    # level 2 tries a superset of level 1, levels 3 and 4 a superset of level 2
+    assert_operator(sizes[1], :<=, sizes[0])
+    assert_operator(sizes[2], :<=, sizes[1])
+    assert_operator(sizes[3], :<=, sizes[1])
+    assert_equal(PNG.encode(128, 133, @raw, :optimize => 2, :time => false),
+                 PNG.encode(128, 133, @raw, :optimize => true, :time => false))
+  end
+
+  test "with a fixed filter" do
+    png = PNG.encode(128, 133, @raw, :optimize => 3, :filter => :up)
+
+    assert_equal(@raw, PNG.decode(png))
+    assert_equal([2] * 133, row_filters(png, 128 * 3))
+  end
+
+  test "image larger than a part" do
+    # the iterative deflate works on 1MiB pieces in parallel
+    raw = (0...500).map {|y| [(y * 37) & 0xff, y & 0xff, 0x80].pack("C*") * 700}.join
+    png = PNG.encode(700, 500, raw, :optimize => 3, :filter => :up, :threads => 2)
+
+    assert_equal(raw, PNG.decode(png))
+    assert_operator(png.bytesize, :<=,
+                    PNG.encode(700, 500, raw, :filter => :up,
+                               :compression => 9).bytesize)
+  end
+
+  test "mixed entropy across parts" do
+    # stored blocks must stay decodable when a part does not end on a byte
+    rnd = Random.new(0)
+    raw = (0...(4095 * 256)).map {rnd.rand(4)}.pack("C*") + rnd.bytes(4095 * 256)
+    png = PNG.encode(4095, 512, raw, :pixel_format => :GRAY, :optimize => 3)
+
+    assert_equal(raw, PNG.decode(png, :pixel_format => :GRAY))
+  end
+
+  test "off" do
+    a = PNG.encode(128, 133, @raw, :time => false)
+
+    assert_equal(a, PNG.encode(128, 133, @raw, :optimize => 0, :time => false))
+    assert_equal(a, PNG.encode(128, 133, @raw, :optimize => false, :time => false))
+  end
+
+  test "errors" do
+    assert_raise_kind_of(RangeError) {PNG::Encoder.new(1, 1, :optimize => 5)}
+    assert_raise_kind_of(RangeError) {PNG::Encoder.new(1, 1, :optimize => -1)}
+    assert_raise_kind_of(TypeError) {PNG::Encoder.new(1, 1, :optimize => "3")}
+    assert_raise_kind_of(ArgumentError) {
+      PNG::Encoder.new(1, 1, :optimize => 1, :interlace => true)
+    }
+    assert_raise_kind_of(ArgumentError) {
+      PNG::Encoder.new(1, 1, :optimize => 1, :restart_points => true)
+    }
+    assert_raise_kind_of(ArgumentError) {
+      PNG::Encoder.new(1, 1, :optimize => 1, :fast => true)
+    }
+
+    [
+      {:compression => 9},
+      {:compression => :AUTO},
+      {:strategy => :RLE},
+      {:window_bits => 12},
+      {:mem_level => 9},
+    ].each { |opt|
+      assert_raise_kind_of(ArgumentError) {
+        PNG::Encoder.new(1, 1, :optimize => 2, **opt)
+      }
+    }
+
+    enc = PNG::Encoder.new(128, 133, :optimize => 1)
+    assert_raise_kind_of(ArgumentError) {enc.start {}}
+    assert_equal(@raw, PNG.decode(enc << @raw))
+  end
+end
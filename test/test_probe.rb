@@ -0,0 +1,125 @@
+require 'test/unit'
+require 'pathname'
+require 'stringio'
+require 'tempfile'
+require 'zlib'
+require 'png'
+
+class TestProbe < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  data("GRAY", ["GRAY", 1])
+  data("GA", ["GA", 2])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "same as read_header" do |arg|
+    png = (DATA_DIR + "sample_#{arg[0]}.png").binread
+    exp = PNG.read_header(png)
+    met = PNG.probe(png)
+
+    assert_kind_of(PNG::Meta, met)
+    assert_true(met.frozen?)
+
+    %i[width height bit_depth color_type interlace_method
+       compression_method filter_method].each { |m|
+      assert_equal(exp.send(m), met.send(m), m.to_s)
+    }
+
+    assert_equal(arg[1], met.num_components)
+    assert_nil(met.chunks)
+  end
+
+  test "interlaced" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    met = PNG.probe(PNG.encode(128, 133, raw, :interlace => true))
+
+    assert_equal("ADAM7", met.interlace_method)
+  end
+
+  test "only the first bytes are needed" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    met = PNG.probe(png[0, 33])
+
+    assert_equal(128, met.width)
+    assert_equal(133, met.height)
+
+    assert_raise_kind_of(RuntimeError) {PNG.probe(png[0, 32])}
+  end
+
+  test "IO" do
+    path = DATA_DIR + "sample_RGBA.png"
+
+    File.open(path, "rb") { |f|
+      met = PNG.probe(f)
+
+      assert_equal(128, met.width)
+      assert_equal(33, f.pos)
+    }
+
+    io  = StringIO.new(path.binread)
+    met = PNG.probe(io)
+
+    assert_equal("RGBA", met.color_type)
+    assert_equal(33, io.pos)
+  end
+
+  test "chunk table" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = PNG.encode(128, 133, raw, :text => {:title => "test"}, :time => false)
+    exp = []
+    pos = 8
+
+    while pos < png.bytesize
+      len = png.byteslice(pos, 4).unpack1("N")
+      exp << [png.byteslice(pos + 4, 4), pos, len]
+      pos += len + 12
+    end
+
+    assert_equal(exp, PNG.probe(png, :chunks => true).chunks)
+    assert_equal(exp, PNG.probe(StringIO.new(png), :chunks => true).chunks)
+
+    Tempfile.create("probe") { |f|
+      f.binmode
+      f.write(png)
+      f.rewind
+
+      assert_equal(exp, PNG.probe(f, :chunks => true).chunks)
+    }
+
+    assert_raise_kind_of(RuntimeError) {
+      PNG.probe(png[0, png.bytesize - 20], :chunks => true)
+    }
+    assert_raise_kind_of(RuntimeError) {
+      PNG.probe(StringIO.new(png[0, png.bytesize - 20]), :chunks => true)
+    }
+
+    # cut off in the middle of IDAT
+    Tempfile.create("probe") { |f|
+      f.binmode
+      f.write(png[0, png.bytesize - 20])
+      f.rewind
+
+      assert_raise_kind_of(RuntimeError) {PNG.probe(f, :chunks => true)}
+    }
+  end
+
+  test "errors" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+
+    assert_raise_kind_of(RuntimeError) {PNG.probe("")}
+    assert_raise_kind_of(RuntimeError) {PNG.probe("not a png data" * 4)}
+    assert_raise_kind_of(TypeError) {PNG.probe(nil)}
+
+    # broken CRC
+    bad = png.dup
+    bad.setbyte(20, bad.getbyte(20) ^ 1)
+    assert_raise_kind_of(RuntimeError) {PNG.probe(bad)}
+
+    # invalid bit depth (with the CRC fixed)
+    bad = png.dup
+    bad.setbyte(24, 3)
+    bad[29, 4] = [Zlib.crc32(bad.byteslice(12, 17))].pack("N")
+    assert_raise_kind_of(RuntimeError) {PNG.probe(bad)}
+  end
+end
@@ -0,0 +1,133 @@
+require 'test/unit'
+require 'pathname'
+require 'zlib'
+require 'png'
+
+class TestRegion < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  def crop(raw, stride, bpp, x, y, w, h)
+    return (y...(y + h)).map { |i|
+      raw.byteslice((i * stride) + (x * bpp), w * bpp)
+    }.join
+  end
+
+  def chunk(type, data)
+    return [data.bytesize].pack("N") + type + data +
+           [Zlib.crc32(type + data)].pack("N")
+  end
+
+  # 1bit grayscale image (not supported by the encoder)
+  def mono_png(w, h, rows)
+    ihdr = [w, h, 1, 0, 0, 0, 0].pack("NNCCCCC")
+    idat = Zlib::Deflate.deflate(rows.map {|row| "\0" + row}.join)
+
+    return "\x89PNG\r\n\x1a\n".b +
+           chunk("IHDR", ihdr) + chunk("IDAT", idat) + chunk("IEND", "")
+  end
+
+  data("GRAY", ["GRAY", 1])
+  data("GA", ["GA", 2])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "simplified" do |arg|
+    png = (DATA_DIR + "sample_#{arg[0]}.png").binread
+    raw = PNG.decode(png, :pixel_format => arg[0])
+
+    img = PNG.decode(png, :pixel_format => arg[0], :region => [10, 20, 30, 40])
+
+    assert_equal(crop(raw, 128 * arg[1], arg[1], 10, 20, 30, 40), img)
+    assert_equal(30, img.meta.width)
+    assert_equal(40, img.meta.height)
+    assert_equal(30 * arg[1], img.meta.stride)
+    assert_equal(arg[0], img.meta.pixel_format)
+  end
+
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "classic" do |arg|
+    png = (DATA_DIR + "sample_#{arg[0]}.png").binread
+    dec = PNG::Decoder.new(:api_type => :classic)
+    raw = dec << png
+
+    img = dec.decode(png, :region => [100, 0, 28, 133])
+
+    assert_equal(crop(raw, 128 * arg[1], arg[1], 100, 0, 28, 133), img)
+    assert_equal(28, img.meta.width)
+    assert_equal(133, img.meta.height)
+  end
+
+  data("none", false)
+  data("adam7", true)
+
+  test "interlace" do |interlace|
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = PNG.encode(128, 133, raw, :interlace => interlace)
+
+    [
+      [0, 0, 128, 133],
+      [0, 0, 1, 1],
+      [127, 132, 1, 1],
+      [5, 7, 50, 3],
+      [64, 100, 64, 33],
+    ].each { |rgn|
+      assert_equal(crop(raw, 128 * 3, 3, *rgn),
+                   PNG.decode(png, :region => rgn), rgn.inspect)
+
+      assert_equal(crop(raw, 128 * 3, 3, *rgn),
+                   PNG::Decoder.new(:api_type => :classic)
+                     .decode(png, :region => rgn), rgn.inspect)
+    }
+  end
+
+  test "sub-byte pixels" do
+    rows = 10.times.map { |y| [0xa5 ^ (y * 17), 0x3c + y].pack("C*") }
+    png  = mono_png(13, 10, rows)
+    dec  = PNG::Decoder.new(:api_type => :classic)
+    bits = rows.map {|row| row.unpack1("B*")}
+
+    img = dec.decode(png, :region => [3, 2, 7, 5])
+    exp = bits[2, 5].map {|b| [b[3, 7]].pack("B*")}.join
+
+    assert_equal(exp, img)
+  end
+
+  test "decode_into with region" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = (DATA_DIR + "sample_RGB.png").binread
+    buf = "\xff".b * (64 * 3 * 10)
+    dec = PNG::Decoder.new
+
+    dec.decode_into(png, buf, :region => [0, 50, 32, 10], :stride => 64 * 3)
+
+    10.times { |i|
+      assert_equal(raw.byteslice(((50 + i) * 128 * 3), 32 * 3),
+                   buf.byteslice(i * 64 * 3, 32 * 3))
+      assert_equal("\xff".b * (32 * 3), buf.byteslice((i * 64 + 32) * 3, 32 * 3))
+    }
+  end
+
+  test "the decoder is usable after region decode" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    dec = PNG::Decoder.new
+
+    dec.decode(png, :region => [0, 0, 10, 10])
+    assert_equal(PNG.decode(png), dec << png)
+  end
+
+  test "bad region" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    dec = PNG::Decoder.new
+
+    assert_raise_kind_of(ArgumentError) {dec.decode(png, :region => [0, 0, 129, 1])}
+    assert_raise_kind_of(ArgumentError) {dec.decode(png, :region => [120, 130, 8, 4])}
+    assert_raise_kind_of(ArgumentError) {dec.decode(png, :region => [0, 0, 1])}
+    assert_raise_kind_of(RangeError) {dec.decode(png, :region => [-1, 0, 1, 1])}
+    assert_raise_kind_of(RangeError) {dec.decode(png, :region => [0, 0, 0, 1])}
+    assert_raise_kind_of(TypeError) {dec.decode(png, :region => "0,0,1,1")}
+
+    assert_nothing_raised {dec << png}
+  end
+end
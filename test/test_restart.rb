@@ -0,0 +1,116 @@
+require 'test/unit'
+require 'pathname'
+require 'zlib'
+require 'png'
+
+class TestRestart < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  def chunk(png, name)
+    pos = 8
+
+    while pos < png.bytesize
+      len = png.byteslice(pos, 4).unpack1("N")
+      return pos if png.byteslice(pos + 4, 4) == name
+      pos += len + 12
+    end
+
+    return nil
+  end
+
+  data("GRAY", ["GRAY", 1])
+  data("GA", ["GA", 2])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "round trip" do |arg|
+    raw = (DATA_DIR + "sample_#{arg[0]}.bin").binread
+    png = PNG.encode(128, 133, raw,
+                     :pixel_format => arg[0], :restart_points => true)
+
+    assert_not_nil(chunk(png, "rsPT"))
+
+    dec = PNG::Decoder.new(:pixel_format => arg[0],
+                           :api_type => :classic, :threads => 4)
+
+    assert_equal(raw, dec << png)
+    assert_equal(raw, dec << png)
+
+    # also readable without the parallel decoder
+    assert_equal(raw, PNG.decode(png, :pixel_format => arg[0]))
+  end
+
+  test "large image" do
+    raw = Random.new(1).bytes(1000 * 300 * 3)
+    png = PNG.encode(1000, 300, raw, :restart_points => true, :threads => 2)
+
+    dec = PNG::Decoder.new(:api_type => :classic, :threads => 4)
+    assert_equal(raw, dec << png)
+  end
+
+  test "without restart points" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = PNG.encode(128, 133, raw)
+
+    assert_nil(chunk(png, "rsPT"))
+
+    dec = PNG::Decoder.new(:api_type => :classic, :threads => 4)
+    assert_equal(raw, dec << png)
+  end
+
+  data("boundary before", -1)
+  data("boundary after", 4)
+
+  test "broken restart points" do |shift|
+    raw = Random.new(2).bytes(600 * 500 * 3)
+    png = PNG.encode(600, 500, raw, :restart_points => true)
+    pos = chunk(png, "rsPT")
+    len = png.byteslice(pos, 4).unpack1("N")
+
+    # shift the strip boundary (and fix the CRC of the chunk)
+    dat = png.byteslice(pos + 8, len).unpack("N*")
+    dat[1] += shift
+    dat[2] -= shift
+    dat = dat.pack("N*")
+
+    png[pos + 8, len] = dat
+    png[pos + 8 + len, 4] = [Zlib.crc32("rsPT" + dat)].pack("N")
+
+    # falls back to the sequential decoder
+    dec = PNG::Decoder.new(:api_type => :classic, :threads => 4)
+    assert_equal(raw, dec << png)
+  end
+
+  test "chunks after IDAT" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = PNG.encode(128, 133, raw, :restart_points => true, :time => false)
+    pos = chunk(png, "IEND")
+    dat = "title\0after"
+
+    png[pos, 0] = [dat.bytesize].pack("N") + "tEXt" + dat +
+                  [Zlib.crc32("tEXt" + dat)].pack("N")
+
+    [1, 4].each { |th|
+      img = PNG::Decoder.new(:api_type => :classic, :threads => th) << png
+
+      assert_equal(raw, img)
+      assert_equal({:title => "after"}, img.meta.text, "threads: #{th}")
+    }
+  end
+
+  test "missing IEND" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = PNG.encode(128, 133, raw, :restart_points => true)
+    png = png.byteslice(0, chunk(png, "IEND"))
+
+    [1, 4].each { |th|
+      dec = PNG::Decoder.new(:api_type => :classic, :threads => th)
+      assert_raise_kind_of(RuntimeError, "threads: #{th}") {dec << png}
+    }
+  end
+
+  test "bad :threads" do
+    assert_raise_kind_of(RangeError) {PNG::Decoder.new(:threads => 0)}
+    assert_raise_kind_of(TypeError) {PNG::Decoder.new(:threads => "2")}
+  end
+end
@@ -0,0 +1,69 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestReuse < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  data("GRAY", ["GRAY", 1])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "encode repeatedly" do |arg|
+    raw = (DATA_DIR + "sample_#{arg[0]}.bin").binread
+    enc = PNG::Encoder.new(128, 133, :pixel_format => arg[0], :time => false)
+    exp = enc << raw
+
+    5.times {
+      assert_equal(exp, enc << raw)
+    }
+
+    assert_equal(raw, PNG.decode(exp, :pixel_format => arg[0]))
+  end
+
+  test "encode with size" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    enc = PNG::Encoder.new(128, 133)
+
+    [[1, 1], [128, 10], [64, 266], [128, 133]].each { |wd, ht|
+      dat = raw.byteslice(0, wd * ht * 3)
+      png = enc.encode(dat, width: wd, height: ht)
+      met = PNG.read_header(png)
+
+      assert_equal([wd, ht], [met.width, met.height])
+      assert_equal(dat, PNG.decode(png))
+    }
+
+    # size given to #initialize is used without keywords
+    assert_equal(raw, PNG.decode(enc << raw))
+  end
+
+  test "encode with size and stride" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    enc = PNG::Encoder.new(128, 133, :stride => 128 * 3)
+
+    # the stride is kept, only the first 64 pixels of each row are used
+    png = enc.encode(raw, width: 64, height: 133)
+    exp = raw.bytes.each_slice(128 * 3).map {|row| row[0, 64 * 3]}.flatten
+
+    assert_equal(exp.pack("C*"), PNG.decode(png))
+  end
+
+  test "bad size" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    enc = PNG::Encoder.new(128, 133)
+
+    assert_raise_kind_of(RangeError) {enc.encode(raw, width: 0)}
+    assert_raise_kind_of(ArgumentError) {enc.encode(raw, width: 64)}
+    assert_raise_kind_of(ArgumentError) {enc.encode(raw, height: 140)}
+    assert_raise_kind_of(TypeError) {enc.encode(raw, width: "64")}
+
+    enc = PNG::Encoder.new(128, 133, :stride => 128 * 3)
+    assert_raise_kind_of(ArgumentError) {
+      enc.encode("\0" * (256 * 3 * 2), width: 256, height: 2)
+    }
+
+    # the encoder is not broken by the errors
+    assert_equal(raw, PNG.decode(enc << raw))
+  end
+end
@@ -0,0 +1,120 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestRows < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  data("GRAY", ["GRAY", 1])
+  data("GA", ["GA", 2])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "each_row" do |arg|
+    png = (DATA_DIR + "sample_#{arg[0]}.png").binread
+    raw = PNG.decode(png, :pixel_format => arg[0])
+    dec = PNG::Decoder.new(:pixel_format => arg[0])
+    ys  = []
+
+    ret = dec.each_row(png) { |row, y|
+      assert_equal(raw.byteslice(y * 128 * arg[1], 128 * arg[1]), row)
+      ys << y
+    }
+
+    assert_same(dec, ret)
+    assert_equal((0...133).to_a, ys)
+  end
+
+  data("none", false)
+  data("adam7", true)
+
+  test "each_row_batch" do |interlace|
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = PNG.encode(128, 133, raw, :interlace => interlace)
+
+    [1, 7, 133, 1000].each { |n|
+      buf = "".b
+      cnt = []
+
+      PNG::Decoder.new.each_row_batch(png, n) { |rows, y, m|
+        assert_equal(buf.bytesize, y * 128 * 3)
+        assert_equal(m * 128 * 3, rows.bytesize)
+        buf << rows
+        cnt << m
+      }
+
+      assert_equal(raw, buf, "n=#{n}")
+      assert_equal(133, cnt.sum)
+      assert_true(cnt[0...-1].all? {|m| m == [n, 133].min})
+    }
+  end
+
+  test "classic API" do
+    png = (DATA_DIR + "sample_RGBA.png").binread
+    dec = PNG::Decoder.new(:api_type => :classic)
+    raw = dec << png
+
+    assert_equal(raw, dec.each_row(png).map {|row, _| row.dup}.join)
+  end
+
+  test "enumerator" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    raw = PNG.decode(png)
+    dec = PNG::Decoder.new
+
+    enum = dec.each_row(png)
+    assert_kind_of(Enumerator, enum)
+
+    row, y = enum.next
+    assert_equal(0, y)
+    assert_equal(raw.byteslice(0, 128 * 3), row)
+
+    # the decoder is busy until the external enumeration completes
+    assert_raise_kind_of(RuntimeError) {dec << png}
+
+    enum = PNG::Decoder.new.each_row_batch(png, 50)
+    assert_equal([50, 50, 33], enum.map {|_, _, n| n})
+  end
+
+  test "break and reuse" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    raw = PNG.decode(png)
+    dec = PNG::Decoder.new
+
+    dec.each_row(png) {|_, y| break if y == 10}
+    dec.each_row_batch(png, 4) {|_, y, _| break if y > 0}
+
+    assert_equal(raw, dec << png)
+  end
+
+  test "errors" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    dec = PNG::Decoder.new
+
+    assert_raise_kind_of(RangeError) {dec.each_row_batch(png, 0) {}}
+    assert_raise_kind_of(RangeError) {dec.each_row_batch(png, -1) {}}
+    assert_raise_kind_of(TypeError) {dec.each_row(nil) {}}
+    assert_raise_kind_of(RuntimeError) {dec.each_row("not png data") {}}
+    assert_raise_kind_of(RuntimeError) {dec.each_row("\x89PNG") {}}
+
+    # truncated data raises after the rows that could be read
+    ys  = []
+    exc = assert_raise_kind_of(RuntimeError) {
+      dec.each_row(png[0, png.bytesize / 2]) {|_, y| ys << y}
+    }
+
+    assert_not_nil(exc)
+    assert_operator(ys.size, :<, 133)
+
+    assert_raise_kind_of(NotImplementedError) {
+      PNG::Decoder.new(:scale_denom => 2).each_row(png) {}
+    }
+
+    # busy while enumerating
+    assert_raise_kind_of(RuntimeError) {
+      dec.each_row(png) {dec << png}
+    }
+
+    assert_equal(PNG.decode(png), dec << png)
+  end
+end
@@ -0,0 +1,107 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestScale < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  # reference box filter
+  def box(raw, w, h, nc, n)
+    ow  = (w + n - 1) / n
+    oh  = (h + n - 1) / n
+    src = raw.unpack("C*")
+    ret = []
+
+    oh.times { |oy|
+      ow.times { |ox|
+        ys = ((oy * n)...[(oy + 1) * n, h].min).to_a
+        xs = ((ox * n)...[(ox + 1) * n, w].min).to_a
+        nc.times { |c|
+          sum = 0
+          ys.each {|y| xs.each {|x| sum += src[((y * w) + x) * nc + c]}}
+          cnt = ys.size * xs.size
+          ret << (sum + (cnt / 2)) / cnt
+        }
+      }
+    }
+
+    return ret.pack("C*")
+  end
+
+  def sample(raw, w, h, nc, n)
+    return (0...h).step(n).map { |y|
+      (0...w).step(n).map {|x| raw.byteslice(((y * w) + x) * nc, nc)}.join
+    }.join
+  end
+
+  data("GRAY 1/2", ["GRAY", 1, 2])
+  data("RGB 1/2", ["RGB", 3, 2])
+  data("RGB 1/4", ["RGB", 3, 4])
+  data("RGBA 1/8", ["RGBA", 4, 8])
+
+  test "box reduction" do |arg|
+    fmt, nc, n = arg
+    raw = (DATA_DIR + "sample_#{fmt}.bin").binread
+    png = PNG.encode(128, 133, raw, :pixel_format => fmt)
+
+    img = PNG.decode(png, :pixel_format => fmt, :scale_denom => n)
+
+    assert_equal(box(raw, 128, 133, nc, n), img)
+    assert_equal((128 + n - 1) / n, img.meta.width)
+    assert_equal((133 + n - 1) / n, img.meta.height)
+    assert_equal(fmt, img.meta.pixel_format)
+
+    # classic API
+    dec = PNG::Decoder.new(:api_type => :classic, :scale_denom => n)
+    img = dec << png
+
+    assert_equal(box(raw, 128, 133, nc, n), img)
+    assert_equal((133 + n - 1) / n, img.meta.height)
+  end
+
+  data("1/2", 2)
+  data("1/4", 4)
+  data("1/8", 8)
+
+  test "interlaced" do |n|
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = PNG.encode(128, 133, raw, :interlace => true)
+
+    img = PNG.decode(png, :scale_denom => n)
+    assert_equal(sample(raw, 128, 133, 3, n), img)
+  end
+
+  test "scale 1" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    assert_equal(PNG.decode(png), PNG.decode(png, :scale_denom => 1))
+  end
+
+  test "decode_into" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = PNG.encode(128, 133, raw)
+    buf = "\0".b * (32 * 3 * 34)
+
+    PNG::Decoder.new(:scale_denom => 4).decode_into(png, buf)
+    assert_equal(box(raw, 128, 133, 3, 4), buf)
+
+    assert_raise_kind_of(ArgumentError) {
+      PNG::Decoder.new(:scale_denom => 2).decode_into(png, "\0".b * 100)
+    }
+  end
+
+  test "bad :scale_denom" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+
+    assert_raise_kind_of(ArgumentError) {PNG::Decoder.new(:scale_denom => 3)}
+    assert_raise_kind_of(ArgumentError) {PNG::Decoder.new(:scale_denom => 16)}
+    assert_raise_kind_of(TypeError) {PNG::Decoder.new(:scale_denom => "2")}
+
+    dec = PNG::Decoder.new(:scale_denom => 2)
+
+    assert_raise_kind_of(ArgumentError) {dec.decode(png, :region => [0, 0, 8, 8])}
+    assert_raise_kind_of(NotImplementedError) {dec.feed(png)}
+    assert_raise_kind_of(NotImplementedError) {dec.decode_many([png])}
+
+    assert_nothing_raised {dec << png}
+  end
+end
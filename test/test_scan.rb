@@ -0,0 +1,95 @@
+require 'test/unit'
+require 'pathname'
+require 'tmpdir'
+require 'png'
+
+class TestScan < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  def assert_same_meta(exp, met)
+    %i[width height bit_depth color_type interlace_method
+       compression_method filter_method text time file_gamma].each { |m|
+      assert_equal(exp.send(m), met.send(m), m.to_s)
+    }
+  end
+
+  test "sample files" do
+    paths = Dir.glob((DATA_DIR + "*.png").to_s).sort
+    ret   = PNG.scan_headers(paths, :threads => 4)
+
+    assert_equal(paths.size, ret.size)
+
+    paths.zip(ret) { |path, met|
+      assert_kind_of(PNG::Meta, met)
+      assert_true(met.frozen?)
+      assert_same_meta(PNG.read_header(File.binread(path)), met)
+    }
+  end
+
+  test "text, time and gamma" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+
+    Dir.mktmpdir { |dir|
+      path = File.join(dir, "a.png")
+      File.binwrite(path, PNG.encode(128, 133, raw,
+                                     :text => {:title => "test", :author => "me"},
+                                     :gamma => 0.5))
+
+      met = PNG.scan_headers([path])[0]
+
+      assert_same_meta(PNG.read_header(File.binread(path)), met)
+      assert_equal({:title => "test", :author => "me"}, met.text)
+      assert_kind_of(Time, met.time)
+    }
+  end
+
+  test "header larger than the prefix" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    txt = "x" * (200 * 1024)
+
+    Dir.mktmpdir { |dir|
+      path = File.join(dir, "a.png")
+      File.binwrite(path, PNG.encode(128, 133, raw, :text => {:comment => txt}))
+
+      met = PNG.scan_headers([Pathname(path)])[0]
+
+      assert_kind_of(PNG::Meta, met)
+      assert_equal(txt, met.text[:comment])
+    }
+  end
+
+  test "errors are returned as entries" do
+    good = (DATA_DIR + "sample_RGB.png").to_s
+
+    Dir.mktmpdir { |dir|
+      bad = File.join(dir, "bad.png")
+      File.binwrite(bad, "not a png file")
+
+      short = File.join(dir, "short.png")
+      File.binwrite(short, File.binread(good)[0, 20])
+
+      ret = PNG.scan_headers([good, File.join(dir, "none.png"), bad, short, dir])
+
+      assert_kind_of(PNG::Meta, ret[0])
+      assert_kind_of(Errno::ENOENT, ret[1])
+      assert_kind_of(RuntimeError, ret[2])
+      assert_kind_of(RuntimeError, ret[3])
+      assert_kind_of(StandardError, ret[4])
+    }
+  end
+
+  test "many files" do
+    paths = Dir.glob((DATA_DIR + "*.png").to_s) * 50
+    ret   = PNG.scan_headers(paths)
+
+    assert_equal(paths.size, ret.size)
+    assert_true(ret.all? {|met| met.kind_of?(PNG::Meta)})
+    assert_equal([], PNG.scan_headers([]))
+  end
+
+  test "bad arguments" do
+    assert_raise_kind_of(TypeError) {PNG.scan_headers("a.png")}
+    assert_raise_kind_of(TypeError) {PNG.scan_headers([1])}
+    assert_raise_kind_of(RangeError) {PNG.scan_headers([], :threads => 0)}
+  end
+end
@@ -38,6 +38,37 @@ class TestSingleton < Test::Unit::TestCase
     assert_equal(met.stride * met.height, img.bytesize)
   end
 
+  data("simplified", :simplified)
+  data("classic", :classic)
+
+  test "decode repeatedly" do |api|
+    png = (DATA_DIR + "sample_RGBA.png").binread
+    exp = PNG::Decoder.new(:api_type => api) << png
+
+    10.times {
+      assert_equal(exp, PNG.decode(png, :api_type => api))
+      assert_equal(128, PNG.read_header(png).width)
+    }
+
+    # different option sets use different decoders
+    assert_equal(128 * 133 * 4,
+                 PNG.decode(png, :pixel_format => :RGBA).bytesize)
+    assert_equal(128 * 133, PNG.decode(png, :pixel_format => :GRAY).bytesize)
+  end
+
+  test "decode in threads" do
+    png = (DATA_DIR + "sample_RGBA.png").binread
+    exp = PNG.decode(png)
+
+    ths = 4.times.map {
+      Thread.new {8.times.map {PNG.decode(png)}}
+    }
+
+    ths.each { |th|
+      th.value.each {|raw| assert_equal(exp, raw)}
+    }
+  end
+
   #
   # encode
   #
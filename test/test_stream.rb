@@ -0,0 +1,171 @@
+require 'test/unit'
+require 'pathname'
+require 'stringio'
+require 'png'
+
+class TestStream < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  def feed_chunks(dec, png, size, &blk)
+    ret = false
+
+    (0...png.bytesize).step(size) { |off|
+      ret = dec.feed(png.byteslice(off, size), &blk)
+    }
+
+    return ret
+  end
+
+  #
+  # buffer mode
+  #
+
+  data("GRAY", ["GRAY", 1])
+  data("GA", ["GA", 2])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "feed (simplified)" do |arg|
+    png = (DATA_DIR + "sample_#{arg[0]}.png").binread
+    exp = PNG::Decoder.new(:pixel_format => arg[0]) << png
+
+    dec = PNG::Decoder.new(:pixel_format => arg[0])
+    assert_true(feed_chunks(dec, png, 1000))
+
+    raw = assert_nothing_raised {dec.finish}
+    assert_equal(exp, raw)
+    assert_equal(128, raw.meta.width)
+    assert_equal(133, raw.meta.height)
+  end
+
+  data("GRAY", "GRAY")
+  data("RGBA", "RGBA")
+
+  test "feed (classic)" do |type|
+    png = (DATA_DIR + "sample_#{type}.png").binread
+    exp = PNG::Decoder.new(:api_type => :classic) << png
+
+    dec = PNG::Decoder.new(:api_type => :classic)
+    feed_chunks(dec, png, 17)
+
+    assert_equal(exp, dec.finish)
+  end
+
+  #
+  # block mode
+  #
+
+  data("none", false)
+  data("adam7", true)
+
+  test "feed with block" do |interlace|
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    png = PNG.encode(128, 133, raw, :interlace => interlace)
+
+    dec  = PNG::Decoder.new
+    rows = []
+
+    feed_chunks(dec, png, 512) { |row, y| rows[y] = row }
+
+    assert_nil(dec.finish)
+    assert_equal(133, rows.size)
+    assert_equal(raw, rows.join)
+  end
+
+  #
+  # error
+  #
+
+  test "incomplete data" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    dec = PNG::Decoder.new
+
+    assert_false(dec.feed(png[0, png.bytesize / 2]))
+    assert_raise_kind_of(RuntimeError) {dec.finish}
+
+    # the decoder can be used again after the failure
+    assert_true(dec.feed(png))
+    assert_nothing_raised {dec.finish}
+  end
+
+  test "exception in block" do
+    png = (DATA_DIR + "sample_RGB.png").binread
+    dec = PNG::Decoder.new
+
+    assert_raise_kind_of(IOError) {
+      dec.feed(png) { |row, y| raise IOError if y == 10 }
+    }
+
+    assert_true(dec.feed(png))
+    assert_equal(PNG.decode(png), dec.finish)
+  end
+
+  test "broken data" do
+    png = (DATA_DIR + "sample_RGB.png").binread.dup
+    png[100, 200] = "\0" * 200
+
+    assert_raise_kind_of(RuntimeError) {
+      PNG::Decoder.new.feed(png)
+    }
+  end
+
+  #
+  # row streaming encoder
+  #
+
+  data("GRAY", ["GRAY", 1])
+  data("GA", ["GA", 2])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "write_rows to IO" do |arg|
+    raw = (DATA_DIR + "sample_#{arg[0]}.bin").binread
+    enc = PNG::Encoder.new(128, 133, :pixel_format => arg[0])
+    io  = StringIO.new("".b)
+
+    enc.start(io)
+
+    (0...133).step(10) { |y|
+      enc.write_rows(raw.byteslice(y * 128 * arg[1], 10 * 128 * arg[1]))
+    }
+
+    assert_equal(io, enc.finish)
+    assert_equal(raw, PNG.decode(io.string, :pixel_format => arg[0]))
+  end
+
+  test "write_rows to block" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    enc = PNG::Encoder.new(128, 133)
+    png = "".b
+
+    enc.start { |dat| png << dat }
+    raw.bytes.each_slice(128 * 3) { |row| enc.write_rows(row.pack("C*")) }
+    enc.finish
+
+    assert_equal(raw, PNG.decode(png))
+
+    # the encoder can be used again
+    png2 = "".b
+    enc.start { |dat| png2 << dat }
+    enc.write_rows(raw)
+    enc.finish
+
+    assert_equal(raw, PNG.decode(png2))
+  end
+
+  test "write_rows errors" do
+    raw = (DATA_DIR + "sample_RGB.bin").binread
+    enc = PNG::Encoder.new(128, 133)
+
+    assert_raise_kind_of(RuntimeError) {enc.write_rows(raw)}
+    assert_raise_kind_of(ArgumentError) {enc.start}
+
+    enc.start(StringIO.new)
+    assert_raise_kind_of(ArgumentError) {enc.write_rows("\0" * 10)}
+    assert_raise_kind_of(ArgumentError) {enc.write_rows(raw + raw)}
+    assert_raise_kind_of(RuntimeError) {enc.finish}
+
+    enc = PNG::Encoder.new(128, 133, :interlace => true)
+    assert_raise_kind_of(ArgumentError) {enc.start(StringIO.new)}
+  end
+end
@@ -0,0 +1,64 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestThread < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  #
+  # decode
+  #
+
+  data("simplified", :simplified)
+  data("classic", :classic)
+
+  test "decode in threads" do |api|
+    png = (DATA_DIR + "sample_RGBA.png").binread
+    exp = PNG::Decoder.new(:api_type => api) << png
+
+    ths = 4.times.map {
+      Thread.new {
+        dec = PNG::Decoder.new(:api_type => api)
+        8.times.map {dec << png}
+      }
+    }
+
+    ths.each { |th|
+      th.value.each {|raw| assert_equal(exp, raw)}
+    }
+  end
+
+  data("simplified", :simplified)
+  data("classic", :classic)
+
+  test "broken data" do |api|
+    png = (DATA_DIR + "sample_RGBA.png").binread
+    png = png[0, png.bytesize / 2]
+
+    assert_raise_kind_of(RuntimeError) {
+      PNG::Decoder.new(:api_type => api) << png
+    }
+  end
+
+  #
+  # encode
+  #
+
+  test "encode in threads" do
+    raw = (DATA_DIR + "sample_RGBA.bin").binread
+
+    ths = 4.times.map {
+      Thread.new {
+        8.times.map {
+          PNG::Encoder.new(128, 133, :pixel_format => :RGBA) << raw
+        }
+      }
+    }
+
+    ths.each { |th|
+      th.value.each { |png|
+        assert_equal(raw, PNG.decode(png, :pixel_format => :RGBA))
+      }
+    }
+  end
+end
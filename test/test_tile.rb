@@ -0,0 +1,113 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestTile < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  def crop(raw, stride, bpp, x, y, w, h)
+    return (y...(y + h)).map { |i|
+      raw.byteslice((i * stride) + (x * bpp), w * bpp)
+    }.join
+  end
+
+  setup do
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+  end
+
+  test "region" do
+    enc = PNG::Encoder.new(128, 133, :time => false)
+
+    [
+      [0, 0, 128, 133],
+      [0, 0, 1, 1],
+      [127, 132, 1, 1],
+      [10, 20, 30, 40],
+      [64, 0, 64, 133],
+    ].each { |rgn|
+      png = enc.encode(@raw, :region => rgn)
+      img = PNG.decode(png)
+
+      assert_equal(crop(@raw, 128 * 3, 3, *rgn), img, rgn.inspect)
+      assert_equal(rgn[2], img.meta.width)
+      assert_equal(rgn[3], img.meta.height)
+    }
+
+    # the size of the encoder is restored
+    assert_equal(@raw, PNG.decode(enc << @raw))
+  end
+
+  data("GRAY", ["GRAY", 1])
+  data("RGBA", ["RGBA", 4])
+
+  test "pixel formats" do |arg|
+    raw = (DATA_DIR + "sample_#{arg[0]}.bin").binread
+    enc = PNG::Encoder.new(128, 133, :pixel_format => arg[0])
+    png = enc.encode(raw, :region => [5, 6, 7, 8])
+
+    assert_equal(crop(raw, 128 * arg[1], arg[1], 5, 6, 7, 8),
+                 PNG.decode(png, :pixel_format => arg[0]))
+  end
+
+  test "tiles of a canvas" do
+    enc = PNG::Encoder.new(128, 133, :interlace => true)
+
+    (0...133).step(32) { |y|
+      (0...128).step(32) { |x|
+        rgn = [x, y, 32, [32, 133 - y].min]
+        assert_equal(crop(@raw, 128 * 3, 3, *rgn),
+                     PNG.decode(enc.encode(@raw, :region => rgn)))
+      }
+    }
+  end
+
+  test "offset" do
+    # image placed after a header in a larger buffer
+    buf = "HEADER" + @raw + "TRAILER"
+    enc = PNG::Encoder.new(128, 133)
+
+    assert_equal(@raw, PNG.decode(enc.encode(buf, :offset => 6)))
+
+    # offset and region together (the region is relative to the offset)
+    png = enc.encode(buf, :offset => 6, :region => [1, 2, 3, 4])
+    assert_equal(crop(@raw, 128 * 3, 3, 1, 2, 3, 4), PNG.decode(png))
+  end
+
+  test "with stride and size override" do
+    enc = PNG::Encoder.new(64, 64, :stride => 128 * 3)
+    png = enc.encode(@raw, :width => 128, :height => 133,
+                     :region => [100, 100, 28, 33])
+
+    assert_equal(crop(@raw, 128 * 3, 3, 100, 100, 28, 33), PNG.decode(png))
+  end
+
+  test "parallel" do
+    raw = Random.new(3).bytes(600 * 400 * 3)
+    enc = PNG::Encoder.new(600, 400, :threads => 4)
+    png = enc.encode(raw, :region => [50, 60, 300, 200])
+
+    assert_equal(crop(raw, 600 * 3, 3, 50, 60, 300, 200), PNG.decode(png))
+  end
+
+  test "errors" do
+    enc = PNG::Encoder.new(128, 133)
+
+    assert_raise_kind_of(ArgumentError) {enc.encode(@raw, :region => [100, 0, 29, 1])}
+    assert_raise_kind_of(ArgumentError) {enc.encode(@raw, :region => [0, 0, 1])}
+    assert_raise_kind_of(RangeError) {enc.encode(@raw, :region => [-1, 0, 1, 1])}
+    assert_raise_kind_of(RangeError) {enc.encode(@raw, :region => [0, 0, 0, 1])}
+    assert_raise_kind_of(TypeError) {enc.encode(@raw, :region => "0,0,1,1")}
+    assert_raise_kind_of(TypeError) {enc.encode(@raw, :region => [0, 0, 1, 1.0])}
+    assert_raise_kind_of(RangeError) {enc.encode(@raw, :offset => -1)}
+    assert_raise_kind_of(TypeError) {enc.encode(@raw, :offset => "1")}
+
+    # input too short for the offset
+    assert_raise_kind_of(ArgumentError) {enc.encode(@raw, :offset => 1)}
+
+    # larger input is accepted only with :offset or :region
+    assert_raise_kind_of(ArgumentError) {enc.encode(@raw + "\0")}
+    assert_nothing_raised {enc.encode(@raw + "\0", :offset => 0)}
+
+    assert_equal(@raw, PNG.decode(enc << @raw))
+  end
+end
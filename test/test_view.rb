@@ -0,0 +1,132 @@
+require 'test/unit'
+require 'pathname'
+require 'zlib'
+require 'png'
+
+begin
+  require 'fiddle'
+rescue LoadError
+end
+
+class TestView < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  def chunk(type, data)
+    return [data.bytesize].pack("N") + type + data +
+           [Zlib.crc32(type + data)].pack("N")
+  end
+
+  # 16bit RGB image (not supported by the encoder)
+  def rgb16_png(w, h, samples)
+    ihdr = [w, h, 16, 2, 0, 0, 0].pack("NNCCCCC")
+    rows = samples.each_slice(w * 3).map {|row| "\0" + row.pack("n*")}
+    idat = Zlib::Deflate.deflate(rows.join)
+
+    return "\x89PNG\r\n\x1a\n".b +
+           chunk("IHDR", ihdr) + chunk("IDAT", idat) + chunk("IEND", "")
+  end
+
+  def omit_without_memory_view
+    omit("Fiddle::MemoryView is not available") if not defined?(Fiddle::MemoryView)
+  end
+
+  setup do
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+    @png = PNG.encode(128, 133, @raw)
+  end
+
+  test "encode from IO::Buffer" do
+    omit("IO::Buffer is not available") if not defined?(IO::Buffer)
+
+    buf = IO::Buffer.for(@raw)
+    enc = PNG::Encoder.new(128, 133)
+
+    assert_equal(@raw, PNG.decode(enc.encode(buf)))
+    assert_equal(@raw, PNG.decode(PNG.encode_many([[128, 133, buf]])[0]))
+
+    # the buffer is unlocked after the encode
+    assert_false(buf.locked?)
+
+    # size check
+    assert_raise_kind_of(ArgumentError) {enc.encode(buf.slice(0, 100))}
+    assert_false(buf.locked?)
+  end
+
+  test "encode from MemoryView" do
+    omit_without_memory_view
+
+    ptr = Fiddle::Pointer.malloc(@raw.bytesize, Fiddle::RUBY_FREE)
+    ptr[0, @raw.bytesize] = @raw
+
+    assert_equal(@raw, PNG.decode(PNG::Encoder.new(128, 133).encode(ptr)))
+
+    # decoded image can be passed to the encoder as it is
+    img = PNG.decode(@png)
+    assert_equal(@raw, PNG.decode(PNG::Encoder.new(128, 133).encode(img)))
+  end
+
+  test "unsupported input" do
+    enc = PNG::Encoder.new(128, 133)
+
+    assert_raise_kind_of(TypeError) {enc.encode(nil)}
+    assert_raise_kind_of(TypeError) {enc.encode([1, 2, 3])}
+    assert_equal(@raw, PNG.decode(enc << @raw))
+  end
+
+  test "decode into MemoryView" do
+    omit_without_memory_view
+
+    ptr = Fiddle::Pointer.malloc(@raw.bytesize, Fiddle::RUBY_FREE)
+    PNG::Decoder.new.decode_into(@png, ptr)
+
+    assert_equal(@raw, ptr[0, @raw.bytesize])
+  end
+
+  data("GRAY", ["GRAY", 1])
+  data("RGB", ["RGB", 3])
+  data("RGBA", ["RGBA", 4])
+
+  test "image exports MemoryView" do |arg|
+    omit_without_memory_view
+
+    img = PNG.decode(@png, :pixel_format => arg[0])
+    mv  = Fiddle::MemoryView.new(img)
+
+    begin
+      assert_equal("C", mv.format)
+      assert_equal(3, mv.ndim)
+      assert_equal([133, 128, arg[1]], mv.shape)
+      assert_equal([128 * arg[1], arg[1], 1], mv.strides)
+      assert_equal(img.bytesize, mv.byte_size)
+      assert_equal(img.getbyte((5 * 128 + 7) * arg[1]), mv[5, 7, 0])
+    ensure
+      mv.release
+    end
+  end
+
+  test "16bit image" do
+    omit_without_memory_view
+
+    smp = (0...(4 * 3 * 3)).map {|i| i * 1000}
+    img = PNG::Decoder.new(:api_type => :classic) << rgb16_png(4, 3, smp)
+    mv  = Fiddle::MemoryView.new(img)
+
+    begin
+      assert_equal("S>", mv.format)
+      assert_equal(2, mv.item_size)
+      assert_equal([3, 4, 3], mv.shape)
+      assert_equal([24, 6, 2], mv.strides)
+      assert_equal(smp[(2 * 4 + 1) * 3 + 2], mv[2, 1, 2])
+    ensure
+      mv.release
+    end
+  end
+
+  test "not exported" do
+    omit_without_memory_view
+
+    # without meta information (plain String)
+    img = PNG.decode(@png, :without_meta => true)
+    assert_raise_kind_of(ArgumentError) {Fiddle::MemoryView.new(img)}
+  end
+end
@@ -0,0 +1,122 @@
+require 'test/unit'
+require 'pathname'
+require 'png'
+
+class TestZlibParams < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  def chunks(png, type)
+    ret = []
+    pos = 8
+
+    while pos < png.bytesize
+      len = png.byteslice(pos, 4).unpack1("N")
+      ret << png.byteslice(pos + 8, len) if png.byteslice(pos + 4, 4) == type
+      pos += len + 12
+    end
+
+    return ret
+  end
+
+  setup do
+    @raw = (DATA_DIR + "sample_RGB.bin").binread
+  end
+
+  data("DEFAULT", [:DEFAULT, 1])
+  data("FILTERED", [:FILTERED, 1])
+  data("HUFFMAN_ONLY", [:HUFFMAN_ONLY, 1])
+  data("RLE", [:RLE, 1])
+  data("FIXED", [:FIXED, 1])
+  data("RLE parallel", [:RLE, 2])
+  data("HUFFMAN_ONLY parallel", ["HUFFMAN_ONLY", 3])
+
+  test "strategy" do |arg|
+    png = PNG.encode(128, 133, @raw, :strategy => arg[0], :threads => arg[1])
+    assert_equal(@raw, PNG.decode(png))
+  end
+
+  data("9", [9, 1])
+  data("12", [12, 1])
+  data("9 parallel", [9, 2])
+  data("12 parallel", [12, 2])
+
+  test "window and memory level" do |arg|
+    [1, 5, 9].each { |mem|
+      png = PNG.encode(128, 133, @raw,
+                       :window_bits => arg[0], :mem_level => mem,
+                       :threads => arg[1])
+
+      # libpng may reduce the window further for small images
+      cinfo = chunks(png, "IDAT")[0].getbyte(0) >> 4
+      assert_operator(cinfo + 8, :<=, arg[0])
+
+      assert_equal(@raw, PNG.decode(png))
+    }
+  end
+
+  data("libpng", [1, false])
+  data("parallel", [2, false])
+  data("restart points", [2, true])
+
+  test "idat_size" do |arg|
+    png  = PNG.encode(128, 133, @raw, :idat_size => 1000,
+                      :threads => arg[0], :restart_points => arg[1])
+    idat = chunks(png, "IDAT")
+
+    assert_operator(idat.size, :>, 1)
+    assert_true(idat[0...-1].all? {|d| d.bytesize == 1000})
+    assert_operator(idat[-1].bytesize, :<=, 1000)
+    assert_equal(@raw, PNG.decode(png))
+  end
+
+  test "auto" do
+    best = PNG.encode(128, 133, @raw, :compression => 9).bytesize
+
+    [1, 2].each { |th|
+      png = PNG.encode(128, 133, @raw, :compression => :AUTO, :threads => th)
+
+      assert_equal(@raw, PNG.decode(png))
+      assert_operator(png.bytesize, :<=, best * 1.1)
+    }
+
+    # flat image (every candidate compresses well)
+    flat = "\x10\x20\x30".b * (300 * 300)
+    png  = PNG.encode(300, 300, flat, :compression => "AUTO")
+
+    assert_equal(flat, PNG.decode(png))
+    assert_operator(png.bytesize,
+                    :<=, PNG.encode(300, 300, flat, :compression => 1).bytesize)
+
+    # tall image (sampled at the top, middle and bottom)
+    tall = Random.new(2).bytes(16 * 4000).tr("\x80-\xff".b, "\0".b)
+    assert_equal(tall, PNG.decode(PNG.encode(16, 4000, tall,
+                                             :pixel_format => :GRAY,
+                                             :compression => :AUTO),
+                                  :pixel_format => :GRAY))
+  end
+
+  test "auto with row streaming" do
+    enc = PNG::Encoder.new(128, 133, :compression => :AUTO)
+    out = "".b
+
+    enc.start {|dat| out << dat}
+    enc.write_rows(@raw)
+    enc.finish
+
+    assert_equal(@raw, PNG.decode(out))
+  end
+
+  test "errors" do
+    assert_raise_kind_of(ArgumentError) {PNG::Encoder.new(1, 1, :strategy => :FOO)}
+    assert_raise_kind_of(TypeError) {PNG::Encoder.new(1, 1, :strategy => 1)}
+    assert_raise_kind_of(RangeError) {PNG::Encoder.new(1, 1, :window_bits => 8)}
+    assert_raise_kind_of(RangeError) {PNG::Encoder.new(1, 1, :window_bits => 16)}
+    assert_raise_kind_of(TypeError) {PNG::Encoder.new(1, 1, :window_bits => "15")}
+    assert_raise_kind_of(RangeError) {PNG::Encoder.new(1, 1, :mem_level => 0)}
+    assert_raise_kind_of(RangeError) {PNG::Encoder.new(1, 1, :mem_level => 10)}
+    assert_raise_kind_of(RangeError) {PNG::Encoder.new(1, 1, :idat_size => 5)}
+    assert_raise_kind_of(TypeError) {PNG::Encoder.new(1, 1, :idat_size => 1.5)}
+    assert_raise_kind_of(ArgumentError) {PNG::Encoder.new(1, 1, :compression => :fast)}
+    assert_raise_kind_of(ArgumentError) {PNG::Encoder.new(1, 1, :compression => :auto)}
+  end
+end